@@ -0,0 +1,937 @@
+#include "ctx.h"
+#include "deleg.h"
+#include "queue.h"
+#include "rollup.h"
+#include "throttle.h"
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Number of queued operations per worker thread.
+#define CTX_QUEUE_DEPTH 64
+
+// Idle I/O contexts of a pool.
+typedef struct ctx_pool {
+  struct ctx_pool *next;
+  char *name;
+  rados_ioctx_t *ioctxs;
+  int count;
+  int cap;
+} ctx_pool_t;
+
+// Write delegation held by the context. Operations on the RT hold a
+// reference while they use it, and the list holds one until it's dropped.
+typedef struct ctx_deleg {
+  struct ctx_deleg *next;
+  char *pool_name;
+  char *rt_name;
+  rt_deleg_t *deleg;
+  int refs;
+} ctx_deleg_t;
+
+// Operation started by rt_ctx_start. While it's run by a worker thread
+// instead, the callback of the caller is kept here.
+typedef struct ctx_aio {
+  struct ctx_aio *next;
+  rt_ctx_t *ctx;
+  rt_ctx_op_t *op;
+  rados_ioctx_t ioctx;
+  rt_aio_t *aio;
+  rt_ctx_op_cb cb;
+  void *arg;
+} ctx_aio_t;
+
+struct rt_ctx {
+  rados_t rados;
+  int connected;
+  // Whether the context runs the rollup flusher.
+  int rollups;
+
+  pthread_mutex_t lock;
+  ctx_pool_t *pools;
+  int idle_ioctxs;
+  ctx_deleg_t *delegs;
+
+  rt_queue_t ops;
+  pthread_t *workers;
+  int workers_count;
+
+  // Options of RT updates, with strings owned by the context.
+  rt_opts_t opts;
+
+  // Memory accounting and the soft limit. Operations wait for
+  // `below_limit` while memory is over the limit.
+  rt_mem_t mem;
+  size_t mem_limit;
+  int in_flight;
+  pthread_cond_t below_limit;
+  unsigned long sheds;
+  unsigned long throttled;
+
+  // Operations started by rt_ctx_start and not completed yet. Those with a
+  // step ready to be processed are queued in `ready`, and `event_fd` is
+  // signalled.
+  int started;
+  int event_fd;
+  pthread_mutex_t ready_lock;
+  ctx_aio_t *ready;
+  ctx_aio_t **ready_tail;
+};
+
+// Completion of a batch.
+typedef struct ctx_batch {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int remaining;
+  int failed;
+
+  // Congestion windows of the pools of the ops, and the times the ops
+  // entered them, indexed as `ops`.
+  rt_ctx_op_t *ops;
+  rt_window_t **windows;
+  double *started;
+} ctx_batch_t;
+
+/*
+ * Memory limit.
+ */
+
+// Returns whether memory used, plus `extra` bytes, is over the soft limit.
+static int over_limit_by(rt_ctx_t *ctx, size_t extra) {
+  size_t limit = __atomic_load_n(&ctx->mem_limit, __ATOMIC_RELAXED);
+  return limit &&
+         __atomic_load_n(&ctx->mem.total, __ATOMIC_RELAXED) + extra > limit;
+}
+
+static int over_limit(rt_ctx_t *ctx) { return over_limit_by(ctx, 0); }
+
+// Drops all idle I/O contexts. Called with lock held.
+static void shed(rt_ctx_t *ctx) {
+  for (ctx_pool_t *p = ctx->pools; p; p = p->next) {
+    for (int i = 0; i < p->count; i++) {
+      rados_ioctx_destroy(p->ioctxs[i]);
+    }
+    rt_mem_charge(&ctx->mem, RT_MEM_CACHE,
+                  -(long)p->count * RT_MEM_IOCTX_SIZE);
+    ctx->idle_ioctxs -= p->count;
+    p->count = 0;
+  }
+
+  ctx->sheds++;
+}
+
+// Counts a new operation in flight. While memory is over the soft limit,
+// caches are dropped first, and if that's not enough, it waits for
+// operations in flight to release memory.
+static void admit(rt_ctx_t *ctx) {
+  pthread_mutex_lock(&ctx->lock);
+
+  if (over_limit(ctx)) {
+    shed(ctx);
+
+    if (over_limit(ctx) && ctx->in_flight > 0) {
+      ctx->throttled++;
+      while (over_limit(ctx) && ctx->in_flight > 0) {
+        pthread_cond_wait(&ctx->below_limit, &ctx->lock);
+      }
+    }
+  }
+
+  ctx->in_flight++;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static void retire(rt_ctx_t *ctx) {
+  pthread_mutex_lock(&ctx->lock);
+  ctx->in_flight--;
+  pthread_cond_broadcast(&ctx->below_limit);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+// Returns memory pinned by queued operation `op`.
+static long op_size(const rt_ctx_op_t *op) {
+  long size = sizeof(rt_ctx_op_t) +
+              op->keys_count * (sizeof(char *) + sizeof(size_t));
+
+  for (int i = 0; i < op->keys_count; i++) {
+    size += op->key_lens[i];
+  }
+
+  return size;
+}
+
+/*
+ * Context.
+ */
+
+static int do_add(rt_ctx_t *ctx, const char *pool_name, const char *rt_name,
+                  const char *const *keys, const size_t *key_lens,
+                  int keys_count, int *rt_created);
+static int do_remove(rt_ctx_t *ctx, const char *pool_name,
+                     const char *rt_name, const char *const *keys,
+                     const size_t *key_lens, int keys_count, int *rt_deleted);
+static void drop_deleg(rt_ctx_t *ctx, ctx_deleg_t *cd);
+
+static void *ctx_worker(void *arg) {
+  rt_ctx_t *ctx = arg;
+  rt_ctx_op_t *op;
+
+  while ((op = rt_queue_pop(&ctx->ops))) {
+    rt_mem_charge(&ctx->mem, RT_MEM_QUEUES, -op_size(op));
+
+    if (op->remove) {
+      op->ret = do_remove(ctx, op->pool_name, op->rt_name, op->keys,
+                          op->key_lens, op->keys_count, &op->flag);
+    } else {
+      op->ret = do_add(ctx, op->pool_name, op->rt_name, op->keys,
+                       op->key_lens, op->keys_count, &op->flag);
+    }
+
+    op->cb(op);
+    retire(ctx);
+  }
+
+  return NULL;
+}
+
+int rt_ctx_connect(const char *client_id, const char *conf_file, int workers,
+                   rt_ctx_t **ctx) {
+  rados_t rados;
+  int ret;
+
+  if ((ret = rados_create(&rados, client_id)) < 0) {
+    return ret;
+  }
+
+  if ((conf_file && (ret = rados_conf_read_file(rados, conf_file)) < 0) ||
+      (ret = rados_connect(rados)) < 0 ||
+      (ret = rt_ctx_create(rados, workers, ctx)) < 0) {
+    rados_shutdown(rados);
+    return ret;
+  }
+
+  (*ctx)->connected = 1;
+  return 0;
+}
+
+int rt_ctx_create(rados_t rados, int workers, rt_ctx_t **ctx) {
+  rt_ctx_t *c = calloc(1, sizeof(rt_ctx_t));
+  int ret;
+
+  if (!c) {
+    return -ENOMEM;
+  }
+
+  if ((ret = rt_queue_init(&c->ops, workers * CTX_QUEUE_DEPTH)) < 0) {
+    free(c);
+    return ret;
+  }
+
+  if ((c->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    ret = -errno;
+    rt_queue_destroy(&c->ops);
+    free(c);
+    return ret;
+  }
+
+  c->rados = rados;
+  rt_opts_init(&c->opts);
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_mutex_init(&c->ready_lock, NULL);
+  c->ready_tail = &c->ready;
+  pthread_cond_init(&c->below_limit, NULL);
+  rt_mem_charge(&c->mem, RT_MEM_QUEUES,
+                sizeof(void *) * workers * CTX_QUEUE_DEPTH);
+
+  c->workers = malloc(sizeof(pthread_t) * workers);
+  for (; c->workers_count < workers; c->workers_count++) {
+    if ((ret = -pthread_create(&c->workers[c->workers_count], NULL,
+                               ctx_worker, c)) < 0) {
+      rt_ctx_destroy(c);
+      return ret;
+    }
+  }
+
+  *ctx = c;
+  return 0;
+}
+
+void rt_ctx_destroy(rt_ctx_t *ctx) {
+  // Complete started operations first, some of them may be run by worker
+  // threads.
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    int started = ctx->started;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (!started) {
+      break;
+    }
+
+    struct pollfd pfd = {.fd = ctx->event_fd, .events = POLLIN};
+    poll(&pfd, 1, -1);
+    rt_ctx_process_completions(ctx);
+  }
+
+  rt_queue_close(&ctx->ops);
+  for (int i = 0; i < ctx->workers_count; i++) {
+    pthread_join(ctx->workers[i], NULL);
+  }
+
+  for (ctx_pool_t *p = ctx->pools, *next; p; p = next) {
+    next = p->next;
+    for (int i = 0; i < p->count; i++) {
+      rados_ioctx_destroy(p->ioctxs[i]);
+    }
+    free(p->ioctxs);
+    free(p->name);
+    free(p);
+  }
+
+  while (ctx->delegs) {
+    drop_deleg(ctx, ctx->delegs);
+  }
+
+  if (ctx->rollups) {
+    rt_rollup_stop();
+  }
+
+  if (ctx->connected) {
+    rt_cluster_release(ctx->rados);
+    rt_window_release(ctx->rados);
+    rados_shutdown(ctx->rados);
+  }
+
+  free((char *)ctx->opts.overflow_pool);
+  free((char *)ctx->opts.writer_id);
+
+  rt_queue_destroy(&ctx->ops);
+  close(ctx->event_fd);
+  pthread_cond_destroy(&ctx->below_limit);
+  pthread_mutex_destroy(&ctx->ready_lock);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx->workers);
+  free(ctx);
+}
+
+int rt_ctx_start_rollups(rt_ctx_t *ctx, int interval_ms) {
+  int ret = rt_rollup_start(ctx->rados, interval_ms);
+  if (ret == 0) {
+    ctx->rollups = 1;
+  }
+
+  return ret;
+}
+
+int rt_ctx_get_windows(rt_ctx_t *ctx, rt_window_stats_t *windows, int max) {
+  return rt_window_list(ctx->rados, windows, max);
+}
+
+void rt_ctx_set_mem_limit(rt_ctx_t *ctx, size_t bytes) {
+  pthread_mutex_lock(&ctx->lock);
+  __atomic_store_n(&ctx->mem_limit, bytes, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&ctx->below_limit);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+void rt_ctx_set_opts(rt_ctx_t *ctx, const rt_opts_t *opts) {
+  free((char *)ctx->opts.overflow_pool);
+  free((char *)ctx->opts.writer_id);
+
+  ctx->opts = *opts;
+  if (opts->overflow_pool) {
+    ctx->opts.overflow_pool = strdup(opts->overflow_pool);
+  }
+  if (opts->writer_id) {
+    ctx->opts.writer_id = strdup(opts->writer_id);
+  }
+}
+
+void rt_ctx_get_stats(rt_ctx_t *ctx, rt_ctx_stats_t *stats) {
+  pthread_mutex_lock(&ctx->lock);
+
+  rt_mem_snapshot(&ctx->mem, &stats->mem);
+  stats->mem_limit = ctx->mem_limit;
+  stats->in_flight = ctx->in_flight;
+  stats->idle_ioctxs = ctx->idle_ioctxs;
+  stats->sheds = ctx->sheds;
+  stats->throttled = ctx->throttled;
+
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+// Returns idle I/O contexts of pool `pool_name`. Called with lock held.
+static ctx_pool_t *find_pool(rt_ctx_t *ctx, const char *pool_name) {
+  ctx_pool_t *p;
+
+  for (p = ctx->pools; p; p = p->next) {
+    if (strcmp(p->name, pool_name) == 0) {
+      return p;
+    }
+  }
+
+  p = calloc(1, sizeof(ctx_pool_t));
+  p->name = strdup(pool_name);
+  p->next = ctx->pools;
+  ctx->pools = p;
+
+  return p;
+}
+
+int rt_ctx_ioctx_get(rt_ctx_t *ctx, const char *pool_name,
+                     rados_ioctx_t *ioctx) {
+  pthread_mutex_lock(&ctx->lock);
+
+  ctx_pool_t *p = find_pool(ctx, pool_name);
+  if (p->count > 0) {
+    *ioctx = p->ioctxs[--p->count];
+    ctx->idle_ioctxs--;
+    rt_mem_charge(&ctx->mem, RT_MEM_CACHE, -RT_MEM_IOCTX_SIZE);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+
+  return rados_ioctx_create(ctx->rados, pool_name, ioctx);
+}
+
+void rt_ctx_ioctx_put(rt_ctx_t *ctx, const char *pool_name,
+                      rados_ioctx_t ioctx) {
+  if (over_limit_by(ctx, RT_MEM_IOCTX_SIZE)) {
+    rados_ioctx_destroy(ioctx);
+    return;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+
+  ctx_pool_t *p = find_pool(ctx, pool_name);
+  if (p->count == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 4;
+    p->ioctxs = realloc(p->ioctxs, sizeof(rados_ioctx_t) * p->cap);
+  }
+  p->ioctxs[p->count++] = ioctx;
+  ctx->idle_ioctxs++;
+  rt_mem_charge(&ctx->mem, RT_MEM_CACHE, RT_MEM_IOCTX_SIZE);
+
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Delegations.
+ */
+
+// Returns a reference to the delegation of RT `rt_name`, or NULL.
+static ctx_deleg_t *get_deleg(rt_ctx_t *ctx, const char *pool_name,
+                              const char *rt_name) {
+  pthread_mutex_lock(&ctx->lock);
+
+  ctx_deleg_t *cd = ctx->delegs;
+  for (; cd; cd = cd->next) {
+    if (strcmp(cd->rt_name, rt_name) == 0 &&
+        strcmp(cd->pool_name, pool_name) == 0) {
+      cd->refs++;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+  return cd;
+}
+
+static void put_deleg(rt_ctx_t *ctx, ctx_deleg_t *cd) {
+  pthread_mutex_lock(&ctx->lock);
+  int refs = --cd->refs;
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (refs == 0) {
+    rt_mem_t *prev = rt_mem_bind(&ctx->mem);
+    rt_deleg_release(cd->deleg);
+    rt_mem_bind(prev);
+
+    free(cd->pool_name);
+    free(cd->rt_name);
+    free(cd);
+  }
+}
+
+// Removes delegation `cd` from the list, if it's still there, and drops
+// the reference of the list.
+static void drop_deleg(rt_ctx_t *ctx, ctx_deleg_t *cd) {
+  int listed = 0;
+
+  pthread_mutex_lock(&ctx->lock);
+  for (ctx_deleg_t **link = &ctx->delegs; *link; link = &(*link)->next) {
+    if (*link == cd) {
+      *link = cd->next;
+      listed = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (listed) {
+    put_deleg(ctx, cd);
+  }
+}
+
+int rt_ctx_delegate(rt_ctx_t *ctx, const char *pool_name,
+                    const char *rt_name) {
+  ctx_deleg_t *cd;
+  int ret;
+
+  if ((cd = get_deleg(ctx, pool_name, rt_name))) {
+    put_deleg(ctx, cd);
+    return 0;
+  }
+
+  cd = calloc(1, sizeof(ctx_deleg_t));
+  cd->pool_name = strdup(pool_name);
+  cd->rt_name = strdup(rt_name);
+  cd->refs = 1;
+
+  rt_mem_t *prev = rt_mem_bind(&ctx->mem);
+  ret = rt_deleg_acquire(ctx->rados, pool_name, rt_name, &cd->deleg);
+  rt_mem_bind(prev);
+
+  if (ret < 0) {
+    free(cd->pool_name);
+    free(cd->rt_name);
+    free(cd);
+    return ret;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  cd->next = ctx->delegs;
+  ctx->delegs = cd;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return 0;
+}
+
+void rt_ctx_undelegate(rt_ctx_t *ctx, const char *pool_name,
+                       const char *rt_name) {
+  ctx_deleg_t *cd = get_deleg(ctx, pool_name, rt_name);
+
+  if (cd) {
+    drop_deleg(ctx, cd);
+    put_deleg(ctx, cd);
+  }
+}
+
+// Returns whether an operation on delegation `cd` failed because the
+// delegation is gone, and drops it in that case. The operation is retried
+// without it.
+static int deleg_gone(rt_ctx_t *ctx, ctx_deleg_t *cd, int ret) {
+  if (ret != -ESTALE && ret != -ENOENT) {
+    return 0;
+  }
+
+  drop_deleg(ctx, cd);
+  return 1;
+}
+
+/*
+ * Operations. Memory allocated by rt.c is accounted to the context while
+ * they run.
+ */
+
+static int do_add(rt_ctx_t *ctx, const char *pool_name, const char *rt_name,
+                  const char *const *keys, const size_t *key_lens,
+                  int keys_count, int *rt_created) {
+  rados_ioctx_t ioctx;
+  int ret;
+
+  *rt_created = 0;
+
+  rt_mem_t *prev = rt_mem_bind(&ctx->mem);
+
+  ctx_deleg_t *cd = get_deleg(ctx, pool_name, rt_name);
+  if (cd) {
+    ret = rt_deleg_add(cd->deleg, keys, key_lens, keys_count);
+    int gone = deleg_gone(ctx, cd, ret);
+    put_deleg(ctx, cd);
+    if (!gone) {
+      rt_mem_bind(prev);
+      return ret;
+    }
+  }
+
+  if ((ret = rt_ctx_ioctx_get(ctx, pool_name, &ioctx)) < 0) {
+    rt_mem_bind(prev);
+    return ret;
+  }
+
+  ret = rt_add3(ioctx, rt_name, keys, key_lens, keys_count, &ctx->opts,
+                rt_created);
+  rt_mem_bind(prev);
+
+  rt_ctx_ioctx_put(ctx, pool_name, ioctx);
+  return ret;
+}
+
+static int do_remove(rt_ctx_t *ctx, const char *pool_name,
+                     const char *rt_name, const char *const *keys,
+                     const size_t *key_lens, int keys_count,
+                     int *rt_deleted) {
+  rados_ioctx_t ioctx;
+  int ret;
+
+  *rt_deleted = 0;
+
+  rt_mem_t *prev = rt_mem_bind(&ctx->mem);
+
+  ctx_deleg_t *cd = get_deleg(ctx, pool_name, rt_name);
+  if (cd) {
+    ret = rt_deleg_remove(cd->deleg, keys, key_lens, keys_count, rt_deleted);
+    int gone = deleg_gone(ctx, cd, ret);
+    if (*rt_deleted) {
+      drop_deleg(ctx, cd);
+    }
+    put_deleg(ctx, cd);
+    if (!gone) {
+      rt_mem_bind(prev);
+      return ret;
+    }
+  }
+
+  if ((ret = rt_ctx_ioctx_get(ctx, pool_name, &ioctx)) < 0) {
+    rt_mem_bind(prev);
+    return ret;
+  }
+
+  ret = rt_remove3(ioctx, rt_name, keys, key_lens, keys_count, &ctx->opts,
+                   rt_deleted);
+  rt_mem_bind(prev);
+
+  rt_ctx_ioctx_put(ctx, pool_name, ioctx);
+  return ret;
+}
+
+int rt_ctx_add(rt_ctx_t *ctx, const char *pool_name, const char *rt_name,
+               const char *const *keys, const size_t *key_lens,
+               int keys_count, int *rt_created) {
+  admit(ctx);
+  int ret = do_add(ctx, pool_name, rt_name, keys, key_lens, keys_count,
+                   rt_created);
+  retire(ctx);
+
+  return ret;
+}
+
+int rt_ctx_remove(rt_ctx_t *ctx, const char *pool_name, const char *rt_name,
+                  const char *const *keys, const size_t *key_lens,
+                  int keys_count, int *rt_deleted) {
+  admit(ctx);
+  int ret = do_remove(ctx, pool_name, rt_name, keys, key_lens, keys_count,
+                      rt_deleted);
+  retire(ctx);
+
+  return ret;
+}
+
+int rt_ctx_list_keys(rt_ctx_t *ctx, const char *pool_name,
+                     const char *rt_name, int page_size, rt_keys_cb cb,
+                     void *arg, uint32_t *refcount) {
+  rados_ioctx_t ioctx;
+  int ret;
+
+  admit(ctx);
+
+  rt_mem_t *prev = rt_mem_bind(&ctx->mem);
+
+  ctx_deleg_t *cd = get_deleg(ctx, pool_name, rt_name);
+  if (cd) {
+    ret = rt_deleg_list_keys(cd->deleg, page_size, cb, arg, refcount);
+    int gone = deleg_gone(ctx, cd, ret);
+    put_deleg(ctx, cd);
+    if (!gone) {
+      goto out;
+    }
+  }
+
+  if ((ret = rt_ctx_ioctx_get(ctx, pool_name, &ioctx)) < 0) {
+    goto out;
+  }
+
+  ret = rt_list_keys(ioctx, rt_name, page_size, cb, arg, refcount);
+
+  rt_ctx_ioctx_put(ctx, pool_name, ioctx);
+
+out:
+  rt_mem_bind(prev);
+  retire(ctx);
+
+  return ret;
+}
+
+int rt_ctx_submit(rt_ctx_t *ctx, rt_ctx_op_t *op) {
+  admit(ctx);
+
+  rt_mem_charge(&ctx->mem, RT_MEM_QUEUES, op_size(op));
+
+  int ret = rt_queue_push(&ctx->ops, op);
+  if (ret < 0) {
+    rt_mem_charge(&ctx->mem, RT_MEM_QUEUES, -op_size(op));
+    retire(ctx);
+  }
+
+  return ret;
+}
+
+static void batch_done(rt_ctx_op_t *op) {
+  ctx_batch_t *b = op->arg;
+  int i = op - b->ops;
+
+  // An update reads the RT and then writes it.
+  rt_window_leave(b->windows[i], b->started[i], RT_WINDOW_WRITE, 2, op->ret);
+
+  pthread_mutex_lock(&b->lock);
+  b->failed += op->ret < 0;
+  if (--b->remaining == 0) {
+    pthread_cond_signal(&b->done);
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+int rt_ctx_batch(rt_ctx_t *ctx, rt_ctx_op_t *ops, int ops_count) {
+  ctx_batch_t b = {
+      .remaining = ops_count,
+      .ops = ops,
+      .windows = malloc(sizeof(rt_window_t *) * ops_count),
+      .started = malloc(sizeof(double) * ops_count),
+  };
+
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.done, NULL);
+
+  for (int i = 0; i < ops_count; i++) {
+    ops[i].cb = batch_done;
+    ops[i].arg = &b;
+
+    // Ops are let in as the window of their pool allows, so that batches
+    // back off when the pool is busy, without holding up the workers.
+    b.windows[i] = rt_window_get(ctx->rados, ops[i].pool_name);
+    b.started[i] = rt_window_enter(b.windows[i]);
+
+    int ret = rt_ctx_submit(ctx, &ops[i]);
+    if (ret < 0) {
+      rt_window_leave(b.windows[i], b.started[i], RT_WINDOW_WRITE, 1, ret);
+
+      // Fail the ops that didn't make it into the queue.
+      pthread_mutex_lock(&b.lock);
+      for (int j = i; j < ops_count; j++) {
+        ops[j].ret = ret;
+        b.failed++;
+        b.remaining--;
+      }
+      pthread_mutex_unlock(&b.lock);
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&b.lock);
+  while (b.remaining > 0) {
+    pthread_cond_wait(&b.done, &b.lock);
+  }
+  pthread_mutex_unlock(&b.lock);
+
+  pthread_cond_destroy(&b.done);
+  pthread_mutex_destroy(&b.lock);
+  free(b.windows);
+  free(b.started);
+
+  return b.failed;
+}
+
+/*
+ * Started operations. Steps of operations run with asynchronous I/O are
+ * processed, and callbacks called, by the thread calling
+ * rt_ctx_process_completions. Operations that can't be run that way are
+ * run by worker threads, and only their callbacks are passed over.
+ */
+
+// Queues operation `ca` for rt_ctx_process_completions, and signals the
+// event fd.
+static void ready(ctx_aio_t *ca) {
+  rt_ctx_t *ctx = ca->ctx;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&ctx->ready_lock);
+  ca->next = NULL;
+  *ctx->ready_tail = ca;
+  ctx->ready_tail = &ca->next;
+  pthread_mutex_unlock(&ctx->ready_lock);
+
+  write(ctx->event_fd, &one, sizeof(one));
+}
+
+static void aio_ready(rt_aio_t *aio, void *arg) { ready(arg); }
+
+static void worker_done(rt_ctx_op_t *op) {
+  ctx_aio_t *ca = op->arg;
+
+  op->cb = ca->cb;
+  op->arg = ca->arg;
+  ready(ca);
+}
+
+// Queues operation `ca`, already counted in flight, for a worker thread.
+// Unlike rt_ctx_submit, it doesn't wait for memory, as operations in
+// flight may only be completed by the caller.
+static int to_worker(rt_ctx_t *ctx, ctx_aio_t *ca) {
+  rt_ctx_op_t *op = ca->op;
+
+  if (ctx->workers_count == 0) {
+    return -EOPNOTSUPP;
+  }
+
+  ca->cb = op->cb;
+  ca->arg = op->arg;
+  op->cb = worker_done;
+  op->arg = ca;
+
+  rt_mem_charge(&ctx->mem, RT_MEM_QUEUES, op_size(op));
+
+  int ret = rt_queue_push(&ctx->ops, op);
+  if (ret < 0) {
+    rt_mem_charge(&ctx->mem, RT_MEM_QUEUES, -op_size(op));
+    op->cb = ca->cb;
+    op->arg = ca->arg;
+  }
+
+  return ret;
+}
+
+// Calls the callback of completed operation `ca`, and frees it.
+static void finish(rt_ctx_t *ctx, ctx_aio_t *ca) {
+  rt_ctx_op_t *op = ca->op;
+
+  rt_mem_charge(&ctx->mem, RT_MEM_QUEUES, -(long)sizeof(ctx_aio_t));
+  free(ca);
+
+  op->cb(op);
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->started--;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+int rt_ctx_start(rt_ctx_t *ctx, rt_ctx_op_t *op) {
+  ctx_aio_t *ca = calloc(1, sizeof(ctx_aio_t));
+  int ret;
+
+  if (!ca) {
+    return -ENOMEM;
+  }
+
+  ca->ctx = ctx;
+  ca->op = op;
+  rt_mem_charge(&ctx->mem, RT_MEM_QUEUES, sizeof(ctx_aio_t));
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->in_flight++;
+  ctx->started++;
+  pthread_mutex_unlock(&ctx->lock);
+
+  // Only updates of single object RTs, without a delegation, are run with
+  // asynchronous I/O.
+
+  ctx_deleg_t *cd = get_deleg(ctx, op->pool_name, op->rt_name);
+  if (cd) {
+    put_deleg(ctx, cd);
+  }
+
+  if (cd || ctx->opts.layout != RT_LAYOUT_SINGLE) {
+    ret = to_worker(ctx, ca);
+  } else if ((ret = rt_ctx_ioctx_get(ctx, op->pool_name, &ca->ioctx)) == 0) {
+    rt_mem_t *prev = rt_mem_bind(&ctx->mem);
+    ret = rt_aio_start(ca->ioctx, op->rt_name, op->remove, op->keys,
+                       op->key_lens, op->keys_count, aio_ready, ca, &ca->aio);
+    rt_mem_bind(prev);
+
+    if (ret < 0) {
+      rt_ctx_ioctx_put(ctx, op->pool_name, ca->ioctx);
+    }
+  }
+
+  if (ret < 0) {
+    rt_mem_charge(&ctx->mem, RT_MEM_QUEUES, -(long)sizeof(ctx_aio_t));
+    free(ca);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->started--;
+    pthread_mutex_unlock(&ctx->lock);
+    retire(ctx);
+  }
+
+  return ret;
+}
+
+// Processes the ready step of operation `ca`. Returns whether the
+// operation is done.
+static int advance(rt_ctx_t *ctx, ctx_aio_t *ca) {
+  rt_ctx_op_t *op = ca->op;
+
+  if (!ca->aio) {
+    // Run by a worker thread.
+    return 1;
+  }
+
+  rt_mem_t *prev = rt_mem_bind(&ctx->mem);
+  int done = rt_aio_advance(ca->aio, &op->ret, &op->flag);
+  if (done) {
+    rt_aio_release(ca->aio);
+  }
+  rt_mem_bind(prev);
+
+  if (!done) {
+    return 0;
+  }
+
+  ca->aio = NULL;
+  rt_ctx_ioctx_put(ctx, op->pool_name, ca->ioctx);
+
+  // The RT has another layout, let a worker thread update it.
+  if (op->ret == -EOPNOTSUPP && to_worker(ctx, ca) == 0) {
+    return 0;
+  }
+
+  retire(ctx);
+  return 1;
+}
+
+int rt_ctx_event_fd(rt_ctx_t *ctx) { return ctx->event_fd; }
+
+int rt_ctx_process_completions(rt_ctx_t *ctx) {
+  uint64_t count;
+  int done = 0;
+
+  // Reset the event fd before taking the ready operations, operations
+  // becoming ready afterwards signal it again.
+  read(ctx->event_fd, &count, sizeof(count));
+
+  pthread_mutex_lock(&ctx->ready_lock);
+  ctx_aio_t *ca = ctx->ready;
+  ctx->ready = NULL;
+  ctx->ready_tail = &ctx->ready;
+  pthread_mutex_unlock(&ctx->ready_lock);
+
+  while (ca) {
+    // Once its next step is issued, the operation may be queued again.
+    ctx_aio_t *next = ca->next;
+
+    if (advance(ctx, ca)) {
+      finish(ctx, ca);
+      done++;
+    }
+
+    ca = next;
+  }
+
+  return done;
+}
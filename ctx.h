@@ -0,0 +1,219 @@
+#ifndef ctx_h_INCLUDED
+#define ctx_h_INCLUDED
+
+#include "mem.h"
+#include "rt.h"
+#include "throttle.h"
+
+/**
+ * rt_ctx is a long-lived context for issuing many RT operations without
+ * paying for a cluster connection and an I/O context each time. It holds a
+ * connection, caches I/O contexts of pools, and runs submitted operations
+ * asynchronously on a pool of worker threads.
+ *
+ * Memory used by operations of a context is accounted per subsystem, see
+ * mem.h. Once it exceeds the soft limit, idle I/O contexts are dropped and
+ * new operations wait for operations in flight to complete.
+ *
+ * All functions are thread-safe.
+ */
+typedef struct rt_ctx rt_ctx_t;
+
+/**
+ * rt_ctx_op is an RT update executed asynchronously by a context.
+ */
+typedef struct rt_ctx_op rt_ctx_op_t;
+
+/**
+ * rt_ctx_op_cb is called by a worker thread of the context once operation
+ * `op` has completed, or for operations started with rt_ctx_start, by the
+ * thread calling rt_ctx_process_completions. It must not block on other
+ * operations of the context.
+ */
+typedef void (*rt_ctx_op_cb)(rt_ctx_op_t *op);
+
+struct rt_ctx_op {
+  // Set by the caller, and kept valid until the op completes.
+  int remove;
+  const char *pool_name;
+  const char *rt_name;
+  const char *const *keys;
+  const size_t *key_lens;
+  int keys_count;
+  rt_ctx_op_cb cb;
+  void *arg;
+
+  // Results, set before `cb` is called: return value of rt_add3 or
+  // rt_remove3, and `rt_created` or `rt_deleted`.
+  int ret;
+  int flag;
+};
+
+typedef struct rt_ctx_stats {
+  // Memory used by the context, with high-water marks.
+  rt_mem_t mem;
+  // Soft limit of `mem.total`, zero if unlimited.
+  size_t mem_limit;
+  // Operations queued or executing.
+  int in_flight;
+  // Cached I/O contexts not in use.
+  int idle_ioctxs;
+  // Number of times caches were dropped, and operations were held back,
+  // because of the soft limit.
+  unsigned long sheds;
+  unsigned long throttled;
+} rt_ctx_stats_t;
+
+/**
+ * rt_ctx_connect connects to the cluster as `client_id`, using Ceph config
+ * file `conf_file` if not NULL, and creates a context on the connection
+ * with `workers` worker threads.
+ */
+int rt_ctx_connect(const char *client_id, const char *conf_file, int workers,
+                   rt_ctx_t **ctx);
+
+/**
+ * rt_ctx_create creates a context on connection `rados` with `workers`
+ * worker threads. The connection must outlive the context.
+ */
+int rt_ctx_create(rados_t rados, int workers, rt_ctx_t **ctx);
+
+/**
+ * rt_ctx_destroy waits for submitted and started operations to complete,
+ * processing completions of the latter, and frees
+ * context `ctx`. The connection is shut down if the context made it.
+ */
+void rt_ctx_destroy(rt_ctx_t *ctx);
+
+/**
+ * rt_ctx_set_mem_limit sets the soft limit of memory used by context `ctx`
+ * to `bytes`, zero for no limit.
+ */
+void rt_ctx_set_mem_limit(rt_ctx_t *ctx, size_t bytes);
+
+/**
+ * rt_ctx_set_opts sets options of RT updates of context `ctx`, see
+ * rt_opts_t. It must be called before any operation is issued.
+ */
+void rt_ctx_set_opts(rt_ctx_t *ctx, const rt_opts_t *opts);
+
+/**
+ * rt_ctx_start_rollups starts feeding the rollups, see rollup.h, with RT
+ * updates done on the connection of context `ctx`, flushing them every
+ * `interval_ms` milliseconds. They're flushed for the last time when the
+ * context is destroyed.
+ */
+int rt_ctx_start_rollups(rt_ctx_t *ctx, int interval_ms);
+
+/**
+ * rt_ctx_get_windows fills `windows` with up to `max` congestion windows of
+ * batches on the connection of context `ctx`, one per pool, and returns
+ * their number.
+ */
+int rt_ctx_get_windows(rt_ctx_t *ctx, rt_window_stats_t *windows, int max);
+
+/**
+ * rt_ctx_get_stats fills `stats` with current statistics of context `ctx`.
+ */
+void rt_ctx_get_stats(rt_ctx_t *ctx, rt_ctx_stats_t *stats);
+
+/**
+ * rt_ctx_ioctx_get sets `ioctx` to an I/O context of pool `pool_name`,
+ * for exclusive use until it's given back with rt_ctx_ioctx_put. RT
+ * operations can't share an I/O context, see rt_list_keys.
+ */
+int rt_ctx_ioctx_get(rt_ctx_t *ctx, const char *pool_name,
+                     rados_ioctx_t *ioctx);
+
+/**
+ * rt_ctx_ioctx_put gives I/O context `ioctx` of pool `pool_name` back to
+ * the cache.
+ */
+void rt_ctx_ioctx_put(rt_ctx_t *ctx, const char *pool_name,
+                      rados_ioctx_t ioctx);
+
+/**
+ * rt_ctx_add calls rt_add3, with options of the context, with a cached I/O
+ * context of pool `pool_name`.
+ */
+int rt_ctx_add(rt_ctx_t *ctx, const char *pool_name, const char *rt_name,
+               const char *const *keys, const size_t *key_lens,
+               int keys_count, int *rt_created);
+
+/**
+ * rt_ctx_remove calls rt_remove3, with options of the context, with a
+ * cached I/O context of pool `pool_name`.
+ */
+int rt_ctx_remove(rt_ctx_t *ctx, const char *pool_name, const char *rt_name,
+                  const char *const *keys, const size_t *key_lens,
+                  int keys_count, int *rt_deleted);
+
+/**
+ * rt_ctx_list_keys calls rt_list_keys with a cached I/O context of pool
+ * `pool_name`.
+ */
+int rt_ctx_list_keys(rt_ctx_t *ctx, const char *pool_name,
+                     const char *rt_name, int page_size, rt_keys_cb cb,
+                     void *arg, uint32_t *refcount);
+
+/**
+ * rt_ctx_delegate acquires write delegation of RT `rt_name` in pool
+ * `pool_name`, see deleg.h. Until it's recalled by another client or
+ * released with rt_ctx_undelegate, rt_ctx_add, rt_ctx_remove and
+ * rt_ctx_list_keys of the RT go through the delegation. Once it's
+ * recalled, they fall back to regular RT operations.
+ */
+int rt_ctx_delegate(rt_ctx_t *ctx, const char *pool_name,
+                    const char *rt_name);
+
+/**
+ * rt_ctx_undelegate releases write delegation of RT `rt_name` in pool
+ * `pool_name`, if held by context `ctx`.
+ */
+void rt_ctx_undelegate(rt_ctx_t *ctx, const char *pool_name,
+                       const char *rt_name);
+
+/**
+ * rt_ctx_submit queues operation `op` for a worker thread, blocking while
+ * the queue is full or memory is over the soft limit. Returns -EPIPE if
+ * the context is being destroyed, in which case `op->cb` isn't called.
+ */
+int rt_ctx_submit(rt_ctx_t *ctx, rt_ctx_op_t *op);
+
+/**
+ * rt_ctx_batch executes `ops_count` operations of `ops` concurrently on
+ * the worker threads and waits for all of them. Their `cb` and `arg` are
+ * overwritten. Operations in flight are bounded by the congestion window of
+ * their pool, see rt_window_t. Returns the number of operations that
+ * failed, see `ret` of each.
+ */
+int rt_ctx_batch(rt_ctx_t *ctx, rt_ctx_op_t *ops, int ops_count);
+
+/**
+ * rt_ctx_start starts operation `op` without blocking, for event loops
+ * driving many operations from a single thread. Updates of single object
+ * RTs are run with asynchronous I/O, see rt_aio_t, and their steps are
+ * processed by rt_ctx_process_completions. Other updates, of RTs of other
+ * layouts or with a delegation, are run by worker threads, and return
+ * -EOPNOTSUPP without them. The event fd of the context is readable while
+ * there are completions to process. Started operations count as in
+ * flight, but unlike rt_ctx_submit, don't wait for memory.
+ */
+int rt_ctx_start(rt_ctx_t *ctx, rt_ctx_op_t *op);
+
+/**
+ * rt_ctx_event_fd returns an eventfd of context `ctx`, readable while
+ * started operations have completions to process, to be polled by event
+ * loops.
+ */
+int rt_ctx_event_fd(rt_ctx_t *ctx);
+
+/**
+ * rt_ctx_process_completions processes completions of operations started
+ * with rt_ctx_start, without blocking, issuing their next steps and
+ * calling callbacks of those done on the calling thread. Returns the
+ * number of operations done.
+ */
+int rt_ctx_process_completions(rt_ctx_t *ctx);
+
+#endif // ctx_h_INCLUDED
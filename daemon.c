@@ -0,0 +1,1216 @@
+#define _GNU_SOURCE
+
+#include "daemon.h"
+#include "history.h"
+#include "hll.h"
+#include "queue.h"
+#include "rollup.h"
+#include "rt.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+
+Tracker daemon
+==============
+
+rt-daemon serves the protocol described in daemon.h. Every connection has a
+reader thread splitting requests into lines and queueing them, and a fixed
+pool of worker threads executes them. Once the queue is full, readers stop
+reading, so that clients sending faster than the workers keep up are pushed
+back by their socket buffers.
+
+LIST results of single object RTs are cached with the RT object version
+they were read at. A cached result is only used after checking, with a
+read operation asserting the version, that the RT hasn't changed since.
+
+Hot restart
+-----------
+
+A new daemon started with -H takes over from the one listening on its
+socket, after it has connected to the cluster:
+
+1. It connects to the socket and sends `- HANDOFF`.
+2. The old daemon stops accepting. Reader threads stop at the next read,
+   keeping the partial request line read so far, and the old daemon waits
+   for queued requests to complete. Clients are not disconnected, their
+   further requests wait in the socket buffers.
+3. It writes a snapshot into a memfd, and passes the snapshot, the
+   listening socket and all client connections to the new daemon with
+   SCM_RIGHTS, in messages of handoff_msg_t:
+
+       {HANDOFF_MAGIC, 2}               fds: listening socket, snapshot
+       {HANDOFF_MAGIC, N}               fds: N client connections
+       ...
+
+4. The new daemon picks up the connections where the old one stopped, and
+   the old one exits without removing the socket.
+
+If the handoff fails before any client connection has been passed, e.g.
+the new daemon died, the old one restarts its workers and the readers of
+the stopped connections, and keeps serving. Once some connections have been
+passed, it can't tell which of them the new daemon serves, and drops them.
+
+The snapshot is in host byte order, both daemons run on the same host:
+
+    u32 HANDOFF_MAGIC
+    u32 number of connections, in the order they're passed in
+    per connection:
+      u32 length of the partial request line, and the line
+    u32 number of cached LIST results
+    per result:
+      u64 RT object version, u32 refcount, u64 keys, u64 hash
+      u32 length of the RT name, and the name
+
+Cached results are validated by RT object version like any other, so the
+new daemon doesn't re-read RTs that haven't changed.
+
+*/
+
+// Attempts of a conflicting update before its error is returned.
+#define DAEMON_MAX_RETRIES 16
+// Number of keys fetched from RT OMap at once by LIST.
+#define DAEMON_KEYS_PAGE_SIZE 1000
+// Number of hash buckets of the LIST cache.
+#define DAEMON_CACHE_BUCKETS 4096
+// Interval of rollup flushes.
+#define DAEMON_ROLLUP_INTERVAL_MS 1000
+// Maximum number of client connections passed by a single handoff message.
+#define HANDOFF_FDS_PER_MSG 64
+#define HANDOFF_MAGIC 0x4f485452 // "RTHO"
+
+typedef struct conn {
+  int fd;
+  pthread_mutex_t write_lock;
+  int refs;
+
+  // Requests read so far, with a partial line at the end. Owned by the
+  // reader thread.
+  char *buf;
+  size_t len;
+
+  // Open connections. Guarded by conns_lock.
+  struct conn *prev, *next;
+  // Set by the reader thread stopped for a handoff.
+  int parked;
+} conn_t;
+
+typedef struct job {
+  conn_t *conn;
+  char *line;
+} job_t;
+
+typedef struct worker {
+  pthread_t thread;
+  // Not shared, see rt_list_keys.
+  rados_ioctx_t ioctx;
+} worker_t;
+
+// Cached LIST result.
+typedef struct list_entry {
+  struct list_entry *next;
+  uint64_t version;
+  uint32_t refcount;
+  uint64_t keys_count;
+  uint64_t hash;
+  char rt_name[];
+} list_entry_t;
+
+// Message passing file descriptors on handoff.
+typedef struct handoff_msg {
+  uint32_t magic;
+  uint32_t fds_count;
+} handoff_msg_t;
+
+static rados_t rados;
+static const char *pool_name;
+// Layout of created RTs and writer identity, see rt_opts_t.
+static rt_opts_t rt_opts;
+static rt_queue_t jobs;
+
+static int conns_count;
+static uint64_t ops_count;
+static uint64_t errors_count;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static list_entry_t *cache[DAEMON_CACHE_BUCKETS];
+static int cache_count;
+static int cache_size = 65536;
+static uint64_t cache_hits;
+
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readers_done = PTHREAD_COND_INITIALIZER;
+static conn_t *conns;
+static int readers_count;
+
+// Readable once the daemon is stopping, waking up poll of the accept loop
+// and of reader threads.
+static int wake_fds[2];
+// Connection the handoff was requested on.
+static conn_t *handoff_conn;
+
+static volatile sig_atomic_t stopping;
+// Stopping on a signal rather than for a handoff.
+static volatile sig_atomic_t signalled;
+
+void print_usage(const char *progname);
+int parse_positive_int(const char *name, const char *val);
+
+/*
+ * Connections.
+ */
+
+static void *conn_run(void *arg);
+
+// Starts serving client connection `fd`, with `len` bytes of requests at
+// `buf` read from it already.
+static void conn_start(int fd, const char *buf, size_t len) {
+  conn_t *c = calloc(1, sizeof(conn_t));
+  c->fd = fd;
+  c->refs = 1;
+  c->buf = malloc(RT_DAEMON_MAX_LINE);
+  c->len = len;
+  memcpy(c->buf, buf, len);
+  pthread_mutex_init(&c->write_lock, NULL);
+  __atomic_add_fetch(&conns_count, 1, 0);
+
+  pthread_mutex_lock(&conns_lock);
+  c->next = conns;
+  if (conns) {
+    conns->prev = c;
+  }
+  conns = c;
+  readers_count++;
+  pthread_mutex_unlock(&conns_lock);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, conn_run, c);
+  pthread_detach(thread);
+}
+
+static void conn_get(conn_t *c) { __atomic_add_fetch(&c->refs, 1, 0); }
+
+static void conn_put(conn_t *c) {
+  if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    pthread_mutex_lock(&conns_lock);
+    if (c->prev) {
+      c->prev->next = c->next;
+    } else {
+      conns = c->next;
+    }
+    if (c->next) {
+      c->next->prev = c->prev;
+    }
+    pthread_mutex_unlock(&conns_lock);
+
+    close(c->fd);
+    pthread_mutex_destroy(&c->write_lock);
+    free(c->buf);
+    free(c);
+    __atomic_sub_fetch(&conns_count, 1, 0);
+  }
+}
+
+static void conn_reply(conn_t *c, const char *tag, const char *fmt, ...) {
+  char buf[256];
+  int len = snprintf(buf, sizeof(buf), "%s ", tag);
+
+  va_list args;
+  va_start(args, fmt);
+  len += vsnprintf(buf + len, sizeof(buf) - len, fmt, args);
+  va_end(args);
+
+  if (len > (int)sizeof(buf) - 2) {
+    len = sizeof(buf) - 2;
+  }
+  buf[len++] = '\n';
+
+  pthread_mutex_lock(&c->write_lock);
+  for (int off = 0; off < len;) {
+    ssize_t n = write(c->fd, buf + off, len - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // Reader thread notices the broken connection.
+      shutdown(c->fd, SHUT_RDWR);
+      break;
+    }
+    off += n;
+  }
+  pthread_mutex_unlock(&c->write_lock);
+}
+
+// Arguments of count_keys.
+typedef struct list_arg {
+  uint64_t keys_count;
+  uint64_t hash;
+} list_arg_t;
+
+// rt_keys_cb counting and hashing listed keys.
+static int count_keys(const char *const *keys, const size_t *key_lens,
+                      int keys_count, void *arg) {
+  list_arg_t *la = arg;
+
+  la->keys_count += keys_count;
+  la->hash ^= rt_history_set_hash(keys, key_lens, keys_count);
+
+  return 0;
+}
+
+/*
+ * LIST cache.
+ */
+
+static list_entry_t **cache_bucket(const char *rt_name) {
+  return &cache[rt_hash64(rt_name, strlen(rt_name)) % DAEMON_CACHE_BUCKETS];
+}
+
+// Copies the cached LIST result of RT `rt_name` into `e`. Returns whether
+// there is one.
+static int cache_get(const char *rt_name, list_entry_t *e) {
+  int found = 0;
+
+  pthread_mutex_lock(&cache_lock);
+  for (list_entry_t *it = *cache_bucket(rt_name); it; it = it->next) {
+    if (strcmp(it->rt_name, rt_name) == 0) {
+      memcpy(e, it, sizeof(list_entry_t));
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  return found;
+}
+
+static void cache_drop(const char *rt_name) {
+  pthread_mutex_lock(&cache_lock);
+  for (list_entry_t **link = cache_bucket(rt_name); *link;
+       link = &(*link)->next) {
+    if (strcmp((*link)->rt_name, rt_name) == 0) {
+      list_entry_t *it = *link;
+      *link = it->next;
+      free(it);
+      cache_count--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// Caches a LIST result. Once the cache is full, the result replaces the
+// last entry of its bucket, if any.
+static void cache_put(const char *rt_name, uint64_t version, uint32_t refcount,
+                      uint64_t keys_count, uint64_t hash) {
+  list_entry_t *e = malloc(sizeof(list_entry_t) + strlen(rt_name) + 1);
+  e->version = version;
+  e->refcount = refcount;
+  e->keys_count = keys_count;
+  e->hash = hash;
+  strcpy(e->rt_name, rt_name);
+
+  pthread_mutex_lock(&cache_lock);
+
+  list_entry_t **bucket = cache_bucket(rt_name);
+  for (list_entry_t **link = bucket; *link; link = &(*link)->next) {
+    list_entry_t *it = *link;
+    if (strcmp(it->rt_name, rt_name) == 0 ||
+        (cache_count >= cache_size && !it->next)) {
+      *link = it->next;
+      free(it);
+      cache_count--;
+      break;
+    }
+  }
+
+  if (cache_count < cache_size) {
+    e->next = *bucket;
+    *bucket = e;
+    cache_count++;
+    e = NULL;
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  free(e);
+}
+
+// Checks that RT `rt_name` is still at object version `version`, without
+// reading it. Returns -ERANGE if it has changed.
+static int check_version(rados_ioctx_t ioctx, const char *rt_name,
+                         uint64_t version) {
+  rados_read_op_t read_op = rados_create_read_op();
+  rados_read_op_assert_version(read_op, version);
+  int ret = rados_read_op_operate(read_op, ioctx, rt_name, 0);
+  rados_release_read_op(read_op);
+
+  return ret;
+}
+
+/*
+ * Request execution.
+ */
+
+static int exec_update(worker_t *w, conn_t *c, const char *tag, int remove,
+                       const char *rt_name, const char *const *keys,
+                       const size_t *key_lens, int keys_count) {
+  int ret, flag = 0;
+
+  for (int attempt = 0; attempt < DAEMON_MAX_RETRIES; attempt++) {
+    if (remove) {
+      ret = rt_remove3(w->ioctx, rt_name, keys, key_lens, keys_count,
+                       &rt_opts, &flag);
+    } else {
+      ret = rt_add3(w->ioctx, rt_name, keys, key_lens, keys_count, &rt_opts,
+                    &flag);
+    }
+
+    // The RT changed between reading and writing it: -EEXIST is a
+    // concurrent creation, -ENOENT and -EOVERFLOW a concurrent deletion.
+    if (ret != -ERANGE && ret != -EEXIST && ret != -ENOENT &&
+        ret != -EOVERFLOW) {
+      break;
+    }
+  }
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  conn_reply(c, tag, remove ? "OK deleted=%d" : "OK created=%d", flag != 0);
+  return 0;
+}
+
+static int exec_list(worker_t *w, conn_t *c, const char *tag,
+                     const char *rt_name) {
+  list_arg_t la;
+  list_entry_t e;
+  uint32_t refcount;
+  uint64_t version;
+  int ret;
+
+  if (cache_get(rt_name, &e)) {
+    if ((ret = check_version(w->ioctx, rt_name, e.version)) == 0) {
+      __atomic_add_fetch(&cache_hits, 1, 0);
+      conn_reply(c, tag, "OK refcount=%u keys=%lu hash=%016lx", e.refcount,
+                 (unsigned long)e.keys_count, (unsigned long)e.hash);
+      return 0;
+    }
+    cache_drop(rt_name);
+  }
+
+  for (int attempt = 0; attempt < DAEMON_MAX_RETRIES; attempt++) {
+    memset(&la, 0, sizeof(la));
+    refcount = 0;
+
+    // Only results of single object RTs can be validated by the version of
+    // the RT object.
+    ret = rt_load(w->ioctx, rt_name, DAEMON_KEYS_PAGE_SIZE, count_keys, &la,
+                  &refcount, &version);
+    if (ret == 0) {
+      cache_put(rt_name, version, refcount, la.keys_count, la.hash);
+    } else if (ret == -EOPNOTSUPP) {
+      memset(&la, 0, sizeof(la));
+      ret = rt_list_keys(w->ioctx, rt_name, DAEMON_KEYS_PAGE_SIZE, count_keys,
+                         &la, &refcount);
+    }
+
+    if (ret != -ERANGE) {
+      break;
+    }
+  }
+
+  if (ret == -ENOENT) {
+    // RT objects are deleted once they hold no references.
+    memset(&la, 0, sizeof(la));
+    refcount = 0;
+    ret = 0;
+  }
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  conn_reply(c, tag, "OK refcount=%u keys=%lu hash=%016lx", refcount,
+             (unsigned long)la.keys_count, (unsigned long)la.hash);
+  return 0;
+}
+
+static void exec_job(worker_t *w, job_t *job) {
+  char *save = NULL;
+  char *tag = strtok_r(job->line, " ", &save);
+  char *verb = strtok_r(NULL, " ", &save);
+  int ret = 0;
+
+  if (!tag) {
+    // Empty line.
+    return;
+  }
+
+  if (!verb) {
+    ret = -EINVAL;
+  } else if (strcmp(verb, "ADD") == 0 || strcmp(verb, "REM") == 0) {
+    char *rt_name = strtok_r(NULL, " ", &save);
+    const char **keys = NULL;
+    size_t *key_lens = NULL;
+    int keys_count = 0;
+
+    for (char *key = strtok_r(NULL, " ", &save); key;
+         key = strtok_r(NULL, " ", &save)) {
+      keys = realloc(keys, sizeof(char *) * (keys_count + 1));
+      key_lens = realloc(key_lens, sizeof(size_t) * (keys_count + 1));
+      keys[keys_count] = key;
+      key_lens[keys_count++] = strlen(key);
+    }
+
+    if (!rt_name || keys_count == 0) {
+      ret = -EINVAL;
+    } else {
+      ret = exec_update(w, job->conn, tag, verb[0] == 'R', rt_name, keys,
+                        key_lens, keys_count);
+    }
+
+    free(keys);
+    free(key_lens);
+  } else if (strcmp(verb, "LIST") == 0) {
+    char *rt_name = strtok_r(NULL, " ", &save);
+    ret = rt_name ? exec_list(w, job->conn, tag, rt_name) : -EINVAL;
+  } else if (strcmp(verb, "STATS") == 0) {
+    pthread_mutex_lock(&jobs.lock);
+    int queued = jobs.count;
+    pthread_mutex_unlock(&jobs.lock);
+
+    pthread_mutex_lock(&cache_lock);
+    int cached = cache_count;
+    pthread_mutex_unlock(&cache_lock);
+
+    conn_reply(job->conn, tag,
+               "OK conns=%d queued=%d ops=%lu errors=%lu cached=%d "
+               "cache_hits=%lu",
+               __atomic_load_n(&conns_count, 0), queued,
+               (unsigned long)__atomic_load_n(&ops_count, 0),
+               (unsigned long)__atomic_load_n(&errors_count, 0), cached,
+               (unsigned long)__atomic_load_n(&cache_hits, 0));
+  } else if (strcmp(verb, "PING") == 0) {
+    conn_reply(job->conn, tag, "OK");
+  } else {
+    ret = -EOPNOTSUPP;
+  }
+
+  __atomic_add_fetch(&ops_count, 1, 0);
+
+  if (ret < 0) {
+    __atomic_add_fetch(&errors_count, 1, 0);
+    conn_reply(job->conn, tag, "ERR %d", ret);
+  }
+}
+
+static void *worker_run(void *arg) {
+  worker_t *w = arg;
+  job_t *job;
+
+  while ((job = rt_queue_pop(&jobs))) {
+    exec_job(w, job);
+
+    conn_put(job->conn);
+    free(job->line);
+    free(job);
+  }
+
+  return NULL;
+}
+
+// Opens the job queue and starts `count` workers.
+static int start_workers(worker_t *workers, int count, int queue_size) {
+  int ret;
+
+  rt_queue_init(&jobs, queue_size);
+
+  for (int i = 0; i < count; i++) {
+    if ((ret = rados_ioctx_create(rados, pool_name, &workers[i].ioctx)) < 0) {
+      return ret;
+    }
+    pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+  }
+
+  return 0;
+}
+
+// Closes the job queue and waits for workers to finish queued requests.
+static void stop_workers(worker_t *workers, int count) {
+  rt_queue_close(&jobs);
+  for (int i = 0; i < count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    rados_ioctx_destroy(workers[i].ioctx);
+  }
+}
+
+// Returns whether `line` is a HANDOFF request.
+static int is_handoff(const char *line, size_t len) {
+  const char *verb = memchr(line, ' ', len);
+  return verb && (size_t)(line + len - verb) == strlen(" HANDOFF") &&
+         memcmp(verb, " HANDOFF", strlen(" HANDOFF")) == 0;
+}
+
+static void *conn_run(void *arg) {
+  conn_t *c = arg;
+
+  for (;;) {
+    struct pollfd fds[] = {
+        {.fd = c->fd, .events = POLLIN},
+        {.fd = wake_fds[0], .events = POLLIN},
+    };
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents) {
+      // Stopping. On handoff, the connection is passed on with the requests
+      // read so far.
+      c->parked = handoff_conn != NULL;
+      break;
+    }
+
+    ssize_t n = read(c->fd, c->buf + c->len, RT_DAEMON_MAX_LINE - c->len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    c->len += n;
+
+    // Queue all complete lines.
+
+    char *beg = c->buf;
+    char *end;
+    while ((end = memchr(beg, '\n', c->buf + c->len - beg))) {
+      conn_t *none = NULL;
+      if (is_handoff(beg, end - beg) &&
+          __atomic_compare_exchange_n(&handoff_conn, &none, c, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        stopping = 1;
+        write(wake_fds[1], "", 1);
+        goto out;
+      }
+
+      job_t *job = malloc(sizeof(job_t));
+      job->conn = c;
+      job->line = strndup(beg, end - beg);
+
+      conn_get(c);
+      if (rt_queue_push(&jobs, job) < 0) {
+        // Shutting down.
+        conn_put(c);
+        free(job->line);
+        free(job);
+        goto out;
+      }
+
+      beg = end + 1;
+    }
+
+    c->len -= beg - c->buf;
+    memmove(c->buf, beg, c->len);
+
+    if (c->len == RT_DAEMON_MAX_LINE) {
+      conn_reply(c, "-", "ERR %d", -E2BIG);
+      break;
+    }
+  }
+
+out:
+  pthread_mutex_lock(&conns_lock);
+  readers_count--;
+  pthread_cond_broadcast(&readers_done);
+  pthread_mutex_unlock(&conns_lock);
+
+  if (c->parked || c == handoff_conn) {
+    // Taken over by the handoff.
+    return NULL;
+  }
+
+  shutdown(c->fd, SHUT_RDWR);
+  conn_put(c);
+
+  return NULL;
+}
+
+static void on_signal(int sig) {
+  signalled = 1;
+  stopping = 1;
+  // Wakes up the accept loop and readers, whichever thread the signal is
+  // delivered to.
+  write(wake_fds[1], "", 1);
+}
+
+/*
+ * Hot restart, see the top of the file.
+ */
+
+static int send_fds(int sock, const int *fds, int fds_count) {
+  handoff_msg_t msg = {.magic = HANDOFF_MAGIC, .fds_count = fds_count};
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+  struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+  struct msghdr mh = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = CMSG_SPACE(sizeof(int) * fds_count),
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_count);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fds_count);
+
+  return sendmsg(sock, &mh, 0) == sizeof(msg) ? 0 : -errno;
+}
+
+// Receives a handoff message into `fds`, and returns the number of file
+// descriptors passed.
+static int recv_fds(int sock, int *fds) {
+  handoff_msg_t msg;
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+  struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+  struct msghdr mh = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+
+  ssize_t n = recvmsg(sock, &mh, MSG_WAITALL);
+  if (n < 0) {
+    return -errno;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  if (n != sizeof(msg) || msg.magic != HANDOFF_MAGIC ||
+      msg.fds_count > HANDOFF_FDS_PER_MSG || !cmsg ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * msg.fds_count)) {
+    return -EPROTO;
+  }
+
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * msg.fds_count);
+  return msg.fds_count;
+}
+
+static void put_u32(FILE *f, uint32_t v) { fwrite(&v, sizeof(v), 1, f); }
+static void put_u64(FILE *f, uint64_t v) { fwrite(&v, sizeof(v), 1, f); }
+
+// Reader of the snapshot.
+typedef struct snapshot {
+  const char *p;
+  const char *end;
+  int err;
+} snapshot_t;
+
+static const void *get_bytes(snapshot_t *r, size_t len) {
+  if (r->err || (size_t)(r->end - r->p) < len) {
+    r->err = 1;
+    return NULL;
+  }
+
+  const void *p = r->p;
+  r->p += len;
+  return p;
+}
+
+static uint32_t get_u32(snapshot_t *r) {
+  const void *p = get_bytes(r, sizeof(uint32_t));
+  uint32_t v = 0;
+  if (p) {
+    memcpy(&v, p, sizeof(v));
+  }
+  return v;
+}
+
+static uint64_t get_u64(snapshot_t *r) {
+  const void *p = get_bytes(r, sizeof(uint64_t));
+  uint64_t v = 0;
+  if (p) {
+    memcpy(&v, p, sizeof(v));
+  }
+  return v;
+}
+
+// Hands the daemon over to the process on `handoff_conn`. Called once
+// readers have stopped and queued requests have completed. On failure,
+// `resumable` is set if no client connection has been passed, and the
+// stopped connections are kept.
+static int handoff_send(int lfd, int *resumable) {
+  int sock = handoff_conn->fd;
+  int sent = 0;
+  int ret = 0;
+
+  *resumable = 1;
+
+  int snap_fd = memfd_create("rt-daemon-handoff", MFD_CLOEXEC);
+  if (snap_fd < 0) {
+    return -errno;
+  }
+
+  FILE *f = fdopen(dup(snap_fd), "w");
+
+  // Connections of readers that stopped for the handoff. Others have been
+  // closed by now.
+  int parked_count = 0;
+  for (conn_t *c = conns; c; c = c->next) {
+    parked_count += c->parked;
+  }
+
+  int *fds = malloc(sizeof(int) * (parked_count + 1));
+  int fds_count = 0;
+
+  put_u32(f, HANDOFF_MAGIC);
+  put_u32(f, parked_count);
+  for (conn_t *c = conns; c; c = c->next) {
+    if (c->parked) {
+      fds[fds_count++] = c->fd;
+      put_u32(f, c->len);
+      fwrite(c->buf, 1, c->len, f);
+    }
+  }
+
+  put_u32(f, cache_count);
+  for (int i = 0; i < DAEMON_CACHE_BUCKETS; i++) {
+    for (list_entry_t *e = cache[i]; e; e = e->next) {
+      put_u64(f, e->version);
+      put_u32(f, e->refcount);
+      put_u64(f, e->keys_count);
+      put_u64(f, e->hash);
+      put_u32(f, strlen(e->rt_name));
+      fwrite(e->rt_name, 1, strlen(e->rt_name), f);
+    }
+  }
+
+  if (fclose(f) != 0) {
+    ret = -EIO;
+    goto out;
+  }
+
+  if ((ret = send_fds(sock, (int[]){lfd, snap_fd}, 2)) < 0) {
+    goto out;
+  }
+
+  for (int i = 0; i < fds_count; i += HANDOFF_FDS_PER_MSG) {
+    int n = fds_count - i < HANDOFF_FDS_PER_MSG ? fds_count - i
+                                                : HANDOFF_FDS_PER_MSG;
+    if ((ret = send_fds(sock, fds + i, n)) < 0) {
+      goto out;
+    }
+    sent += n;
+  }
+
+  fprintf(stderr, "Handed over %d connections and %d cached results.\n",
+          parked_count, cache_count);
+
+out:
+  free(fds);
+  close(snap_fd);
+
+  *resumable = ret < 0 && sent == 0;
+
+  // The new daemon holds the connections now, or they're dropped if the
+  // handoff failed after passing some of them.
+  for (conn_t *c = conns, *next; c && !*resumable; c = next) {
+    next = c->next;
+    if (c->parked) {
+      conn_put(c);
+    }
+  }
+  conn_put(handoff_conn);
+  handoff_conn = NULL;
+
+  return ret;
+}
+
+// Restarts readers of the connections stopped for a failed handoff.
+static void handoff_resume(void) {
+  char buf[64];
+  struct pollfd wake = {.fd = wake_fds[0], .events = POLLIN};
+
+  stopping = 0;
+  while (poll(&wake, 1, 0) > 0 && read(wake_fds[0], buf, sizeof(buf)) > 0) {
+  }
+
+  pthread_mutex_lock(&conns_lock);
+  for (conn_t *c = conns; c; c = c->next) {
+    if (c->parked) {
+      // The reader takes over the reference of the stopped one.
+      c->parked = 0;
+      readers_count++;
+
+      pthread_t thread;
+      pthread_create(&thread, NULL, conn_run, c);
+      pthread_detach(thread);
+    }
+  }
+  pthread_mutex_unlock(&conns_lock);
+}
+
+// Takes over from the daemon listening on `socket_path`, and sets `lfd` to
+// its listening socket.
+static int handoff_receive(const char *socket_path, int *lfd) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int fds[HANDOFF_FDS_PER_MSG];
+  int snap_fd = -1;
+  int conn_fds_count = 0;
+  int *conn_fds = NULL;
+  snapshot_t r = {0};
+  char *snap = MAP_FAILED;
+  struct stat st;
+  int ret;
+
+  *lfd = -1;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  strcpy(addr.sun_path, socket_path);
+  const char *req = "- HANDOFF\n";
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      write(sock, req, strlen(req)) != (ssize_t)strlen(req)) {
+    ret = -errno;
+    goto out;
+  }
+
+  if ((ret = recv_fds(sock, fds)) < 0) {
+    goto out;
+  }
+  if (ret != 2) {
+    ret = -EPROTO;
+    goto out;
+  }
+  *lfd = fds[0];
+  snap_fd = fds[1];
+
+  if (fstat(snap_fd, &st) < 0 ||
+      (snap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, snap_fd, 0)) ==
+          MAP_FAILED) {
+    ret = -errno;
+    goto out;
+  }
+  r.p = snap;
+  r.end = snap + st.st_size;
+
+  if (get_u32(&r) != HANDOFF_MAGIC) {
+    ret = -EPROTO;
+    goto out;
+  }
+
+  // Receive all connections before serving any, the snapshot follows them.
+  conn_fds_count = get_u32(&r);
+  conn_fds = malloc(sizeof(int) * (conn_fds_count + 1));
+  for (int i = 0; i < conn_fds_count; i++) {
+    conn_fds[i] = -1;
+  }
+  for (int i = 0; i < conn_fds_count;) {
+    if ((ret = recv_fds(sock, fds)) <= 0 || i + ret > conn_fds_count) {
+      ret = ret < 0 ? ret : -EPROTO;
+      goto out;
+    }
+    memcpy(conn_fds + i, fds, sizeof(int) * ret);
+    i += ret;
+  }
+
+  for (int i = 0; i < conn_fds_count; i++) {
+    uint32_t len = get_u32(&r);
+    const char *buf = get_bytes(&r, len);
+    if (!buf || len >= RT_DAEMON_MAX_LINE) {
+      ret = -EPROTO;
+      goto out;
+    }
+    conn_start(conn_fds[i], buf, len);
+    conn_fds[i] = -1;
+  }
+
+  uint32_t entries = get_u32(&r);
+  for (uint32_t i = 0; i < entries && !r.err; i++) {
+    uint64_t version = get_u64(&r);
+    uint32_t refcount = get_u32(&r);
+    uint64_t keys_count = get_u64(&r);
+    uint64_t hash = get_u64(&r);
+    uint32_t len = get_u32(&r);
+    const char *name = get_bytes(&r, len);
+    if (name) {
+      char *rt_name = strndup(name, len);
+      cache_put(rt_name, version, refcount, keys_count, hash);
+      free(rt_name);
+    }
+  }
+
+  fprintf(stderr, "Took over %d connections and %u cached results.\n",
+          conn_fds_count, entries);
+  ret = 0;
+
+out:
+  if (ret < 0) {
+    for (int i = 0; i < conn_fds_count; i++) {
+      if (conn_fds[i] >= 0) {
+        close(conn_fds[i]);
+      }
+    }
+    if (*lfd >= 0) {
+      close(*lfd);
+    }
+  }
+  if (snap != MAP_FAILED) {
+    munmap(snap, st.st_size);
+  }
+  if (snap_fd >= 0) {
+    close(snap_fd);
+  }
+  free(conn_fds);
+  close(sock);
+
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  const char *socket_path = RT_DAEMON_DEFAULT_SOCKET;
+  char *client_id = NULL;
+  char *ceph_conf = NULL;
+  int workers_count = 16;
+  int queue_size = 1024;
+  int verbose = 0;
+  int takeover = 0;
+  int ret = 0;
+  int opt;
+
+  rt_opts_init(&rt_opts);
+
+  while ((opt = getopt(argc, argv, "i:p:c:s:j:q:C:W:Hvh")) != -1) {
+    switch (opt) {
+    case 'i':
+      client_id = optarg;
+      break;
+    case 'p':
+      pool_name = optarg;
+      break;
+    case 'c':
+      ceph_conf = optarg;
+      break;
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'j':
+      workers_count = parse_positive_int("-j", optarg);
+      break;
+    case 'q':
+      queue_size = parse_positive_int("-q", optarg);
+      break;
+    case 'C':
+      cache_size = parse_positive_int("-C", optarg);
+      break;
+    case 'W':
+      rt_opts.layout = RT_LAYOUT_PARTITIONED;
+      rt_opts.writer_id = optarg;
+      break;
+    case 'H':
+      takeover = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'h':
+    default:
+      print_usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (!client_id || !ceph_conf || !pool_name) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (!verbose) {
+    // Debug log of every op would dominate the daemon's cost.
+    freopen("/dev/null", "w", stdout);
+  }
+
+  rados_create(&rados, client_id);
+  if ((ret = rados_conf_read_file(rados, ceph_conf)) < 0 ||
+      (ret = rados_connect(rados)) < 0) {
+    fprintf(stderr, "Failed to connect to RADOS cluster: %d\n", ret);
+    return 1;
+  }
+
+  if ((ret = rt_rollup_start(rados, DAEMON_ROLLUP_INTERVAL_MS)) < 0) {
+    fprintf(stderr, "Failed to start rollup flusher: %d\n", ret);
+    return 1;
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  pipe(wake_fds);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Workers are ready before taking over, so that requests of handed over
+  // connections don't wait for them.
+  worker_t *workers = calloc(workers_count, sizeof(worker_t));
+  if ((ret = start_workers(workers, workers_count, queue_size)) < 0) {
+    fprintf(stderr, "Failed to create ioctx: %d\n", ret);
+    return 1;
+  }
+
+  int lfd;
+
+  if (takeover) {
+    if ((ret = handoff_receive(socket_path, &lfd)) < 0) {
+      fprintf(stderr, "Failed to take over from %s: %s\n", socket_path,
+              strerror(-ret));
+      return 1;
+    }
+  } else {
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1024) < 0) {
+      fprintf(stderr, "Failed to listen on %s: %s\n", socket_path,
+              strerror(errno));
+      return 1;
+    }
+  }
+
+  fprintf(stderr, "Listening on %s with %d workers, pool %s.\n", socket_path,
+          workers_count, pool_name);
+
+  for (;;) {
+    while (!stopping) {
+      struct pollfd fds[] = {
+          {.fd = lfd, .events = POLLIN},
+          {.fd = wake_fds[0], .events = POLLIN},
+      };
+
+      if (poll(fds, 2, -1) < 0 || !(fds[0].revents & POLLIN)) {
+        continue;
+      }
+
+      int fd = accept(lfd, NULL, NULL);
+      if (fd < 0) {
+        if (stopping || errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        fprintf(stderr, "accept failed: %s\n", strerror(errno));
+        ret = 1;
+        break;
+      }
+
+      conn_start(fd, NULL, 0);
+    }
+
+    if (handoff_conn) {
+      // Stop reading at request boundaries, the rest of the requests stays
+      // in socket buffers for the new daemon.
+      pthread_mutex_lock(&conns_lock);
+      while (readers_count > 0) {
+        pthread_cond_wait(&readers_done, &conns_lock);
+      }
+      pthread_mutex_unlock(&conns_lock);
+    }
+
+    // Stop accepting, finish queued requests.
+
+    stop_workers(workers, workers_count);
+
+    if (!handoff_conn) {
+      unlink(socket_path);
+      break;
+    }
+
+    int resumable;
+    if (handoff_send(lfd, &resumable) == 0) {
+      break;
+    }
+
+    if (!resumable || signalled) {
+      fprintf(stderr, "Handoff failed, connections dropped.\n");
+      ret = 1;
+      break;
+    }
+
+    fprintf(stderr, "Handoff failed, serving on.\n");
+
+    // All readers have stopped, nothing uses the closed queue anymore.
+    rt_queue_destroy(&jobs);
+    if ((ret = start_workers(workers, workers_count, queue_size)) < 0) {
+      fprintf(stderr, "Failed to create ioctx: %d\n", ret);
+      ret = 1;
+      break;
+    }
+    handoff_resume();
+  }
+  free(workers);
+  close(lfd);
+
+  fprintf(stderr, "Served %lu requests, %lu failed.\n",
+          (unsigned long)ops_count, (unsigned long)errors_count);
+
+  rt_rollup_stop();
+  rt_cluster_release(rados);
+  rados_shutdown(rados);
+
+  return ret;
+}
+
+int parse_positive_int(const char *name, const char *val) {
+  char *end;
+  long n = strtol(val, &end, 10);
+  if (*end != '\0' || n <= 0) {
+    fprintf(stderr, "%s must be a positive integer\n", name);
+    exit(1);
+  }
+
+  return (int)n;
+}
+
+void print_usage(const char *progname) {
+  printf("Usage: %s -i CLIENT ID -p POOL NAME -c CEPH CONFIG FILE "
+         "[-s SOCKET] [-j WORKERS] [-q QUEUE SIZE] [-C CACHE SIZE] "
+         "[-W WRITER ID] [-H] [-v] [-h]\n",
+         progname);
+  printf("Serves RT operations on a Unix socket, see daemon.h for the "
+         "protocol.\n");
+  printf("  -s SOCKET\t\tUnix socket to listen on. Defaults to %s.\n",
+         RT_DAEMON_DEFAULT_SOCKET);
+  printf("  -j WORKERS\t\tNumber of threads executing requests. Defaults to "
+         "16.\n");
+  printf("  -q QUEUE SIZE\t\tMaximum number of requests waiting for a "
+         "worker. Defaults to 1024.\n");
+  printf("  -C CACHE SIZE\t\tMaximum number of cached LIST results. "
+         "Defaults to 65536.\n");
+  printf("  -W WRITER ID\t\tCreate partitioned RTs, and update them as "
+         "this writer.\n");
+  printf("  -H\t\t\tTake over from the daemon listening on SOCKET.\n");
+  printf("  -v\t\t\tKeep the tracker's debug log on stdout.\n");
+  printf("  -h\t\t\tThis help message.\n");
+}
@@ -0,0 +1,50 @@
+#ifndef daemon_h_INCLUDED
+#define daemon_h_INCLUDED
+
+/*
+
+Tracker daemon protocol
+=======================
+
+rt-daemon keeps a connected RADOS session and serves RT operations to local
+clients over a Unix socket. Requests and replies are text lines terminated
+by LF, with fields separated by single spaces:
+
+    Request:  TAG VERB [ARG]...
+    Reply:    TAG OK [NAME=VALUE]...
+              TAG ERR ERRNO
+
+TAG is chosen by the client and echoed in the reply, it may not contain
+spaces. A client may send further requests without waiting for replies.
+Requests are executed concurrently, so replies may come in a different
+order than the requests; TAG is what matches them up. ERRNO is a negative
+errno value.
+
+Verbs:
+
+    ADD RT KEY...  Adds keys to RT. Replies `created=0|1`.
+    REM RT KEY...  Removes keys from RT. Replies `deleted=0|1`.
+    LIST RT        Counts keys of RT. Replies `refcount=N keys=N hash=H`,
+                   all zero if RT doesn't exist. H is the set hash of the
+                   keys, see rt_history_set_hash in history.h.
+    STATS          Replies `conns=N queued=N ops=N errors=N cached=N
+                   cache_hits=N`: open connections, requests waiting for a
+                   worker, executed and failed requests since start, and
+                   cached LIST results and LIST requests served from them.
+    PING           Replies with a plain OK.
+    HANDOFF        Hands the daemon over to the client, which is a new
+                   daemon taking over, see daemon.c. Replies with handoff
+                   messages instead of a line.
+
+Conflicting concurrent updates of an RT are retried by the daemon, a client
+only sees their error if they keep conflicting.
+
+Lines longer than RT_DAEMON_MAX_LINE are answered with `- ERR -7` (E2BIG)
+and the connection is closed.
+
+*/
+
+#define RT_DAEMON_DEFAULT_SOCKET "/tmp/rt-daemon.sock"
+#define RT_DAEMON_MAX_LINE (64 * 1024)
+
+#endif // daemon_h_INCLUDED
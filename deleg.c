@@ -0,0 +1,600 @@
+#include "deleg.h"
+#include "hll.h"
+#include "mem.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+
+// See rt.c.
+#ifdef RT_NO_DEBUG_LOG
+#define printf(...) ((void)(0 && printf(__VA_ARGS__)))
+#endif
+
+// Name of the lock on the lease object.
+#define DELEG_LOCK_NAME "rt-deleg"
+// Lease object name suffix.
+#define DELEG_LEASE_SUFFIX ".deleg"
+// Lease duration in seconds. Updates renew it once half of it has passed.
+#define DELEG_LEASE_SECS 30
+// Notify payload recalling a delegation.
+#define DELEG_RECALL "recall"
+// How long a recall waits for the holder to acknowledge it.
+#define DELEG_RECALL_TIMEOUT_MS 5000
+// Delay between attempts to take a recalled lease.
+#define DELEG_ACQUIRE_DELAY_US 100000
+// Maximum number of keys read from RT OMap at once when loading the RT.
+#define DELEG_LOAD_PAGE_SIZE 1024
+// Maximum number of attempts to load an RT that keeps being modified.
+#define DELEG_LOAD_MAX_RETRIES 8
+// Initial number of buckets of the key table.
+#define DELEG_MIN_BUCKETS 64
+
+typedef enum deleg_state {
+  DELEG_HELD,
+  // Recalled by another client, or the watch of the lease object failed.
+  DELEG_RECALLED,
+  // The RT has been deleted.
+  DELEG_DELETED,
+} deleg_state_t;
+
+// Key of the delegated RT.
+typedef struct deleg_key {
+  struct deleg_key *next;
+  size_t len;
+  char key[];
+} deleg_key_t;
+
+struct rt_deleg {
+  rados_t rados;
+  rados_ioctx_t ioctx;
+  char *rt_name;
+  char *lease_oid;
+  char cookie[40];
+  uint64_t watch;
+  int watching;
+
+  // Guards everything below. Operations hold it for their duration, so
+  // that recalls wait for the update being written.
+  pthread_mutex_t lock;
+  deleg_state_t state;
+  time_t renew_at;
+
+  // Copy of the RT, and the RT object version it's from.
+  uint64_t gen;
+  uint32_t refcount;
+  deleg_key_t **buckets;
+  size_t buckets_count;
+  size_t keys_count;
+};
+
+static uint64_t last_cookie;
+
+/*
+ * Key table.
+ */
+
+// Returns the link pointing to key `key`, or NULL if it's not held.
+static deleg_key_t **find_key(rt_deleg_t *d, const char *key, size_t len) {
+  deleg_key_t **link =
+      &d->buckets[rt_hash64(key, len) & (d->buckets_count - 1)];
+
+  for (; *link; link = &(*link)->next) {
+    if ((*link)->len == len && memcmp((*link)->key, key, len) == 0) {
+      return link;
+    }
+  }
+
+  return NULL;
+}
+
+static void grow_keys(rt_deleg_t *d) {
+  size_t count = d->buckets_count ? d->buckets_count * 2 : DELEG_MIN_BUCKETS;
+  deleg_key_t **buckets =
+      rt_mem_alloc(RT_MEM_CACHE, sizeof(deleg_key_t *) * count);
+  memset(buckets, 0, sizeof(deleg_key_t *) * count);
+
+  for (size_t i = 0; i < d->buckets_count; i++) {
+    for (deleg_key_t *k = d->buckets[i], *next; k; k = next) {
+      next = k->next;
+      deleg_key_t **bucket =
+          &buckets[rt_hash64(k->key, k->len) & (count - 1)];
+      k->next = *bucket;
+      *bucket = k;
+    }
+  }
+
+  rt_mem_free(d->buckets);
+  d->buckets = buckets;
+  d->buckets_count = count;
+}
+
+static void insert_key(rt_deleg_t *d, const char *key, size_t len) {
+  if (d->keys_count >= d->buckets_count) {
+    grow_keys(d);
+  }
+
+  deleg_key_t *k = rt_mem_alloc(RT_MEM_CACHE, sizeof(deleg_key_t) + len);
+  k->len = len;
+  memcpy(k->key, key, len);
+
+  deleg_key_t **bucket =
+      &d->buckets[rt_hash64(key, len) & (d->buckets_count - 1)];
+  k->next = *bucket;
+  *bucket = k;
+  d->keys_count++;
+}
+
+static void erase_key(rt_deleg_t *d, deleg_key_t **link) {
+  deleg_key_t *k = *link;
+  *link = k->next;
+  rt_mem_free(k);
+  d->keys_count--;
+}
+
+static void clear_keys(rt_deleg_t *d) {
+  for (size_t i = 0; i < d->buckets_count; i++) {
+    while (d->buckets[i]) {
+      erase_key(d, &d->buckets[i]);
+    }
+  }
+}
+
+/*
+ * Lease.
+ */
+
+// Gives up the lease, if it's still ours. Removing the lease object drops
+// the lock with it, so that lease objects don't pile up. It's renewed
+// first, which fails if the lock isn't ours anymore, and guarantees it
+// doesn't expire before it's removed. Called with lock held.
+static void drop_lease(rt_deleg_t *d) {
+  struct timeval lease = {DELEG_LEASE_SECS, 0};
+
+  if (rados_lock_exclusive(d->ioctx, d->lease_oid, DELEG_LOCK_NAME,
+                           d->cookie, "", &lease,
+                           LIBRADOS_LOCK_FLAG_RENEW) == 0) {
+    rados_remove(d->ioctx, d->lease_oid);
+  }
+}
+
+// Renews the lease once half of it has passed. Called with lock held.
+static int renew_lease(rt_deleg_t *d) {
+  struct timeval lease = {DELEG_LEASE_SECS, 0};
+  int ret;
+
+  if (time(NULL) < d->renew_at) {
+    return 0;
+  }
+
+  if ((ret = rados_lock_exclusive(d->ioctx, d->lease_oid, DELEG_LOCK_NAME,
+                                  d->cookie, "", &lease,
+                                  LIBRADOS_LOCK_FLAG_RENEW)) < 0) {
+    { // Debug log message.
+      printf("deleg: Lost lease of RT %s: %d.\n", d->rt_name, ret);
+    }
+    d->state = DELEG_RECALLED;
+    return -ESTALE;
+  }
+
+  d->renew_at = time(NULL) + DELEG_LEASE_SECS / 2;
+  return 0;
+}
+
+static void on_notify(void *arg, uint64_t notify_id, uint64_t handle,
+                      uint64_t notifier_id, void *data, size_t data_len) {
+  rt_deleg_t *d = arg;
+
+  if (data_len == strlen(DELEG_RECALL) &&
+      memcmp(data, DELEG_RECALL, data_len) == 0) {
+    // Waits for the operation in progress.
+    pthread_mutex_lock(&d->lock);
+    if (d->state == DELEG_HELD) {
+      { // Debug log message.
+        printf("deleg: Delegation of RT %s recalled.\n", d->rt_name);
+      }
+      drop_lease(d);
+      d->state = DELEG_RECALLED;
+    }
+    pthread_mutex_unlock(&d->lock);
+  }
+
+  rados_notify_ack(d->ioctx, d->lease_oid, notify_id, handle, NULL, 0);
+}
+
+static void on_watch_error(void *arg, uint64_t cookie, int err) {
+  rt_deleg_t *d = arg;
+
+  // Recalls may have been missed.
+  pthread_mutex_lock(&d->lock);
+  if (d->state == DELEG_HELD) {
+    { // Debug log message.
+      printf("deleg: Watch of RT %s lease failed: %d.\n", d->rt_name, err);
+    }
+    drop_lease(d);
+    d->state = DELEG_RECALLED;
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+// Takes the lease, recalling it from its holder. Holders that don't
+// respond lose it once it expires.
+static int take_lease(rt_deleg_t *d) {
+  struct timeval lease = {DELEG_LEASE_SECS, 0};
+  time_t deadline =
+      time(NULL) + DELEG_LEASE_SECS + DELEG_RECALL_TIMEOUT_MS / 1000;
+  int ret;
+
+  while ((ret = rados_lock_exclusive(d->ioctx, d->lease_oid, DELEG_LOCK_NAME,
+                                     d->cookie, "RT delegation", &lease,
+                                     0)) == -EBUSY &&
+         time(NULL) < deadline) {
+    rados_notify2(d->ioctx, d->lease_oid, DELEG_RECALL, strlen(DELEG_RECALL),
+                  DELEG_RECALL_TIMEOUT_MS, NULL, NULL);
+    usleep(DELEG_ACQUIRE_DELAY_US);
+  }
+
+  if (ret == 0) {
+    d->renew_at = time(NULL) + DELEG_LEASE_SECS / 2;
+  }
+
+  return ret;
+}
+
+/*
+ * Delegation.
+ */
+
+static int load_keys(const char *const *keys, const size_t *key_lens,
+                     int keys_count, void *arg) {
+  rt_deleg_t *d = arg;
+
+  for (int i = 0; i < keys_count; i++) {
+    insert_key(d, keys[i], key_lens[i]);
+  }
+
+  return 0;
+}
+
+// Replaces the copy of the RT with the RT as stored. Called with lock
+// held.
+static int reload(rt_deleg_t *d) {
+  int ret = -ERANGE;
+
+  for (int attempt = 0; attempt < DELEG_LOAD_MAX_RETRIES && ret == -ERANGE;
+       attempt++) {
+    clear_keys(d);
+    ret = rt_load(d->ioctx, d->rt_name, DELEG_LOAD_PAGE_SIZE, load_keys, d,
+                  &d->refcount, &d->gen);
+  }
+
+  if (ret < 0) {
+    clear_keys(d);
+    if (ret == -ENOENT) {
+      d->state = DELEG_DELETED;
+    } else {
+      drop_lease(d);
+      d->state = DELEG_RECALLED;
+    }
+  }
+
+  return ret;
+}
+
+// Reloads the copy of the RT if another writer has modified the RT since,
+// checked with a read asserting the RT object version. Called with lock
+// held.
+static int validate(rt_deleg_t *d) {
+  rados_read_op_t read_op = rados_create_read_op();
+  rados_read_op_assert_version(read_op, d->gen);
+  int ret = rados_read_op_operate(read_op, d->ioctx, d->rt_name, 0);
+  rados_release_read_op(read_op);
+
+  if (ret == -ENOENT) {
+    clear_keys(d);
+    d->state = DELEG_DELETED;
+  } else if (ret == -ERANGE || ret == -EOVERFLOW) {
+    { // Debug log message.
+      printf("deleg: RT %s modified by another writer, reloading.\n",
+             d->rt_name);
+    }
+    ret = reload(d);
+  }
+
+  return ret;
+}
+
+// Locks `d` for an operation.
+static int begin(rt_deleg_t *d) {
+  int ret = 0;
+
+  pthread_mutex_lock(&d->lock);
+
+  if (d->state == DELEG_DELETED) {
+    ret = -ENOENT;
+  } else if (d->state != DELEG_HELD) {
+    ret = -ESTALE;
+  } else {
+    ret = renew_lease(d);
+  }
+
+  if (ret < 0) {
+    pthread_mutex_unlock(&d->lock);
+  }
+
+  return ret;
+}
+
+// Handles a failed write of an update: reloads the RT if it's been
+// modified by another writer. Returns whether to try again.
+static int retry_store(rt_deleg_t *d, int *ret) {
+  if (*ret == -ENOENT) {
+    clear_keys(d);
+    d->state = DELEG_DELETED;
+    return 0;
+  }
+
+  if (*ret != -ERANGE) {
+    return 0;
+  }
+
+  { // Debug log message.
+    printf("deleg: RT %s modified by another writer, reloading.\n",
+           d->rt_name);
+  }
+
+  if ((*ret = reload(d)) < 0) {
+    return 0;
+  }
+
+  *ret = -ERANGE;
+  return 1;
+}
+
+static void free_deleg(rt_deleg_t *d) {
+  if (d->watching) {
+    rados_unwatch2(d->ioctx, d->watch);
+    rados_watch_flush(d->rados);
+  }
+
+  if (d->state != DELEG_RECALLED) {
+    drop_lease(d);
+  }
+
+  clear_keys(d);
+  rt_mem_free(d->buckets);
+
+  if (d->ioctx) {
+    rados_ioctx_destroy(d->ioctx);
+  }
+
+  pthread_mutex_destroy(&d->lock);
+  free(d->lease_oid);
+  free(d->rt_name);
+  free(d);
+}
+
+int rt_deleg_acquire(rados_t rados, const char *pool_name,
+                     const char *rt_name, rt_deleg_t **deleg) {
+  rt_deleg_t *d = calloc(1, sizeof(rt_deleg_t));
+  int ret;
+
+  if (!d) {
+    return -ENOMEM;
+  }
+
+  d->rados = rados;
+  d->state = DELEG_RECALLED;
+  d->rt_name = strdup(rt_name);
+  d->lease_oid = malloc(strlen(rt_name) + sizeof(DELEG_LEASE_SUFFIX));
+  sprintf(d->lease_oid, "%s" DELEG_LEASE_SUFFIX, rt_name);
+  snprintf(d->cookie, sizeof(d->cookie), "%" PRIx64 ".%" PRIx64,
+           rados_get_instance_id(rados),
+           __atomic_add_fetch(&last_cookie, 1, __ATOMIC_RELAXED));
+  pthread_mutex_init(&d->lock, NULL);
+
+  if ((ret = rados_ioctx_create(rados, pool_name, &d->ioctx)) < 0) {
+    d->ioctx = NULL;
+    goto fail;
+  }
+
+  if ((ret = take_lease(d)) < 0) {
+    { // Debug log message.
+      printf("deleg: Failed to take lease of RT %s: %d.\n", rt_name, ret);
+    }
+    goto fail;
+  }
+
+  // Recalls wait until the RT is loaded.
+  pthread_mutex_lock(&d->lock);
+  d->state = DELEG_HELD;
+
+  if ((ret = rados_watch2(d->ioctx, d->lease_oid, &d->watch, on_notify,
+                          on_watch_error, d)) < 0) {
+    drop_lease(d);
+    d->state = DELEG_RECALLED;
+  } else {
+    d->watching = 1;
+    ret = reload(d);
+  }
+
+  pthread_mutex_unlock(&d->lock);
+
+  if (ret < 0) {
+    goto fail;
+  }
+
+  *deleg = d;
+  return 0;
+
+fail:
+  free_deleg(d);
+  return ret;
+}
+
+int rt_deleg_add(rt_deleg_t *d, const char *const *keys,
+                 const size_t *key_lens, int keys_count) {
+  int ret;
+
+  if ((ret = begin(d)) < 0) {
+    return ret;
+  }
+
+  const char **add = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(char *) * keys_count);
+  size_t *add_lens =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * keys_count);
+
+  // The update is worked out from the copy again after a reload, once.
+  for (int attempt = 0;; attempt++) {
+    int n = 0;
+
+    // Keys are added to the copy up front, which also skips duplicates.
+    for (int i = 0; i < keys_count; i++) {
+      if (!find_key(d, keys[i], key_lens[i])) {
+        insert_key(d, keys[i], key_lens[i]);
+        add[n] = keys[i];
+        add_lens[n] = key_lens[i];
+        n++;
+      }
+    }
+
+    if (n == 0) {
+      ret = 0;
+      break;
+    }
+
+    if ((ret = rt_store(d->ioctx, d->rt_name, &d->gen, d->refcount + n, add,
+                        add_lens, n, NULL, NULL, 0)) == 0) {
+      d->refcount += n;
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      erase_key(d, find_key(d, add[i], add_lens[i]));
+    }
+
+    if (!retry_store(d, &ret) || attempt > 0) {
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&d->lock);
+
+  rt_mem_free(add);
+  rt_mem_free(add_lens);
+
+  return ret;
+}
+
+int rt_deleg_remove(rt_deleg_t *d, const char *const *keys,
+                    const size_t *key_lens, int keys_count, int *rt_deleted) {
+  int ret;
+
+  *rt_deleted = 0;
+
+  if ((ret = begin(d)) < 0) {
+    return ret;
+  }
+
+  const char **rm = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(char *) * keys_count);
+  size_t *rm_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * keys_count);
+
+  for (int attempt = 0;; attempt++) {
+    int n = 0;
+    deleg_key_t **link;
+
+    // Keys are removed from the copy up front, which also skips
+    // duplicates.
+    for (int i = 0; i < keys_count; i++) {
+      if ((link = find_key(d, keys[i], key_lens[i]))) {
+        erase_key(d, link);
+        rm[n] = keys[i];
+        rm_lens[n] = key_lens[i];
+        n++;
+      }
+    }
+
+    if (n == 0) {
+      ret = 0;
+      break;
+    }
+
+    uint32_t refcount = d->refcount > (uint32_t)n ? d->refcount - n : 0;
+
+    if ((ret = rt_store(d->ioctx, d->rt_name, &d->gen, refcount, NULL, NULL,
+                        0, rm, rm_lens, n)) == 0) {
+      d->refcount = refcount;
+      if (refcount == 0) {
+        clear_keys(d);
+        d->state = DELEG_DELETED;
+        *rt_deleted = 1;
+      }
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      insert_key(d, rm[i], rm_lens[i]);
+    }
+
+    if (!retry_store(d, &ret) || attempt > 0) {
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&d->lock);
+
+  rt_mem_free(rm);
+  rt_mem_free(rm_lens);
+
+  return ret;
+}
+
+int rt_deleg_list_keys(rt_deleg_t *d, int page_size, rt_keys_cb cb,
+                       void *arg, uint32_t *refcount) {
+  int ret;
+
+  if ((ret = begin(d)) < 0) {
+    return ret;
+  }
+
+  // Updates of writers not using delegations aren't seen by the copy.
+  if ((ret = validate(d)) < 0) {
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+  }
+
+  const char **keys = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(char *) * page_size);
+  size_t *key_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * page_size);
+  int n = 0;
+
+  for (size_t i = 0; i < d->buckets_count && ret == 0; i++) {
+    for (deleg_key_t *k = d->buckets[i]; k && ret == 0; k = k->next) {
+      keys[n] = k->key;
+      key_lens[n] = k->len;
+      if (++n == page_size) {
+        ret = cb(keys, key_lens, n, arg);
+        n = 0;
+      }
+    }
+  }
+
+  if (ret == 0 && n > 0) {
+    ret = cb(keys, key_lens, n, arg);
+  }
+
+  *refcount = d->refcount;
+
+  pthread_mutex_unlock(&d->lock);
+
+  rt_mem_free(keys);
+  rt_mem_free(key_lens);
+
+  return ret;
+}
+
+void rt_deleg_release(rt_deleg_t *d) { free_deleg(d); }
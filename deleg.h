@@ -0,0 +1,86 @@
+#ifndef deleg_h_INCLUDED
+#define deleg_h_INCLUDED
+
+#include "rt.h"
+#include <rados/librados.h>
+
+/**
+ * rt_deleg is a write delegation of a single object RT: exclusive local
+ * ownership of the RT by one client, for RTs updated by the same client
+ * most of the time.
+ *
+ * The holder takes a lease, an exclusive RADOS lock on a separate lease
+ * object "<rt_name>.deleg", and watches it. It loads the RT once, and
+ * then serves listings from its copy of the keys, and works out updates
+ * locally and writes them with rt_store: a single write, asserting the RT
+ * object version, without reading the RT first. The lease lives outside
+ * of the RT so that renewing it doesn't change the RT object version.
+ *
+ * Another client takes the delegation over by recalling it: it notifies
+ * the lease object and the holder, once the update it's writing is done,
+ * releases the lease. Recalled delegations fail with -ESTALE, and the
+ * caller falls back to regular RT operations.
+ *
+ * Writers not using delegations are still safe: their updates change the
+ * RT object version, the holder's next write fails the version assertion,
+ * and the holder reloads the RT and tries once more. Listings of the
+ * holder check the RT object version with a read first, and reload the RT
+ * if it changed.
+ *
+ * Only RTs of the v1 layout can be delegated.
+ */
+typedef struct rt_deleg rt_deleg_t;
+
+/**
+ * rt_deleg_acquire acquires delegation of an RT, recalling it from its
+ * current holder if any, and loads the RT.
+ *
+ * `rados` is a handle to a Ceph cluster.
+ * `pool_name` is name of the pool where the RT RADOS object is stored.
+ * `rt_name` is name of the reference tracker RADOS object.
+ * `deleg` is set to the delegation, to be released with rt_deleg_release.
+ *
+ * Returns -ENOENT if the RT doesn't exist, -EOPNOTSUPP if it's not a v1
+ * RT, and -EBUSY if the current holder doesn't give it up.
+ */
+int rt_deleg_acquire(rados_t rados, const char *pool_name,
+                     const char *rt_name, rt_deleg_t **deleg);
+
+/**
+ * rt_deleg_add adds keys to the RT of delegation `deleg`, see rt_add.
+ *
+ * Returns -ESTALE if the delegation has been recalled, and -ENOENT if the
+ * RT has been deleted.
+ */
+int rt_deleg_add(rt_deleg_t *deleg, const char *const *keys,
+                 const size_t *key_lens, int keys_count);
+
+/**
+ * rt_deleg_remove removes keys from the RT of delegation `deleg`, see
+ * rt_remove. Once the RT is deleted, the delegation can only be released.
+ *
+ * Returns -ESTALE if the delegation has been recalled, and -ENOENT if the
+ * RT has been deleted.
+ */
+int rt_deleg_remove(rt_deleg_t *deleg, const char *const *keys,
+                    const size_t *key_lens, int keys_count, int *rt_deleted);
+
+/**
+ * rt_deleg_list_keys lists keys of the RT of delegation `deleg` from its
+ * copy of them, see rt_list_keys. The copy is reloaded first if the RT
+ * has been modified by another writer.
+ *
+ * Returns -ESTALE if the delegation has been recalled, and -ENOENT if the
+ * RT has been deleted. If the RT can't be reloaded, the delegation is
+ * dropped, as if recalled.
+ */
+int rt_deleg_list_keys(rt_deleg_t *deleg, int page_size, rt_keys_cb cb,
+                       void *arg, uint32_t *refcount);
+
+/**
+ * rt_deleg_release releases the lease, if still held, and frees
+ * delegation `deleg`. It must not be used by other threads anymore.
+ */
+void rt_deleg_release(rt_deleg_t *deleg);
+
+#endif // deleg_h_INCLUDED
@@ -0,0 +1,1473 @@
+#include "map.h"
+#include "proto.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/un.h>
+#include <time.h>
+
+/*
+
+RADOS emulator
+==============
+
+rt-emu serves the subset of RADOS semantics the tracker relies on to any
+number of local client processes, see emu/proto.h for the protocol and
+emu/rados/librados.h for the client side.
+
+Objects live in memory. Like OSD op shards, operations on objects are
+executed by a fixed number of shard threads, each owning the objects that
+hash to it and serving them one operation at a time. Every operation holds
+its shard for the configured service time after it's been applied and
+before it's answered, so that operations on one object queue up behind each
+other the way they do on a primary OSD.
+
+Object versions come from a per-pool counter, so a version is never reused
+by an object that's been deleted and created again.
+
+Compound write operations are applied atomically: all preconditions are
+checked first, and nothing is changed if any of them fails.
+
+*/
+
+#define USEC_PER_SEC 1000000ULL
+#define MAX_POOLS 1024
+
+typedef struct conn {
+  int fd;
+  uint64_t gid;
+  pthread_mutex_t write_lock;
+  int refs;
+  int dead;
+} conn_t;
+
+typedef struct watch {
+  struct watch *next;
+  conn_t *conn;
+  uint64_t cookie;
+} watch_t;
+
+typedef struct obj {
+  char *oid;
+  size_t oid_len;
+
+  uint64_t version;
+  time_t mtime;
+
+  char *data;
+  size_t data_len;
+
+  // Values are malloc'd byte arrays with the length in node's val_len.
+  emu_map_t xattrs;
+  emu_map_t omap;
+
+  // Exclusive advisory lock, if lock_name is set.
+  char *lock_name;
+  char *lock_cookie;
+  uint64_t lock_gid;
+  uint64_t lock_expires_us; // 0 if it doesn't expire.
+
+  watch_t *watchers;
+} obj_t;
+
+typedef struct nspace {
+  struct nspace *next;
+  char *name;
+
+  // Keyed by big-endian object hash followed by oid, so that in-order
+  // traversal yields the listing order.
+  emu_map_t objects;
+} nspace_t;
+
+typedef struct pool {
+  int64_t id;
+  char *name;
+  uint64_t last_version;
+  nspace_t *nspaces;
+} pool_t;
+
+typedef struct job {
+  struct job *next;
+  conn_t *conn;
+  emu_msg_hdr_t hdr;
+  char *payload;
+} job_t;
+
+typedef struct shard {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  job_t *head;
+  job_t *tail;
+} shard_t;
+
+// Watcher a notify waits for.
+typedef struct notify_waiter {
+  conn_t *conn;
+  uint64_t cookie;
+  int acked;
+} notify_waiter_t;
+
+typedef struct notify {
+  struct notify *next;
+  uint64_t id;
+  conn_t *conn; // Notifier.
+  uint64_t req_id;
+  uint64_t deadline_us;
+
+  notify_waiter_t *waiters;
+  int waiters_count;
+  int pending;
+
+  // Replies of acked watchers, in EMU_MSG_NOTIFY reply format.
+  emu_buf_t replies;
+  uint32_t replies_count;
+} notify_t;
+
+/*
+ * Global state.
+ */
+
+static int shards_count = 32;
+static uint64_t read_service_us = 0;
+static uint64_t write_service_us = 0;
+
+static shard_t *shards;
+
+// Guards pools and object indexes. Object contents are only ever accessed
+// by the shard owning the object.
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *pools[MAX_POOLS];
+static int pools_count;
+
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static notify_t *notifies;
+static uint64_t last_notify_id;
+
+static uint64_t last_gid;
+
+void print_usage(const char *progname);
+int parse_uint(const char *name, const char *val, uint64_t *out);
+
+/*
+ * Helpers.
+ */
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us) {
+  if (us == 0) {
+    return;
+  }
+
+  struct timespec ts = {.tv_sec = us / USEC_PER_SEC,
+                        .tv_nsec = (us % USEC_PER_SEC) * 1000};
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+  }
+}
+
+static void conn_get(conn_t *c) { __atomic_add_fetch(&c->refs, 1, 0); }
+
+static void conn_put(conn_t *c) {
+  if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    close(c->fd);
+    pthread_mutex_destroy(&c->write_lock);
+    free(c);
+  }
+}
+
+static int conn_dead(conn_t *c) { return __atomic_load_n(&c->dead, 0); }
+
+static void conn_send(conn_t *c, uint16_t type, uint64_t id,
+                      const emu_buf_t *payload) {
+  pthread_mutex_lock(&c->write_lock);
+  if (!conn_dead(c) && emu_send_msg(c->fd, type, id, payload) < 0) {
+    // Reader thread notices the broken connection.
+    shutdown(c->fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&c->write_lock);
+}
+
+// Starts a reply payload, leaving room for result and version.
+static void reply_begin(emu_buf_t *out) {
+  out->len = 0;
+  emu_put_u32(out, 0);
+  emu_put_u64(out, 0);
+}
+
+// Fills in result and version, sends and frees the reply.
+static void reply_send(conn_t *c, uint64_t id, emu_buf_t *out, int result,
+                       uint64_t version) {
+  int32_t r = result;
+  memcpy(out->data, &r, sizeof(r));
+  memcpy(out->data + sizeof(r), &version, sizeof(version));
+  conn_send(c, EMU_MSG_REPLY, id, out);
+  free(out->data);
+  out->data = NULL;
+  out->len = out->cap = 0;
+}
+
+static void reply_result(conn_t *c, uint64_t id, int result,
+                         uint64_t version) {
+  emu_buf_t out = {0};
+  reply_begin(&out);
+  reply_send(c, id, &out, result, version);
+}
+
+/*
+ * Store.
+ */
+
+// Returns id of pool `name`, creating the pool if there's none yet.
+static int64_t pool_lookup(const char *name) {
+  pool_t *pool = NULL;
+
+  pthread_mutex_lock(&store_lock);
+
+  for (int i = 0; i < pools_count; i++) {
+    if (strcmp(pools[i]->name, name) == 0) {
+      pool = pools[i];
+      break;
+    }
+  }
+
+  if (!pool && pools_count < MAX_POOLS) {
+    pool = calloc(1, sizeof(pool_t));
+    pool->id = pools_count + 1;
+    pool->name = strdup(name);
+    pools[pools_count++] = pool;
+  }
+
+  pthread_mutex_unlock(&store_lock);
+
+  return pool ? pool->id : -ENOSPC;
+}
+
+static int pool_exists(int64_t pool_id) {
+  pthread_mutex_lock(&store_lock);
+  int exists = pool_id >= 1 && pool_id <= pools_count;
+  pthread_mutex_unlock(&store_lock);
+  return exists;
+}
+
+// Returns namespace of the pool, optionally creating it. Caller holds
+// store_lock.
+static nspace_t *nspace_lookup(int64_t pool_id, const char *name, int create) {
+  if (pool_id < 1 || pool_id > pools_count) {
+    return NULL;
+  }
+
+  pool_t *pool = pools[pool_id - 1];
+  for (nspace_t *ns = pool->nspaces; ns; ns = ns->next) {
+    if (strcmp(ns->name, name) == 0) {
+      return ns;
+    }
+  }
+
+  if (!create) {
+    return NULL;
+  }
+
+  nspace_t *ns = calloc(1, sizeof(nspace_t));
+  ns->name = strdup(name);
+  emu_map_init(&ns->objects);
+  ns->next = pool->nspaces;
+  pool->nspaces = ns;
+
+  return ns;
+}
+
+static uint64_t pool_next_version(int64_t pool_id) {
+  return __atomic_add_fetch(&pools[pool_id - 1]->last_version, 1,
+                            __ATOMIC_RELAXED);
+}
+
+// Builds object index key of `oid`. Returns its length.
+static size_t obj_key(char **key, const char *oid, size_t oid_len) {
+  uint32_t h = emu_obj_hash(oid, oid_len);
+
+  *key = malloc(4 + oid_len);
+  (*key)[0] = h >> 24;
+  (*key)[1] = h >> 16;
+  (*key)[2] = h >> 8;
+  (*key)[3] = h;
+  memcpy(*key + 4, oid, oid_len);
+
+  return 4 + oid_len;
+}
+
+static obj_t *obj_lookup(int64_t pool_id, const char *nspace,
+                         const char *oid) {
+  obj_t *obj = NULL;
+  char *key;
+  size_t key_len = obj_key(&key, oid, strlen(oid));
+
+  pthread_mutex_lock(&store_lock);
+
+  nspace_t *ns = nspace_lookup(pool_id, nspace, 0);
+  if (ns) {
+    emu_map_node_t *n = emu_map_get(&ns->objects, key, key_len);
+    obj = n ? n->val : NULL;
+  }
+
+  pthread_mutex_unlock(&store_lock);
+
+  free(key);
+  return obj;
+}
+
+static obj_t *obj_create(int64_t pool_id, const char *nspace,
+                         const char *oid) {
+  obj_t *obj = calloc(1, sizeof(obj_t));
+  obj->oid = strdup(oid);
+  obj->oid_len = strlen(oid);
+  emu_map_init(&obj->xattrs);
+  emu_map_init(&obj->omap);
+
+  char *key;
+  size_t key_len = obj_key(&key, oid, obj->oid_len);
+  int created;
+
+  pthread_mutex_lock(&store_lock);
+  nspace_t *ns = nspace_lookup(pool_id, nspace, 1);
+  emu_map_insert(&ns->objects, key, key_len, &created)->val = obj;
+  pthread_mutex_unlock(&store_lock);
+
+  free(key);
+  return obj;
+}
+
+static void obj_delete(int64_t pool_id, const char *nspace, obj_t *obj) {
+  char *key;
+  size_t key_len = obj_key(&key, obj->oid, obj->oid_len);
+
+  pthread_mutex_lock(&store_lock);
+  nspace_t *ns = nspace_lookup(pool_id, nspace, 0);
+  free(emu_map_remove(&ns->objects, key, key_len));
+  pthread_mutex_unlock(&store_lock);
+
+  free(key);
+
+  // Watches don't survive the object.
+
+  emu_buf_t ev = {0};
+  for (watch_t *w = obj->watchers, *next; w; w = next) {
+    next = w->next;
+
+    ev.len = 0;
+    emu_put_u64(&ev, w->cookie);
+    emu_put_u32(&ev, (uint32_t)-ENOTCONN);
+    conn_send(w->conn, EMU_MSG_EVENT_WATCH_ERROR, 0, &ev);
+
+    conn_put(w->conn);
+    free(w);
+  }
+  free(ev.data);
+
+  emu_map_clear(&obj->xattrs, free);
+  emu_map_clear(&obj->omap, free);
+  free(obj->lock_name);
+  free(obj->lock_cookie);
+  free(obj->data);
+  free(obj->oid);
+  free(obj);
+}
+
+static void map_set(emu_map_t *m, const char *key, size_t key_len,
+                    const char *val, size_t val_len) {
+  int created;
+  emu_map_node_t *n = emu_map_insert(m, key, key_len, &created);
+
+  free(n->val);
+  n->val = malloc(val_len ? val_len : 1);
+  memcpy(n->val, val, val_len);
+  n->val_len = val_len;
+}
+
+static void map_del(emu_map_t *m, const char *key, size_t key_len) {
+  emu_map_node_t *n = emu_map_remove(m, key, key_len);
+  if (n) {
+    free(n->val);
+    free(n);
+  }
+}
+
+/*
+ * Operations.
+ */
+
+static int assert_version(obj_t *obj, uint64_t ver) {
+  if (!obj) {
+    return -ENOENT;
+  }
+  if (ver < obj->version) {
+    return -ERANGE;
+  }
+  if (ver > obj->version) {
+    return -EOVERFLOW;
+  }
+  return 0;
+}
+
+// Compares `a` with `b` by comparison operator `op`.
+static int cmp_op(const char *a, size_t a_len, uint8_t op, const char *b,
+                  size_t b_len) {
+  int c = emu_map_key_cmp(a, a_len, b, b_len);
+
+  int ok;
+  switch (op) {
+  case 1: // EQ
+    ok = c == 0;
+    break;
+  case 2: // NE
+    ok = c != 0;
+    break;
+  case 3: // GT
+    ok = c > 0;
+    break;
+  case 4: // GTE
+    ok = c >= 0;
+    break;
+  case 5: // LT
+    ok = c < 0;
+    break;
+  case 6: // LTE
+    ok = c <= 0;
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  return ok ? 0 : -ECANCELED;
+}
+
+static int cmpxattr(obj_t *obj, const char *name, uint8_t op,
+                    const char *val, size_t val_len) {
+  if (!obj) {
+    return -ENOENT;
+  }
+
+  // Missing xattr compares as empty.
+  emu_map_node_t *n = emu_map_get(&obj->xattrs, name, strlen(name));
+  return n ? cmp_op(n->val, n->val_len, op, val, val_len)
+           : cmp_op("", 0, op, val, val_len);
+}
+
+static int omap_cmp(obj_t *obj, const char *key, size_t key_len, uint8_t op,
+                    const char *val, size_t val_len) {
+  if (!obj) {
+    return -ENOENT;
+  }
+
+  // Unlike xattrs, missing keys fail the comparison.
+  emu_map_node_t *n = emu_map_get(&obj->omap, key, key_len);
+  return n ? cmp_op(n->val, n->val_len, op, val, val_len) : -ECANCELED;
+}
+
+static int lock_held(obj_t *obj) {
+  return obj && obj->lock_name &&
+         (obj->lock_expires_us == 0 || obj->lock_expires_us > now_us());
+}
+
+/*
+ * Runs sub-operations of a write op. With `apply` unset only checks their
+ * preconditions, tracking whether the object would exist after each one.
+ * With `apply` set, performs them, and none may fail.
+ */
+static int exec_write(obj_t **objp, int64_t pool_id, const char *nspace,
+                      const char *oid, emu_reader_t *r, uint32_t count,
+                      uint64_t gid, int apply) {
+  obj_t *obj = *objp;
+  int exists = obj != NULL;
+  int ret = 0;
+
+  for (uint32_t i = 0; i < count && ret == 0 && !r->err; i++) {
+    uint8_t code = emu_get_u8(r);
+    const char *name, *val, *cookie;
+    size_t name_len, val_len, cookie_len;
+
+    // Operations other than asserts create the object.
+    int creates = code != EMU_OP_ASSERT_VERSION &&
+                  code != EMU_OP_ASSERT_EXISTS && code != EMU_OP_CMPXATTR &&
+                  code != EMU_OP_OMAP_CMP && code != EMU_OP_REMOVE &&
+                  code != EMU_OP_UNLOCK && code != EMU_OP_BREAK_LOCK &&
+                  code != EMU_OP_OMAP_RM && code != EMU_OP_OMAP_CLEAR &&
+                  code != EMU_OP_RMXATTR;
+
+    if (code != EMU_OP_CREATE && code != EMU_OP_ASSERT_VERSION &&
+        code != EMU_OP_CMPXATTR && code != EMU_OP_OMAP_CMP && !creates &&
+        !exists) {
+      ret = -ENOENT;
+      break;
+    }
+
+    if (apply && creates && !obj) {
+      obj = *objp = obj_create(pool_id, nspace, oid);
+    }
+
+    switch (code) {
+    case EMU_OP_ASSERT_VERSION: {
+      uint64_t ver = emu_get_u64(r);
+      if (!apply) {
+        ret = assert_version(*objp, ver);
+      }
+      break;
+    }
+    case EMU_OP_ASSERT_EXISTS:
+      break;
+    case EMU_OP_CMPXATTR: {
+      name = emu_get_bytes(r, &name_len);
+      uint8_t op = emu_get_u8(r);
+      val = emu_get_bytes(r, &val_len);
+      if (!apply && !r->err) {
+        char *name_ = strndup(name, name_len);
+        ret = cmpxattr(*objp, name_, op, val, val_len);
+        free(name_);
+      }
+      break;
+    }
+    case EMU_OP_OMAP_CMP: {
+      name = emu_get_bytes(r, &name_len);
+      uint8_t op = emu_get_u8(r);
+      val = emu_get_bytes(r, &val_len);
+      if (!apply && !r->err) {
+        ret = omap_cmp(*objp, name, name_len, op, val, val_len);
+      }
+      break;
+    }
+    case EMU_OP_CREATE: {
+      uint8_t exclusive = emu_get_u8(r);
+      if (!apply && exists && exclusive) {
+        ret = -EEXIST;
+      }
+      break;
+    }
+    case EMU_OP_SETXATTR:
+      name = emu_get_bytes(r, &name_len);
+      val = emu_get_bytes(r, &val_len);
+      if (apply) {
+        map_set(&obj->xattrs, name, name_len, val, val_len);
+      }
+      break;
+    case EMU_OP_RMXATTR:
+      name = emu_get_bytes(r, &name_len);
+      if (apply) {
+        map_del(&obj->xattrs, name, name_len);
+      } else if (!*objp || !emu_map_get(&(*objp)->xattrs, name, name_len)) {
+        ret = -ENODATA;
+      }
+      break;
+    case EMU_OP_WRITE_FULL:
+      val = emu_get_bytes(r, &val_len);
+      if (apply) {
+        free(obj->data);
+        obj->data = malloc(val_len ? val_len : 1);
+        memcpy(obj->data, val, val_len);
+        obj->data_len = val_len;
+      }
+      break;
+    case EMU_OP_OMAP_SET: {
+      uint32_t n = emu_get_u32(r);
+      for (uint32_t j = 0; j < n && !r->err; j++) {
+        name = emu_get_bytes(r, &name_len);
+        val = emu_get_bytes(r, &val_len);
+        if (apply) {
+          map_set(&obj->omap, name, name_len, val, val_len);
+        }
+      }
+      break;
+    }
+    case EMU_OP_OMAP_RM: {
+      uint32_t n = emu_get_u32(r);
+      for (uint32_t j = 0; j < n && !r->err; j++) {
+        name = emu_get_bytes(r, &name_len);
+        if (apply) {
+          map_del(&obj->omap, name, name_len);
+        }
+      }
+      break;
+    }
+    case EMU_OP_OMAP_CLEAR:
+      if (apply) {
+        emu_map_clear(&obj->omap, free);
+      }
+      break;
+    case EMU_OP_REMOVE:
+      if (apply) {
+        // Object may be created again by the following operations.
+        free(obj->data);
+        obj->data = NULL;
+        obj->data_len = 0;
+        emu_map_clear(&obj->xattrs, free);
+        emu_map_clear(&obj->omap, free);
+      }
+      exists = 0;
+      break;
+    case EMU_OP_LOCK: {
+      name = emu_get_bytes(r, &name_len);
+      cookie = emu_get_bytes(r, &cookie_len);
+      uint64_t duration_us = emu_get_u64(r);
+      uint8_t flags = emu_get_u8(r);
+      if (r->err) {
+        break;
+      }
+
+      int ours = lock_held(*objp) && (*objp)->lock_gid == gid &&
+                 strlen((*objp)->lock_cookie) == cookie_len &&
+                 memcmp((*objp)->lock_cookie, cookie, cookie_len) == 0 &&
+                 strlen((*objp)->lock_name) == name_len &&
+                 memcmp((*objp)->lock_name, name, name_len) == 0;
+
+      if (!apply) {
+        if (ours && !(flags & 0x1)) {
+          ret = -EEXIST;
+        } else if (!ours && lock_held(*objp)) {
+          ret = -EBUSY;
+        }
+        break;
+      }
+
+      free(obj->lock_name);
+      free(obj->lock_cookie);
+      obj->lock_name = strndup(name, name_len);
+      obj->lock_cookie = strndup(cookie, cookie_len);
+      obj->lock_gid = gid;
+      obj->lock_expires_us = duration_us ? now_us() + duration_us : 0;
+      break;
+    }
+    case EMU_OP_UNLOCK:
+    case EMU_OP_BREAK_LOCK: {
+      name = emu_get_bytes(r, &name_len);
+      uint64_t owner = code == EMU_OP_UNLOCK ? gid : emu_get_u64(r);
+      cookie = emu_get_bytes(r, &cookie_len);
+      if (r->err) {
+        break;
+      }
+
+      if (!apply) {
+        obj_t *o = *objp;
+        if (!o || !o->lock_name || o->lock_gid != owner ||
+            strlen(o->lock_name) != name_len ||
+            memcmp(o->lock_name, name, name_len) != 0 ||
+            strlen(o->lock_cookie) != cookie_len ||
+            memcmp(o->lock_cookie, cookie, cookie_len) != 0) {
+          ret = -ENOENT;
+        }
+        break;
+      }
+
+      free(obj->lock_name);
+      free(obj->lock_cookie);
+      obj->lock_name = obj->lock_cookie = NULL;
+      break;
+    }
+    default:
+      ret = -EOPNOTSUPP;
+    }
+
+    if (creates) {
+      exists = 1;
+    }
+  }
+
+  if (r->err) {
+    return r->err;
+  }
+
+  if (apply && obj && !exists) {
+    obj_delete(pool_id, nspace, obj);
+    *objp = NULL;
+  }
+
+  return ret;
+}
+
+// Orders map nodes by key, for qsort.
+static int node_cmp(const void *a, const void *b) {
+  const emu_map_node_t *x = *(emu_map_node_t *const *)a;
+  const emu_map_node_t *y = *(emu_map_node_t *const *)b;
+  return emu_map_key_cmp(x->key, x->key_len, y->key, y->key_len);
+}
+
+static void put_omap_entry(emu_buf_t *out, emu_map_node_t *n, int vals) {
+  emu_put_bytes(out, n->key, n->key_len);
+  if (vals) {
+    emu_put_bytes(out, n->val, n->val_len);
+  } else {
+    emu_put_u32(out, 0);
+  }
+}
+
+/*
+ * Runs sub-operations of a read op, appending their outputs to `out`.
+ * Stops at the first failing one.
+ */
+static int exec_read(obj_t *obj, emu_reader_t *r, uint32_t count,
+                     emu_buf_t *out) {
+  if (!obj) {
+    return -ENOENT;
+  }
+
+  int ret = 0;
+
+  // Number of sub-operations run, filled in at the end.
+  size_t count_off = out->len;
+  uint32_t done = 0;
+  emu_put_u32(out, 0);
+
+  for (uint32_t i = 0; i < count && ret == 0 && !r->err; i++) {
+    uint8_t code = emu_get_u8(r);
+    const char *name, *val;
+    size_t name_len, val_len;
+
+    switch (code) {
+    case EMU_OP_ASSERT_VERSION:
+      ret = assert_version(obj, emu_get_u64(r));
+      break;
+    case EMU_OP_CMPXATTR: {
+      name = emu_get_bytes(r, &name_len);
+      uint8_t op = emu_get_u8(r);
+      val = emu_get_bytes(r, &val_len);
+      if (!r->err) {
+        char *name_ = strndup(name, name_len);
+        ret = cmpxattr(obj, name_, op, val, val_len);
+        free(name_);
+      }
+      break;
+    }
+    case EMU_OP_STAT:
+      emu_put_u32(out, 0);
+      emu_put_u64(out, obj->data_len);
+      emu_put_u64(out, obj->mtime);
+      break;
+    case EMU_OP_READ: {
+      uint64_t off = emu_get_u64(r);
+      uint64_t len = emu_get_u64(r);
+      if (off > obj->data_len) {
+        off = obj->data_len;
+      }
+      if (len == 0 || len > obj->data_len - off) {
+        len = obj->data_len - off;
+      }
+      emu_put_u32(out, 0);
+      emu_put_bytes(out, obj->data + off, len);
+      break;
+    }
+    case EMU_OP_GETXATTR: {
+      name = emu_get_bytes(r, &name_len);
+      emu_map_node_t *n = emu_map_get(&obj->xattrs, name, name_len);
+      if (!n) {
+        ret = -ENODATA;
+        break;
+      }
+      emu_put_u32(out, 0);
+      emu_put_bytes(out, n->val, n->val_len);
+      break;
+    }
+    case EMU_OP_GETXATTRS: {
+      emu_put_u32(out, 0);
+      emu_put_u32(out, obj->xattrs.count);
+      for (emu_map_node_t *n = emu_map_lower_bound(&obj->xattrs, NULL, 0, 0);
+           n; n = emu_map_lower_bound(&obj->xattrs, n->key, n->key_len, 0)) {
+        put_omap_entry(out, n, 1);
+      }
+      break;
+    }
+    case EMU_OP_OMAP_GET_VALS_BY_KEYS: {
+      uint32_t n_keys = emu_get_u32(r);
+
+      emu_put_u32(out, 0);
+      emu_put_u8(out, 0);
+      size_t n_off = out->len;
+      uint32_t found = 0;
+      emu_put_u32(out, 0);
+
+      // The OSD looks keys up as a set, so entries come back in key order
+      // and once each, whatever the order of the request.
+      emu_map_node_t **nodes = malloc(sizeof(*nodes) * (n_keys + 1));
+      for (uint32_t j = 0; j < n_keys && !r->err; j++) {
+        name = emu_get_bytes(r, &name_len);
+        emu_map_node_t *n = emu_map_get(&obj->omap, name, name_len);
+        if (n) {
+          nodes[found++] = n;
+        }
+      }
+      qsort(nodes, found, sizeof(*nodes), node_cmp);
+      uint32_t unique = 0;
+      for (uint32_t j = 0; j < found; j++) {
+        if (j == 0 || nodes[j] != nodes[j - 1]) {
+          put_omap_entry(out, nodes[j], 1);
+          unique++;
+        }
+      }
+      free(nodes);
+      found = unique;
+      memcpy(out->data + n_off, &found, sizeof(found));
+      break;
+    }
+    case EMU_OP_OMAP_GET_KEYS:
+    case EMU_OP_OMAP_GET_VALS: {
+      const char *start = emu_get_bytes(r, &name_len);
+      const char *prefix = "";
+      size_t prefix_len = 0;
+      if (code == EMU_OP_OMAP_GET_VALS) {
+        prefix = emu_get_bytes(r, &prefix_len);
+      }
+      uint64_t max = emu_get_u64(r);
+      if (r->err) {
+        break;
+      }
+
+      // Start past `start_after`, but not before the first prefixed key.
+      emu_map_node_t *n =
+          emu_map_lower_bound(&obj->omap, start, name_len, 0);
+      if (prefix_len > 0 &&
+          emu_map_key_cmp(start, name_len, prefix, prefix_len) < 0) {
+        n = emu_map_lower_bound(&obj->omap, prefix, prefix_len, 1);
+      }
+
+      emu_put_u32(out, 0);
+      size_t more_off = out->len;
+      emu_put_u8(out, 0);
+      size_t n_off = out->len;
+      uint32_t found = 0;
+      emu_put_u32(out, 0);
+
+      for (; n; n = emu_map_lower_bound(&obj->omap, n->key, n->key_len, 0)) {
+        if (n->key_len < prefix_len ||
+            memcmp(n->key, prefix, prefix_len) != 0) {
+          break;
+        }
+        if (found == max) {
+          out->data[more_off] = 1;
+          break;
+        }
+        put_omap_entry(out, n, code == EMU_OP_OMAP_GET_VALS);
+        found++;
+      }
+      memcpy(out->data + n_off, &found, sizeof(found));
+      break;
+    }
+    default:
+      ret = -EOPNOTSUPP;
+    }
+
+    if (ret == 0) {
+      done++;
+    }
+  }
+
+  memcpy(out->data + count_off, &done, sizeof(done));
+
+  return r->err ? r->err : ret;
+}
+
+static void handle_op(conn_t *c, uint64_t id, emu_reader_t *r) {
+  int64_t pool_id = emu_get_u64(r);
+  char *nspace = emu_get_str(r);
+  char *oid = emu_get_str(r);
+  uint8_t is_write = emu_get_u8(r);
+  uint32_t count = emu_get_u32(r);
+  int ret = r->err;
+
+  if (ret == 0 && !pool_exists(pool_id)) {
+    ret = -ENOENT;
+  }
+
+  emu_buf_t out = {0};
+  reply_begin(&out);
+
+  obj_t *obj = ret ? NULL : obj_lookup(pool_id, nspace, oid);
+  uint64_t version = obj ? obj->version : 0;
+
+  if (ret == 0 && !is_write) {
+    ret = exec_read(obj, r, count, &out);
+    sleep_us(read_service_us);
+  } else if (ret == 0) {
+    emu_reader_t ops = *r;
+    if ((ret = exec_write(&obj, pool_id, nspace, oid, &ops, count, c->gid,
+                          0)) == 0) {
+      exec_write(&obj, pool_id, nspace, oid, r, count, c->gid, 1);
+
+      version = pool_next_version(pool_id);
+      if (obj) {
+        obj->version = version;
+        obj->mtime = time(NULL);
+      }
+    }
+    sleep_us(write_service_us);
+  }
+
+  reply_send(c, id, &out, ret, version);
+
+  free(nspace);
+  free(oid);
+}
+
+/*
+ * Watch/notify.
+ */
+
+static void handle_watch(conn_t *c, uint64_t id, emu_reader_t *r,
+                         int unwatch) {
+  int64_t pool_id = emu_get_u64(r);
+  char *nspace = emu_get_str(r);
+  char *oid = emu_get_str(r);
+  uint64_t cookie = emu_get_u64(r);
+  int ret = r->err;
+
+  obj_t *obj = ret ? NULL : obj_lookup(pool_id, nspace, oid);
+  if (ret == 0 && !obj) {
+    ret = -ENOENT;
+  }
+
+  if (ret == 0 && !unwatch) {
+    watch_t *w = malloc(sizeof(watch_t));
+    conn_get(c);
+    w->conn = c;
+    w->cookie = cookie;
+    w->next = obj->watchers;
+    obj->watchers = w;
+  } else if (ret == 0) {
+    ret = -ENOENT;
+    for (watch_t **link = &obj->watchers; *link; link = &(*link)->next) {
+      watch_t *w = *link;
+      if (w->conn == c && w->cookie == cookie) {
+        *link = w->next;
+        conn_put(w->conn);
+        free(w);
+        ret = 0;
+        break;
+      }
+    }
+  }
+
+  reply_result(c, id, ret, obj ? obj->version : 0);
+
+  free(nspace);
+  free(oid);
+}
+
+// Answers the notifier and frees the notify. Caller holds notify_lock and
+// has unlinked it.
+static void notify_finish(notify_t *n, int result) {
+  emu_buf_t out = {0};
+  reply_begin(&out);
+  emu_put_u32(&out, n->replies_count);
+  emu_put(&out, n->replies.data, n->replies.len);
+  reply_send(n->conn, n->req_id, &out, result, 0);
+
+  for (int i = 0; i < n->waiters_count; i++) {
+    conn_put(n->waiters[i].conn);
+  }
+  conn_put(n->conn);
+  free(n->waiters);
+  free(n->replies.data);
+  free(n);
+}
+
+static void handle_notify(conn_t *c, uint64_t id, emu_reader_t *r) {
+  int64_t pool_id = emu_get_u64(r);
+  char *nspace = emu_get_str(r);
+  char *oid = emu_get_str(r);
+  uint64_t timeout_ms = emu_get_u64(r);
+  size_t payload_len;
+  const char *payload = emu_get_bytes(r, &payload_len);
+
+  obj_t *obj = r->err ? NULL : obj_lookup(pool_id, nspace, oid);
+  if (r->err || !obj) {
+    reply_result(c, id, r->err ? r->err : -ENOENT, 0);
+    goto out;
+  }
+
+  notify_t *n = calloc(1, sizeof(notify_t));
+  conn_get(c);
+  n->conn = c;
+  n->req_id = id;
+  n->deadline_us = now_us() + (timeout_ms ? timeout_ms : 30000) * 1000;
+
+  // Drop watchers of closed connections.
+  for (watch_t **link = &obj->watchers; *link;) {
+    watch_t *w = *link;
+    if (conn_dead(w->conn)) {
+      *link = w->next;
+      conn_put(w->conn);
+      free(w);
+    } else {
+      n->waiters_count++;
+      link = &w->next;
+    }
+  }
+
+  n->waiters = calloc(n->waiters_count + 1, sizeof(notify_waiter_t));
+
+  pthread_mutex_lock(&notify_lock);
+
+  n->id = ++last_notify_id;
+
+  int i = 0;
+  for (watch_t *w = obj->watchers; w; w = w->next, i++) {
+    conn_get(w->conn);
+    n->waiters[i].conn = w->conn;
+    n->waiters[i].cookie = w->cookie;
+  }
+  n->pending = n->waiters_count;
+
+  if (n->pending == 0) {
+    notify_finish(n, 0);
+    pthread_mutex_unlock(&notify_lock);
+    goto out;
+  }
+
+  n->next = notifies;
+  notifies = n;
+
+  // Events are sent under notify_lock, so that acks can't race ahead of
+  // the notify being registered.
+
+  emu_buf_t ev = {0};
+  for (i = 0; i < n->waiters_count; i++) {
+    ev.len = 0;
+    emu_put_u64(&ev, n->waiters[i].cookie);
+    emu_put_u64(&ev, n->id);
+    emu_put_u64(&ev, c->gid);
+    emu_put_bytes(&ev, payload, payload_len);
+    conn_send(n->waiters[i].conn, EMU_MSG_EVENT_NOTIFY, 0, &ev);
+  }
+  free(ev.data);
+
+  pthread_mutex_unlock(&notify_lock);
+
+out:
+  free(nspace);
+  free(oid);
+}
+
+static void handle_notify_ack(conn_t *c, uint64_t id, emu_reader_t *r) {
+  uint64_t notify_id = emu_get_u64(r);
+  uint64_t cookie = emu_get_u64(r);
+  size_t reply_len;
+  const char *reply = emu_get_bytes(r, &reply_len);
+
+  if (r->err) {
+    reply_result(c, id, r->err, 0);
+    return;
+  }
+
+  pthread_mutex_lock(&notify_lock);
+
+  for (notify_t **link = &notifies; *link; link = &(*link)->next) {
+    notify_t *n = *link;
+    if (n->id != notify_id) {
+      continue;
+    }
+
+    for (int i = 0; i < n->waiters_count; i++) {
+      notify_waiter_t *w = &n->waiters[i];
+      if (w->conn != c || w->cookie != cookie || w->acked) {
+        continue;
+      }
+
+      w->acked = 1;
+      n->pending--;
+      n->replies_count++;
+      emu_put_u64(&n->replies, c->gid);
+      emu_put_u64(&n->replies, cookie);
+      emu_put_bytes(&n->replies, reply, reply_len);
+      break;
+    }
+
+    if (n->pending == 0) {
+      *link = n->next;
+      notify_finish(n, 0);
+    }
+    break;
+  }
+
+  pthread_mutex_unlock(&notify_lock);
+
+  reply_result(c, id, 0, 0);
+}
+
+// Times out notifies whose watchers didn't all ack in time.
+static void *notify_timer(void *arg) {
+  for (;;) {
+    sleep_us(10000);
+
+    uint64_t now = now_us();
+
+    pthread_mutex_lock(&notify_lock);
+    for (notify_t **link = &notifies; *link;) {
+      notify_t *n = *link;
+      if (n->deadline_us <= now) {
+        *link = n->next;
+        notify_finish(n, -ETIMEDOUT);
+      } else {
+        link = &n->next;
+      }
+    }
+    pthread_mutex_unlock(&notify_lock);
+  }
+
+  return NULL;
+}
+
+/*
+ * Listing.
+ */
+
+static void put_cursor(emu_buf_t *out, int is_end, const char *key,
+                       size_t key_len) {
+  emu_put_u8(out, is_end);
+  if (is_end) {
+    emu_put_u32(out, 0);
+    emu_put_u32(out, 0);
+    return;
+  }
+
+  uint32_t h = (uint32_t)(unsigned char)key[0] << 24 |
+               (uint32_t)(unsigned char)key[1] << 16 |
+               (uint32_t)(unsigned char)key[2] << 8 | (unsigned char)key[3];
+  emu_put_u32(out, h);
+  emu_put_bytes(out, key + 4, key_len - 4);
+}
+
+// Reads a cursor into object index key. Returns length of the key, or 0 for
+// the end cursor.
+static size_t get_cursor(emu_reader_t *r, char **key) {
+  uint8_t is_end = emu_get_u8(r);
+  uint32_t h = emu_get_u32(r);
+  size_t oid_len;
+  const char *oid = emu_get_bytes(r, &oid_len);
+
+  *key = malloc(4 + oid_len);
+  (*key)[0] = h >> 24;
+  (*key)[1] = h >> 16;
+  (*key)[2] = h >> 8;
+  (*key)[3] = h;
+  if (oid_len) {
+    memcpy(*key + 4, oid, oid_len);
+  }
+
+  return is_end ? 0 : 4 + oid_len;
+}
+
+static void handle_list(conn_t *c, uint64_t id, emu_reader_t *r) {
+  int64_t pool_id = emu_get_u64(r);
+  char *nspace = emu_get_str(r);
+  char *start, *finish;
+  size_t start_len = get_cursor(r, &start);
+  size_t finish_len = get_cursor(r, &finish);
+  uint32_t max = emu_get_u32(r);
+
+  emu_buf_t out = {0};
+  reply_begin(&out);
+
+  if (r->err) {
+    reply_send(c, id, &out, r->err, 0);
+    goto out;
+  }
+
+  size_t count_off = out.len;
+  uint32_t count = 0;
+  emu_put_u32(&out, 0);
+
+  pthread_mutex_lock(&store_lock);
+
+  nspace_t *ns = nspace_lookup(pool_id, nspace, 0);
+  emu_map_node_t *n =
+      ns ? emu_map_lower_bound(&ns->objects, start, start_len, 1) : NULL;
+
+  for (; n; n = emu_map_lower_bound(&ns->objects, n->key, n->key_len, 0)) {
+    if (finish_len > 0 &&
+        emu_map_key_cmp(n->key, n->key_len, finish, finish_len) >= 0) {
+      n = NULL;
+      break;
+    }
+    if (count == max) {
+      break;
+    }
+
+    emu_put_bytes(&out, n->key + 4, n->key_len - 4);
+    count++;
+  }
+
+  // Listing continues from the next object, if there's one left.
+  if (n) {
+    put_cursor(&out, 0, n->key, n->key_len);
+  } else {
+    put_cursor(&out, finish_len == 0, finish, finish_len);
+  }
+
+  pthread_mutex_unlock(&store_lock);
+
+  memcpy(out.data + count_off, &count, sizeof(count));
+  sleep_us(read_service_us);
+  reply_send(c, id, &out, 0, 0);
+
+out:
+  free(start);
+  free(finish);
+  free(nspace);
+}
+
+/*
+ * Shards and connections.
+ */
+
+static void *shard_run(void *arg) {
+  shard_t *s = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->head) {
+      pthread_cond_wait(&s->cond, &s->lock);
+    }
+    job_t *job = s->head;
+    s->head = job->next;
+    if (!s->head) {
+      s->tail = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    emu_reader_t r = {.p = job->payload,
+                      .end = job->payload + job->hdr.len};
+
+    switch (job->hdr.type) {
+    case EMU_MSG_OP:
+      handle_op(job->conn, job->hdr.id, &r);
+      break;
+    case EMU_MSG_WATCH:
+      handle_watch(job->conn, job->hdr.id, &r, 0);
+      break;
+    case EMU_MSG_UNWATCH:
+      handle_watch(job->conn, job->hdr.id, &r, 1);
+      break;
+    case EMU_MSG_NOTIFY:
+      handle_notify(job->conn, job->hdr.id, &r);
+      break;
+    }
+
+    conn_put(job->conn);
+    free(job->payload);
+    free(job);
+  }
+
+  return NULL;
+}
+
+// Queues a message addressed to an object on the shard owning the object.
+static void shard_submit(conn_t *c, emu_msg_hdr_t *hdr, char *payload) {
+  emu_reader_t r = {.p = payload, .end = payload + hdr->len};
+  int64_t pool_id = emu_get_u64(&r);
+  size_t nspace_len, oid_len;
+  const char *nspace = emu_get_bytes(&r, &nspace_len);
+  const char *oid = emu_get_bytes(&r, &oid_len);
+
+  if (r.err) {
+    reply_result(c, hdr->id, r.err, 0);
+    free(payload);
+    return;
+  }
+
+  uint32_t h = emu_obj_hash(oid, oid_len) ^
+               emu_obj_hash(nspace, nspace_len) ^ (uint32_t)pool_id;
+  shard_t *s = &shards[h % shards_count];
+
+  job_t *job = malloc(sizeof(job_t));
+  conn_get(c);
+  job->conn = c;
+  job->hdr = *hdr;
+  job->payload = payload;
+  job->next = NULL;
+
+  pthread_mutex_lock(&s->lock);
+  if (s->tail) {
+    s->tail->next = job;
+  } else {
+    s->head = job;
+  }
+  s->tail = job;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void *conn_run(void *arg) {
+  conn_t *c = arg;
+  emu_msg_hdr_t hdr;
+  char *payload;
+
+  while (emu_recv_msg(c->fd, &hdr, &payload) == 0) {
+    emu_reader_t r = {.p = payload, .end = payload + hdr.len};
+
+    switch (hdr.type) {
+    case EMU_MSG_HELLO: {
+      emu_buf_t out = {0};
+      reply_begin(&out);
+      emu_put_u64(&out, c->gid);
+      reply_send(c, hdr.id, &out, 0, 0);
+      break;
+    }
+    case EMU_MSG_POOL_LOOKUP: {
+      char *name = emu_get_str(&r);
+      int64_t pool_id = pool_lookup(name);
+      emu_buf_t out = {0};
+      reply_begin(&out);
+      emu_put_u64(&out, pool_id);
+      reply_send(c, hdr.id, &out, pool_id < 0 ? pool_id : r.err, 0);
+      free(name);
+      break;
+    }
+    case EMU_MSG_LIST:
+      handle_list(c, hdr.id, &r);
+      break;
+    case EMU_MSG_NOTIFY_ACK:
+      handle_notify_ack(c, hdr.id, &r);
+      break;
+    case EMU_MSG_OP:
+    case EMU_MSG_WATCH:
+    case EMU_MSG_UNWATCH:
+    case EMU_MSG_NOTIFY:
+      // Payload is handed over to the shard.
+      shard_submit(c, &hdr, payload);
+      continue;
+    default:
+      reply_result(c, hdr.id, -EOPNOTSUPP, 0);
+    }
+
+    free(payload);
+  }
+
+  pthread_mutex_lock(&c->write_lock);
+  __atomic_store_n(&c->dead, 1, 0);
+  shutdown(c->fd, SHUT_RDWR);
+  pthread_mutex_unlock(&c->write_lock);
+
+  conn_put(c);
+
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  const char *socket_path = EMU_DEFAULT_SOCKET;
+  uint64_t val;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:n:r:w:h")) != -1) {
+    switch (opt) {
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'n':
+      if (parse_uint("-n", optarg, &val) < 0 || val == 0) {
+        return 1;
+      }
+      shards_count = val;
+      break;
+    case 'r':
+      if (parse_uint("-r", optarg, &read_service_us) < 0) {
+        return 1;
+      }
+      break;
+    case 'w':
+      if (parse_uint("-w", optarg, &write_service_us) < 0) {
+        return 1;
+      }
+      break;
+    case 'h':
+    default:
+      print_usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(lfd, 128) < 0) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", socket_path,
+            strerror(errno));
+    return 1;
+  }
+
+  shards = calloc(shards_count, sizeof(shard_t));
+  for (int i = 0; i < shards_count; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    pthread_cond_init(&shards[i].cond, NULL);
+    pthread_create(&shards[i].thread, NULL, shard_run, &shards[i]);
+  }
+
+  pthread_t timer;
+  pthread_create(&timer, NULL, notify_timer, NULL);
+
+  printf("Listening on %s with %d shards, service time read=%luus "
+         "write=%luus.\n",
+         socket_path, shards_count, (unsigned long)read_service_us,
+         (unsigned long)write_service_us);
+  fflush(stdout);
+
+  for (;;) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "accept failed: %s\n", strerror(errno));
+      return 1;
+    }
+
+    conn_t *c = calloc(1, sizeof(conn_t));
+    c->fd = fd;
+    c->gid = __atomic_add_fetch(&last_gid, 1, 0) + 4100;
+    c->refs = 1;
+    pthread_mutex_init(&c->write_lock, NULL);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, conn_run, c);
+    pthread_detach(thread);
+  }
+
+  return 0;
+}
+
+int parse_uint(const char *name, const char *val, uint64_t *out) {
+  char *end;
+  errno = 0;
+  unsigned long long v = strtoull(val, &end, 10);
+
+  if (errno != 0 || *end != '\0' || *val == '\0' || *val == '-') {
+    fprintf(stderr, "Invalid value for %s: %s\n", name, val);
+    return -EINVAL;
+  }
+
+  *out = v;
+  return 0;
+}
+
+void print_usage(const char *progname) {
+  printf("Usage: %s [-s SOCKET] [-n SHARDS] [-r USEC] [-w USEC]\n",
+         progname);
+  printf("Local RADOS emulator serving the tracker's subset of RADOS.\n");
+  printf("Options:\n");
+  printf("  -s SOCKET  Unix socket to listen on (default %s).\n",
+         EMU_DEFAULT_SOCKET);
+  printf("  -n SHARDS  Number of op shards, each executing one op at a time "
+         "(default 32).\n");
+  printf("  -r USEC    Service time of a read op in microseconds.\n");
+  printf("  -w USEC    Service time of a write op in microseconds.\n");
+  printf("  -h         Show this help message.\n");
+}
@@ -0,0 +1,1482 @@
+#include "rados/librados.h"
+#include "proto.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/un.h>
+
+/*
+ * librados C API backed by the local RADOS emulator, see emu/emu.c.
+ *
+ * Each cluster handle holds one connection. Requests are matched with
+ * replies by id, so any number of them may be in flight. A reader thread
+ * receives replies and events, and a finisher thread runs completion and
+ * watch callbacks, so that callbacks may issue further requests.
+ */
+
+#define PENDING_BUCKETS 256
+
+typedef struct emu_cluster emu_cluster_t;
+typedef struct emu_completion emu_completion_t;
+
+// Destination of the output of one sub-operation.
+typedef struct emu_op_out {
+  uint8_t code;
+  int *prval;
+
+  uint64_t *psize;
+  time_t *pmtime;
+
+  char *buf;
+  size_t buf_len;
+  size_t *bytes_read;
+
+  struct emu_iter *iter;
+  unsigned char *pmore;
+} emu_op_out_t;
+
+typedef struct emu_op {
+  emu_buf_t buf;
+  uint32_t count;
+
+  emu_op_out_t *outs;
+  size_t outs_cap;
+} emu_op_t;
+
+typedef struct emu_iter_entry {
+  char *key;
+  size_t key_len;
+  char *val;
+  size_t val_len;
+} emu_iter_entry_t;
+
+// Both OMap and xattrs iterator.
+typedef struct emu_iter {
+  emu_iter_entry_t *entries;
+  size_t count;
+  size_t pos;
+} emu_iter_t;
+
+struct emu_completion {
+  emu_completion_t *next; // In the pending table.
+  uint64_t id;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int complete;
+  int rval;
+  uint64_t version;
+  int refs;
+
+  rados_callback_t cb;
+  void *cb_arg;
+
+  // Read op whose outputs are decoded from the reply.
+  emu_op_t *op;
+
+  // Raw reply payload past result and version, kept if `keep_reply` is set.
+  int keep_reply;
+  char *reply;
+  const char *reply_p;
+  size_t reply_len;
+};
+
+typedef struct emu_watch {
+  struct emu_watch *next;
+  uint64_t cookie;
+  int64_t pool_id;
+  char *nspace;
+  char *oid;
+  rados_watchcb2_t cb;
+  rados_watcherrcb_t errcb;
+  void *arg;
+} emu_watch_t;
+
+// Callback waiting to be run by the finisher.
+typedef struct emu_finish {
+  struct emu_finish *next;
+
+  emu_completion_t *c;
+
+  rados_watchcb2_t watch_cb;
+  rados_watcherrcb_t watch_errcb;
+  void *watch_arg;
+  uint64_t cookie;
+  uint64_t notify_id;
+  uint64_t notifier_id;
+  int err;
+  char *data;
+  size_t data_len;
+} emu_finish_t;
+
+struct emu_cluster {
+  char *socket_path;
+  int fd;
+  uint64_t gid;
+  int connected;
+  pthread_t reader;
+
+  // Guards the socket writes, request ids, pending table and watches.
+  pthread_mutex_t lock;
+  uint64_t last_id;
+  emu_completion_t *pending[PENDING_BUCKETS];
+  emu_watch_t *watches;
+  uint64_t last_cookie;
+
+  pthread_t finisher;
+  pthread_mutex_t finish_lock;
+  pthread_cond_t finish_cond;
+  emu_finish_t *finish_head;
+  emu_finish_t *finish_tail;
+  int finish_stop;
+};
+
+typedef struct emu_ioctx {
+  emu_cluster_t *cluster;
+  int64_t pool_id;
+  char *nspace;
+  uint64_t last_version;
+} emu_ioctx_t;
+
+typedef struct emu_cursor {
+  int is_end;
+  uint32_t hash;
+  char *oid;
+} emu_cursor_t;
+
+/*
+ * Requests.
+ */
+
+static emu_completion_t *completion_new(void) {
+  emu_completion_t *c = calloc(1, sizeof(emu_completion_t));
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  c->refs = 1;
+  return c;
+}
+
+static void completion_put(emu_completion_t *c) {
+  if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    free(c->reply);
+    free(c);
+  }
+}
+
+static void completion_wait(emu_completion_t *c) {
+  pthread_mutex_lock(&c->lock);
+  while (!c->complete) {
+    pthread_cond_wait(&c->cond, &c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+static void finisher_queue(emu_cluster_t *cl, emu_finish_t *f) {
+  pthread_mutex_lock(&cl->finish_lock);
+  if (cl->finish_tail) {
+    cl->finish_tail->next = f;
+  } else {
+    cl->finish_head = f;
+  }
+  cl->finish_tail = f;
+  pthread_cond_signal(&cl->finish_cond);
+  pthread_mutex_unlock(&cl->finish_lock);
+}
+
+static void *finisher_run(void *arg) {
+  emu_cluster_t *cl = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&cl->finish_lock);
+    while (!cl->finish_head && !cl->finish_stop) {
+      pthread_cond_wait(&cl->finish_cond, &cl->finish_lock);
+    }
+    emu_finish_t *f = cl->finish_head;
+    if (!f) {
+      pthread_mutex_unlock(&cl->finish_lock);
+      break;
+    }
+    cl->finish_head = f->next;
+    if (!cl->finish_head) {
+      cl->finish_tail = NULL;
+    }
+    pthread_mutex_unlock(&cl->finish_lock);
+
+    if (f->c) {
+      f->c->cb(f->c, f->c->cb_arg);
+      completion_put(f->c);
+    } else if (f->watch_cb) {
+      f->watch_cb(f->watch_arg, f->notify_id, f->cookie, f->notifier_id,
+                  f->data, f->data_len);
+    } else if (f->watch_errcb) {
+      f->watch_errcb(f->watch_arg, f->cookie, f->err);
+    }
+
+    free(f->data);
+    free(f);
+  }
+
+  return NULL;
+}
+
+static void decode_outputs(emu_op_t *op, emu_reader_t *r, int result);
+
+// Completes a request with the reply payload, which it takes over.
+static void complete(emu_cluster_t *cl, emu_completion_t *c, char *payload,
+                     size_t len, int err) {
+  emu_reader_t r = {.p = payload, .end = payload + len};
+  int result = err;
+  uint64_t version = 0;
+
+  if (payload) {
+    result = (int32_t)emu_get_u32(&r);
+    version = emu_get_u64(&r);
+    if (r.err) {
+      result = r.err;
+    }
+  }
+
+  if (c->op) {
+    decode_outputs(c->op, &r, result);
+  }
+
+  if (c->keep_reply && payload) {
+    c->reply = payload;
+    c->reply_p = r.p;
+    c->reply_len = r.end - r.p;
+  } else {
+    free(payload);
+  }
+
+  pthread_mutex_lock(&c->lock);
+  c->rval = result;
+  c->version = version;
+  c->complete = 1;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+
+  // Drop reference of the in-flight request, once the callback's run.
+  if (c->cb) {
+    emu_finish_t *f = calloc(1, sizeof(emu_finish_t));
+    f->c = c;
+    finisher_queue(cl, f);
+  } else {
+    completion_put(c);
+  }
+}
+
+// Sends a request completing `c`. Takes over the payload.
+static void submit(emu_cluster_t *cl, uint16_t type, emu_buf_t *payload,
+                   emu_completion_t *c) {
+  __atomic_add_fetch(&c->refs, 1, 0);
+
+  pthread_mutex_lock(&cl->lock);
+
+  int ret = cl->connected ? 0 : -ENOTCONN;
+  if (ret == 0) {
+    c->id = ++cl->last_id;
+    emu_completion_t **bucket = &cl->pending[c->id % PENDING_BUCKETS];
+    c->next = *bucket;
+    *bucket = c;
+
+    if ((ret = emu_send_msg(cl->fd, type, c->id, payload)) < 0) {
+      *bucket = c->next;
+    }
+  }
+
+  pthread_mutex_unlock(&cl->lock);
+
+  free(payload->data);
+
+  if (ret < 0) {
+    complete(cl, c, NULL, 0, ret);
+  }
+}
+
+// Sends a request and waits for the reply. Returns the result. With `cp`
+// set, the caller gets the completion holding the reply and releases it.
+static int call(emu_cluster_t *cl, uint16_t type, emu_buf_t *payload,
+                emu_completion_t **cp) {
+  emu_completion_t *c = completion_new();
+  c->keep_reply = cp != NULL;
+
+  submit(cl, type, payload, c);
+  completion_wait(c);
+
+  int ret = c->rval;
+  if (cp) {
+    *cp = c;
+  } else {
+    completion_put(c);
+  }
+
+  return ret;
+}
+
+static void *reader_run(void *arg) {
+  emu_cluster_t *cl = arg;
+  emu_msg_hdr_t hdr;
+  char *payload;
+
+  while (emu_recv_msg(cl->fd, &hdr, &payload) == 0) {
+    if (hdr.type == EMU_MSG_REPLY) {
+      pthread_mutex_lock(&cl->lock);
+      emu_completion_t *c = NULL;
+      for (emu_completion_t **link = &cl->pending[hdr.id % PENDING_BUCKETS];
+           *link; link = &(*link)->next) {
+        if ((*link)->id == hdr.id) {
+          c = *link;
+          *link = c->next;
+          break;
+        }
+      }
+      pthread_mutex_unlock(&cl->lock);
+
+      if (c) {
+        complete(cl, c, payload, hdr.len, 0);
+      } else {
+        free(payload);
+      }
+      continue;
+    }
+
+    emu_reader_t r = {.p = payload, .end = payload + hdr.len};
+    emu_finish_t *f = calloc(1, sizeof(emu_finish_t));
+    f->cookie = emu_get_u64(&r);
+
+    if (hdr.type == EMU_MSG_EVENT_NOTIFY) {
+      f->notify_id = emu_get_u64(&r);
+      f->notifier_id = emu_get_u64(&r);
+      const char *data = emu_get_bytes(&r, &f->data_len);
+      f->data = malloc(f->data_len + 1);
+      memcpy(f->data, data, f->data_len);
+    } else {
+      f->err = (int32_t)emu_get_u32(&r);
+    }
+
+    pthread_mutex_lock(&cl->lock);
+    for (emu_watch_t *w = cl->watches; w; w = w->next) {
+      if (w->cookie == f->cookie) {
+        f->watch_arg = w->arg;
+        if (hdr.type == EMU_MSG_EVENT_NOTIFY) {
+          f->watch_cb = w->cb;
+        } else {
+          f->watch_errcb = w->errcb;
+        }
+        break;
+      }
+    }
+    pthread_mutex_unlock(&cl->lock);
+
+    if (!r.err && (f->watch_cb || f->watch_errcb)) {
+      finisher_queue(cl, f);
+    } else {
+      free(f->data);
+      free(f);
+    }
+
+    free(payload);
+  }
+
+  // Connection is gone, fail requests in flight.
+
+  pthread_mutex_lock(&cl->lock);
+  cl->connected = 0;
+  emu_completion_t *failed = NULL;
+  for (int i = 0; i < PENDING_BUCKETS; i++) {
+    while (cl->pending[i]) {
+      emu_completion_t *c = cl->pending[i];
+      cl->pending[i] = c->next;
+      c->next = failed;
+      failed = c;
+    }
+  }
+  pthread_mutex_unlock(&cl->lock);
+
+  while (failed) {
+    emu_completion_t *c = failed;
+    failed = c->next;
+    complete(cl, c, NULL, 0, -ENOTCONN);
+  }
+
+  return NULL;
+}
+
+/*
+ * Cluster and pool context.
+ */
+
+int rados_create(rados_t *cluster, const char *const id) {
+  emu_cluster_t *cl = calloc(1, sizeof(emu_cluster_t));
+  cl->socket_path = strdup(EMU_DEFAULT_SOCKET);
+  cl->fd = -1;
+  pthread_mutex_init(&cl->lock, NULL);
+  pthread_mutex_init(&cl->finish_lock, NULL);
+  pthread_cond_init(&cl->finish_cond, NULL);
+
+  *cluster = cl;
+  return 0;
+}
+
+int rados_conf_read_file(rados_t cluster, const char *path) {
+  emu_cluster_t *cl = cluster;
+
+  if (!path) {
+    return 0;
+  }
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return -errno;
+  }
+
+  // Only `rt_emu_socket = PATH` is of interest, spaces and underscores in
+  // option names being interchangeable like in Ceph config files.
+
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    char *eq = strchr(line, '=');
+    if (!eq) {
+      continue;
+    }
+
+    char name[64];
+    size_t n = 0;
+    for (char *p = line; p < eq && n < sizeof(name) - 1; p++) {
+      if (*p == ' ' || *p == '\t') {
+        if (n > 0 && name[n - 1] != '_') {
+          name[n++] = '_';
+        }
+      } else {
+        name[n++] = *p;
+      }
+    }
+    while (n > 0 && name[n - 1] == '_') {
+      n--;
+    }
+    name[n] = '\0';
+
+    if (strcmp(name, "rt_emu_socket") != 0) {
+      continue;
+    }
+
+    char *val = eq + 1;
+    while (isspace((unsigned char)*val)) {
+      val++;
+    }
+    size_t len = strlen(val);
+    while (len > 0 && isspace((unsigned char)val[len - 1])) {
+      val[--len] = '\0';
+    }
+
+    free(cl->socket_path);
+    cl->socket_path = strdup(val);
+  }
+
+  fclose(f);
+  return 0;
+}
+
+int rados_connect(rados_t cluster) {
+  emu_cluster_t *cl = cluster;
+  const char *path = getenv("RT_EMU_SOCKET");
+  if (!path || !*path) {
+    path = cl->socket_path;
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -ENAMETOOLONG;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  cl->fd = fd;
+  cl->connected = 1;
+  pthread_create(&cl->reader, NULL, reader_run, cl);
+  pthread_create(&cl->finisher, NULL, finisher_run, cl);
+
+  emu_buf_t req = {0};
+  emu_completion_t *c;
+  int ret = call(cl, EMU_MSG_HELLO, &req, &c);
+  if (ret == 0) {
+    emu_reader_t r = {.p = c->reply_p, .end = c->reply_p + c->reply_len};
+    cl->gid = emu_get_u64(&r);
+  }
+  completion_put(c);
+
+  return ret;
+}
+
+void rados_shutdown(rados_t cluster) {
+  emu_cluster_t *cl = cluster;
+
+  if (cl->fd >= 0) {
+    shutdown(cl->fd, SHUT_RDWR);
+    pthread_join(cl->reader, NULL);
+
+    pthread_mutex_lock(&cl->finish_lock);
+    cl->finish_stop = 1;
+    pthread_cond_signal(&cl->finish_cond);
+    pthread_mutex_unlock(&cl->finish_lock);
+    pthread_join(cl->finisher, NULL);
+
+    close(cl->fd);
+  }
+
+  while (cl->watches) {
+    emu_watch_t *w = cl->watches;
+    cl->watches = w->next;
+    free(w->nspace);
+    free(w->oid);
+    free(w);
+  }
+
+  pthread_mutex_destroy(&cl->lock);
+  pthread_mutex_destroy(&cl->finish_lock);
+  pthread_cond_destroy(&cl->finish_cond);
+  free(cl->socket_path);
+  free(cl);
+}
+
+uint64_t rados_get_instance_id(rados_t cluster) {
+  return ((emu_cluster_t *)cluster)->gid;
+}
+
+int64_t rados_pool_lookup(rados_t cluster, const char *pool_name) {
+  emu_buf_t req = {0};
+  emu_put_str(&req, pool_name);
+
+  emu_completion_t *c;
+  int64_t ret = call(cluster, EMU_MSG_POOL_LOOKUP, &req, &c);
+  if (ret == 0) {
+    emu_reader_t r = {.p = c->reply_p, .end = c->reply_p + c->reply_len};
+    ret = (int64_t)emu_get_u64(&r);
+  }
+  completion_put(c);
+
+  return ret;
+}
+
+int rados_ioctx_create(rados_t cluster, const char *pool_name,
+                       rados_ioctx_t *ioctx) {
+  emu_cluster_t *cl = cluster;
+
+  emu_buf_t req = {0};
+  emu_put_str(&req, pool_name);
+
+  emu_completion_t *c;
+  int ret = call(cl, EMU_MSG_POOL_LOOKUP, &req, &c);
+  if (ret == 0) {
+    emu_reader_t r = {.p = c->reply_p, .end = c->reply_p + c->reply_len};
+
+    emu_ioctx_t *io = calloc(1, sizeof(emu_ioctx_t));
+    io->cluster = cl;
+    io->pool_id = emu_get_u64(&r);
+    io->nspace = strdup("");
+    *ioctx = io;
+  }
+  completion_put(c);
+
+  return ret;
+}
+
+int rados_ioctx_create2(rados_t cluster, int64_t pool_id,
+                        rados_ioctx_t *ioctx) {
+  emu_ioctx_t *io = calloc(1, sizeof(emu_ioctx_t));
+  io->cluster = cluster;
+  io->pool_id = pool_id;
+  io->nspace = strdup("");
+  *ioctx = io;
+
+  return 0;
+}
+
+void rados_ioctx_destroy(rados_ioctx_t io) {
+  emu_ioctx_t *ioctx = io;
+  free(ioctx->nspace);
+  free(ioctx);
+}
+
+int64_t rados_ioctx_get_id(rados_ioctx_t io) {
+  return ((emu_ioctx_t *)io)->pool_id;
+}
+
+rados_t rados_ioctx_get_cluster(rados_ioctx_t io) {
+  return ((emu_ioctx_t *)io)->cluster;
+}
+
+void rados_ioctx_set_namespace(rados_ioctx_t io, const char *nspace) {
+  emu_ioctx_t *ioctx = io;
+  free(ioctx->nspace);
+  ioctx->nspace = strdup(nspace ? nspace : "");
+}
+
+uint64_t rados_get_last_version(rados_ioctx_t io) {
+  return __atomic_load_n(&((emu_ioctx_t *)io)->last_version, 0);
+}
+
+void rados_buffer_free(char *buf) { free(buf); }
+
+/*
+ * Operations.
+ */
+
+static emu_op_t *op_new(void) { return calloc(1, sizeof(emu_op_t)); }
+
+static void op_free(emu_op_t *op) {
+  free(op->buf.data);
+  free(op->outs);
+  free(op);
+}
+
+// Starts a sub-operation, returning destination of its output.
+static emu_op_out_t *op_add(emu_op_t *op, uint8_t code) {
+  if (op->count == op->outs_cap) {
+    op->outs_cap = op->outs_cap ? op->outs_cap * 2 : 8;
+    op->outs = realloc(op->outs, sizeof(emu_op_out_t) * op->outs_cap);
+  }
+
+  emu_op_out_t *out = &op->outs[op->count++];
+  memset(out, 0, sizeof(*out));
+  out->code = code;
+
+  emu_put_u8(&op->buf, code);
+
+  return out;
+}
+
+static emu_iter_t *iter_new(void) { return calloc(1, sizeof(emu_iter_t)); }
+
+static void iter_free(emu_iter_t *it) {
+  for (size_t i = 0; i < it->count; i++) {
+    free(it->entries[i].key);
+    free(it->entries[i].val);
+  }
+  free(it->entries);
+  free(it);
+}
+
+// Reads entries into the iterator. Keys and values are NUL-terminated.
+static void iter_decode(emu_iter_t *it, emu_reader_t *r) {
+  uint32_t n = emu_get_u32(r);
+  if (r->err) {
+    return;
+  }
+
+  it->entries = calloc(n + 1, sizeof(emu_iter_entry_t));
+
+  for (uint32_t i = 0; i < n && !r->err; i++) {
+    emu_iter_entry_t *e = &it->entries[it->count++];
+    const char *key = emu_get_bytes(r, &e->key_len);
+    const char *val = emu_get_bytes(r, &e->val_len);
+
+    e->key = malloc(e->key_len + 1);
+    memcpy(e->key, key, e->key_len);
+    e->key[e->key_len] = '\0';
+    e->val = malloc(e->val_len + 1);
+    memcpy(e->val, val, e->val_len);
+    e->val[e->val_len] = '\0';
+  }
+}
+
+static void decode_outputs(emu_op_t *op, emu_reader_t *r, int result) {
+  uint32_t done = r->p < r->end ? emu_get_u32(r) : 0;
+
+  for (uint32_t i = 0; i < op->count; i++) {
+    emu_op_out_t *o = &op->outs[i];
+
+    if (i >= done || r->err) {
+      // Failed, or not run because an earlier one failed.
+      if (o->prval) {
+        *o->prval = result < 0 ? result : -EIO;
+      }
+      continue;
+    }
+
+    if (o->code == EMU_OP_ASSERT_VERSION || o->code == EMU_OP_CMPXATTR ||
+        o->code == EMU_OP_OMAP_CMP) {
+      continue;
+    }
+
+    int rval = (int32_t)emu_get_u32(r);
+
+    switch (o->code) {
+    case EMU_OP_STAT: {
+      uint64_t size = emu_get_u64(r);
+      uint64_t mtime = emu_get_u64(r);
+      if (o->psize) {
+        *o->psize = size;
+      }
+      if (o->pmtime) {
+        *o->pmtime = mtime;
+      }
+      break;
+    }
+    case EMU_OP_READ:
+    case EMU_OP_GETXATTR: {
+      size_t len;
+      const char *data = emu_get_bytes(r, &len);
+
+      if (o->code == EMU_OP_GETXATTR) {
+        // Like rados_getxattr, returns the value length.
+        rval = len > o->buf_len ? -ERANGE : (int)len;
+      }
+      if (len > o->buf_len) {
+        len = o->buf_len;
+      }
+      if (data && o->buf) {
+        memcpy(o->buf, data, len);
+      }
+      if (o->bytes_read) {
+        *o->bytes_read = len;
+      }
+      break;
+    }
+    case EMU_OP_GETXATTRS:
+      iter_decode(o->iter, r);
+      break;
+    case EMU_OP_OMAP_GET_VALS_BY_KEYS:
+    case EMU_OP_OMAP_GET_KEYS:
+    case EMU_OP_OMAP_GET_VALS: {
+      uint8_t more = emu_get_u8(r);
+      if (o->pmore) {
+        *o->pmore = more;
+      }
+      iter_decode(o->iter, r);
+      break;
+    }
+    }
+
+    if (o->prval) {
+      *o->prval = r->err ? r->err : rval;
+    }
+  }
+}
+
+// Runs an op on object `oid`. Completes `c` if set, otherwise waits for the
+// op and returns its result.
+static int operate(emu_op_t *op, emu_ioctx_t *io, const char *oid,
+                   int is_write, emu_completion_t *c) {
+  emu_buf_t req = {0};
+  emu_put_u64(&req, io->pool_id);
+  emu_put_str(&req, io->nspace);
+  emu_put_str(&req, oid);
+  emu_put_u8(&req, is_write);
+  emu_put_u32(&req, op->count);
+  emu_put(&req, op->buf.data, op->buf.len);
+
+  int sync = c == NULL;
+  if (sync) {
+    c = completion_new();
+  }
+  c->op = is_write ? NULL : op;
+
+  submit(io->cluster, EMU_MSG_OP, &req, c);
+
+  if (!sync) {
+    return 0;
+  }
+
+  completion_wait(c);
+  int ret = c->rval;
+  __atomic_store_n(&io->last_version, c->version, 0);
+  completion_put(c);
+
+  return ret;
+}
+
+int rados_getxattr(rados_ioctx_t io, const char *o, const char *name,
+                   char *buf, size_t len) {
+  emu_op_t *op = op_new();
+  int rval = 0;
+
+  emu_op_out_t *out = op_add(op, EMU_OP_GETXATTR);
+  emu_put_str(&op->buf, name);
+  out->buf = buf;
+  out->buf_len = len;
+  out->prval = &rval;
+
+  int ret = operate(op, io, o, 0, NULL);
+  op_free(op);
+
+  return ret < 0 ? ret : rval;
+}
+
+int rados_remove(rados_ioctx_t io, const char *oid) {
+  emu_op_t *op = op_new();
+  op_add(op, EMU_OP_REMOVE);
+
+  int ret = operate(op, io, oid, 1, NULL);
+  op_free(op);
+
+  return ret;
+}
+
+/*
+ * Write operations.
+ */
+
+rados_write_op_t rados_create_write_op(void) { return op_new(); }
+
+void rados_release_write_op(rados_write_op_t write_op) { op_free(write_op); }
+
+void rados_write_op_assert_version(rados_write_op_t write_op, uint64_t ver) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_ASSERT_VERSION);
+  emu_put_u64(&op->buf, ver);
+}
+
+void rados_write_op_assert_exists(rados_write_op_t write_op) {
+  op_add(write_op, EMU_OP_ASSERT_EXISTS);
+}
+
+void rados_write_op_cmpxattr(rados_write_op_t write_op, const char *name,
+                             uint8_t comparison_operator, const char *value,
+                             size_t value_len) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_CMPXATTR);
+  emu_put_str(&op->buf, name);
+  emu_put_u8(&op->buf, comparison_operator);
+  emu_put_bytes(&op->buf, value, value_len);
+}
+
+void rados_write_op_omap_cmp(rados_write_op_t write_op, const char *key,
+                             uint8_t comparison_operator, const char *val,
+                             size_t val_len, int *prval) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_OMAP_CMP);
+  emu_put_str(&op->buf, key);
+  emu_put_u8(&op->buf, comparison_operator);
+  emu_put_bytes(&op->buf, val, val_len);
+}
+
+void rados_write_op_create(rados_write_op_t write_op, int exclusive,
+                           const char *category) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_CREATE);
+  emu_put_u8(&op->buf, exclusive == LIBRADOS_CREATE_EXCLUSIVE);
+}
+
+void rados_write_op_setxattr(rados_write_op_t write_op, const char *name,
+                             const char *value, size_t value_len) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_SETXATTR);
+  emu_put_str(&op->buf, name);
+  emu_put_bytes(&op->buf, value, value_len);
+}
+
+void rados_write_op_rmxattr(rados_write_op_t write_op, const char *name) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_RMXATTR);
+  emu_put_str(&op->buf, name);
+}
+
+void rados_write_op_write_full(rados_write_op_t write_op, const char *buffer,
+                               size_t len) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_WRITE_FULL);
+  emu_put_bytes(&op->buf, buffer, len);
+}
+
+void rados_write_op_omap_set2(rados_write_op_t write_op,
+                              char const *const *keys,
+                              char const *const *vals, const size_t *key_lens,
+                              const size_t *val_lens, size_t num) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_OMAP_SET);
+  emu_put_u32(&op->buf, num);
+  for (size_t i = 0; i < num; i++) {
+    emu_put_bytes(&op->buf, keys[i], key_lens[i]);
+    emu_put_bytes(&op->buf, vals[i], val_lens[i]);
+  }
+}
+
+void rados_write_op_omap_rm_keys2(rados_write_op_t write_op,
+                                  char const *const *keys,
+                                  const size_t *key_lens, size_t keys_len) {
+  emu_op_t *op = write_op;
+  op_add(op, EMU_OP_OMAP_RM);
+  emu_put_u32(&op->buf, keys_len);
+  for (size_t i = 0; i < keys_len; i++) {
+    emu_put_bytes(&op->buf, keys[i], key_lens[i]);
+  }
+}
+
+void rados_write_op_omap_clear(rados_write_op_t write_op) {
+  op_add(write_op, EMU_OP_OMAP_CLEAR);
+}
+
+void rados_write_op_remove(rados_write_op_t write_op) {
+  op_add(write_op, EMU_OP_REMOVE);
+}
+
+int rados_write_op_operate(rados_write_op_t write_op, rados_ioctx_t io,
+                           const char *oid, time_t *mtime, int flags) {
+  return operate(write_op, io, oid, 1, NULL);
+}
+
+/*
+ * Read operations.
+ */
+
+rados_read_op_t rados_create_read_op(void) { return op_new(); }
+
+void rados_release_read_op(rados_read_op_t read_op) { op_free(read_op); }
+
+void rados_read_op_assert_version(rados_read_op_t read_op, uint64_t ver) {
+  rados_write_op_assert_version(read_op, ver);
+}
+
+void rados_read_op_cmpxattr(rados_read_op_t read_op, const char *name,
+                            uint8_t comparison_operator, const char *value,
+                            size_t value_len) {
+  rados_write_op_cmpxattr(read_op, name, comparison_operator, value,
+                          value_len);
+}
+
+void rados_read_op_stat(rados_read_op_t read_op, uint64_t *psize,
+                        time_t *pmtime, int *prval) {
+  emu_op_out_t *out = op_add(read_op, EMU_OP_STAT);
+  out->psize = psize;
+  out->pmtime = pmtime;
+  out->prval = prval;
+}
+
+void rados_read_op_read(rados_read_op_t read_op, uint64_t offset, size_t len,
+                        char *buffer, size_t *bytes_read, int *prval) {
+  emu_op_t *op = read_op;
+  emu_op_out_t *out = op_add(op, EMU_OP_READ);
+  emu_put_u64(&op->buf, offset);
+  emu_put_u64(&op->buf, len);
+  out->buf = buffer;
+  out->buf_len = len;
+  out->bytes_read = bytes_read;
+  out->prval = prval;
+}
+
+void rados_read_op_getxattrs(rados_read_op_t read_op,
+                             rados_xattrs_iter_t *iter, int *prval) {
+  emu_op_out_t *out = op_add(read_op, EMU_OP_GETXATTRS);
+  out->iter = iter_new();
+  out->prval = prval;
+  *iter = out->iter;
+}
+
+void rados_read_op_omap_get_vals_by_keys2(rados_read_op_t read_op,
+                                          char const *const *keys,
+                                          size_t num_keys,
+                                          const size_t *key_lens,
+                                          rados_omap_iter_t *iter, int *prval) {
+  emu_op_t *op = read_op;
+  emu_op_out_t *out = op_add(op, EMU_OP_OMAP_GET_VALS_BY_KEYS);
+  emu_put_u32(&op->buf, num_keys);
+  for (size_t i = 0; i < num_keys; i++) {
+    emu_put_bytes(&op->buf, keys[i], key_lens[i]);
+  }
+  out->iter = iter_new();
+  out->prval = prval;
+  *iter = out->iter;
+}
+
+void rados_read_op_omap_get_keys2(rados_read_op_t read_op,
+                                  const char *start_after, uint64_t max_return,
+                                  rados_omap_iter_t *iter,
+                                  unsigned char *pmore, int *prval) {
+  emu_op_t *op = read_op;
+  emu_op_out_t *out = op_add(op, EMU_OP_OMAP_GET_KEYS);
+  emu_put_str(&op->buf, start_after);
+  emu_put_u64(&op->buf, max_return);
+  out->iter = iter_new();
+  out->pmore = pmore;
+  out->prval = prval;
+  *iter = out->iter;
+}
+
+void rados_read_op_omap_get_vals2(rados_read_op_t read_op,
+                                  const char *start_after,
+                                  const char *filter_prefix,
+                                  uint64_t max_return, rados_omap_iter_t *iter,
+                                  unsigned char *pmore, int *prval) {
+  emu_op_t *op = read_op;
+  emu_op_out_t *out = op_add(op, EMU_OP_OMAP_GET_VALS);
+  emu_put_str(&op->buf, start_after);
+  emu_put_str(&op->buf, filter_prefix);
+  emu_put_u64(&op->buf, max_return);
+  out->iter = iter_new();
+  out->pmore = pmore;
+  out->prval = prval;
+  *iter = out->iter;
+}
+
+int rados_read_op_operate(rados_read_op_t read_op, rados_ioctx_t io,
+                          const char *oid, int flags) {
+  return operate(read_op, io, oid, 0, NULL);
+}
+
+int rados_omap_get_next2(rados_omap_iter_t iter, char **key, char **val,
+                         size_t *key_len, size_t *val_len) {
+  emu_iter_t *it = iter;
+
+  if (it->pos == it->count) {
+    *key = NULL;
+    if (val) {
+      *val = NULL;
+    }
+    if (key_len) {
+      *key_len = 0;
+    }
+    if (val_len) {
+      *val_len = 0;
+    }
+    return 0;
+  }
+
+  emu_iter_entry_t *e = &it->entries[it->pos++];
+  *key = e->key;
+  if (val) {
+    *val = e->val;
+  }
+  if (key_len) {
+    *key_len = e->key_len;
+  }
+  if (val_len) {
+    *val_len = e->val_len;
+  }
+
+  return 0;
+}
+
+unsigned int rados_omap_iter_size(rados_omap_iter_t iter) {
+  return ((emu_iter_t *)iter)->count;
+}
+
+void rados_omap_get_end(rados_omap_iter_t iter) { iter_free(iter); }
+
+int rados_getxattrs_next(rados_xattrs_iter_t iter, const char **name,
+                         const char **val, size_t *len) {
+  emu_iter_t *it = iter;
+
+  if (it->pos == it->count) {
+    *name = NULL;
+    *val = NULL;
+    *len = 0;
+    return 0;
+  }
+
+  emu_iter_entry_t *e = &it->entries[it->pos++];
+  *name = e->key;
+  *val = e->val;
+  *len = e->val_len;
+
+  return 0;
+}
+
+void rados_getxattrs_end(rados_xattrs_iter_t iter) { iter_free(iter); }
+
+/*
+ * Object listing.
+ */
+
+static emu_cursor_t *cursor_new(int is_end, uint32_t hash, const char *oid,
+                                size_t oid_len) {
+  emu_cursor_t *cur = malloc(sizeof(emu_cursor_t));
+  cur->is_end = is_end;
+  cur->hash = hash;
+  cur->oid = strndup(oid, oid_len);
+  return cur;
+}
+
+static emu_cursor_t *cursor_dup(const emu_cursor_t *cur) {
+  return cursor_new(cur->is_end, cur->hash, cur->oid, strlen(cur->oid));
+}
+
+static void put_cursor(emu_buf_t *b, const emu_cursor_t *cur) {
+  emu_put_u8(b, cur->is_end);
+  emu_put_u32(b, cur->hash);
+  emu_put_str(b, cur->oid);
+}
+
+rados_object_list_cursor rados_object_list_begin(rados_ioctx_t io) {
+  return cursor_new(0, 0, "", 0);
+}
+
+rados_object_list_cursor rados_object_list_end(rados_ioctx_t io) {
+  return cursor_new(1, 0, "", 0);
+}
+
+int rados_object_list_is_end(rados_ioctx_t io, rados_object_list_cursor cur) {
+  return ((emu_cursor_t *)cur)->is_end;
+}
+
+int rados_object_list_cursor_cmp(rados_ioctx_t io,
+                                 rados_object_list_cursor lhs,
+                                 rados_object_list_cursor rhs) {
+  emu_cursor_t *a = lhs, *b = rhs;
+
+  if (a->is_end || b->is_end) {
+    return a->is_end - b->is_end;
+  }
+  if (a->hash != b->hash) {
+    return a->hash < b->hash ? -1 : 1;
+  }
+
+  int c = strcmp(a->oid, b->oid);
+  return (c > 0) - (c < 0);
+}
+
+void rados_object_list_cursor_free(rados_ioctx_t io,
+                                   rados_object_list_cursor cur) {
+  emu_cursor_t *cursor = cur;
+  if (cursor) {
+    free(cursor->oid);
+    free(cursor);
+  }
+}
+
+int rados_object_list(rados_ioctx_t io, const rados_object_list_cursor start,
+                      const rados_object_list_cursor finish,
+                      const size_t result_size, const char *filter_buf,
+                      const size_t filter_buf_len,
+                      rados_object_list_item *results,
+                      rados_object_list_cursor *next) {
+  emu_ioctx_t *ioctx = io;
+
+  emu_buf_t req = {0};
+  emu_put_u64(&req, ioctx->pool_id);
+  emu_put_str(&req, ioctx->nspace);
+  put_cursor(&req, start);
+  put_cursor(&req, finish);
+  emu_put_u32(&req, result_size);
+
+  emu_completion_t *c;
+  int ret = call(ioctx->cluster, EMU_MSG_LIST, &req, &c);
+  if (ret < 0) {
+    completion_put(c);
+    return ret;
+  }
+
+  emu_reader_t r = {.p = c->reply_p, .end = c->reply_p + c->reply_len};
+  uint32_t count = emu_get_u32(&r);
+
+  for (uint32_t i = 0; i < count && i < result_size; i++) {
+    rados_object_list_item *item = &results[i];
+    const char *oid = emu_get_bytes(&r, &item->oid_length);
+
+    item->oid = strndup(oid ? oid : "", item->oid_length);
+    item->nspace = strdup(ioctx->nspace);
+    item->nspace_length = strlen(ioctx->nspace);
+    item->locator = NULL;
+    item->locator_length = 0;
+  }
+
+  uint8_t is_end = emu_get_u8(&r);
+  uint32_t hash = emu_get_u32(&r);
+  size_t oid_len;
+  const char *oid = emu_get_bytes(&r, &oid_len);
+  *next = cursor_new(is_end, hash, oid ? oid : "", oid_len);
+
+  ret = r.err ? r.err : (int)count;
+  completion_put(c);
+
+  return ret;
+}
+
+void rados_object_list_free(const size_t result_size,
+                            rados_object_list_item *results) {
+  for (size_t i = 0; i < result_size; i++) {
+    free(results[i].oid);
+    free(results[i].nspace);
+    free(results[i].locator);
+  }
+}
+
+void rados_object_list_slice(rados_ioctx_t io,
+                             const rados_object_list_cursor start,
+                             const rados_object_list_cursor finish,
+                             const size_t n, const size_t m,
+                             rados_object_list_cursor *split_start,
+                             rados_object_list_cursor *split_finish) {
+  const emu_cursor_t *s = start, *f = finish;
+
+  // Split the hash range evenly.
+  uint64_t lo = s->is_end ? 1ULL << 32 : s->hash;
+  uint64_t hi = f->is_end ? 1ULL << 32 : f->hash;
+  uint64_t range = hi > lo ? hi - lo : 0;
+
+  uint64_t split_lo = lo + range * n / m;
+  uint64_t split_hi = lo + range * (n + 1) / m;
+
+  *split_start = n == 0 ? cursor_dup(s)
+                        : cursor_new(split_lo >> 32, split_lo, "", 0);
+  *split_finish = n + 1 >= m ? cursor_dup(f)
+                             : cursor_new(split_hi >> 32, split_hi, "", 0);
+}
+
+/*
+ * Advisory locks.
+ */
+
+int rados_lock_exclusive(rados_ioctx_t io, const char *oid, const char *name,
+                         const char *cookie, const char *desc,
+                         struct timeval *duration, uint8_t flags) {
+  emu_op_t *op = op_new();
+  op_add(op, EMU_OP_LOCK);
+  emu_put_str(&op->buf, name);
+  emu_put_str(&op->buf, cookie);
+  emu_put_u64(&op->buf, duration ? duration->tv_sec * 1000000ULL +
+                                       duration->tv_usec
+                                 : 0);
+  emu_put_u8(&op->buf, flags);
+
+  int ret = operate(op, io, oid, 1, NULL);
+  op_free(op);
+
+  return ret;
+}
+
+int rados_unlock(rados_ioctx_t io, const char *o, const char *name,
+                 const char *cookie) {
+  emu_op_t *op = op_new();
+  op_add(op, EMU_OP_UNLOCK);
+  emu_put_str(&op->buf, name);
+  emu_put_str(&op->buf, cookie);
+
+  int ret = operate(op, io, o, 1, NULL);
+  op_free(op);
+
+  return ret;
+}
+
+int rados_break_lock(rados_ioctx_t io, const char *o, const char *name,
+                     const char *client, const char *cookie) {
+  // Clients are named client.<instance id>.
+  if (strncmp(client, "client.", 7) != 0) {
+    return -EINVAL;
+  }
+
+  emu_op_t *op = op_new();
+  op_add(op, EMU_OP_BREAK_LOCK);
+  emu_put_str(&op->buf, name);
+  emu_put_u64(&op->buf, strtoull(client + 7, NULL, 10));
+  emu_put_str(&op->buf, cookie);
+
+  int ret = operate(op, io, o, 1, NULL);
+  op_free(op);
+
+  return ret;
+}
+
+/*
+ * Watch/notify.
+ */
+
+int rados_watch2(rados_ioctx_t io, const char *o, uint64_t *cookie,
+                 rados_watchcb2_t watchcb, rados_watcherrcb_t watcherrcb,
+                 void *arg) {
+  emu_ioctx_t *ioctx = io;
+  emu_cluster_t *cl = ioctx->cluster;
+
+  emu_watch_t *w = calloc(1, sizeof(emu_watch_t));
+  w->pool_id = ioctx->pool_id;
+  w->nspace = strdup(ioctx->nspace);
+  w->oid = strdup(o);
+  w->cb = watchcb;
+  w->errcb = watcherrcb;
+  w->arg = arg;
+
+  // Register first, notifies may arrive before the reply.
+  pthread_mutex_lock(&cl->lock);
+  w->cookie = ++cl->last_cookie;
+  w->next = cl->watches;
+  cl->watches = w;
+  pthread_mutex_unlock(&cl->lock);
+
+  emu_buf_t req = {0};
+  emu_put_u64(&req, w->pool_id);
+  emu_put_str(&req, w->nspace);
+  emu_put_str(&req, w->oid);
+  emu_put_u64(&req, w->cookie);
+
+  int ret = call(cl, EMU_MSG_WATCH, &req, NULL);
+  if (ret < 0) {
+    rados_unwatch2(io, w->cookie);
+    return ret;
+  }
+
+  *cookie = w->cookie;
+  return 0;
+}
+
+int rados_unwatch2(rados_ioctx_t io, uint64_t cookie) {
+  emu_cluster_t *cl = ((emu_ioctx_t *)io)->cluster;
+  emu_watch_t *w = NULL;
+
+  pthread_mutex_lock(&cl->lock);
+  for (emu_watch_t **link = &cl->watches; *link; link = &(*link)->next) {
+    if ((*link)->cookie == cookie) {
+      w = *link;
+      *link = w->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cl->lock);
+
+  if (!w) {
+    return -ENOENT;
+  }
+
+  emu_buf_t req = {0};
+  emu_put_u64(&req, w->pool_id);
+  emu_put_str(&req, w->nspace);
+  emu_put_str(&req, w->oid);
+  emu_put_u64(&req, w->cookie);
+
+  int ret = call(cl, EMU_MSG_UNWATCH, &req, NULL);
+
+  free(w->nspace);
+  free(w->oid);
+  free(w);
+
+  return ret;
+}
+
+int rados_notify2(rados_ioctx_t io, const char *o, const char *buf,
+                  int buf_len, uint64_t timeout_ms, char **reply_buffer,
+                  size_t *reply_buffer_len) {
+  emu_ioctx_t *ioctx = io;
+
+  emu_buf_t req = {0};
+  emu_put_u64(&req, ioctx->pool_id);
+  emu_put_str(&req, ioctx->nspace);
+  emu_put_str(&req, o);
+  emu_put_u64(&req, timeout_ms);
+  emu_put_bytes(&req, buf, buf_len > 0 ? buf_len : 0);
+
+  emu_completion_t *c;
+  int ret = call(ioctx->cluster, EMU_MSG_NOTIFY, &req, &c);
+
+  if (reply_buffer && c->reply) {
+    *reply_buffer = malloc(c->reply_len ? c->reply_len : 1);
+    memcpy(*reply_buffer, c->reply_p, c->reply_len);
+    if (reply_buffer_len) {
+      *reply_buffer_len = c->reply_len;
+    }
+  } else if (reply_buffer) {
+    *reply_buffer = NULL;
+    if (reply_buffer_len) {
+      *reply_buffer_len = 0;
+    }
+  }
+  completion_put(c);
+
+  return ret;
+}
+
+int rados_notify_ack(rados_ioctx_t io, const char *o, uint64_t notify_id,
+                     uint64_t cookie, const char *buf, int buf_len) {
+  emu_buf_t req = {0};
+  emu_put_u64(&req, notify_id);
+  emu_put_u64(&req, cookie);
+  emu_put_bytes(&req, buf, buf_len > 0 ? buf_len : 0);
+
+  return call(((emu_ioctx_t *)io)->cluster, EMU_MSG_NOTIFY_ACK, &req, NULL);
+}
+
+// Marker queued behind the watch callbacks pending at rados_watch_flush.
+typedef struct emu_flush {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int done;
+} emu_flush_t;
+
+static void flush_done(void *arg, uint64_t cookie, int err) {
+  emu_flush_t *fl = arg;
+
+  pthread_mutex_lock(&fl->lock);
+  fl->done = 1;
+  pthread_cond_signal(&fl->cond);
+  pthread_mutex_unlock(&fl->lock);
+}
+
+int rados_watch_flush(rados_t cluster) {
+  emu_flush_t fl = {.done = 0};
+  pthread_mutex_init(&fl.lock, NULL);
+  pthread_cond_init(&fl.cond, NULL);
+
+  emu_finish_t *f = calloc(1, sizeof(emu_finish_t));
+  f->watch_errcb = flush_done;
+  f->watch_arg = &fl;
+  finisher_queue(cluster, f);
+
+  pthread_mutex_lock(&fl.lock);
+  while (!fl.done) {
+    pthread_cond_wait(&fl.cond, &fl.lock);
+  }
+  pthread_mutex_unlock(&fl.lock);
+
+  pthread_cond_destroy(&fl.cond);
+  pthread_mutex_destroy(&fl.lock);
+
+  return 0;
+}
+
+/*
+ * Asynchronous I/O.
+ */
+
+int rados_aio_create_completion2(void *cb_arg, rados_callback_t cb_complete,
+                                 rados_completion_t *pc) {
+  emu_completion_t *c = completion_new();
+  c->cb = cb_complete;
+  c->cb_arg = cb_arg;
+  *pc = c;
+  return 0;
+}
+
+int rados_aio_write_op_operate(rados_write_op_t write_op, rados_ioctx_t io,
+                               rados_completion_t completion, const char *oid,
+                               time_t *mtime, int flags) {
+  return operate(write_op, io, oid, 1, completion);
+}
+
+int rados_aio_read_op_operate(rados_read_op_t read_op, rados_ioctx_t io,
+                              rados_completion_t completion, const char *oid,
+                              int flags) {
+  return operate(read_op, io, oid, 0, completion);
+}
+
+int rados_aio_wait_for_complete(rados_completion_t c) {
+  completion_wait(c);
+  return 0;
+}
+
+int rados_aio_is_complete(rados_completion_t c) {
+  emu_completion_t *comp = c;
+  pthread_mutex_lock(&comp->lock);
+  int complete = comp->complete;
+  pthread_mutex_unlock(&comp->lock);
+  return complete;
+}
+
+int rados_aio_get_return_value(rados_completion_t c) {
+  return ((emu_completion_t *)c)->rval;
+}
+
+uint64_t rados_aio_get_version(rados_completion_t c) {
+  return ((emu_completion_t *)c)->version;
+}
+
+void rados_aio_release(rados_completion_t c) { completion_put(c); }
@@ -0,0 +1,165 @@
+#include "map.h"
+#include <stdlib.h>
+#include <string.h>
+
+void emu_map_init(emu_map_t *m) {
+  m->root = NULL;
+  m->count = 0;
+  m->seed = 0x9e3779b9;
+}
+
+int emu_map_key_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+  size_t n = a_len < b_len ? a_len : b_len;
+  int c = memcmp(a, b, n);
+  return c ? c : (a_len > b_len) - (a_len < b_len);
+}
+
+static uint32_t next_prio(emu_map_t *m) {
+  // xorshift32.
+  uint32_t x = m->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  m->seed = x;
+  return x;
+}
+
+static void clear(emu_map_node_t *n, void (*free_val)(void *)) {
+  while (n) {
+    clear(n->left, free_val);
+    emu_map_node_t *right = n->right;
+    if (free_val && n->val) {
+      free_val(n->val);
+    }
+    free(n);
+    n = right;
+  }
+}
+
+void emu_map_clear(emu_map_t *m, void (*free_val)(void *)) {
+  clear(m->root, free_val);
+  m->root = NULL;
+  m->count = 0;
+}
+
+emu_map_node_t *emu_map_get(const emu_map_t *m, const char *key, size_t len) {
+  emu_map_node_t *n = m->root;
+
+  while (n) {
+    int c = emu_map_key_cmp(key, len, n->key, n->key_len);
+    if (c == 0) {
+      return n;
+    }
+    n = c < 0 ? n->left : n->right;
+  }
+
+  return NULL;
+}
+
+// Inserts `new` into subtree `n`, which doesn't contain its key yet, keeping
+// the heap order of priorities. Returns the new root of the subtree.
+static emu_map_node_t *insert(emu_map_node_t *n, emu_map_node_t *new) {
+  if (!n) {
+    return new;
+  }
+
+  if (emu_map_key_cmp(new->key, new->key_len, n->key, n->key_len) < 0) {
+    n->left = insert(n->left, new);
+    if (n->left->prio > n->prio) {
+      // Rotate right.
+      emu_map_node_t *l = n->left;
+      n->left = l->right;
+      l->right = n;
+      return l;
+    }
+  } else {
+    n->right = insert(n->right, new);
+    if (n->right->prio > n->prio) {
+      // Rotate left.
+      emu_map_node_t *r = n->right;
+      n->right = r->left;
+      r->left = n;
+      return r;
+    }
+  }
+
+  return n;
+}
+
+emu_map_node_t *emu_map_insert(emu_map_t *m, const char *key, size_t len,
+                               int *created) {
+  emu_map_node_t *n = emu_map_get(m, key, len);
+  if (n) {
+    *created = 0;
+    return n;
+  }
+
+  n = malloc(sizeof(emu_map_node_t) + len);
+  n->left = n->right = NULL;
+  n->prio = next_prio(m);
+  n->val = NULL;
+  n->val_len = 0;
+  n->key_len = len;
+  memcpy(n->key, key, len);
+
+  m->root = insert(m->root, n);
+  m->count++;
+  *created = 1;
+
+  return n;
+}
+
+// Joins subtrees where all keys of `a` are less than those of `b`.
+static emu_map_node_t *merge(emu_map_node_t *a, emu_map_node_t *b) {
+  if (!a) {
+    return b;
+  }
+  if (!b) {
+    return a;
+  }
+
+  if (a->prio > b->prio) {
+    a->right = merge(a->right, b);
+    return a;
+  }
+
+  b->left = merge(a, b->left);
+  return b;
+}
+
+emu_map_node_t *emu_map_remove(emu_map_t *m, const char *key, size_t len) {
+  emu_map_node_t **link = &m->root;
+
+  while (*link) {
+    emu_map_node_t *n = *link;
+    int c = emu_map_key_cmp(key, len, n->key, n->key_len);
+
+    if (c == 0) {
+      *link = merge(n->left, n->right);
+      n->left = n->right = NULL;
+      m->count--;
+      return n;
+    }
+
+    link = c < 0 ? &n->left : &n->right;
+  }
+
+  return NULL;
+}
+
+emu_map_node_t *emu_map_lower_bound(const emu_map_t *m, const char *key,
+                                    size_t len, int inclusive) {
+  emu_map_node_t *n = m->root, *found = NULL;
+
+  while (n) {
+    int c = key ? emu_map_key_cmp(n->key, n->key_len, key, len) : 1;
+    if (c > 0 || (c == 0 && inclusive)) {
+      found = n;
+      n = n->left;
+    } else {
+      n = n->right;
+    }
+  }
+
+  return found;
+}
@@ -0,0 +1,63 @@
+#ifndef emu_map_h_INCLUDED
+#define emu_map_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ordered map with byte string keys, used for object OMaps and pool object
+ * indexes. Keys compare like memcmp, shorter key first on a common prefix.
+ * It's a treap, so lookups, inserts and removals take expected O(log n).
+ */
+
+typedef struct emu_map_node {
+  struct emu_map_node *left;
+  struct emu_map_node *right;
+  uint32_t prio;
+
+  // Value is owned by the user of the map.
+  void *val;
+  size_t val_len;
+
+  size_t key_len;
+  char key[];
+} emu_map_node_t;
+
+typedef struct emu_map {
+  emu_map_node_t *root;
+  size_t count;
+  uint32_t seed;
+} emu_map_t;
+
+void emu_map_init(emu_map_t *m);
+
+/** emu_map_clear removes all nodes, calling `free_val` on non-NULL values. */
+void emu_map_clear(emu_map_t *m, void (*free_val)(void *));
+
+emu_map_node_t *emu_map_get(const emu_map_t *m, const char *key, size_t len);
+
+/**
+ * emu_map_insert returns node of `key`, inserting one with NULL value if it's
+ * not in the map yet. `created` is set to whether the node was inserted.
+ */
+emu_map_node_t *emu_map_insert(emu_map_t *m, const char *key, size_t len,
+                               int *created);
+
+/**
+ * emu_map_remove detaches node of `key` from the map and returns it, or NULL
+ * if there's none. Caller frees the node and its value.
+ */
+emu_map_node_t *emu_map_remove(emu_map_t *m, const char *key, size_t len);
+
+/**
+ * emu_map_lower_bound returns the first node with key greater than `key`,
+ * or greater or equal if `inclusive` is set. Returns NULL past the end.
+ * NULL `key` returns the first node.
+ */
+emu_map_node_t *emu_map_lower_bound(const emu_map_t *m, const char *key,
+                                    size_t len, int inclusive);
+
+/** emu_map_key_cmp compares keys the way the map orders them. */
+int emu_map_key_cmp(const char *a, size_t a_len, const char *b, size_t b_len);
+
+#endif // emu_map_h_INCLUDED
@@ -0,0 +1,309 @@
+#ifndef emu_proto_h_INCLUDED
+#define emu_proto_h_INCLUDED
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+
+Emulator wire protocol
+======================
+
+Clients talk to rt-emu over a Unix stream socket. Both directions carry
+messages made of a fixed header followed by `len` bytes of payload. Values
+are in host byte order, as both ends run on the same machine. Strings and
+byte arrays are encoded as uint32_t length followed by the bytes.
+
+    byte idx      type         name
+    --------     ------       ------
+     0 ..  3     uint32_t     len
+     4 ..  5     uint16_t     type
+     6 ..  7     uint16_t     reserved
+     8 .. 15     uint64_t     id
+
+Requests (client to server), answered by EMU_MSG_REPLY with the same id:
+
+    EMU_MSG_HELLO         -> uint64_t client gid
+    EMU_MSG_POOL_LOOKUP   string pool -> int64_t pool id
+    EMU_MSG_OP            int64_t pool, string nspace, string oid,
+                          uint8_t is_write, uint32_t subops_count, subops...
+                          -> per subop: int32_t rval, output...
+    EMU_MSG_LIST          int64_t pool, string nspace, cursor start,
+                          cursor finish, uint32_t max
+                          -> uint32_t count, count * string oid, cursor next
+    EMU_MSG_WATCH         int64_t pool, string nspace, string oid,
+                          uint64_t cookie
+    EMU_MSG_UNWATCH       int64_t pool, string nspace, string oid,
+                          uint64_t cookie
+    EMU_MSG_NOTIFY        int64_t pool, string nspace, string oid,
+                          uint64_t timeout_ms, bytes payload
+                          -> uint32_t count, count * (uint64_t gid,
+                             uint64_t cookie, bytes reply)
+    EMU_MSG_NOTIFY_ACK    uint64_t notify_id, uint64_t cookie, bytes reply
+
+Every reply payload starts with int32_t result and uint64_t object version.
+
+Events (server to client), with id zero:
+
+    EMU_MSG_EVENT_NOTIFY  uint64_t cookie, uint64_t notify_id,
+                          uint64_t notifier gid, bytes payload
+    EMU_MSG_EVENT_WATCH_ERROR
+                          uint64_t cookie, int32_t err
+
+A cursor is uint8_t is_end, uint32_t hash, string oid. Objects are listed
+in (hash, oid) order.
+
+*/
+
+#define EMU_DEFAULT_SOCKET "/tmp/rt-emu.sock"
+
+enum emu_msg_type {
+  EMU_MSG_HELLO = 1,
+  EMU_MSG_POOL_LOOKUP,
+  EMU_MSG_OP,
+  EMU_MSG_LIST,
+  EMU_MSG_WATCH,
+  EMU_MSG_UNWATCH,
+  EMU_MSG_NOTIFY,
+  EMU_MSG_NOTIFY_ACK,
+
+  EMU_MSG_REPLY = 100,
+  EMU_MSG_EVENT_NOTIFY,
+  EMU_MSG_EVENT_WATCH_ERROR,
+};
+
+// Sub-operations of EMU_MSG_OP. Outputs are only sent for read ops.
+enum emu_subop {
+  // Common.
+  EMU_OP_ASSERT_VERSION = 1, // uint64_t ver
+  EMU_OP_ASSERT_EXISTS,      //
+  EMU_OP_CMPXATTR,           // string name, uint8_t op, bytes value
+  EMU_OP_OMAP_CMP,           // string key, uint8_t op, bytes value
+
+  // Write.
+  EMU_OP_CREATE = 20, // uint8_t exclusive
+  EMU_OP_SETXATTR,    // string name, bytes value
+  EMU_OP_RMXATTR,     // string name
+  EMU_OP_WRITE_FULL,  // bytes data
+  EMU_OP_OMAP_SET,    // uint32_t n, n * (string key, bytes val)
+  EMU_OP_OMAP_RM,     // uint32_t n, n * string key
+  EMU_OP_OMAP_CLEAR,  //
+  EMU_OP_REMOVE,      //
+  EMU_OP_LOCK,        // string name, string cookie, uint64_t duration_us,
+                      // uint8_t flags
+  EMU_OP_UNLOCK,      // string name, string cookie
+  EMU_OP_BREAK_LOCK,  // string name, uint64_t gid, string cookie
+
+  // Read.
+  EMU_OP_STAT = 40,          // -> uint64_t size, uint64_t mtime
+  EMU_OP_READ,               // uint64_t off, uint64_t len -> bytes data
+  EMU_OP_GETXATTR,           // string name -> bytes value
+  EMU_OP_GETXATTRS,          // -> uint32_t n, n * (string name, bytes val)
+  EMU_OP_OMAP_GET_VALS_BY_KEYS, // uint32_t n, n * string key -> omap
+  EMU_OP_OMAP_GET_KEYS,      // string start_after, uint64_t max -> omap
+  EMU_OP_OMAP_GET_VALS,      // string start_after, string prefix,
+                             // uint64_t max -> omap
+};
+
+// omap output is uint8_t more, uint32_t n, n * (string key, bytes val).
+
+typedef struct emu_msg_hdr {
+  uint32_t len;
+  uint16_t type;
+  uint16_t reserved;
+  uint64_t id;
+} emu_msg_hdr_t;
+
+/*
+ * Encoding.
+ */
+
+typedef struct emu_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+} emu_buf_t;
+
+static inline void emu_put(emu_buf_t *b, const void *data, size_t len) {
+  if (b->len + len > b->cap) {
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + len) {
+      cap *= 2;
+    }
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+  }
+
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+static inline void emu_put_u8(emu_buf_t *b, uint8_t v) { emu_put(b, &v, 1); }
+
+static inline void emu_put_u32(emu_buf_t *b, uint32_t v) {
+  emu_put(b, &v, sizeof(v));
+}
+
+static inline void emu_put_u64(emu_buf_t *b, uint64_t v) {
+  emu_put(b, &v, sizeof(v));
+}
+
+static inline void emu_put_bytes(emu_buf_t *b, const void *data, size_t len) {
+  emu_put_u32(b, len);
+  emu_put(b, data, len);
+}
+
+static inline void emu_put_str(emu_buf_t *b, const char *s) {
+  emu_put_bytes(b, s ? s : "", s ? strlen(s) : 0);
+}
+
+/*
+ * Decoding. Reading past the end of the payload sets `err` and yields
+ * zeroes, so decoders only need to check it once at the end.
+ */
+
+typedef struct emu_reader {
+  const char *p;
+  const char *end;
+  int err;
+} emu_reader_t;
+
+static inline const char *emu_get(emu_reader_t *r, size_t len) {
+  if (r->err || (size_t)(r->end - r->p) < len) {
+    r->err = -EINVAL;
+    return NULL;
+  }
+
+  const char *p = r->p;
+  r->p += len;
+  return p;
+}
+
+static inline uint8_t emu_get_u8(emu_reader_t *r) {
+  const char *p = emu_get(r, 1);
+  return p ? (uint8_t)*p : 0;
+}
+
+static inline uint32_t emu_get_u32(emu_reader_t *r) {
+  uint32_t v = 0;
+  const char *p = emu_get(r, sizeof(v));
+  if (p) {
+    memcpy(&v, p, sizeof(v));
+  }
+  return v;
+}
+
+static inline uint64_t emu_get_u64(emu_reader_t *r) {
+  uint64_t v = 0;
+  const char *p = emu_get(r, sizeof(v));
+  if (p) {
+    memcpy(&v, p, sizeof(v));
+  }
+  return v;
+}
+
+// Returns pointer to the bytes within the payload, not NUL-terminated.
+static inline const char *emu_get_bytes(emu_reader_t *r, size_t *len) {
+  *len = emu_get_u32(r);
+  const char *p = emu_get(r, *len);
+  if (!p) {
+    *len = 0;
+  }
+  return p;
+}
+
+// Returns a newly allocated NUL-terminated copy of the string.
+static inline char *emu_get_str(emu_reader_t *r) {
+  size_t len;
+  const char *p = emu_get_bytes(r, &len);
+  return p ? strndup(p, len) : strdup("");
+}
+
+/*
+ * Socket I/O.
+ */
+
+static inline int emu_write_full(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static inline int emu_read_full(int fd, void *data, size_t len) {
+  char *p = data;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      return -ECONNRESET;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Sends a message. Caller serializes writers of the socket.
+static inline int emu_send_msg(int fd, uint16_t type, uint64_t id,
+                               const emu_buf_t *payload) {
+  emu_msg_hdr_t hdr = {
+      .len = payload ? payload->len : 0,
+      .type = type,
+      .id = id,
+  };
+
+  int ret = emu_write_full(fd, &hdr, sizeof(hdr));
+  if (ret == 0 && payload && payload->len > 0) {
+    ret = emu_write_full(fd, payload->data, payload->len);
+  }
+  return ret;
+}
+
+// Receives a message. Payload is allocated and owned by the caller.
+static inline int emu_recv_msg(int fd, emu_msg_hdr_t *hdr, char **payload) {
+  int ret = emu_read_full(fd, hdr, sizeof(*hdr));
+  if (ret < 0) {
+    return ret;
+  }
+
+  *payload = malloc(hdr->len ? hdr->len : 1);
+  if ((ret = emu_read_full(fd, *payload, hdr->len)) < 0) {
+    free(*payload);
+    *payload = NULL;
+  }
+  return ret;
+}
+
+// Hash placing objects in the listing order. FNV-1a with a final mix.
+static inline uint32_t emu_obj_hash(const char *oid, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)oid[i];
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+#endif // emu_proto_h_INCLUDED
@@ -0,0 +1,238 @@
+#ifndef emu_librados_h_INCLUDED
+#define emu_librados_h_INCLUDED
+
+/*
+ * Subset of the librados C API served by the local RADOS emulator (rt-emu).
+ * Signatures and constants match librados, so that the tracker builds
+ * unchanged against either. Build with `make EMU=1` to use it.
+ *
+ * The emulator socket is taken from the RT_EMU_SOCKET environment variable,
+ * or from `rt_emu_socket = PATH` in the config file passed to
+ * rados_conf_read_file, and defaults to /tmp/rt-emu.sock.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define LIBRADOS_CREATE_EXCLUSIVE 1
+#define LIBRADOS_CREATE_IDEMPOTENT 0
+
+#define LIBRADOS_CMPXATTR_OP_EQ 1
+#define LIBRADOS_CMPXATTR_OP_NE 2
+#define LIBRADOS_CMPXATTR_OP_GT 3
+#define LIBRADOS_CMPXATTR_OP_GTE 4
+#define LIBRADOS_CMPXATTR_OP_LT 5
+#define LIBRADOS_CMPXATTR_OP_LTE 6
+
+#define LIBRADOS_LOCK_FLAG_RENEW 0x1
+
+#define LIBRADOS_OPERATION_NOFLAG 0
+
+typedef void *rados_t;
+typedef void *rados_ioctx_t;
+typedef void *rados_omap_iter_t;
+typedef void *rados_xattrs_iter_t;
+typedef void *rados_write_op_t;
+typedef void *rados_read_op_t;
+typedef void *rados_completion_t;
+typedef void *rados_object_list_cursor;
+
+typedef struct {
+  size_t oid_length;
+  char *oid;
+  size_t nspace_length;
+  char *nspace;
+  size_t locator_length;
+  char *locator;
+} rados_object_list_item;
+
+typedef void (*rados_callback_t)(rados_completion_t cb, void *arg);
+typedef void (*rados_watchcb2_t)(void *arg, uint64_t notify_id, uint64_t handle,
+                                 uint64_t notifier_id, void *data,
+                                 size_t data_len);
+typedef void (*rados_watcherrcb_t)(void *pre, uint64_t cookie, int err);
+
+/*
+ * Cluster and pool context.
+ */
+
+int rados_create(rados_t *cluster, const char *const id);
+int rados_conf_read_file(rados_t cluster, const char *path);
+int rados_connect(rados_t cluster);
+void rados_shutdown(rados_t cluster);
+uint64_t rados_get_instance_id(rados_t cluster);
+int64_t rados_pool_lookup(rados_t cluster, const char *pool_name);
+
+int rados_ioctx_create(rados_t cluster, const char *pool_name,
+                       rados_ioctx_t *ioctx);
+int rados_ioctx_create2(rados_t cluster, int64_t pool_id,
+                        rados_ioctx_t *ioctx);
+void rados_ioctx_destroy(rados_ioctx_t io);
+int64_t rados_ioctx_get_id(rados_ioctx_t io);
+rados_t rados_ioctx_get_cluster(rados_ioctx_t io);
+void rados_ioctx_set_namespace(rados_ioctx_t io, const char *nspace);
+uint64_t rados_get_last_version(rados_ioctx_t io);
+
+int rados_getxattr(rados_ioctx_t io, const char *o, const char *name,
+                   char *buf, size_t len);
+int rados_remove(rados_ioctx_t io, const char *oid);
+
+void rados_buffer_free(char *buf);
+
+/*
+ * Write operations.
+ */
+
+rados_write_op_t rados_create_write_op(void);
+void rados_release_write_op(rados_write_op_t write_op);
+
+void rados_write_op_assert_version(rados_write_op_t write_op, uint64_t ver);
+void rados_write_op_assert_exists(rados_write_op_t write_op);
+void rados_write_op_cmpxattr(rados_write_op_t write_op, const char *name,
+                             uint8_t comparison_operator, const char *value,
+                             size_t value_len);
+void rados_write_op_omap_cmp(rados_write_op_t write_op, const char *key,
+                             uint8_t comparison_operator, const char *val,
+                             size_t val_len, int *prval);
+void rados_write_op_create(rados_write_op_t write_op, int exclusive,
+                           const char *category);
+void rados_write_op_setxattr(rados_write_op_t write_op, const char *name,
+                             const char *value, size_t value_len);
+void rados_write_op_rmxattr(rados_write_op_t write_op, const char *name);
+void rados_write_op_write_full(rados_write_op_t write_op, const char *buffer,
+                               size_t len);
+void rados_write_op_omap_set2(rados_write_op_t write_op,
+                              char const *const *keys,
+                              char const *const *vals, const size_t *key_lens,
+                              const size_t *val_lens, size_t num);
+void rados_write_op_omap_rm_keys2(rados_write_op_t write_op,
+                                  char const *const *keys,
+                                  const size_t *key_lens, size_t keys_len);
+void rados_write_op_omap_clear(rados_write_op_t write_op);
+void rados_write_op_remove(rados_write_op_t write_op);
+
+int rados_write_op_operate(rados_write_op_t write_op, rados_ioctx_t io,
+                           const char *oid, time_t *mtime, int flags);
+
+/*
+ * Read operations.
+ */
+
+rados_read_op_t rados_create_read_op(void);
+void rados_release_read_op(rados_read_op_t read_op);
+
+void rados_read_op_assert_version(rados_read_op_t read_op, uint64_t ver);
+void rados_read_op_cmpxattr(rados_read_op_t read_op, const char *name,
+                            uint8_t comparison_operator, const char *value,
+                            size_t value_len);
+void rados_read_op_stat(rados_read_op_t read_op, uint64_t *psize,
+                        time_t *pmtime, int *prval);
+void rados_read_op_read(rados_read_op_t read_op, uint64_t offset, size_t len,
+                        char *buffer, size_t *bytes_read, int *prval);
+void rados_read_op_getxattrs(rados_read_op_t read_op,
+                             rados_xattrs_iter_t *iter, int *prval);
+void rados_read_op_omap_get_vals_by_keys2(rados_read_op_t read_op,
+                                          char const *const *keys,
+                                          size_t num_keys,
+                                          const size_t *key_lens,
+                                          rados_omap_iter_t *iter, int *prval);
+void rados_read_op_omap_get_keys2(rados_read_op_t read_op,
+                                  const char *start_after, uint64_t max_return,
+                                  rados_omap_iter_t *iter,
+                                  unsigned char *pmore, int *prval);
+void rados_read_op_omap_get_vals2(rados_read_op_t read_op,
+                                  const char *start_after,
+                                  const char *filter_prefix,
+                                  uint64_t max_return, rados_omap_iter_t *iter,
+                                  unsigned char *pmore, int *prval);
+
+int rados_read_op_operate(rados_read_op_t read_op, rados_ioctx_t io,
+                          const char *oid, int flags);
+
+int rados_omap_get_next2(rados_omap_iter_t iter, char **key, char **val,
+                         size_t *key_len, size_t *val_len);
+unsigned int rados_omap_iter_size(rados_omap_iter_t iter);
+void rados_omap_get_end(rados_omap_iter_t iter);
+
+int rados_getxattrs_next(rados_xattrs_iter_t iter, const char **name,
+                         const char **val, size_t *len);
+void rados_getxattrs_end(rados_xattrs_iter_t iter);
+
+/*
+ * Object listing.
+ */
+
+rados_object_list_cursor rados_object_list_begin(rados_ioctx_t io);
+rados_object_list_cursor rados_object_list_end(rados_ioctx_t io);
+int rados_object_list_is_end(rados_ioctx_t io, rados_object_list_cursor cur);
+int rados_object_list_cursor_cmp(rados_ioctx_t io,
+                                 rados_object_list_cursor lhs,
+                                 rados_object_list_cursor rhs);
+void rados_object_list_cursor_free(rados_ioctx_t io,
+                                   rados_object_list_cursor cur);
+int rados_object_list(rados_ioctx_t io, const rados_object_list_cursor start,
+                      const rados_object_list_cursor finish,
+                      const size_t result_size, const char *filter_buf,
+                      const size_t filter_buf_len,
+                      rados_object_list_item *results,
+                      rados_object_list_cursor *next);
+void rados_object_list_free(const size_t result_size,
+                            rados_object_list_item *results);
+void rados_object_list_slice(rados_ioctx_t io,
+                             const rados_object_list_cursor start,
+                             const rados_object_list_cursor finish,
+                             const size_t n, const size_t m,
+                             rados_object_list_cursor *split_start,
+                             rados_object_list_cursor *split_finish);
+
+/*
+ * Advisory locks.
+ */
+
+int rados_lock_exclusive(rados_ioctx_t io, const char *oid, const char *name,
+                         const char *cookie, const char *desc,
+                         struct timeval *duration, uint8_t flags);
+int rados_unlock(rados_ioctx_t io, const char *o, const char *name,
+                 const char *cookie);
+int rados_break_lock(rados_ioctx_t io, const char *o, const char *name,
+                     const char *client, const char *cookie);
+
+/*
+ * Watch/notify. Notify reply buffer is the emulator's EMU_MSG_NOTIFY reply,
+ * see emu/proto.h, not the librados encoding.
+ */
+
+int rados_watch2(rados_ioctx_t io, const char *o, uint64_t *cookie,
+                 rados_watchcb2_t watchcb, rados_watcherrcb_t watcherrcb,
+                 void *arg);
+int rados_unwatch2(rados_ioctx_t io, uint64_t cookie);
+int rados_notify2(rados_ioctx_t io, const char *o, const char *buf,
+                  int buf_len, uint64_t timeout_ms, char **reply_buffer,
+                  size_t *reply_buffer_len);
+int rados_notify_ack(rados_ioctx_t io, const char *o, uint64_t notify_id,
+                     uint64_t cookie, const char *buf, int buf_len);
+// Waits for watch callbacks already queued. Must not be called from one.
+int rados_watch_flush(rados_t cluster);
+
+/*
+ * Asynchronous I/O. Callbacks run on a separate completion thread.
+ */
+
+int rados_aio_create_completion2(void *cb_arg, rados_callback_t cb_complete,
+                                 rados_completion_t *pc);
+int rados_aio_write_op_operate(rados_write_op_t write_op, rados_ioctx_t io,
+                               rados_completion_t completion, const char *oid,
+                               time_t *mtime, int flags);
+int rados_aio_read_op_operate(rados_read_op_t read_op, rados_ioctx_t io,
+                              rados_completion_t completion, const char *oid,
+                              int flags);
+int rados_aio_wait_for_complete(rados_completion_t c);
+int rados_aio_is_complete(rados_completion_t c);
+int rados_aio_get_return_value(rados_completion_t c);
+uint64_t rados_aio_get_version(rados_completion_t c);
+void rados_aio_release(rados_completion_t c);
+
+#endif // emu_librados_h_INCLUDED
@@ -0,0 +1,287 @@
+#include "export.h"
+#include "rt.h"
+#include "snapshot.h"
+#include "throttle.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of objects fetched from pool listing at once.
+#define EXPORT_LIST_PAGE_SIZE 1024
+// Number of keys fetched from RT OMap at once.
+#define EXPORT_KEYS_PAGE_SIZE 1024
+
+// Growable byte buffer a record is serialized into.
+typedef struct export_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+} export_buf_t;
+
+typedef struct export {
+  rados_t rados;
+  const char *pool_name;
+  rados_ioctx_t ioctx;
+  int threads;
+  rt_throttle_t throttle;
+  rt_window_t *window;
+
+  // Output file, current write offset and record offsets written so far.
+  pthread_mutex_t lock;
+  FILE *out;
+  uint64_t offset;
+  uint64_t *index;
+  uint64_t index_len;
+  uint64_t index_cap;
+  int err;
+} export_t;
+
+// Scanner thread state.
+typedef struct export_scanner {
+  export_t *ex;
+  pthread_t thread;
+  int slice;
+
+  // Not shared, see rt_list_keys.
+  rados_ioctx_t ioctx;
+
+  export_buf_t buf;
+  uint32_t keys_count;
+} export_scanner_t;
+
+void *export_scan(void *arg);
+
+void export_buf_append(export_buf_t *buf, const void *data, size_t len) {
+  if (buf->len + len > buf->cap) {
+    while (buf->len + len > buf->cap) {
+      buf->cap = buf->cap ? buf->cap * 2 : 4096;
+    }
+    buf->data = realloc(buf->data, buf->cap);
+  }
+
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+void export_buf_pad(export_buf_t *buf) {
+  static const char zeros[RT_SNAP_ALIGN];
+  size_t pad = (RT_SNAP_ALIGN - buf->len % RT_SNAP_ALIGN) % RT_SNAP_ALIGN;
+  export_buf_append(buf, zeros, pad);
+}
+
+int rt_export_run(rados_t rados, const char *pool_name, const char *path,
+                  int threads, double max_ops_per_sec,
+                  unsigned long *rts_exported) {
+  int ret = 0;
+
+  export_t ex = {.rados = rados, .pool_name = pool_name, .threads = threads};
+
+  if ((ret = rados_ioctx_create(rados, pool_name, &ex.ioctx)) < 0) {
+    return ret;
+  }
+
+  if (!(ex.out = fopen(path, "wb"))) {
+    ret = -errno;
+    rados_ioctx_destroy(ex.ioctx);
+    return ret;
+  }
+
+  // Header is rewritten once the records and index are in place.
+
+  rt_snap_header_t header = {.magic = RT_SNAP_MAGIC};
+  fwrite(&header, sizeof(header), 1, ex.out);
+  ex.offset = sizeof(header);
+
+  rt_throttle_init(&ex.throttle, max_ops_per_sec);
+  ex.window = rt_window_get(rados, pool_name);
+  pthread_mutex_init(&ex.lock, NULL);
+
+  {
+    export_scanner_t *scanners = calloc(threads, sizeof(export_scanner_t));
+
+    for (int i = 0; i < threads; i++) {
+      scanners[i].ex = &ex;
+      scanners[i].slice = i;
+      pthread_create(&scanners[i].thread, NULL, export_scan, &scanners[i]);
+    }
+
+    for (int i = 0; i < threads; i++) {
+      pthread_join(scanners[i].thread, NULL);
+      free(scanners[i].buf.data);
+    }
+
+    free(scanners);
+  }
+
+  // Write index and header.
+
+  if (!ex.err) {
+    header.records_count = htole64(ex.index_len);
+    header.index_offset = htole64(ex.offset);
+
+    for (uint64_t i = 0; i < ex.index_len; i++) {
+      uint64_t off = htole64(ex.index[i]);
+      fwrite(&off, sizeof(off), 1, ex.out);
+    }
+
+    fseek(ex.out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, ex.out);
+  }
+
+  if (fclose(ex.out) != 0 && !ex.err) {
+    ex.err = -errno;
+  }
+
+  ret = ex.err;
+  *rts_exported = ex.index_len;
+
+  pthread_mutex_destroy(&ex.lock);
+  rt_throttle_destroy(&ex.throttle);
+  free(ex.index);
+  rados_ioctx_destroy(ex.ioctx);
+
+  return ret;
+}
+
+// rt_keys_cb serializing keys into the record being built.
+int export_keys(const char *const *keys, const size_t *key_lens,
+                int keys_count, void *arg) {
+  export_scanner_t *s = arg;
+
+  for (int i = 0; i < keys_count; i++) {
+    uint32_t key_len = htole32(key_lens[i]);
+    export_buf_append(&s->buf, &key_len, sizeof(key_len));
+    export_buf_append(&s->buf, keys[i], key_lens[i]);
+  }
+  s->keys_count += keys_count;
+
+  return 0;
+}
+
+int export_rt(export_scanner_t *s, const char *rt_name) {
+  export_t *ex = s->ex;
+  int ret;
+  uint32_t refcount;
+
+  rt_snap_record_t record = {.name_len = htole32(strlen(rt_name))};
+
+  do {
+    rt_throttle_wait(&ex->throttle, 1);
+
+    // Start over with an empty record, filled in once the keys are known.
+    s->buf.len = 0;
+    s->keys_count = 0;
+    export_buf_append(&s->buf, &record, sizeof(record));
+    export_buf_append(&s->buf, rt_name, strlen(rt_name));
+
+    double started = rt_window_enter(ex->window);
+    ret = rt_list_keys(s->ioctx, rt_name, EXPORT_KEYS_PAGE_SIZE, export_keys,
+                       s, &refcount);
+    rt_window_leave(ex->window, started, RT_WINDOW_READ,
+                    rt_list_ops(ret == 0 ? refcount : 0,
+                                EXPORT_KEYS_PAGE_SIZE),
+                    ret);
+  } while (ret == -ERANGE);
+
+  if (ret == -ENODATA || ret == -ENOENT) {
+    // Not an RT object, or it's been deleted in the meantime.
+    return 0;
+  }
+
+  if (ret < 0) {
+    return ret;
+  }
+
+  record.refcount = htole32(refcount);
+  record.keys_count = htole32(s->keys_count);
+  memcpy(s->buf.data, &record, sizeof(record));
+  export_buf_pad(&s->buf);
+
+  // Append the record.
+
+  pthread_mutex_lock(&ex->lock);
+
+  if (ex->index_len == ex->index_cap) {
+    ex->index_cap = ex->index_cap ? ex->index_cap * 2 : 1024;
+    ex->index = realloc(ex->index, sizeof(uint64_t) * ex->index_cap);
+  }
+  ex->index[ex->index_len++] = ex->offset;
+
+  if (fwrite(s->buf.data, 1, s->buf.len, ex->out) != s->buf.len) {
+    ret = -EIO;
+  }
+  ex->offset += s->buf.len;
+
+  pthread_mutex_unlock(&ex->lock);
+
+  return ret;
+}
+
+void *export_scan(void *arg) {
+  export_scanner_t *s = arg;
+  export_t *ex = s->ex;
+  int ret;
+
+  if ((ret = rados_ioctx_create(ex->rados, ex->pool_name, &s->ioctx)) < 0) {
+    pthread_mutex_lock(&ex->lock);
+    ex->err = ret;
+    pthread_mutex_unlock(&ex->lock);
+    return NULL;
+  }
+
+  rados_ioctx_t ioctx = s->ioctx;
+
+  rados_object_list_item items[EXPORT_LIST_PAGE_SIZE];
+  rados_object_list_cursor begin = rados_object_list_begin(ioctx);
+  rados_object_list_cursor end = rados_object_list_end(ioctx);
+  rados_object_list_cursor cursor, slice_end;
+
+  rados_object_list_slice(ioctx, begin, end, s->slice, ex->threads, &cursor,
+                          &slice_end);
+
+  while (ret == 0 &&
+         rados_object_list_cursor_cmp(ioctx, cursor, slice_end) < 0) {
+    rados_object_list_cursor next = NULL;
+
+    double started = rt_window_enter(ex->window);
+    int n = rados_object_list(ioctx, cursor, slice_end, EXPORT_LIST_PAGE_SIZE,
+                              NULL, 0, items, &next);
+    rt_window_leave(ex->window, started, RT_WINDOW_LIST, 1, n < 0 ? n : 0);
+    if (n < 0) {
+      ret = n;
+      break;
+    }
+
+    for (int i = 0; i < n && ret == 0; i++) {
+      char *rt_name = strndup(items[i].oid, items[i].oid_length);
+      ret = export_rt(s, rt_name);
+      free(rt_name);
+    }
+
+    rados_object_list_free(n, items);
+    rados_object_list_cursor_free(ioctx, cursor);
+    cursor = next;
+  }
+
+  if (ret < 0) {
+    { // Debug log message.
+      printf("export: Scanning slice %d failed with error code %d.\n",
+             s->slice, ret);
+    }
+
+    pthread_mutex_lock(&ex->lock);
+    ex->err = ret;
+    pthread_mutex_unlock(&ex->lock);
+  }
+
+  rados_object_list_cursor_free(ioctx, cursor);
+  rados_object_list_cursor_free(ioctx, slice_end);
+  rados_object_list_cursor_free(ioctx, begin);
+  rados_object_list_cursor_free(ioctx, end);
+
+  rados_ioctx_destroy(ioctx);
+
+  return NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef export_h_INCLUDED
+#define export_h_INCLUDED
+
+#include <rados/librados.h>
+
+/**
+ * rt_export_run exports all RT objects in a pool into a snapshot file, see
+ * snapshot.h for its layout. The pool is scanned in `threads` parallel
+ * slices, and each RT is read from a single object version.
+ *
+ * `rados` is a handle to a Ceph cluster.
+ * `pool_name` is name of the pool where the RT RADOS objects are stored.
+ * `path` is the path of the snapshot file to write.
+ * `threads` is the number of parallel scanners.
+ * `max_ops_per_sec` limits the rate of RADOS operations, zero means
+ *                   unlimited.
+ * `rts_exported` is set to the number of exported RTs.
+ */
+int rt_export_run(rados_t rados, const char *pool_name, const char *path,
+                  int threads, double max_ops_per_sec,
+                  unsigned long *rts_exported);
+
+#endif // export_h_INCLUDED
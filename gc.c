@@ -0,0 +1,717 @@
+#define _GNU_SOURCE
+
+#include "gc.h"
+#include "queue.h"
+#include "rt.h"
+#include "throttle.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+
+GC pipeline
+===========
+
+    scanners ---[batches]---> oracle workers ---[jobs]---> removers
+
+Scanners list their slice of the pool and read all keys of every RT they
+find. Keys are packed into batches of at most `batch_size` keys, which may
+span several RTs. Oracle workers pass the batches to the liveness oracle and
+group dead keys by RT into removal jobs. Removers execute the jobs using
+rt_remove3, which re-reads the RT and only removes keys that are still
+tracked, guarded by RT object version.
+
+Keys of partitioned RTs are held per writer. They're grouped by RT and by
+the writer of the partition they were listed from, and removed as that
+writer.
+
+Both queues are bounded, so a slow stage applies backpressure to the stages
+before it.
+
+*/
+
+// Number of objects fetched from pool listing at once.
+#define GC_LIST_PAGE_SIZE 1024
+// Number of keys fetched from RT OMap at once.
+#define GC_KEYS_PAGE_SIZE 1024
+// Number of batches/jobs that may be queued between pipeline stages, per
+// consumer thread.
+#define GC_QUEUE_DEPTH 4
+// How many times an RT update is retried when the RT changes underneath.
+#define GC_MAX_RETRIES 5
+
+// Keys of a single RT, or RT partition, within a batch.
+typedef struct gc_seg {
+  char *rt_name;
+  // Writer of the partition, NULL for RTs of other layouts.
+  char *writer;
+  int first;
+  int count;
+} gc_seg_t;
+
+// Batch of keys passed to the oracle.
+typedef struct gc_batch {
+  char **keys;
+  int count;
+
+  gc_seg_t *segs;
+  int segs_count;
+} gc_batch_t;
+
+// Removal job, dead keys of a single RT, or RT partition.
+typedef struct gc_job {
+  char *rt_name;
+  char *writer;
+  char **keys;
+  int count;
+} gc_job_t;
+
+typedef struct gc {
+  rados_t rados;
+  const char *pool_name;
+  const rt_gc_opts_t *opts;
+
+  rt_queue_t batches;
+  rt_queue_t jobs;
+  rt_throttle_t throttle;
+  rt_window_t *window;
+
+  pthread_mutex_t stats_lock;
+  rt_gc_stats_t stats;
+} gc_t;
+
+// Scanner thread state.
+typedef struct gc_scanner {
+  gc_t *gc;
+  pthread_t thread;
+  int slice;
+
+  // Not shared, see rt_list_keys.
+  rados_ioctx_t ioctx;
+
+  gc_batch_t *batch;
+  const char *rt_name;
+} gc_scanner_t;
+
+void gc_add_stat(gc_t *gc, unsigned long *stat, unsigned long n);
+
+gc_batch_t *gc_batch_new(int batch_size);
+void gc_batch_free(gc_batch_t *batch);
+void gc_job_free(gc_job_t *job);
+
+void *gc_scan(void *arg);
+void *gc_decide(void *arg);
+void *gc_remove(void *arg);
+
+void rt_gc_opts_init(rt_gc_opts_t *opts) {
+  opts->oracle = NULL;
+  opts->oracle_arg = NULL;
+  opts->scan_threads = RT_WINDOW_THREADS;
+  opts->oracle_threads = 4;
+  opts->remove_threads = RT_WINDOW_THREADS;
+  opts->batch_size = 1000;
+  opts->max_ops_per_sec = 0;
+}
+
+int rt_gc_run(rados_t rados, const char *pool_name, const rt_gc_opts_t *opts,
+              rt_gc_stats_t *stats) {
+  int ret = 0;
+
+  gc_t gc = {
+      .rados = rados,
+      .pool_name = pool_name,
+      .opts = opts,
+  };
+
+  memset(stats, 0, sizeof(*stats));
+
+  rt_queue_init(&gc.batches, opts->oracle_threads * GC_QUEUE_DEPTH);
+  rt_queue_init(&gc.jobs, opts->remove_threads * GC_QUEUE_DEPTH);
+  rt_throttle_init(&gc.throttle, opts->max_ops_per_sec);
+  gc.window = rt_window_get(rados, pool_name);
+  pthread_mutex_init(&gc.stats_lock, NULL);
+
+  gc_scanner_t *scanners = calloc(opts->scan_threads, sizeof(gc_scanner_t));
+  pthread_t *deciders = malloc(sizeof(pthread_t) * opts->oracle_threads);
+  pthread_t *removers = malloc(sizeof(pthread_t) * opts->remove_threads);
+
+  // Start the pipeline from its end, so that every stage has a consumer.
+
+  for (int i = 0; i < opts->remove_threads; i++) {
+    pthread_create(&removers[i], NULL, gc_remove, &gc);
+  }
+
+  for (int i = 0; i < opts->oracle_threads; i++) {
+    pthread_create(&deciders[i], NULL, gc_decide, &gc);
+  }
+
+  for (int i = 0; i < opts->scan_threads; i++) {
+    scanners[i].gc = &gc;
+    scanners[i].slice = i;
+    pthread_create(&scanners[i].thread, NULL, gc_scan, &scanners[i]);
+  }
+
+  // Drain the pipeline stage by stage.
+
+  for (int i = 0; i < opts->scan_threads; i++) {
+    pthread_join(scanners[i].thread, NULL);
+  }
+  rt_queue_close(&gc.batches);
+
+  for (int i = 0; i < opts->oracle_threads; i++) {
+    pthread_join(deciders[i], NULL);
+  }
+  rt_queue_close(&gc.jobs);
+
+  for (int i = 0; i < opts->remove_threads; i++) {
+    pthread_join(removers[i], NULL);
+  }
+
+  *stats = gc.stats;
+  rt_window_get_stats(gc.window, &stats->window);
+  if (stats->errors > 0) {
+    ret = -EIO;
+  }
+
+  free(scanners);
+  free(deciders);
+  free(removers);
+
+  pthread_mutex_destroy(&gc.stats_lock);
+  rt_throttle_destroy(&gc.throttle);
+  rt_queue_destroy(&gc.jobs);
+  rt_queue_destroy(&gc.batches);
+
+  return ret;
+}
+
+void gc_add_stat(gc_t *gc, unsigned long *stat, unsigned long n) {
+  pthread_mutex_lock(&gc->stats_lock);
+  *stat += n;
+  pthread_mutex_unlock(&gc->stats_lock);
+}
+
+gc_batch_t *gc_batch_new(int batch_size) {
+  gc_batch_t *batch = malloc(sizeof(gc_batch_t));
+
+  batch->keys = malloc(sizeof(char *) * batch_size);
+  batch->count = 0;
+  batch->segs = malloc(sizeof(gc_seg_t) * batch_size);
+  batch->segs_count = 0;
+
+  return batch;
+}
+
+void gc_batch_free(gc_batch_t *batch) {
+  for (int i = 0; i < batch->count; i++) {
+    free(batch->keys[i]);
+  }
+  for (int i = 0; i < batch->segs_count; i++) {
+    free(batch->segs[i].rt_name);
+    free(batch->segs[i].writer);
+  }
+
+  free(batch->keys);
+  free(batch->segs);
+  free(batch);
+}
+
+void gc_job_free(gc_job_t *job) {
+  for (int i = 0; i < job->count; i++) {
+    free(job->keys[i]);
+  }
+
+  free(job->keys);
+  free(job->rt_name);
+  free(job->writer);
+  free(job);
+}
+
+/*
+ * Scanner stage.
+ */
+
+// Whether keys of `writer` of the RT being scanned go to segment `seg`.
+static int gc_seg_matches(const gc_seg_t *seg, const char *rt_name,
+                          const char *writer) {
+  if (strcmp(seg->rt_name, rt_name) != 0) {
+    return 0;
+  }
+  if (!seg->writer || !writer) {
+    return !seg->writer && !writer;
+  }
+  return strcmp(seg->writer, writer) == 0;
+}
+
+// rt_writer_keys_cb packing keys of the RT being scanned into batches.
+int gc_scan_keys(const char *writer, const char *const *keys,
+                 const size_t *key_lens, int keys_count, void *arg) {
+  gc_scanner_t *s = arg;
+  gc_t *gc = s->gc;
+
+  for (int i = 0; i < keys_count; i++) {
+    gc_batch_t *batch = s->batch;
+
+    if (batch->segs_count == 0 ||
+        !gc_seg_matches(&batch->segs[batch->segs_count - 1], s->rt_name,
+                        writer)) {
+      // First key of this RT, or partition, in the batch.
+      gc_seg_t *seg = &batch->segs[batch->segs_count++];
+      seg->rt_name = strdup(s->rt_name);
+      seg->writer = writer ? strdup(writer) : NULL;
+      seg->first = batch->count;
+      seg->count = 0;
+    }
+
+    batch->keys[batch->count++] = strndup(keys[i], key_lens[i]);
+    batch->segs[batch->segs_count - 1].count++;
+
+    if (batch->count == gc->opts->batch_size) {
+      if (rt_queue_push(&gc->batches, batch) < 0) {
+        gc_batch_free(batch);
+      }
+      s->batch = gc_batch_new(gc->opts->batch_size);
+    }
+  }
+
+  gc_add_stat(gc, &gc->stats.keys_scanned, keys_count);
+
+  return 0;
+}
+
+void gc_scan_rt(gc_scanner_t *s, const char *rt_name) {
+  gc_t *gc = s->gc;
+  int ret;
+  uint32_t refcount;
+
+  s->rt_name = rt_name;
+
+  for (int attempt = 0; attempt < GC_MAX_RETRIES; attempt++) {
+    rt_throttle_wait(&gc->throttle, 1);
+
+    // Keys listed before the RT changed underneath may have already been
+    // batched. That's harmless, they are only removal candidates and the
+    // removal re-reads the RT anyway.
+    double started = rt_window_enter(gc->window);
+    ret = rt_list_keys2(s->ioctx, rt_name, GC_KEYS_PAGE_SIZE, gc_scan_keys,
+                        s, &refcount);
+    rt_window_leave(gc->window, started, RT_WINDOW_READ,
+                    rt_list_ops(ret == 0 ? refcount : 0, GC_KEYS_PAGE_SIZE),
+                    ret);
+    if (ret != -ERANGE) {
+      break;
+    }
+  }
+
+  if (ret == -ENODATA || ret == -ENOENT) {
+    // Not an RT object, or it's been deleted in the meantime.
+    return;
+  }
+
+  if (ret < 0) {
+    { // Debug log message.
+      printf("gc: Failed to scan RT %s: %d.\n", rt_name, ret);
+    }
+    gc_add_stat(gc, &gc->stats.errors, 1);
+    return;
+  }
+
+  gc_add_stat(gc, &gc->stats.rts_scanned, 1);
+}
+
+void *gc_scan(void *arg) {
+  gc_scanner_t *s = arg;
+  gc_t *gc = s->gc;
+  int ret;
+
+  if ((ret = rados_ioctx_create(gc->rados, gc->pool_name, &s->ioctx)) < 0) {
+    { // Debug log message.
+      printf("gc: Failed to create ioctx: %d.\n", ret);
+    }
+    gc_add_stat(gc, &gc->stats.errors, 1);
+    return NULL;
+  }
+
+  rados_ioctx_t ioctx = s->ioctx;
+
+  rados_object_list_item items[GC_LIST_PAGE_SIZE];
+  rados_object_list_cursor begin = rados_object_list_begin(ioctx);
+  rados_object_list_cursor end = rados_object_list_end(ioctx);
+  rados_object_list_cursor cursor, slice_end;
+
+  rados_object_list_slice(ioctx, begin, end, s->slice, gc->opts->scan_threads,
+                          &cursor, &slice_end);
+
+  s->batch = gc_batch_new(gc->opts->batch_size);
+
+  while (rados_object_list_cursor_cmp(ioctx, cursor, slice_end) < 0) {
+    rados_object_list_cursor next = NULL;
+
+    double started = rt_window_enter(gc->window);
+    int n = rados_object_list(ioctx, cursor, slice_end, GC_LIST_PAGE_SIZE,
+                              NULL, 0, items, &next);
+    rt_window_leave(gc->window, started, RT_WINDOW_LIST, 1, n < 0 ? n : 0);
+    if (n < 0) {
+      { // Debug log message.
+        printf("gc: Pool listing failed with error code %d.\n", n);
+      }
+      gc_add_stat(gc, &gc->stats.errors, 1);
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      char *rt_name = strndup(items[i].oid, items[i].oid_length);
+      gc_scan_rt(s, rt_name);
+      free(rt_name);
+    }
+
+    rados_object_list_free(n, items);
+    rados_object_list_cursor_free(ioctx, cursor);
+    cursor = next;
+  }
+
+  // Flush the last, partial batch.
+
+  if (s->batch->count > 0 && rt_queue_push(&gc->batches, s->batch) == 0) {
+    s->batch = NULL;
+  }
+  if (s->batch) {
+    gc_batch_free(s->batch);
+  }
+
+  rados_object_list_cursor_free(ioctx, cursor);
+  rados_object_list_cursor_free(ioctx, slice_end);
+  rados_object_list_cursor_free(ioctx, begin);
+  rados_object_list_cursor_free(ioctx, end);
+
+  rados_ioctx_destroy(ioctx);
+
+  return NULL;
+}
+
+/*
+ * Oracle stage.
+ */
+
+void *gc_decide(void *arg) {
+  gc_t *gc = arg;
+  gc_batch_t *batch;
+
+  while ((batch = rt_queue_pop(&gc->batches))) {
+    int *dead = calloc(batch->count, sizeof(int));
+
+    int ret = gc->opts->oracle((const char *const *)batch->keys, batch->count,
+                               dead, gc->opts->oracle_arg);
+    if (ret < 0) {
+      { // Debug log message.
+        printf("gc: Liveness oracle failed with error code %d.\n", ret);
+      }
+      gc_add_stat(gc, &gc->stats.errors, 1);
+      goto next;
+    }
+
+    // Group dead keys by RT.
+
+    for (int i = 0; i < batch->segs_count; i++) {
+      gc_seg_t *seg = &batch->segs[i];
+      gc_job_t *job = NULL;
+
+      for (int j = seg->first; j < seg->first + seg->count; j++) {
+        if (!dead[j]) {
+          continue;
+        }
+
+        if (!job) {
+          job = malloc(sizeof(gc_job_t));
+          job->rt_name = strdup(seg->rt_name);
+          job->writer = seg->writer ? strdup(seg->writer) : NULL;
+          job->keys = malloc(sizeof(char *) * seg->count);
+          job->count = 0;
+        }
+
+        // Move the key to the job.
+        job->keys[job->count++] = batch->keys[j];
+        batch->keys[j] = NULL;
+      }
+
+      if (job) {
+        gc_add_stat(gc, &gc->stats.keys_dead, job->count);
+
+        if (rt_queue_push(&gc->jobs, job) < 0) {
+          gc_job_free(job);
+        }
+      }
+    }
+
+  next:
+    free(dead);
+    gc_batch_free(batch);
+  }
+
+  return NULL;
+}
+
+/*
+ * Removal stage.
+ */
+
+void *gc_remove(void *arg) {
+  gc_t *gc = arg;
+  gc_job_t *job;
+  rados_ioctx_t ioctx;
+
+  // Not shared, see rt_list_keys.
+  int ioctx_ret = rados_ioctx_create(gc->rados, gc->pool_name, &ioctx);
+  if (ioctx_ret < 0) {
+    { // Debug log message.
+      printf("gc: Failed to create ioctx: %d.\n", ioctx_ret);
+    }
+  }
+
+  while ((job = rt_queue_pop(&gc->jobs))) {
+    int ret = ioctx_ret;
+    int deleted = 0;
+
+    // Keys of partitioned RTs are removed as the writer holding them.
+    rt_opts_t opts;
+    rt_opts_init(&opts);
+    opts.writer_id = job->writer;
+
+    size_t *key_lens = malloc(sizeof(size_t) * job->count);
+    for (int i = 0; i < job->count; i++) {
+      key_lens[i] = strlen(job->keys[i]);
+    }
+
+    for (int attempt = 0; ioctx_ret == 0 && attempt < GC_MAX_RETRIES;
+         attempt++) {
+      // rt_remove3 reads the RT and then writes it, once its version is
+      // known.
+      rt_throttle_wait(&gc->throttle, 2);
+
+      double started = rt_window_enter(gc->window);
+      ret = rt_remove3(ioctx, job->rt_name, (const char *const *)job->keys,
+                       key_lens, job->count, &opts, &deleted);
+      rt_window_leave(gc->window, started, RT_WINDOW_WRITE, 3, ret);
+      if (ret != -ERANGE) {
+        break;
+      }
+    }
+
+    if (ret < 0) {
+      { // Debug log message.
+        printf("gc: Failed to remove %d keys from RT %s: %d.\n", job->count,
+               job->rt_name, ret);
+      }
+      gc_add_stat(gc, &gc->stats.errors, 1);
+    } else {
+      gc_add_stat(gc, &gc->stats.keys_removed, job->count);
+      gc_add_stat(gc, &gc->stats.rts_deleted, deleted ? 1 : 0);
+    }
+
+    free(key_lens);
+    gc_job_free(job);
+  }
+
+  if (ioctx_ret == 0) {
+    rados_ioctx_destroy(ioctx);
+  }
+
+  return NULL;
+}
+
+/*
+ * External command oracle.
+ */
+
+typedef struct gc_key_idx {
+  const char *key;
+  int idx;
+} gc_key_idx_t;
+
+int gc_key_idx_cmp(const void *a, const void *b) {
+  return strcmp(((const gc_key_idx_t *)a)->key, ((const gc_key_idx_t *)b)->key);
+}
+
+int rt_gc_exec_oracle(const char *const *keys, int keys_count, int *dead,
+                      void *arg) {
+  const char *cmd = arg;
+  int ret = 0;
+
+  int in_pipe[2], out_pipe[2];
+
+  if (pipe2(in_pipe, O_CLOEXEC) < 0) {
+    return -errno;
+  }
+  if (pipe2(out_pipe, O_CLOEXEC) < 0) {
+    ret = -errno;
+    close(in_pipe[0]);
+    close(in_pipe[1]);
+    return ret;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(in_pipe[0], STDIN_FILENO);
+    dup2(out_pipe[1], STDOUT_FILENO);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+
+  close(in_pipe[0]);
+  close(out_pipe[1]);
+
+  if (pid < 0) {
+    ret = -errno;
+    close(in_pipe[1]);
+    close(out_pipe[0]);
+    return ret;
+  }
+
+  // A blocking write of the whole input would deadlock with a command that
+  // answers as it reads, once its output fills the pipe.
+  fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
+
+  // Prepare input, one key per line.
+
+  size_t in_len = 0;
+  for (int i = 0; i < keys_count; i++) {
+    in_len += strlen(keys[i]) + 1;
+  }
+
+  char *in_buf = malloc(in_len);
+  for (int i = 0, off = 0; i < keys_count; i++) {
+    size_t len = strlen(keys[i]);
+    memcpy(in_buf + off, keys[i], len);
+    in_buf[off + len] = '\n';
+    off += len + 1;
+  }
+
+  size_t out_len = 0, out_cap = 4096;
+  char *out_buf = malloc(out_cap);
+
+  // Feed the input and collect the output at the same time, the command may
+  // start answering before it's read the whole batch.
+
+  {
+    size_t in_off = 0;
+    struct pollfd fds[2] = {{.fd = out_pipe[0], .events = POLLIN},
+                            {.fd = in_pipe[1], .events = POLLOUT}};
+    int nfds = in_len > 0 ? 2 : 1;
+
+    if (nfds == 1) {
+      close(in_pipe[1]);
+    }
+
+    for (;;) {
+      if (poll(fds, nfds, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        ret = -errno;
+        break;
+      }
+
+      if (nfds == 2 && fds[1].revents) {
+        ssize_t n = write(in_pipe[1], in_buf + in_off, in_len - in_off);
+        if (n > 0) {
+          in_off += n;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+          // Pipe is full, poll again.
+        } else if (n < 0 || in_off == in_len) {
+          // Either done, or the command doesn't want any more input.
+          close(in_pipe[1]);
+          nfds = 1;
+        }
+      }
+
+      if (fds[0].revents) {
+        if (out_len == out_cap) {
+          out_cap *= 2;
+          out_buf = realloc(out_buf, out_cap);
+        }
+
+        ssize_t n = read(out_pipe[0], out_buf + out_len, out_cap - out_len);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          break;
+        }
+        out_len += n;
+      }
+    }
+
+    if (nfds == 2) {
+      close(in_pipe[1]);
+    }
+    close(out_pipe[0]);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+
+  if (ret == 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+    { // Debug log message.
+      printf("gc: Liveness oracle command exited with status %d.\n", status);
+    }
+    ret = -ECHILD;
+  }
+
+  // Mark keys listed in the output as dead.
+
+  if (ret == 0) {
+    gc_key_idx_t *sorted = malloc(sizeof(gc_key_idx_t) * keys_count);
+    for (int i = 0; i < keys_count; i++) {
+      sorted[i].key = keys[i];
+      sorted[i].idx = i;
+      dead[i] = 0;
+    }
+    qsort(sorted, keys_count, sizeof(gc_key_idx_t), gc_key_idx_cmp);
+
+    char *line = out_buf;
+    char *out_end = out_buf + out_len;
+    while (line < out_end) {
+      char *eol = memchr(line, '\n', out_end - line);
+      if (!eol) {
+        eol = out_end;
+      }
+
+      char *key = strndup(line, eol - line);
+      gc_key_idx_t needle = {.key = key};
+      gc_key_idx_t *found = bsearch(&needle, sorted, keys_count,
+                                    sizeof(gc_key_idx_t), gc_key_idx_cmp);
+      if (found) {
+        // The same key may be batched for several RTs, mark all of them.
+        gc_key_idx_t *first = found, *last = found;
+        while (first > sorted && gc_key_idx_cmp(first - 1, &needle) == 0) {
+          first--;
+        }
+        while (last + 1 < sorted + keys_count &&
+               gc_key_idx_cmp(last + 1, &needle) == 0) {
+          last++;
+        }
+        for (gc_key_idx_t *k = first; k <= last; k++) {
+          dead[k->idx] = 1;
+        }
+      }
+      free(key);
+
+      line = eol + 1;
+    }
+
+    free(sorted);
+  }
+
+  free(in_buf);
+  free(out_buf);
+
+  return ret;
+}
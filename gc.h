@@ -0,0 +1,81 @@
+#ifndef gc_h_INCLUDED
+#define gc_h_INCLUDED
+
+#include "throttle.h"
+#include <rados/librados.h>
+
+/**
+ * Orphan reference GC scans all RT objects in a pool, asks a liveness
+ * oracle which of the tracked keys are still referenced, and removes the
+ * dead ones using the regular guarded rt_remove update. Scanning, oracle
+ * calls and removals run in separate pipeline stages, so they overlap.
+ */
+
+/**
+ * rt_gc_oracle_fn decides liveness of a batch of reference keys.
+ *
+ * `keys` is an array of `keys_count` key strings.
+ * `dead` is an array of `keys_count` flags. The oracle sets `dead[i]` to
+ *        non-zero value for every key that is no longer referenced.
+ *
+ * Returns a negative value on error, in which case no key of the batch is
+ * removed.
+ */
+typedef int (*rt_gc_oracle_fn)(const char *const *keys, int keys_count,
+                               int *dead, void *arg);
+
+/**
+ * rt_gc_exec_oracle is an rt_gc_oracle_fn running an external command.
+ *
+ * `arg` is a shell command line. Keys of the batch are written to its
+ * standard input, one per line. The command writes the dead ones to its
+ * standard output, one per line, and must exit with zero status.
+ */
+int rt_gc_exec_oracle(const char *const *keys, int keys_count, int *dead,
+                      void *arg);
+
+typedef struct rt_gc_opts {
+  // Liveness oracle and its argument.
+  rt_gc_oracle_fn oracle;
+  void *oracle_arg;
+  // Number of parallel pool scanners. Each scans its own slice of the pool.
+  int scan_threads;
+  // Number of concurrent oracle invocations.
+  int oracle_threads;
+  // Number of concurrent rt_remove calls.
+  int remove_threads;
+  // Maximum number of keys passed to the oracle at once.
+  int batch_size;
+  // Maximum number of RADOS operations per second. Zero means unlimited.
+  double max_ops_per_sec;
+} rt_gc_opts_t;
+
+typedef struct rt_gc_stats {
+  unsigned long rts_scanned;
+  unsigned long keys_scanned;
+  unsigned long keys_dead;
+  unsigned long keys_removed;
+  unsigned long rts_deleted;
+  unsigned long errors;
+  // Congestion window of the pool at the end of the run.
+  rt_window_stats_t window;
+} rt_gc_stats_t;
+
+/**
+ * rt_gc_opts_init fills `opts` with default values. Caller still needs to
+ * set the oracle.
+ */
+void rt_gc_opts_init(rt_gc_opts_t *opts);
+
+/**
+ * rt_gc_run runs orphan reference GC on all RT objects in a pool.
+ *
+ * `rados` is a handle to a Ceph cluster.
+ * `pool_name` is name of the pool where the RT RADOS objects are stored.
+ * `opts` are GC options.
+ * `stats` is filled with GC statistics.
+ */
+int rt_gc_run(rados_t rados, const char *pool_name, const rt_gc_opts_t *opts,
+              rt_gc_stats_t *stats);
+
+#endif // gc_h_INCLUDED
@@ -0,0 +1,64 @@
+#include "hist.h"
+
+int rt_hist_bucket(uint64_t v) {
+  if (v < RT_HIST_SUB) {
+    return v;
+  }
+
+  // Bucket of v is given by its most significant bit and the 4 bits below
+  // it.
+  int msb = 63 - __builtin_clzll(v);
+  int sub = (v >> (msb - 4)) & (RT_HIST_SUB - 1);
+  return (msb - 3) * RT_HIST_SUB + sub;
+}
+
+uint64_t rt_hist_bucket_value(int b) {
+  if (b < RT_HIST_SUB) {
+    return b;
+  }
+
+  int msb = b / RT_HIST_SUB + 3;
+  uint64_t sub = b % RT_HIST_SUB;
+  return (1ULL << msb) | (sub << (msb - 4));
+}
+
+void rt_hist_add(rt_hist_t *h, uint64_t v) {
+  h->counts[rt_hist_bucket(v)]++;
+  h->count++;
+  h->sum += v;
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+void rt_hist_merge(rt_hist_t *dst, const rt_hist_t *src) {
+  for (int i = 0; i < RT_HIST_BUCKETS; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+uint64_t rt_hist_percentile(const rt_hist_t *h, double p) {
+  if (h->count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(p * h->count);
+  if (rank >= h->count) {
+    rank = h->count - 1;
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < RT_HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      return rt_hist_bucket_value(i);
+    }
+  }
+
+  return h->max;
+}
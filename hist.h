@@ -0,0 +1,51 @@
+#ifndef hist_h_INCLUDED
+#define hist_h_INCLUDED
+
+#include <stdint.h>
+
+// Sub-buckets per power of two.
+#define RT_HIST_SUB 16
+// Exact buckets below RT_HIST_SUB, then powers of two 2^4 to 2^63.
+#define RT_HIST_BUCKETS (61 * RT_HIST_SUB)
+
+/**
+ * rt_hist is a log-linear histogram of latencies used by benchmarks. Values
+ * below RT_HIST_SUB are counted exactly, larger ones in RT_HIST_SUB buckets
+ * per power of two, i.e. with a relative error of at most 1/16.
+ * Zero-initialized histogram is empty.
+ */
+typedef struct rt_hist {
+  uint64_t counts[RT_HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+} rt_hist_t;
+
+/**
+ * rt_hist_add adds value `v` to histogram `h`.
+ */
+void rt_hist_add(rt_hist_t *h, uint64_t v);
+
+/**
+ * rt_hist_merge adds all values of histogram `src` to `dst`.
+ */
+void rt_hist_merge(rt_hist_t *dst, const rt_hist_t *src);
+
+/**
+ * rt_hist_percentile returns the value below which fraction `p` of values in
+ * histogram `h` fall, rounded down to its bucket. Returns 0 for an empty
+ * histogram.
+ */
+uint64_t rt_hist_percentile(const rt_hist_t *h, double p);
+
+/**
+ * rt_hist_bucket returns the bucket value `v` is counted in.
+ */
+int rt_hist_bucket(uint64_t v);
+
+/**
+ * rt_hist_bucket_value returns the smallest value counted in bucket `b`.
+ */
+uint64_t rt_hist_bucket_value(int b);
+
+#endif // hist_h_INCLUDED
@@ -0,0 +1,817 @@
+#include "history.h"
+#include "hll.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+
+Linearizability checker
+=======================
+
+rt-histcheck verifies that histories recorded by concurrent runs (see
+history.h) are linearizable with respect to the RT model: an RT is a set of
+keys, its refcount is the size of the set, and it only exists while the set
+isn't empty.
+
+  * ADD adds keys to the set, and reports CREATED iff the set was empty.
+  * REM removes keys from the set, and reports DELETED iff the set is empty
+    afterwards (including when it already was).
+  * LIST observes the refcount and the keys of the set.
+
+A history is linearizable if every operation can be assigned a point in
+time between its call and return at which it took effect, such that the
+results of all operations follow from the model applied in that order.
+This is what "no duplicate increments/decrements" comes down to for
+concurrent writers.
+
+Every update is a single compound RADOS write op, applied atomically or not
+at all, so failed operations haven't taken effect and are left out. Only
+updates that never returned, or failed because the connection was lost,
+may or may not have taken effect at any time after their call.
+
+RTs are independent objects and linearizability is a local property, so
+each RT's operations are checked separately, by a depth-first search for
+an order. Following the just-in-time linearization of Lowe, an operation is
+only linearized once its return is reached, possibly preceded by operations
+called before then that its result depends on. Operations that take long,
+such as retried updates, thus don't get placed early and force revisiting
+everything after them. Operations with the same effect and results are
+interchangeable, so only the earliest returning one of them is tried at
+each point. Configurations already explored are remembered by a hash of the
+set of linearized operations and of the model state.
+
+*/
+
+#define HC_DEFAULT_MAX_STEPS 100000000L
+
+typedef enum hc_type { HC_ADD, HC_REM, HC_LIST } hc_type_t;
+
+typedef struct hc_op {
+  uint64_t call_ns;
+  // RT_HISTORY_NO_RETURN if the op may have taken effect any time after its
+  // call.
+  uint64_t return_ns;
+  hc_type_t type;
+  int indeterminate;
+
+  // ADD and REM.
+  int flag;
+  uint32_t *keys;
+  int keys_count;
+
+  // LIST.
+  uint32_t refcount;
+  uint64_t keys_listed;
+  uint64_t hash;
+
+  // Location of the op in history files.
+  int file;
+  long line;
+} hc_op_t;
+
+typedef struct hc_rt {
+  char *name;
+
+  hc_op_t *ops;
+  int ops_count;
+  int ops_cap;
+
+  // Keys of the RT, identified by their index.
+  char **key_names;
+  uint64_t *key_hashes;
+  uint32_t keys_count;
+  uint32_t keys_cap;
+  // Open addressing table of key index + 1.
+  uint32_t *key_table;
+  uint32_t key_table_cap;
+} hc_rt_t;
+
+// Search bookkeeping of an op. Ops not linearized yet are linked in call
+// order, and in return order per class of equivalent ops. Nodes past the ops
+// are list heads.
+typedef struct hc_node {
+  int prev;
+  int next;
+  int class_prev;
+  int class_next;
+  int class_head;
+  int linearized;
+} hc_node_t;
+
+typedef struct hc_frame {
+  // Op whose return has been reached and its index in return order.
+  int forced;
+  int return_pos;
+  // Op linearized last in this frame, -1 before the first one.
+  int tried;
+  size_t undo_pos;
+} hc_frame_t;
+
+typedef struct hc_memo {
+  uint64_t *slots; // Pairs of linearized set hash and state hash.
+  size_t cap;
+  size_t count;
+} hc_memo_t;
+
+typedef struct hc_state {
+  uint8_t *present;
+  uint64_t count;
+  uint64_t hash;
+
+  // Keys flipped by applied ops, to undo them on backtracking.
+  uint32_t *undo;
+  size_t undo_len;
+  size_t undo_cap;
+} hc_state_t;
+
+// All RTs, open addressing table by name.
+static hc_rt_t **rts;
+static size_t rts_cap = 1024;
+static size_t rts_count;
+
+static long ops_total;
+static long ops_skipped;
+static long ops_indeterminate;
+
+void print_usage(const char *progname);
+
+/*
+ * Loading histories.
+ */
+
+// Unescapes %XX sequences of `s` in place.
+static void unescape(char *s) {
+  char *out = s;
+
+  for (char *in = s; *in; in++) {
+    if (in[0] == '%' && in[1] && in[2]) {
+      char hex[3] = {in[1], in[2], '\0'};
+      *out++ = (char)strtol(hex, NULL, 16);
+      in += 2;
+    } else {
+      *out++ = *in;
+    }
+  }
+
+  *out = '\0';
+}
+
+static hc_rt_t *rt_lookup(const char *name) {
+  if (rts_count * 2 >= rts_cap) {
+    size_t old_cap = rts_cap;
+    hc_rt_t **old = rts;
+
+    rts_cap *= 2;
+    rts = calloc(rts_cap, sizeof(hc_rt_t *));
+    for (size_t i = 0; i < old_cap; i++) {
+      if (!old[i]) {
+        continue;
+      }
+      size_t j = rt_hash64(old[i]->name, strlen(old[i]->name)) % rts_cap;
+      while (rts[j]) {
+        j = (j + 1) % rts_cap;
+      }
+      rts[j] = old[i];
+    }
+    free(old);
+  }
+
+  size_t i = rt_hash64(name, strlen(name)) % rts_cap;
+  while (rts[i]) {
+    if (strcmp(rts[i]->name, name) == 0) {
+      return rts[i];
+    }
+    i = (i + 1) % rts_cap;
+  }
+
+  rts[i] = calloc(1, sizeof(hc_rt_t));
+  rts[i]->name = strdup(name);
+  rts_count++;
+
+  return rts[i];
+}
+
+static void key_table_insert(hc_rt_t *rt, uint32_t id) {
+  uint32_t i = rt->key_hashes[id] % rt->key_table_cap;
+  while (rt->key_table[i]) {
+    i = (i + 1) % rt->key_table_cap;
+  }
+  rt->key_table[i] = id + 1;
+}
+
+// Returns index of `key` in `rt`, adding it if needed.
+static uint32_t key_intern(hc_rt_t *rt, const char *key) {
+  uint64_t hash = rt_hash64(key, strlen(key));
+
+  if (rt->key_table_cap) {
+    uint32_t i = hash % rt->key_table_cap;
+    while (rt->key_table[i]) {
+      uint32_t id = rt->key_table[i] - 1;
+      if (rt->key_hashes[id] == hash && strcmp(rt->key_names[id], key) == 0) {
+        return id;
+      }
+      i = (i + 1) % rt->key_table_cap;
+    }
+  }
+
+  if (rt->keys_count == rt->keys_cap) {
+    rt->keys_cap = rt->keys_cap ? rt->keys_cap * 2 : 16;
+    rt->key_names = realloc(rt->key_names, sizeof(char *) * rt->keys_cap);
+    rt->key_hashes = realloc(rt->key_hashes, sizeof(uint64_t) * rt->keys_cap);
+  }
+
+  uint32_t id = rt->keys_count++;
+  rt->key_names[id] = strdup(key);
+  rt->key_hashes[id] = hash;
+
+  if (rt->keys_count * 2 > rt->key_table_cap) {
+    free(rt->key_table);
+    rt->key_table_cap = rt->keys_cap * 2;
+    rt->key_table = calloc(rt->key_table_cap, sizeof(uint32_t));
+    for (uint32_t k = 0; k < rt->keys_count; k++) {
+      key_table_insert(rt, k);
+    }
+  } else {
+    key_table_insert(rt, id);
+  }
+
+  return id;
+}
+
+// Returns 1 if an update failing with `err` might have been applied anyway.
+static int is_indeterminate(int err) {
+  switch (err) {
+  case -ETIMEDOUT:
+  case -ENOTCONN:
+  case -ECONNRESET:
+  case -ESHUTDOWN:
+  case -EIO:
+    return 1;
+  }
+
+  return 0;
+}
+
+static int parse_line(char *line, int file, long line_no) {
+  char *save = NULL;
+  char *fields[8];
+
+  // Fixed fields: PROC CALL_NS RETURN_NS OP RT RESULT.
+  for (int i = 0; i < 6; i++) {
+    if (!(fields[i] = strtok_r(i == 0 ? line : NULL, " \n", &save))) {
+      return i == 0 ? 0 : -EINVAL;
+    }
+  }
+
+  hc_op_t op = {.file = file, .line = line_no};
+  int result = atoi(fields[5]);
+
+  op.call_ns = strtoull(fields[1], NULL, 10);
+  op.return_ns = strcmp(fields[2], "-") == 0 ? RT_HISTORY_NO_RETURN
+                                             : strtoull(fields[2], NULL, 10);
+
+  if (strcmp(fields[3], "ADD") == 0) {
+    op.type = HC_ADD;
+  } else if (strcmp(fields[3], "REM") == 0) {
+    op.type = HC_REM;
+  } else if (strcmp(fields[3], "LIST") == 0) {
+    op.type = HC_LIST;
+  } else {
+    return -EINVAL;
+  }
+
+  ops_total++;
+
+  if (op.type == HC_LIST) {
+    char *refcount = strtok_r(NULL, " \n", &save);
+    char *keys = strtok_r(NULL, " \n", &save);
+    char *hash = strtok_r(NULL, " \n", &save);
+    if (!hash) {
+      return -EINVAL;
+    }
+
+    if (result != 0 || op.return_ns == RT_HISTORY_NO_RETURN) {
+      // Nothing was observed.
+      ops_skipped++;
+      return 0;
+    }
+
+    op.refcount = strtoul(refcount, NULL, 10);
+    op.keys_listed = strtoull(keys, NULL, 10);
+    op.hash = strtoull(hash, NULL, 16);
+  } else {
+    char *flag = strtok_r(NULL, " \n", &save);
+    if (!flag) {
+      return -EINVAL;
+    }
+    op.flag = atoi(flag);
+
+    if (result != 0 && !is_indeterminate(result)) {
+      ops_skipped++;
+      return 0;
+    }
+
+    if (op.return_ns == RT_HISTORY_NO_RETURN || is_indeterminate(result)) {
+      op.indeterminate = 1;
+      op.return_ns = RT_HISTORY_NO_RETURN;
+      ops_indeterminate++;
+    }
+  }
+
+  unescape(fields[4]);
+  hc_rt_t *rt = rt_lookup(fields[4]);
+
+  if (op.type != HC_LIST) {
+    for (char *key = strtok_r(NULL, " \n", &save); key;
+         key = strtok_r(NULL, " \n", &save)) {
+      unescape(key);
+      op.keys = realloc(op.keys, sizeof(uint32_t) * (op.keys_count + 1));
+      op.keys[op.keys_count++] = key_intern(rt, key);
+    }
+  }
+
+  if (rt->ops_count == rt->ops_cap) {
+    rt->ops_cap = rt->ops_cap ? rt->ops_cap * 2 : 16;
+    rt->ops = realloc(rt->ops, sizeof(hc_op_t) * rt->ops_cap);
+  }
+  rt->ops[rt->ops_count++] = op;
+
+  return 0;
+}
+
+static int load_file(const char *path, int file) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -errno;
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+  long line_no = 0;
+  int ret = 0;
+
+  while (getline(&line, &cap, f) > 0) {
+    line_no++;
+    if ((ret = parse_line(line, file, line_no)) < 0) {
+      fprintf(stderr, "%s:%ld: malformed history line\n", path, line_no);
+      break;
+    }
+  }
+
+  free(line);
+  fclose(f);
+  return ret;
+}
+
+/*
+ * Checking.
+ */
+
+static uint64_t mix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Returns 1 if the configuration hasn't been seen before, and remembers it.
+static int memo_insert(hc_memo_t *m, uint64_t lin, uint64_t state) {
+  if ((m->count + 1) * 2 > m->cap) {
+    size_t old_cap = m->cap;
+    uint64_t *old = m->slots;
+
+    m->cap = old_cap ? old_cap * 2 : 1024;
+    m->slots = calloc(m->cap * 2, sizeof(uint64_t));
+    m->count = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[2 * i] || old[2 * i + 1]) {
+        memo_insert(m, old[2 * i], old[2 * i + 1]);
+      }
+    }
+    free(old);
+  }
+
+  size_t i = mix64(lin ^ mix64(state)) % m->cap;
+  while (m->slots[2 * i] || m->slots[2 * i + 1]) {
+    if (m->slots[2 * i] == lin && m->slots[2 * i + 1] == state) {
+      return 0;
+    }
+    i = (i + 1) % m->cap;
+  }
+
+  m->slots[2 * i] = lin;
+  m->slots[2 * i + 1] = state;
+  m->count++;
+  return 1;
+}
+
+static void flip(hc_rt_t *rt, hc_state_t *s, uint32_t key) {
+  s->present[key] ^= 1;
+  s->count += s->present[key] ? 1 : -1;
+  s->hash ^= rt->key_hashes[key];
+
+  if (s->undo_len == s->undo_cap) {
+    s->undo_cap = s->undo_cap ? s->undo_cap * 2 : 1024;
+    s->undo = realloc(s->undo, sizeof(uint32_t) * s->undo_cap);
+  }
+  s->undo[s->undo_len++] = key;
+}
+
+static void undo(hc_rt_t *rt, hc_state_t *s, size_t pos) {
+  while (s->undo_len > pos) {
+    uint32_t key = s->undo[--s->undo_len];
+    s->present[key] ^= 1;
+    s->count += s->present[key] ? 1 : -1;
+    s->hash ^= rt->key_hashes[key];
+  }
+}
+
+// Applies `op` to state `s`. Returns 0 and leaves the state unchanged if the
+// op's results aren't consistent with it.
+static int apply(hc_rt_t *rt, hc_state_t *s, const hc_op_t *op) {
+  size_t pos = s->undo_len;
+
+  switch (op->type) {
+  case HC_ADD:
+    if (!op->indeterminate && op->flag != (s->count == 0)) {
+      return 0;
+    }
+    for (int i = 0; i < op->keys_count; i++) {
+      if (!s->present[op->keys[i]]) {
+        flip(rt, s, op->keys[i]);
+      }
+    }
+    return 1;
+  case HC_REM:
+    for (int i = 0; i < op->keys_count; i++) {
+      if (s->present[op->keys[i]]) {
+        flip(rt, s, op->keys[i]);
+      }
+    }
+    if (!op->indeterminate && op->flag != (s->count == 0)) {
+      undo(rt, s, pos);
+      return 0;
+    }
+    return 1;
+  case HC_LIST:
+    return s->count == op->refcount && s->count == op->keys_listed &&
+           s->hash == op->hash;
+  }
+
+  return 0;
+}
+
+static int call_cmp(const void *a, const void *b) {
+  const hc_op_t *oa = a, *ob = b;
+
+  if (oa->call_ns != ob->call_ns) {
+    return oa->call_ns < ob->call_ns ? -1 : 1;
+  }
+  return (oa->return_ns > ob->return_ns) - (oa->return_ns < ob->return_ns);
+}
+
+static const hc_op_t *sort_ops;
+
+static int return_cmp(const void *a, const void *b) {
+  int ia = *(const int *)a, ib = *(const int *)b;
+  uint64_t ra = sort_ops[ia].return_ns, rb = sort_ops[ib].return_ns;
+
+  if (ra != rb) {
+    return ra < rb ? -1 : 1;
+  }
+  return ia - ib;
+}
+
+// Returns a signature shared by ops with the same effect and results.
+static uint64_t op_signature(const hc_rt_t *rt, const hc_op_t *op) {
+  uint64_t sig = mix64(op->type * 4 + op->flag * 2 + op->indeterminate);
+
+  if (op->type == HC_LIST) {
+    return sig ^ mix64(op->refcount ^ mix64(op->keys_listed ^ op->hash));
+  }
+  for (int i = 0; i < op->keys_count; i++) {
+    sig += mix64(rt->key_hashes[op->keys[i]]);
+  }
+  return sig;
+}
+
+static int sig_cmp(const void *a, const void *b) {
+  const uint64_t *sa = a, *sb = b;
+
+  if (sa[0] != sb[0]) {
+    return sa[0] < sb[0] ? -1 : 1;
+  }
+  return (sa[1] > sb[1]) - (sa[1] < sb[1]);
+}
+
+static void lift(hc_node_t *nodes, int i) {
+  hc_node_t *x = &nodes[i];
+
+  nodes[x->prev].next = x->next;
+  nodes[x->next].prev = x->prev;
+  nodes[x->class_prev].class_next = x->class_next;
+  nodes[x->class_next].class_prev = x->class_prev;
+  x->linearized = 1;
+}
+
+static void unlift(hc_node_t *nodes, int i) {
+  hc_node_t *x = &nodes[i];
+
+  nodes[x->class_prev].class_next = i;
+  nodes[x->class_next].class_prev = i;
+  nodes[x->prev].next = i;
+  nodes[x->next].prev = i;
+  x->linearized = 0;
+}
+
+// Returns the next op to linearize in frame `f`: the forced op first, then
+// other ops called before its return. Of equivalent ops, only the one
+// returning first is tried, as swapping it with a later one gives another
+// valid order. Returns -1 once all have been tried.
+static int next_candidate(const hc_rt_t *rt, hc_node_t *nodes, hc_frame_t *f) {
+  uint64_t deadline = rt->ops[f->forced].return_ns;
+  int head = rt->ops_count;
+
+  if (f->tried < 0) {
+    return f->tried = f->forced;
+  }
+
+  int c = f->tried == f->forced ? nodes[head].next : nodes[f->tried].next;
+  for (; c != head && rt->ops[c].call_ns <= deadline; c = nodes[c].next) {
+    if (c == f->forced) {
+      continue;
+    }
+
+    int first = nodes[nodes[c].class_head].class_next;
+    while (rt->ops[first].call_ns > deadline) {
+      first = nodes[first].class_next;
+    }
+    if (first == c) {
+      return f->tried = c;
+    }
+  }
+
+  return -1;
+}
+
+static void print_op(const hc_op_t *op, char *const *paths) {
+  FILE *f = fopen(paths[op->file], "r");
+  char *line = NULL;
+  size_t cap = 0;
+
+  for (long i = 0; f && i < op->line; i++) {
+    if (getline(&line, &cap, f) <= 0) {
+      break;
+    }
+  }
+
+  fprintf(stderr, "  %s:%ld: %s", paths[op->file], op->line,
+          line ? line : "\n");
+  free(line);
+  if (f) {
+    fclose(f);
+  }
+}
+
+// Returns 0 if the history of `rt` is linearizable, 1 if it isn't, and 2 if
+// the search gave up after `max_steps`.
+static int check_rt(hc_rt_t *rt, long max_steps, char *const *paths) {
+  int n = rt->ops_count;
+  int ret = 0;
+
+  qsort(rt->ops, n, sizeof(hc_op_t), call_cmp);
+
+  int *by_return = malloc(sizeof(int) * n);
+  uint64_t *sigs = malloc(sizeof(uint64_t) * 2 * n);
+  for (int i = 0; i < n; i++) {
+    by_return[i] = i;
+    sigs[2 * i] = op_signature(rt, &rt->ops[i]);
+    sigs[2 * i + 1] = i;
+  }
+  sort_ops = rt->ops;
+  qsort(by_return, n, sizeof(int), return_cmp);
+  qsort(sigs, n, 2 * sizeof(uint64_t), sig_cmp);
+
+  // Nodes of ops, then the head of the call order list, then class heads.
+  hc_node_t *nodes = calloc(2 * n + 1, sizeof(hc_node_t));
+  int classes = 0;
+  for (int i = 0; i < n; i++) {
+    if (i > 0 && sigs[2 * i] != sigs[2 * i - 2]) {
+      classes++;
+    }
+    nodes[sigs[2 * i + 1]].class_head = n + 1 + classes;
+  }
+  for (int i = n; i < 2 * n + 1; i++) {
+    nodes[i].prev = nodes[i].next = i;
+    nodes[i].class_prev = nodes[i].class_next = i;
+  }
+  for (int i = 0; i < n; i++) {
+    hc_node_t *x = &nodes[i];
+    x->next = n;
+    x->prev = nodes[n].prev;
+    nodes[x->prev].next = i;
+    nodes[n].prev = i;
+
+    x = &nodes[by_return[i]];
+    x->class_next = x->class_head;
+    x->class_prev = nodes[x->class_head].class_prev;
+    nodes[x->class_prev].class_next = by_return[i];
+    nodes[x->class_head].class_prev = by_return[i];
+  }
+  free(sigs);
+
+  uint64_t *zobrist = malloc(sizeof(uint64_t) * n);
+  for (int i = 0; i < n; i++) {
+    zobrist[i] = mix64(rt_hash64(rt->name, strlen(rt->name)) + i);
+  }
+
+  hc_frame_t *stack = malloc(sizeof(hc_frame_t) * (n + 1));
+  hc_memo_t memo = {0};
+  hc_state_t state = {.present = calloc(rt->keys_count + 1, 1)};
+  int depth = 0;
+  int linearized = 0;
+  int best = -1;
+  const hc_op_t *best_blocked = NULL;
+  uint64_t lin = 0;
+  long steps = 0;
+  int pos = 0;
+  int push = 1;
+
+  for (;;) {
+    if (push) {
+      // The next return of an op that isn't linearized yet forces it.
+      while (pos < n && nodes[by_return[pos]].linearized) {
+        pos++;
+      }
+      if (pos == n || rt->ops[by_return[pos]].indeterminate) {
+        break;
+      }
+
+      if (linearized > best) {
+        best = linearized;
+        best_blocked = &rt->ops[by_return[pos]];
+      }
+      stack[depth++] = (hc_frame_t){
+          .forced = by_return[pos], .return_pos = pos, .tried = -1};
+    }
+
+    if (++steps > max_steps) {
+      ret = 2;
+      break;
+    }
+
+    hc_frame_t *f = &stack[depth - 1];
+    int c = next_candidate(rt, nodes, f);
+
+    if (c >= 0) {
+      size_t undo_pos = state.undo_len;
+      uint64_t next_lin = lin ^ zobrist[c];
+
+      push = 0;
+      if (apply(rt, &state, &rt->ops[c])) {
+        if (memo_insert(&memo, next_lin, state.hash ^ mix64(state.count))) {
+          f->undo_pos = undo_pos;
+          lin = next_lin;
+          lift(nodes, c);
+          linearized++;
+          // Either the forced op is done, or it's still to be linearized.
+          pos = f->return_pos;
+          push = 1;
+          continue;
+        }
+        undo(rt, &state, undo_pos);
+      }
+      continue;
+    }
+
+    // Nothing left to try here, revisit the op linearized before.
+    if (--depth == 0) {
+      ret = 1;
+      break;
+    }
+
+    f = &stack[depth - 1];
+    undo(rt, &state, f->undo_pos);
+    lin ^= zobrist[f->tried];
+    unlift(nodes, f->tried);
+    linearized--;
+    push = 0;
+  }
+
+  if (ret == 1) {
+    fprintf(stderr,
+            "RT %s is not linearizable: after %d of %d operations, no order "
+            "is consistent with the result of\n",
+            rt->name, best, n);
+    print_op(best_blocked, paths);
+  } else if (ret == 2) {
+    fprintf(stderr,
+            "RT %s: gave up after %ld steps, at most %d of %d operations "
+            "linearized.\n",
+            rt->name, max_steps, best, n);
+    if (best_blocked) {
+      fprintf(stderr, "The search was stuck before the return of\n");
+      print_op(best_blocked, paths);
+    }
+  }
+
+  free(by_return);
+  free(nodes);
+  free(zobrist);
+  free(stack);
+  free(memo.slots);
+  free(state.present);
+  free(state.undo);
+
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  long max_steps = HC_DEFAULT_MAX_STEPS;
+  int verbose = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:vh")) != -1) {
+    switch (opt) {
+    case 's': {
+      char *end;
+      max_steps = strtol(optarg, &end, 10);
+      if (*end != '\0' || max_steps <= 0) {
+        fprintf(stderr, "-s must be a positive integer\n");
+        return 1;
+      }
+      break;
+    }
+    case 'v':
+      verbose = 1;
+      break;
+    case 'h':
+    default:
+      print_usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind >= argc) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  rts = calloc(rts_cap, sizeof(hc_rt_t *));
+
+  for (int i = optind; i < argc; i++) {
+    if (load_file(argv[i], i) < 0) {
+      return 1;
+    }
+  }
+
+  int violations = 0;
+  int inconclusive = 0;
+
+  for (size_t i = 0; i < rts_cap; i++) {
+    if (!rts[i]) {
+      continue;
+    }
+
+    int ret = check_rt(rts[i], max_steps, argv);
+    violations += ret == 1;
+    inconclusive += ret == 2;
+
+    if (verbose) {
+      printf("%s: %d operations, %s\n", rts[i]->name, rts[i]->ops_count,
+             ret == 0 ? "linearizable"
+                      : (ret == 1 ? "NOT linearizable" : "inconclusive"));
+    }
+  }
+
+  printf("Checked %lu RTs, %ld operations (%ld without effect, %ld "
+         "indeterminate): ",
+         (unsigned long)rts_count, ops_total, ops_skipped,
+         ops_indeterminate);
+  if (violations) {
+    printf("%d RTs are NOT linearizable.\n", violations);
+  } else if (inconclusive) {
+    printf("%d RTs inconclusive, the rest linearizable.\n", inconclusive);
+  } else {
+    printf("linearizable.\n");
+  }
+
+  return violations ? 1 : (inconclusive ? 2 : 0);
+}
+
+void print_usage(const char *progname) {
+  printf("Usage: %s [-s MAX STEPS] [-v] [-h] HISTORY FILE...\n", progname);
+  printf("Checks that recorded RT histories are linearizable. Histories of "
+         "several processes of the same run may be checked together.\n");
+  printf("  -s MAX STEPS\t\tGive up on an RT after MAX STEPS search steps. "
+         "Defaults to %ld.\n",
+         HC_DEFAULT_MAX_STEPS);
+  printf("  -v\t\t\tPrint result of every RT.\n");
+  printf("  -h\t\t\tThis help message.\n");
+  printf("Exit status is 0 if all histories are linearizable, 1 if some "
+         "aren't and 2 if the check was inconclusive.\n");
+}
@@ -0,0 +1,99 @@
+#include "history.h"
+#include "hll.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+// Writes `len` bytes of `s` escaped.
+static void put_escaped(FILE *f, const char *s, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c <= ' ' || c > '~' || c == '%') {
+      fprintf(f, "%%%02X", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+}
+
+int rt_history_open(rt_history_t *h, const char *path) {
+  if (!(h->f = fopen(path, "w"))) {
+    return -errno;
+  }
+
+  pthread_mutex_init(&h->lock, NULL);
+  return 0;
+}
+
+int rt_history_close(rt_history_t *h) {
+  int ret = 0;
+
+  if (ferror(h->f) || fclose(h->f) != 0) {
+    ret = -EIO;
+  }
+
+  pthread_mutex_destroy(&h->lock);
+  return ret;
+}
+
+uint64_t rt_history_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t rt_history_set_hash(const char *const *keys, const size_t *key_lens,
+                             int keys_count) {
+  uint64_t hash = 0;
+
+  for (int i = 0; i < keys_count; i++) {
+    hash ^= rt_hash64(keys[i], key_lens ? key_lens[i] : strlen(keys[i]));
+  }
+
+  return hash;
+}
+
+// Writes fields common to all operations.
+static void put_call(rt_history_t *h, int proc, uint64_t call_ns,
+                     uint64_t return_ns, const char *op,
+                     const char *rt_name, int ret) {
+  fprintf(h->f, "%d %lu ", proc, (unsigned long)call_ns);
+  if (return_ns == RT_HISTORY_NO_RETURN) {
+    fputc('-', h->f);
+  } else {
+    fprintf(h->f, "%lu", (unsigned long)return_ns);
+  }
+
+  fprintf(h->f, " %s ", op);
+  put_escaped(h->f, rt_name, strlen(rt_name));
+  fprintf(h->f, " %d", ret);
+}
+
+void rt_history_update(rt_history_t *h, int proc, uint64_t call_ns,
+                       uint64_t return_ns, int remove, const char *rt_name,
+                       const char *const *keys, int keys_count, int ret,
+                       int flag) {
+  pthread_mutex_lock(&h->lock);
+
+  put_call(h, proc, call_ns, return_ns, remove ? "REM" : "ADD", rt_name, ret);
+  fprintf(h->f, " %d", flag != 0);
+  for (int i = 0; i < keys_count; i++) {
+    fputc(' ', h->f);
+    put_escaped(h->f, keys[i], strlen(keys[i]));
+  }
+  fputc('\n', h->f);
+
+  pthread_mutex_unlock(&h->lock);
+}
+
+void rt_history_list(rt_history_t *h, int proc, uint64_t call_ns,
+                     uint64_t return_ns, const char *rt_name, int ret,
+                     uint32_t refcount, uint64_t keys_count, uint64_t hash) {
+  pthread_mutex_lock(&h->lock);
+
+  put_call(h, proc, call_ns, return_ns, "LIST", rt_name, ret);
+  fprintf(h->f, " %u %lu %016lx\n", refcount, (unsigned long)keys_count,
+          (unsigned long)hash);
+
+  pthread_mutex_unlock(&h->lock);
+}
@@ -0,0 +1,90 @@
+#ifndef history_h_INCLUDED
+#define history_h_INCLUDED
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+
+History format
+==============
+
+A history is a text file recording RT operations of a concurrent run, one
+completed operation per line, for rt-histcheck to verify offline:
+
+    PROC CALL_NS RETURN_NS ADD RT RESULT CREATED KEY...
+    PROC CALL_NS RETURN_NS REM RT RESULT DELETED KEY...
+    PROC CALL_NS RETURN_NS LIST RT RESULT REFCOUNT KEYS HASH
+
+PROC identifies the thread or connection issuing the operation. CALL_NS and
+RETURN_NS are CLOCK_MONOTONIC timestamps in nanoseconds taken before the
+operation was issued and after its result was known, so histories of
+processes on the same host can be checked together. RETURN_NS is `-` if the
+result never arrived. RESULT is 0 or a negative errno value. CREATED and
+DELETED are the rt_created and rt_deleted flags. REFCOUNT, KEYS and HASH
+are the RT refcount, the number of listed keys and their set hash, see
+rt_history_set_hash.
+
+RT names and keys have bytes outside of `!`..`~` and `%` escaped as %XX.
+
+*/
+
+/**
+ * rt_history records completed RT operations into a history file. It's safe
+ * to use from multiple threads.
+ */
+typedef struct rt_history {
+  FILE *f;
+  pthread_mutex_t lock;
+} rt_history_t;
+
+// RETURN_NS of an operation whose result never arrived.
+#define RT_HISTORY_NO_RETURN UINT64_MAX
+
+/**
+ * rt_history_open creates history file at `path`. Returns negative errno on
+ * failure.
+ */
+int rt_history_open(rt_history_t *h, const char *path);
+
+/**
+ * rt_history_close flushes and closes history `h`. Returns negative errno if
+ * the history couldn't be written completely.
+ */
+int rt_history_close(rt_history_t *h);
+
+/**
+ * rt_history_now returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t rt_history_now(void);
+
+/**
+ * rt_history_set_hash returns an order-independent hash of a set of keys.
+ * Hashes of disjoint sets may be combined with XOR. `key_lens` may be NULL
+ * for NUL-terminated keys.
+ */
+uint64_t rt_history_set_hash(const char *const *keys, const size_t *key_lens,
+                             int keys_count);
+
+/**
+ * rt_history_update records rt_add, or rt_remove if `remove` is non-zero,
+ * of `keys` called at `call_ns`, which returned `ret` and `flag` at
+ * `return_ns`.
+ */
+void rt_history_update(rt_history_t *h, int proc, uint64_t call_ns,
+                       uint64_t return_ns, int remove, const char *rt_name,
+                       const char *const *keys, int keys_count, int ret,
+                       int flag);
+
+/**
+ * rt_history_list records listing of RT keys called at `call_ns`, which
+ * returned `ret` at `return_ns`. `keys_count` and `hash` describe the listed
+ * keys.
+ */
+void rt_history_list(rt_history_t *h, int proc, uint64_t call_ns,
+                     uint64_t return_ns, const char *rt_name, int ret,
+                     uint32_t refcount, uint64_t keys_count, uint64_t hash);
+
+#endif // history_h_INCLUDED
@@ -0,0 +1,68 @@
+#include "hll.h"
+#include <math.h>
+#include <string.h>
+
+uint64_t rt_hash64(const char *data, size_t len) {
+  // FNV-1a, followed by splitmix64 finalizer to spread the bits, so that
+  // both the register index and the rank are well distributed.
+
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+
+  return h;
+}
+
+void rt_hll_init(rt_hll_t *hll) { memset(hll, 0, sizeof(*hll)); }
+
+void rt_hll_add(rt_hll_t *hll, const char *key, size_t len) {
+  uint64_t h = rt_hash64(key, len);
+
+  uint32_t idx = h >> (64 - RT_HLL_BITS);
+  uint64_t rest = h << RT_HLL_BITS;
+  // Position of the leftmost 1-bit in the remaining bits.
+  uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - RT_HLL_BITS + 1;
+
+  if (rank > hll->registers[idx]) {
+    hll->registers[idx] = rank;
+  }
+}
+
+void rt_hll_merge(rt_hll_t *dst, const rt_hll_t *src) {
+  for (int i = 0; i < RT_HLL_REGISTERS; i++) {
+    if (src->registers[i] > dst->registers[i]) {
+      dst->registers[i] = src->registers[i];
+    }
+  }
+}
+
+double rt_hll_estimate(const rt_hll_t *hll) {
+  const double m = RT_HLL_REGISTERS;
+  const double alpha = 0.7213 / (1 + 1.079 / m);
+
+  double sum = 0;
+  int zeros = 0;
+  for (int i = 0; i < RT_HLL_REGISTERS; i++) {
+    sum += ldexp(1.0, -hll->registers[i]);
+    if (hll->registers[i] == 0) {
+      zeros++;
+    }
+  }
+
+  double estimate = alpha * m * m / sum;
+
+  // Small range correction, use linear counting.
+  if (estimate <= 2.5 * m && zeros > 0) {
+    estimate = m * log(m / zeros);
+  }
+
+  return estimate;
+}
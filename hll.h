@@ -0,0 +1,48 @@
+#ifndef hll_h_INCLUDED
+#define hll_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * rt_hll is a HyperLogLog sketch estimating the number of distinct keys
+ * added to it, using a fixed amount of memory. With 2^12 registers, the
+ * relative standard error of the estimate is about 1.6%.
+ */
+
+// Number of index bits of HyperLogLog sketch.
+#define RT_HLL_BITS 12
+// Number of HyperLogLog registers.
+#define RT_HLL_REGISTERS (1 << RT_HLL_BITS)
+
+typedef struct rt_hll {
+  uint8_t registers[RT_HLL_REGISTERS];
+} rt_hll_t;
+
+/**
+ * rt_hash64 is a 64-bit hash of `len` bytes at `data`.
+ */
+uint64_t rt_hash64(const char *data, size_t len);
+
+/**
+ * rt_hll_init initializes an empty sketch.
+ */
+void rt_hll_init(rt_hll_t *hll);
+
+/**
+ * rt_hll_add adds key `key` of `len` bytes to the sketch.
+ */
+void rt_hll_add(rt_hll_t *hll, const char *key, size_t len);
+
+/**
+ * rt_hll_merge merges sketch `src` into `dst`. The result is the same as if
+ * all keys of `src` were added to `dst`.
+ */
+void rt_hll_merge(rt_hll_t *dst, const rt_hll_t *src);
+
+/**
+ * rt_hll_estimate returns estimated number of distinct keys in the sketch.
+ */
+double rt_hll_estimate(const rt_hll_t *hll);
+
+#endif // hll_h_INCLUDED
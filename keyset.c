@@ -0,0 +1,428 @@
+#include "keyset.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+
+Keyset layout
+=============
+
+Keys are stored in a single byte buffer, grouped into blocks of
+RT_KEYSET_BLOCK_SIZE keys. Lengths are LEB128 varints.
+
+    first key:    varint key_len, key
+    other keys:   varint shared_len, varint suffix_len, suffix
+
+`shared_len` is the length of prefix shared with the previous key in the
+block. `blocks` holds offsets of the blocks in the buffer.
+
+*/
+
+struct rt_keyset {
+  char *data;
+  size_t data_len;
+
+  uint64_t *blocks;
+  size_t blocks_count;
+
+  size_t count;
+};
+
+struct rt_keyset_builder {
+  char *data;
+  size_t data_len;
+  size_t data_cap;
+
+  uint64_t *blocks;
+  size_t blocks_count;
+  size_t blocks_cap;
+
+  size_t count;
+
+  // Last added key.
+  char *last;
+  size_t last_len;
+  size_t last_cap;
+
+  int err;
+};
+
+// Merge modes of keyset_merge.
+#define KEYSET_UNION 1
+#define KEYSET_INTERSECT 2
+#define KEYSET_DIFFERENCE 3
+
+static void *grow(void *p, size_t *cap, size_t need, size_t elem_size) {
+  if (need <= *cap) {
+    return p;
+  }
+
+  size_t cap_ = *cap ? *cap : 64;
+  while (cap_ < need) {
+    cap_ *= 2;
+  }
+
+  *cap = cap_;
+  return realloc(p, cap_ * elem_size);
+}
+
+static size_t put_varint(char *p, size_t v) {
+  size_t n = 0;
+  do {
+    uint8_t byte = v & 0x7f;
+    v >>= 7;
+    p[n++] = byte | (v ? 0x80 : 0);
+  } while (v);
+
+  return n;
+}
+
+static size_t get_varint(const char *p, size_t *v) {
+  size_t n = 0;
+  int shift = 0;
+  *v = 0;
+
+  for (;;) {
+    uint8_t byte = p[n++];
+    *v |= (size_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+    shift += 7;
+  }
+
+  return n;
+}
+
+static int key_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+  size_t n = a_len < b_len ? a_len : b_len;
+  int c = memcmp(a, b, n);
+  return c ? c : (a_len > b_len) - (a_len < b_len);
+}
+
+/*
+ * Builder.
+ */
+
+rt_keyset_builder_t *rt_keyset_builder_new(void) {
+  return calloc(1, sizeof(rt_keyset_builder_t));
+}
+
+int rt_keyset_builder_add(rt_keyset_builder_t *b, const char *key,
+                          size_t len) {
+  if (b->err) {
+    return b->err;
+  }
+
+  if (b->count > 0 && key_cmp(b->last, b->last_len, key, len) >= 0) {
+    b->err = -EINVAL;
+    return b->err;
+  }
+
+  // Worst case, two varints of 10 bytes each, and the whole key.
+  b->data = grow(b->data, &b->data_cap, b->data_len + 20 + len, 1);
+
+  char *p = b->data + b->data_len;
+
+  if (b->count % RT_KEYSET_BLOCK_SIZE == 0) {
+    // Start a new block.
+    b->blocks = grow(b->blocks, &b->blocks_cap, b->blocks_count + 1,
+                     sizeof(uint64_t));
+    b->blocks[b->blocks_count++] = b->data_len;
+
+    p += put_varint(p, len);
+    memcpy(p, key, len);
+    p += len;
+  } else {
+    size_t shared = 0;
+    size_t max = len < b->last_len ? len : b->last_len;
+    while (shared < max && key[shared] == b->last[shared]) {
+      shared++;
+    }
+
+    p += put_varint(p, shared);
+    p += put_varint(p, len - shared);
+    memcpy(p, key + shared, len - shared);
+    p += len - shared;
+  }
+
+  b->data_len = p - b->data;
+  b->count++;
+
+  b->last = grow(b->last, &b->last_cap, len, 1);
+  memcpy(b->last, key, len);
+  b->last_len = len;
+
+  return 0;
+}
+
+int rt_keyset_builder_add_page(const char *const *keys, const size_t *key_lens,
+                               int keys_count, void *arg) {
+  rt_keyset_builder_t *b = arg;
+  int ret = 0;
+
+  for (int i = 0; i < keys_count && ret == 0; i++) {
+    ret = rt_keyset_builder_add(b, keys[i], key_lens[i]);
+  }
+
+  return ret;
+}
+
+rt_keyset_t *rt_keyset_builder_finish(rt_keyset_builder_t *b) {
+  rt_keyset_t *ks = NULL;
+
+  if (!b->err) {
+    ks = malloc(sizeof(rt_keyset_t));
+
+    // Give back the slack of the growing buffers.
+    ks->data = b->data_len ? realloc(b->data, b->data_len) : b->data;
+    ks->data_len = b->data_len;
+    ks->blocks = b->blocks_count
+                     ? realloc(b->blocks, sizeof(uint64_t) * b->blocks_count)
+                     : b->blocks;
+    ks->blocks_count = b->blocks_count;
+    ks->count = b->count;
+
+    b->data = NULL;
+    b->blocks = NULL;
+  }
+
+  rt_keyset_builder_abort(b);
+
+  return ks;
+}
+
+void rt_keyset_builder_abort(rt_keyset_builder_t *b) {
+  free(b->data);
+  free(b->blocks);
+  free(b->last);
+  free(b);
+}
+
+/*
+ * Keyset.
+ */
+
+void rt_keyset_free(rt_keyset_t *ks) {
+  if (!ks) {
+    return;
+  }
+
+  free(ks->data);
+  free(ks->blocks);
+  free(ks);
+}
+
+size_t rt_keyset_size(const rt_keyset_t *ks) { return ks->count; }
+
+size_t rt_keyset_memory(const rt_keyset_t *ks) {
+  return sizeof(rt_keyset_t) + ks->data_len +
+         sizeof(uint64_t) * ks->blocks_count;
+}
+
+// Returns the first key of block `block`.
+static const char *block_first_key(const rt_keyset_t *ks, size_t block,
+                                   size_t *len) {
+  const char *p = ks->data + ks->blocks[block];
+  return p + get_varint(p, len);
+}
+
+// Returns index of the last block whose first key is not greater than `key`,
+// or -1 if there's none.
+static long find_block(const rt_keyset_t *ks, const char *key, size_t len) {
+  long lo = 0, hi = (long)ks->blocks_count - 1, found = -1;
+
+  while (lo <= hi) {
+    long mid = lo + (hi - lo) / 2;
+
+    size_t first_len;
+    const char *first = block_first_key(ks, mid, &first_len);
+
+    if (key_cmp(first, first_len, key, len) <= 0) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  return found;
+}
+
+int rt_keyset_contains(const rt_keyset_t *ks, const char *key, size_t len) {
+  long block = find_block(ks, key, len);
+  if (block < 0) {
+    return 0;
+  }
+
+  rt_keyset_iter_t it;
+  rt_keyset_iter_init(&it, ks);
+  it.off = ks->blocks[block];
+  it.idx = block * RT_KEYSET_BLOCK_SIZE;
+
+  int found = 0;
+  const char *cur;
+  size_t cur_len;
+
+  // Keys of a block are sorted, stop at the first one not less than `key`.
+  for (size_t i = 0;
+       i < RT_KEYSET_BLOCK_SIZE && rt_keyset_iter_next(&it, &cur, &cur_len);
+       i++) {
+    int c = key_cmp(cur, cur_len, key, len);
+    if (c >= 0) {
+      found = c == 0;
+      break;
+    }
+  }
+
+  rt_keyset_iter_end(&it);
+
+  return found;
+}
+
+/*
+ * Iteration.
+ */
+
+void rt_keyset_iter_init(rt_keyset_iter_t *it, const rt_keyset_t *ks) {
+  it->ks = ks;
+  it->off = 0;
+  it->idx = 0;
+  it->key = NULL;
+  it->key_len = 0;
+  it->key_cap = 0;
+}
+
+void rt_keyset_iter_seek(rt_keyset_iter_t *it, const char *key, size_t len) {
+  const rt_keyset_t *ks = it->ks;
+
+  long block = find_block(ks, key, len);
+  if (block < 0) {
+    block = 0;
+  }
+
+  it->off = ks->blocks_count ? ks->blocks[block] : 0;
+  it->idx = block * RT_KEYSET_BLOCK_SIZE;
+
+  // Skip keys less than `key` within the block. The iterator is left before
+  // the first key not less than `key`, so that rt_keyset_iter_next returns
+  // it.
+
+  while (it->idx < ks->count) {
+    size_t off = it->off, idx = it->idx;
+    const char *cur;
+    size_t cur_len;
+
+    rt_keyset_iter_next(it, &cur, &cur_len);
+
+    if (key_cmp(cur, cur_len, key, len) >= 0) {
+      // Step back. The decoded key shares with itself the same prefix it
+      // shares with its predecessor, so it decodes the same way again.
+      it->off = off;
+      it->idx = idx;
+      break;
+    }
+  }
+}
+
+int rt_keyset_iter_next(rt_keyset_iter_t *it, const char **key, size_t *len) {
+  const rt_keyset_t *ks = it->ks;
+
+  if (it->idx >= ks->count) {
+    return 0;
+  }
+
+  const char *p = ks->data + it->off;
+  size_t shared = 0, suffix_len;
+
+  if (it->idx % RT_KEYSET_BLOCK_SIZE == 0) {
+    p += get_varint(p, &suffix_len);
+  } else {
+    p += get_varint(p, &shared);
+    p += get_varint(p, &suffix_len);
+  }
+
+  it->key = grow(it->key, &it->key_cap, shared + suffix_len, 1);
+  memcpy(it->key + shared, p, suffix_len);
+  it->key_len = shared + suffix_len;
+
+  it->off = p + suffix_len - ks->data;
+  it->idx++;
+
+  *key = it->key;
+  *len = it->key_len;
+
+  return 1;
+}
+
+void rt_keyset_iter_end(rt_keyset_iter_t *it) {
+  free(it->key);
+  it->key = NULL;
+}
+
+/*
+ * Set operations.
+ */
+
+static rt_keyset_t *keyset_merge(const rt_keyset_t *a, const rt_keyset_t *b,
+                                 int mode) {
+  rt_keyset_builder_t *out = rt_keyset_builder_new();
+  rt_keyset_iter_t ia, ib;
+  const char *ka = NULL, *kb = NULL;
+  size_t la = 0, lb = 0;
+
+  rt_keyset_iter_init(&ia, a);
+  rt_keyset_iter_init(&ib, b);
+
+  int has_a = rt_keyset_iter_next(&ia, &ka, &la);
+  int has_b = rt_keyset_iter_next(&ib, &kb, &lb);
+
+  while (has_a || has_b) {
+    int c = !has_a ? 1 : !has_b ? -1 : key_cmp(ka, la, kb, lb);
+
+    if (c < 0) {
+      // Only in `a`.
+      if (mode != KEYSET_INTERSECT) {
+        rt_keyset_builder_add(out, ka, la);
+      }
+      has_a = rt_keyset_iter_next(&ia, &ka, &la);
+    } else if (c > 0) {
+      // Only in `b`.
+      if (mode == KEYSET_UNION) {
+        rt_keyset_builder_add(out, kb, lb);
+      } else if (mode == KEYSET_DIFFERENCE && !has_a) {
+        break;
+      }
+      has_b = rt_keyset_iter_next(&ib, &kb, &lb);
+    } else {
+      // In both.
+      if (mode != KEYSET_DIFFERENCE) {
+        rt_keyset_builder_add(out, ka, la);
+      }
+      has_a = rt_keyset_iter_next(&ia, &ka, &la);
+      has_b = rt_keyset_iter_next(&ib, &kb, &lb);
+    }
+
+    if (mode == KEYSET_INTERSECT && (!has_a || !has_b)) {
+      break;
+    }
+  }
+
+  rt_keyset_iter_end(&ia);
+  rt_keyset_iter_end(&ib);
+
+  return rt_keyset_builder_finish(out);
+}
+
+rt_keyset_t *rt_keyset_union(const rt_keyset_t *a, const rt_keyset_t *b) {
+  return keyset_merge(a, b, KEYSET_UNION);
+}
+
+rt_keyset_t *rt_keyset_intersect(const rt_keyset_t *a, const rt_keyset_t *b) {
+  return keyset_merge(a, b, KEYSET_INTERSECT);
+}
+
+rt_keyset_t *rt_keyset_difference(const rt_keyset_t *a, const rt_keyset_t *b) {
+  return keyset_merge(a, b, KEYSET_DIFFERENCE);
+}
@@ -0,0 +1,136 @@
+#ifndef keyset_h_INCLUDED
+#define keyset_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * rt_keyset is a compact, immutable, sorted set of reference keys.
+ *
+ * Keys are front-coded in blocks of RT_KEYSET_BLOCK_SIZE: the first key of
+ * a block is stored in full, every following key only as the length of the
+ * prefix it shares with its predecessor and the remaining suffix. All blocks
+ * live in a single buffer, so there's no per-key allocation or pointer.
+ * Membership tests binary search the first keys of blocks and then decode at
+ * most one block.
+ *
+ * Keysets are built in one pass from keys in ascending order, such as pages
+ * of an RT OMap listing.
+ */
+
+// Number of keys per front-coded block.
+#define RT_KEYSET_BLOCK_SIZE 16
+
+typedef struct rt_keyset rt_keyset_t;
+typedef struct rt_keyset_builder rt_keyset_builder_t;
+
+/**
+ * rt_keyset_builder_new creates a builder of a new keyset.
+ */
+rt_keyset_builder_t *rt_keyset_builder_new(void);
+
+/**
+ * rt_keyset_builder_add appends key `key` of `len` bytes to the keyset being
+ * built. Keys must be added in strictly ascending order, otherwise -EINVAL
+ * is returned and the builder fails.
+ */
+int rt_keyset_builder_add(rt_keyset_builder_t *b, const char *key,
+                          size_t len);
+
+/**
+ * rt_keyset_builder_add_page appends a page of keys to the keyset being
+ * built. It's an rt_keys_cb, so passing it to rt_list_keys along with the
+ * builder as `arg` builds a keyset of all keys of an RT.
+ */
+int rt_keyset_builder_add_page(const char *const *keys, const size_t *key_lens,
+                               int keys_count, void *arg);
+
+/**
+ * rt_keyset_builder_finish finishes the keyset and frees the builder.
+ * Returns NULL if any key was rejected by the builder.
+ */
+rt_keyset_t *rt_keyset_builder_finish(rt_keyset_builder_t *b);
+
+/**
+ * rt_keyset_builder_abort frees the builder without building a keyset.
+ */
+void rt_keyset_builder_abort(rt_keyset_builder_t *b);
+
+/**
+ * rt_keyset_free frees keyset `ks`.
+ */
+void rt_keyset_free(rt_keyset_t *ks);
+
+/**
+ * rt_keyset_size returns the number of keys in keyset `ks`.
+ */
+size_t rt_keyset_size(const rt_keyset_t *ks);
+
+/**
+ * rt_keyset_memory returns the number of bytes of memory used by keyset
+ * `ks`.
+ */
+size_t rt_keyset_memory(const rt_keyset_t *ks);
+
+/**
+ * rt_keyset_contains reports whether keyset `ks` contains key `key` of `len`
+ * bytes.
+ */
+int rt_keyset_contains(const rt_keyset_t *ks, const char *key, size_t len);
+
+/**
+ * rt_keyset_iter iterates over keys of a keyset in ascending order.
+ */
+typedef struct rt_keyset_iter {
+  const rt_keyset_t *ks;
+  // Offset of the next key in keyset data, and its index.
+  size_t off;
+  size_t idx;
+  // Current, decoded, key.
+  char *key;
+  size_t key_len;
+  size_t key_cap;
+} rt_keyset_iter_t;
+
+/**
+ * rt_keyset_iter_init positions iterator `it` before the first key of
+ * keyset `ks`.
+ */
+void rt_keyset_iter_init(rt_keyset_iter_t *it, const rt_keyset_t *ks);
+
+/**
+ * rt_keyset_iter_seek positions iterator `it` before the first key not less
+ * than `key`.
+ */
+void rt_keyset_iter_seek(rt_keyset_iter_t *it, const char *key, size_t len);
+
+/**
+ * rt_keyset_iter_next advances iterator `it` to the next key and sets `key`
+ * and `len` to it. The key is valid until the next call. Returns zero once
+ * there are no more keys.
+ */
+int rt_keyset_iter_next(rt_keyset_iter_t *it, const char **key, size_t *len);
+
+/**
+ * rt_keyset_iter_end releases resources held by iterator `it`.
+ */
+void rt_keyset_iter_end(rt_keyset_iter_t *it);
+
+/**
+ * rt_keyset_union returns a new keyset with keys present in `a` or `b`.
+ */
+rt_keyset_t *rt_keyset_union(const rt_keyset_t *a, const rt_keyset_t *b);
+
+/**
+ * rt_keyset_intersect returns a new keyset with keys present in both `a` and
+ * `b`.
+ */
+rt_keyset_t *rt_keyset_intersect(const rt_keyset_t *a, const rt_keyset_t *b);
+
+/**
+ * rt_keyset_difference returns a new keyset with keys present in `a` but not
+ * in `b`.
+ */
+rt_keyset_t *rt_keyset_difference(const rt_keyset_t *a, const rt_keyset_t *b);
+
+#endif // keyset_h_INCLUDED
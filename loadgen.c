@@ -0,0 +1,865 @@
+#include "daemon.h"
+#include "hist.h"
+#include "history.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+
+Daemon load generator
+=====================
+
+rt-loadgen opens a number of connections to rt-daemon, spread over a few
+threads each driving its connections from an epoll loop, and sends requests
+of a weighted mix of ADD, REM and LIST on RTs picked with a Zipf
+distribution.
+
+In closed loop, every connection keeps a fixed number of requests in
+flight, sending the next one as soon as a reply arrives. In open loop,
+requests are sent at a fixed total rate regardless of replies, and latency
+is measured from the time a request was scheduled to be sent, not from the
+time it was actually written. A daemon that can't keep up then shows in the
+latencies, instead of silently slowing down the load (coordinated omission).
+
+Every interval a line with throughput and latency percentiles of the
+interval is written to stdout, followed at the end by per-op summaries and
+a latency histogram of the whole run. With -H, all requests are recorded
+into a history for rt-histcheck, as issued by their connection.
+
+*/
+
+#define USEC_PER_SEC 1000000ULL
+
+// Time to wait for outstanding replies once the run is over.
+#define LG_DRAIN_US (5 * USEC_PER_SEC)
+#define LG_MAX_EVENTS 64
+
+typedef enum lg_op { LG_OP_ADD, LG_OP_REM, LG_OP_LIST, LG_OP_COUNT } lg_op_t;
+
+static const char *lg_op_names[LG_OP_COUNT] = {"add", "rem", "list"};
+static const char *lg_op_verbs[LG_OP_COUNT] = {"ADD", "REM", "LIST"};
+
+typedef struct lg_opts {
+  const char *socket_path;
+  int conns;
+  int threads;
+  int duration;
+  int interval;
+  // Total requests per second in open loop, closed loop if zero.
+  int rate;
+  // Requests in flight per connection in closed loop.
+  int depth;
+  int weights[LG_OP_COUNT];
+  int rts;
+  int keys;
+  double zipf;
+  const char *prefix;
+  rt_history_t *history;
+} lg_opts_t;
+
+typedef struct lg_conn {
+  int fd;
+  int id;
+
+  // Requests not yet accepted by the socket.
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  int want_out;
+
+  char in[4096];
+  size_t in_len;
+} lg_conn_t;
+
+typedef struct lg_pending {
+  uint64_t seq;
+  uint64_t start_us;
+  lg_op_t op;
+  int rt;
+  int key;
+  lg_conn_t *conn;
+  int busy;
+  // Time the request was written, for history.
+  uint64_t call_ns;
+} lg_pending_t;
+
+// Measurements of one interval.
+typedef struct lg_interval {
+  rt_hist_t ops[LG_OP_COUNT];
+  uint64_t errors;
+  // Open loop requests not sent because too many were in flight.
+  uint64_t overflows;
+} lg_interval_t;
+
+typedef struct lg_thread {
+  pthread_t thread;
+  int id;
+  const lg_opts_t *opts;
+
+  lg_conn_t *conns;
+  int conns_count;
+  int epfd;
+
+  uint64_t rand_state;
+  uint64_t next_seq;
+  lg_pending_t *pending;
+  uint64_t pending_mask;
+  int outstanding;
+
+  pthread_mutex_t lock;
+  lg_interval_t cur;
+} lg_thread_t;
+
+static volatile int lg_stop;
+static uint64_t lg_end_us;
+// Zipf CDF over RT indexes.
+static double *lg_cdf;
+
+void print_usage(const char *progname);
+int parse_positive_int(const char *name, const char *val);
+int parse_mix(const char *mix, int *weights);
+
+/*
+ * Helpers.
+ */
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+// xorshift64*, rand_r is too coarse for large RT populations.
+static uint64_t next_rand(lg_thread_t *t) {
+  t->rand_state ^= t->rand_state >> 12;
+  t->rand_state ^= t->rand_state << 25;
+  t->rand_state ^= t->rand_state >> 27;
+  return t->rand_state * 2685821657736338717ULL;
+}
+
+static double next_unit(lg_thread_t *t) {
+  return (next_rand(t) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static double *zipf_cdf(int n, double s) {
+  double *cdf = malloc(sizeof(double) * n);
+  double sum = 0;
+
+  for (int i = 0; i < n; i++) {
+    sum += 1.0 / pow(i + 1, s);
+    cdf[i] = sum;
+  }
+  for (int i = 0; i < n; i++) {
+    cdf[i] /= sum;
+  }
+
+  return cdf;
+}
+
+// Picks an RT index, index 0 being the most popular one.
+static int pick_rt(lg_thread_t *t) {
+  double u = next_unit(t);
+  int lo = 0, hi = t->opts->rts - 1;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (lg_cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static lg_op_t pick_op(lg_thread_t *t) {
+  const int *weights = t->opts->weights;
+  int total = 0;
+  for (int i = 0; i < LG_OP_COUNT; i++) {
+    total += weights[i];
+  }
+
+  int r = next_rand(t) % total;
+  for (int i = 0; i < LG_OP_COUNT; i++) {
+    if (r < weights[i]) {
+      return i;
+    }
+    r -= weights[i];
+  }
+
+  return LG_OP_ADD;
+}
+
+static void conn_watch(lg_thread_t *t, lg_conn_t *c, int want_out) {
+  struct epoll_event ev = {.events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+                           .data.ptr = c};
+  epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  c->want_out = want_out;
+}
+
+static void conn_failed(lg_conn_t *c, const char *what) {
+  fprintf(stderr, "Connection to daemon failed in %s: %s\n", what,
+          strerror(errno));
+  exit(1);
+}
+
+static void conn_flush(lg_thread_t *t, lg_conn_t *c) {
+  size_t off = 0;
+
+  while (off < c->out_len) {
+    ssize_t n = write(c->fd, c->out + off, c->out_len - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (n < 0) {
+      conn_failed(c, "write");
+    }
+    off += n;
+  }
+
+  c->out_len -= off;
+  memmove(c->out, c->out + off, c->out_len);
+
+  // Wait for room in the socket buffer only while there's something left.
+  if ((c->out_len > 0) != c->want_out) {
+    conn_watch(t, c, c->out_len > 0);
+  }
+}
+
+/*
+ * Requests.
+ */
+
+// Sends a request on connection `c`, scheduled at `start_us`.
+static void send_request(lg_thread_t *t, lg_conn_t *c, uint64_t start_us) {
+  const lg_opts_t *opts = t->opts;
+  uint64_t seq = t->next_seq;
+  lg_pending_t *p = &t->pending[seq & t->pending_mask];
+
+  if (p->busy) {
+    pthread_mutex_lock(&t->lock);
+    t->cur.overflows++;
+    pthread_mutex_unlock(&t->lock);
+    return;
+  }
+
+  t->next_seq++;
+  p->seq = seq;
+  p->start_us = start_us;
+  p->op = pick_op(t);
+  p->rt = pick_rt(t);
+  p->key = next_rand(t) % opts->keys;
+  p->conn = c;
+  p->busy = 1;
+  p->call_ns = opts->history ? rt_history_now() : 0;
+  t->outstanding++;
+
+  char line[256];
+  int len;
+
+  if (p->op == LG_OP_LIST) {
+    len = snprintf(line, sizeof(line), "%lx LIST %s%d\n", (unsigned long)seq,
+                   opts->prefix, p->rt);
+  } else {
+    len = snprintf(line, sizeof(line), "%lx %s %s%d k%d\n",
+                   (unsigned long)seq, lg_op_verbs[p->op], opts->prefix,
+                   p->rt, p->key);
+  }
+
+  if (c->out_len + len > c->out_cap) {
+    c->out_cap = (c->out_len + len) * 2;
+    c->out = realloc(c->out, c->out_cap);
+  }
+  memcpy(c->out + c->out_len, line, len);
+  c->out_len += len;
+
+  conn_flush(t, c);
+}
+
+// Records request `p` with `reply`, the part of the reply after the tag, or
+// NULL if there was none.
+static void record(lg_thread_t *t, lg_pending_t *p, const char *reply) {
+  const lg_opts_t *opts = t->opts;
+  uint64_t return_ns = reply ? rt_history_now() : RT_HISTORY_NO_RETURN;
+  int ret = reply ? 0 : -ETIMEDOUT;
+  char rt_name[128], key[32];
+  const char *keys[1] = {key};
+
+  snprintf(rt_name, sizeof(rt_name), "%s%d", opts->prefix, p->rt);
+  snprintf(key, sizeof(key), "k%d", p->key);
+
+  if (reply && strncmp(reply, "ERR ", 4) == 0) {
+    ret = atoi(reply + 4);
+  }
+
+  if (p->op == LG_OP_LIST) {
+    unsigned int refcount = 0;
+    unsigned long keys_count = 0, hash = 0;
+    if (ret == 0 && reply &&
+        sscanf(reply, "OK refcount=%u keys=%lu hash=%lx", &refcount,
+               &keys_count, &hash) != 3) {
+      ret = -EBADMSG;
+    }
+    rt_history_list(opts->history, p->conn->id, p->call_ns, return_ns,
+                    rt_name, ret, refcount, keys_count, hash);
+  } else {
+    const char *flag = reply ? strchr(reply, '=') : NULL;
+    rt_history_update(opts->history, p->conn->id, p->call_ns, return_ns,
+                      p->op == LG_OP_REM, rt_name, keys, 1, ret,
+                      ret == 0 && flag && flag[1] == '1');
+  }
+}
+
+static void handle_reply(lg_thread_t *t, char *line) {
+  char *end;
+  uint64_t seq = strtoull(line, &end, 16);
+  lg_pending_t *p = &t->pending[seq & t->pending_mask];
+
+  if (*end != ' ' || !p->busy || p->seq != seq) {
+    fprintf(stderr, "Unexpected reply from daemon: %s\n", line);
+    return;
+  }
+
+  uint64_t now = now_us();
+
+  pthread_mutex_lock(&t->lock);
+  if (strncmp(end + 1, "OK", 2) == 0) {
+    rt_hist_add(&t->cur.ops[p->op], now - p->start_us);
+  } else {
+    t->cur.errors++;
+  }
+  pthread_mutex_unlock(&t->lock);
+
+  if (t->opts->history) {
+    record(t, p, end + 1);
+  }
+
+  p->busy = 0;
+  t->outstanding--;
+
+  if (t->opts->rate == 0 && !lg_stop) {
+    send_request(t, p->conn, now);
+  }
+}
+
+static void conn_read(lg_thread_t *t, lg_conn_t *c) {
+  ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  }
+  if (n <= 0) {
+    if (n == 0) {
+      errno = ECONNRESET;
+    }
+    conn_failed(c, "read");
+  }
+  c->in_len += n;
+
+  char *beg = c->in;
+  char *end;
+  while ((end = memchr(beg, '\n', c->in + c->in_len - beg))) {
+    *end = '\0';
+    handle_reply(t, beg);
+    beg = end + 1;
+  }
+
+  c->in_len -= beg - c->in;
+  memmove(c->in, beg, c->in_len);
+}
+
+static void *thread_run(void *arg) {
+  lg_thread_t *t = arg;
+  const lg_opts_t *opts = t->opts;
+  struct epoll_event events[LG_MAX_EVENTS];
+
+  // Open loop: this thread's share of the rate, sent round-robin over its
+  // connections.
+  double gap_us = opts->rate ? (double)USEC_PER_SEC * opts->threads /
+                                   opts->rate
+                             : 0;
+  double next_send = now_us();
+  int next_conn = 0;
+
+  if (opts->rate == 0) {
+    for (int i = 0; i < t->conns_count; i++) {
+      for (int d = 0; d < opts->depth; d++) {
+        send_request(t, &t->conns[i], now_us());
+      }
+    }
+  }
+
+  for (;;) {
+    uint64_t now = now_us();
+    uint64_t timeout_us = 100000;
+
+    if (!lg_stop && opts->rate) {
+      while (next_send <= now) {
+        send_request(t, &t->conns[next_conn], (uint64_t)next_send);
+        next_conn = (next_conn + 1) % t->conns_count;
+        next_send += gap_us;
+      }
+      timeout_us = next_send - now;
+    }
+
+    if (lg_stop && (t->outstanding == 0 || now > lg_end_us + LG_DRAIN_US)) {
+      break;
+    }
+
+    struct timespec ts = {.tv_sec = timeout_us / USEC_PER_SEC,
+                          .tv_nsec = (timeout_us % USEC_PER_SEC) * 1000};
+    int n = epoll_pwait2(t->epfd, events, LG_MAX_EVENTS, &ts, NULL);
+
+    for (int i = 0; i < n; i++) {
+      lg_conn_t *c = events[i].data.ptr;
+      if (events[i].events & EPOLLOUT) {
+        conn_flush(t, c);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        conn_read(t, c);
+      }
+    }
+  }
+
+  if (t->outstanding > 0) {
+    fprintf(stderr, "Thread %d: %d requests unanswered after drain.\n", t->id,
+            t->outstanding);
+
+    // They may still take effect.
+    for (uint64_t i = 0; opts->history && i <= t->pending_mask; i++) {
+      if (t->pending[i].busy) {
+        record(t, &t->pending[i], NULL);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static int connect_daemon(const char *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    close(fd);
+    return -ENAMETOOLONG;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+/*
+ * Reporting.
+ */
+
+// Collects measurements of all threads since the last call into `sum`.
+static void collect(lg_thread_t *threads, int threads_count,
+                    lg_interval_t *sum) {
+  lg_interval_t *cur = malloc(sizeof(lg_interval_t));
+  memset(sum, 0, sizeof(*sum));
+
+  for (int i = 0; i < threads_count; i++) {
+    pthread_mutex_lock(&threads[i].lock);
+    memcpy(cur, &threads[i].cur, sizeof(*cur));
+    memset(&threads[i].cur, 0, sizeof(threads[i].cur));
+    pthread_mutex_unlock(&threads[i].lock);
+
+    for (int op = 0; op < LG_OP_COUNT; op++) {
+      rt_hist_merge(&sum->ops[op], &cur->ops[op]);
+    }
+    sum->errors += cur->errors;
+    sum->overflows += cur->overflows;
+  }
+
+  free(cur);
+}
+
+static void print_summary(const char *name, const rt_hist_t *h,
+                          double secs) {
+  printf("%-6s %10lu %10.1f %8lu %8lu %8lu %8lu %8lu %8lu\n", name,
+         (unsigned long)h->count, h->count / secs,
+         (unsigned long)(h->count ? h->sum / h->count : 0),
+         (unsigned long)rt_hist_percentile(h, 0.5),
+         (unsigned long)rt_hist_percentile(h, 0.9),
+         (unsigned long)rt_hist_percentile(h, 0.99),
+         (unsigned long)rt_hist_percentile(h, 0.999),
+         (unsigned long)h->max);
+}
+
+// Prints histogram `h` with one row per power of two.
+static void print_hist(const rt_hist_t *h) {
+  uint64_t cum = 0;
+
+  printf("%12s %12s %10s %7s %7s\n", "from_us", "to_us", "count", "pct",
+         "cum");
+  for (int b = 0; b < RT_HIST_BUCKETS;) {
+    uint64_t lo = rt_hist_bucket_value(b);
+    uint64_t count = 0;
+
+    int next = b + 1;
+    if (lo >= RT_HIST_SUB) {
+      next = b + RT_HIST_SUB;
+    }
+    for (int i = b; i < next; i++) {
+      count += h->counts[i];
+    }
+    b = next;
+
+    if (count == 0) {
+      continue;
+    }
+    cum += count;
+    printf("%12lu %12lu %10lu %6.2f%% %6.2f%%\n", (unsigned long)lo,
+           (unsigned long)(b < RT_HIST_BUCKETS ? rt_hist_bucket_value(b)
+                                               : h->max + 1),
+           (unsigned long)count, 100.0 * count / h->count,
+           100.0 * cum / h->count);
+  }
+}
+
+static void on_signal(int sig) { lg_stop = 1; }
+
+int main(int argc, char *argv[]) {
+  lg_opts_t opts = {
+      .socket_path = RT_DAEMON_DEFAULT_SOCKET,
+      .conns = 16,
+      .threads = 4,
+      .duration = 30,
+      .interval = 1,
+      .depth = 1,
+      .weights = {50, 40, 10},
+      .rts = 10000,
+      .keys = 16,
+      .zipf = 0.99,
+      .prefix = "lg-rt-",
+  };
+  char *history_path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:C:j:d:I:R:D:m:n:k:z:P:H:h")) != -1) {
+    switch (opt) {
+    case 's':
+      opts.socket_path = optarg;
+      break;
+    case 'C':
+      opts.conns = parse_positive_int("-C", optarg);
+      break;
+    case 'j':
+      opts.threads = parse_positive_int("-j", optarg);
+      break;
+    case 'd':
+      opts.duration = parse_positive_int("-d", optarg);
+      break;
+    case 'I':
+      opts.interval = parse_positive_int("-I", optarg);
+      break;
+    case 'R':
+      opts.rate = parse_positive_int("-R", optarg);
+      break;
+    case 'D':
+      opts.depth = parse_positive_int("-D", optarg);
+      break;
+    case 'm':
+      if (parse_mix(optarg, opts.weights) < 0) {
+        return 1;
+      }
+      break;
+    case 'n':
+      opts.rts = parse_positive_int("-n", optarg);
+      break;
+    case 'k':
+      opts.keys = parse_positive_int("-k", optarg);
+      break;
+    case 'z': {
+      char *end;
+      opts.zipf = strtod(optarg, &end);
+      if (*end != '\0' || opts.zipf < 0) {
+        fprintf(stderr, "-z must be a non-negative number\n");
+        return 1;
+      }
+      break;
+    }
+    case 'P':
+      opts.prefix = optarg;
+      break;
+    case 'H':
+      history_path = optarg;
+      break;
+    case 'h':
+    default:
+      print_usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  rt_history_t history;
+  if (history_path) {
+    int ret;
+    if ((ret = rt_history_open(&history, history_path)) < 0) {
+      fprintf(stderr, "Failed to create history file %s: %d\n", history_path,
+              ret);
+      return 1;
+    }
+    opts.history = &history;
+  }
+
+  if (opts.threads > opts.conns) {
+    opts.threads = opts.conns;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  lg_cdf = zipf_cdf(opts.rts, opts.zipf);
+
+  lg_thread_t *threads = calloc(opts.threads, sizeof(lg_thread_t));
+  for (int i = 0; i < opts.threads; i++) {
+    lg_thread_t *t = &threads[i];
+    t->id = i;
+    t->opts = &opts;
+    t->rand_state = (now_us() ^ (i + 1) * 0x9e3779b97f4a7c15ULL) | 1;
+    t->epfd = epoll_create1(0);
+    pthread_mutex_init(&t->lock, NULL);
+
+    // Connections are split evenly between threads.
+    t->conns_count =
+        opts.conns / opts.threads + (i < opts.conns % opts.threads);
+    t->conns = calloc(t->conns_count, sizeof(lg_conn_t));
+
+    for (int j = 0; j < t->conns_count; j++) {
+      lg_conn_t *c = &t->conns[j];
+      c->id = i + j * opts.threads;
+      c->fd = connect_daemon(opts.socket_path);
+      if (c->fd < 0) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", opts.socket_path,
+                strerror(-c->fd));
+        return 1;
+      }
+
+      struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+      epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    // Enough slots for closed loop depth, and for open loop backlog of a
+    // daemon falling behind.
+    uint64_t slots = 65536;
+    while (slots < (uint64_t)t->conns_count * opts.depth * 2) {
+      slots *= 2;
+    }
+    t->pending = calloc(slots, sizeof(lg_pending_t));
+    t->pending_mask = slots - 1;
+  }
+
+  printf("%d connections, %d threads, %s", opts.conns, opts.threads,
+         opts.rate ? "open loop" : "closed loop");
+  if (opts.rate) {
+    printf(" at %d requests/s", opts.rate);
+  } else {
+    printf(" with %d in flight per connection", opts.depth);
+  }
+  printf(", %d RTs with Zipf s=%.2f.\n", opts.rts, opts.zipf);
+  printf("%8s %10s %8s %8s %8s %8s %8s %8s\n", "time_s", "ops/s", "errors",
+         "overflow", "p50_us", "p99_us", "p999_us", "max_us");
+  fflush(stdout);
+
+  uint64_t start = now_us();
+  lg_end_us = start + opts.duration * USEC_PER_SEC;
+
+  for (int i = 0; i < opts.threads; i++) {
+    pthread_create(&threads[i].thread, NULL, thread_run, &threads[i]);
+  }
+
+  // Report every interval until the end of the run.
+
+  rt_hist_t *total = calloc(LG_OP_COUNT + 1, sizeof(rt_hist_t));
+  lg_interval_t *sum = malloc(sizeof(lg_interval_t));
+  rt_hist_t *all = malloc(sizeof(rt_hist_t));
+  uint64_t errors = 0, overflows = 0;
+  uint64_t last = start;
+
+  while (!lg_stop) {
+    uint64_t next = last + opts.interval * USEC_PER_SEC;
+    while (!lg_stop && now_us() < next && now_us() < lg_end_us) {
+      usleep(10000);
+    }
+    if (now_us() >= lg_end_us) {
+      lg_stop = 1;
+    }
+
+    uint64_t now = now_us();
+    collect(threads, opts.threads, sum);
+
+    memset(all, 0, sizeof(*all));
+    for (int op = 0; op < LG_OP_COUNT; op++) {
+      rt_hist_merge(all, &sum->ops[op]);
+      rt_hist_merge(&total[op], &sum->ops[op]);
+    }
+    rt_hist_merge(&total[LG_OP_COUNT], all);
+    errors += sum->errors;
+    overflows += sum->overflows;
+
+    printf("%8.1f %10.1f %8lu %8lu %8lu %8lu %8lu %8lu\n",
+           (now - start) / 1e6, all->count * 1e6 / (now - last),
+           (unsigned long)sum->errors, (unsigned long)sum->overflows,
+           (unsigned long)rt_hist_percentile(all, 0.5),
+           (unsigned long)rt_hist_percentile(all, 0.99),
+           (unsigned long)rt_hist_percentile(all, 0.999),
+           (unsigned long)all->max);
+    fflush(stdout);
+    last = now;
+  }
+
+  for (int i = 0; i < opts.threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+  }
+
+  // Replies received while draining.
+  collect(threads, opts.threads, sum);
+  for (int op = 0; op < LG_OP_COUNT; op++) {
+    rt_hist_merge(&total[op], &sum->ops[op]);
+    rt_hist_merge(&total[LG_OP_COUNT], &sum->ops[op]);
+  }
+  errors += sum->errors;
+  overflows += sum->overflows;
+
+  double secs = (lg_end_us - start) / 1e6;
+
+  printf("\n%-6s %10s %10s %8s %8s %8s %8s %8s %8s\n", "op", "count",
+         "ops/s", "mean_us", "p50_us", "p90_us", "p99_us", "p999_us",
+         "max_us");
+  for (int op = 0; op < LG_OP_COUNT; op++) {
+    print_summary(lg_op_names[op], &total[op], secs);
+  }
+  print_summary("all", &total[LG_OP_COUNT], secs);
+  printf("errors=%lu overflows=%lu\n\n", (unsigned long)errors,
+         (unsigned long)overflows);
+
+  print_hist(&total[LG_OP_COUNT]);
+
+  for (int i = 0; i < opts.threads; i++) {
+    for (int j = 0; j < threads[i].conns_count; j++) {
+      close(threads[i].conns[j].fd);
+      free(threads[i].conns[j].out);
+    }
+    free(threads[i].conns);
+    free(threads[i].pending);
+    close(threads[i].epfd);
+    pthread_mutex_destroy(&threads[i].lock);
+  }
+  free(threads);
+  free(total);
+  free(sum);
+  free(all);
+  free(lg_cdf);
+
+  if (opts.history && rt_history_close(opts.history) < 0) {
+    fprintf(stderr, "Failed to write history file %s\n", history_path);
+    return 1;
+  }
+
+  return 0;
+}
+
+int parse_positive_int(const char *name, const char *val) {
+  char *end;
+  long n = strtol(val, &end, 10);
+  if (*end != '\0' || n <= 0) {
+    fprintf(stderr, "%s must be a positive integer\n", name);
+    exit(1);
+  }
+
+  return (int)n;
+}
+
+// Parses op mix of the form `add=50,rem=40,list=10`. Ops not listed get zero
+// weight.
+int parse_mix(const char *mix, int *weights) {
+  int total = 0;
+  char *str = strdup(mix);
+  char *save = NULL;
+
+  memset(weights, 0, sizeof(int) * LG_OP_COUNT);
+
+  for (char *tok = strtok_r(str, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+    char *eq = strchr(tok, '=');
+    int op = -1;
+
+    if (eq) {
+      *eq = '\0';
+      for (int i = 0; i < LG_OP_COUNT; i++) {
+        if (strcmp(tok, lg_op_names[i]) == 0) {
+          op = i;
+        }
+      }
+    }
+
+    if (op < 0 || atoi(eq + 1) < 0) {
+      fprintf(stderr, "Invalid op mix entry in -m: %s\n", tok);
+      free(str);
+      return -EINVAL;
+    }
+
+    weights[op] = atoi(eq + 1);
+    total += weights[op];
+  }
+
+  free(str);
+
+  if (total <= 0) {
+    fprintf(stderr, "Op mix in -m must have a positive total weight\n");
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+void print_usage(const char *progname) {
+  printf("Usage: %s [-s SOCKET] [-C CONNECTIONS] [-j THREADS] [-d SECONDS] "
+         "[-I SECONDS] [-R RATE | -D DEPTH] [-m MIX] [-n RTS] [-k KEYS] "
+         "[-z SKEW] [-P PREFIX] [-H HISTORY FILE] [-h]\n",
+         progname);
+  printf("Load generator for rt-daemon.\n");
+  printf("  -s SOCKET\t\tDaemon socket. Defaults to %s.\n",
+         RT_DAEMON_DEFAULT_SOCKET);
+  printf("  -C CONNECTIONS\tNumber of connections. Defaults to 16.\n");
+  printf("  -j THREADS\t\tNumber of threads driving the connections. "
+         "Defaults to 4.\n");
+  printf("  -d SECONDS\t\tDuration of the run. Defaults to 30.\n");
+  printf("  -I SECONDS\t\tReporting interval. Defaults to 1.\n");
+  printf("  -R RATE\t\tOpen loop: send RATE requests per second in total. "
+         "Closed loop by default.\n");
+  printf("  -D DEPTH\t\tClosed loop: requests in flight per connection. "
+         "Defaults to 1.\n");
+  printf("  -m MIX\t\tOp weights. Defaults to add=50,rem=40,list=10.\n");
+  printf("  -n RTS\t\tNumber of RTs. Defaults to 10000.\n");
+  printf("  -k KEYS\t\tNumber of distinct keys per RT. Defaults to 16.\n");
+  printf("  -z SKEW\t\tZipf exponent of RT popularity, 0 is uniform. "
+         "Defaults to 0.99.\n");
+  printf("  -P PREFIX\t\tPrefix of RT names. Defaults to lg-rt-.\n");
+  printf("  -H HISTORY FILE\tRecord all requests for rt-histcheck. The "
+         "history must start from empty RTs, use a fresh -P.\n");
+  printf("  -h\t\t\tThis help message.\n");
+}
@@ -1,34 +1,88 @@
+#include "export.h"
+#include "gc.h"
+#include "relocate.h"
+#include "rollup.h"
 #include "rt.h"
+#include "stats.h"
+#include "zygote.h"
+#include <inttypes.h>
+#include <pthread.h>
 #include <rados/librados.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+// Interval of rollup flushes of the zygote, GC and relocation. Single updates
+// don't feed the rollups, a flush would cost them more than the update
+// itself.
+#define CLI_ROLLUP_INTERVAL_MS 1000
+
 void print_err(const char *op, int err_code) {
   fprintf(stderr, "%s failed: %d\n", op, err_code);
 }
 
-void validate_not_empty(const char *name, const char *val) {
+int validate_not_empty(const char *name, const char *val) {
   if (!val || strlen(val) == 0) {
     fprintf(stderr, "%s may not be empty\n", name);
-    exit(1);
+    return -1;
   }
+
+  return 0;
 }
 
-typedef enum rt_op { RT_OP_ADD, RT_OP_REM } rt_op_t;
+typedef enum rt_op {
+  RT_OP_NONE = -1,
+  RT_OP_ADD,
+  RT_OP_REM,
+  RT_OP_GC,
+  RT_OP_STATS,
+  RT_OP_EXPORT,
+  RT_OP_RELOCATE,
+  RT_OP_CUTOVER,
+  RT_OP_ROLLUP,
+  RT_OP_RECONCILE
+} rt_op_t;
 
 rt_op_t validate_and_parse_op(const char *op_str) {
   if (strcmp(op_str, "add") == 0) {
     return RT_OP_ADD;
   } else if (strcmp(op_str, "rem") == 0) {
     return RT_OP_REM;
+  } else if (strcmp(op_str, "gc") == 0) {
+    return RT_OP_GC;
+  } else if (strcmp(op_str, "stats") == 0) {
+    return RT_OP_STATS;
+  } else if (strcmp(op_str, "export") == 0) {
+    return RT_OP_EXPORT;
+  } else if (strcmp(op_str, "relocate") == 0) {
+    return RT_OP_RELOCATE;
+  } else if (strcmp(op_str, "cutover") == 0) {
+    return RT_OP_CUTOVER;
+  } else if (strcmp(op_str, "rollup") == 0) {
+    return RT_OP_ROLLUP;
+  } else if (strcmp(op_str, "reconcile") == 0) {
+    return RT_OP_RECONCILE;
   }
 
   fprintf(stderr,
-          "Unknown operation passed in -o %s. Valid operations are 'add' and "
-          "'rem'.\n",
+          "Unknown operation passed in -o %s. Valid operations are 'add', "
+          "'rem', 'gc', 'stats', 'export', 'relocate', 'cutover', 'rollup' "
+          "and 'reconcile'.\n",
           op_str);
-  exit(1);
+  return RT_OP_NONE;
+}
+
+// Returns -1 if `val` is not a positive integer.
+int parse_positive_int(const char *name, const char *val) {
+  char *end;
+  long n = strtol(val, &end, 10);
+  if (*end != '\0' || n <= 0) {
+    fprintf(stderr, "%s must be a positive integer\n", name);
+    return -1;
+  }
+
+  return (int)n;
 }
 
 char *mkstring(const char *src, int len) {
@@ -76,7 +130,10 @@ void print_usage(const char *progname) {
          "reference tracker for ceph-csi plugin.\n\n");
 
   printf("Usage: %s -i CLIENT ID -p POOL NAME -c CEPH CONFIG FILE "
-         "[-r RT NAME] -k REF KEYS -o RT OPERATION [-h]\n",
+         "[-r RT NAME] -k REF KEYS -o RT OPERATION [-x ORACLE COMMAND] "
+         "[-j THREADS] [-b BATCH SIZE] [-t OPS PER SEC] [-a SAMPLES] "
+         "[-f SNAPSHOT FILE] [-d DEST POOL NAME] [-O OVERFLOW POOL NAME] "
+         "[-W WRITER ID] [-Z ZYGOTE SOCKET] [-h]\n",
          progname);
 
   printf("  -i CLIENT ID\t\tcephx client ID.\n");
@@ -86,72 +143,315 @@ void print_usage(const char *progname) {
          "Defaults to 'hello-reference-tracker' if none provided.\n");
   printf("  -k REF KEYS\t\tComma-separated list of keys to be used in the RT "
          "operation.\n");
-  printf("  -o RT OPERATION\tAccepted values are 'add' and 'rem'. Specifies "
-         "what to do with provided keys. 'add' adds them to tracked "
-         "references, 'rem' removes them.\n");
+  printf("  -o RT OPERATION\tAccepted values are 'add', 'rem', 'gc', "
+         "'stats', 'export', 'relocate', 'cutover', 'rollup' and 'reconcile'. "
+         "Specifies what to do with provided keys. 'add' adds them to tracked "
+         "references, 'rem' removes them. 'gc' scans all RTs in the pool and "
+         "removes keys reported dead by the liveness oracle. 'stats' counts "
+         "RTs and references in the pool. 'export' writes all RTs in the "
+         "pool into a snapshot file for rt-query. 'relocate' moves all RTs in "
+         "the pool into another pool, leaving forwarding markers behind. "
+         "'cutover' removes the forwarding markers once clients use the other "
+         "pool. 'rollup' reads the incrementally maintained totals of the pool. "
+         "'reconcile' corrects them against a full census. -k and -r are "
+         "ignored by all but 'add' and 'rem'.\n");
+  printf("  -x ORACLE COMMAND\tgc: Shell command deciding liveness of keys. "
+         "It reads keys from stdin and prints the dead ones to stdout, one per "
+         "line.\n");
+  printf("  -j THREADS\t\tgc, stats, export, relocate, cutover, reconcile: "
+         "Number of scanner, oracle and remover threads each. Defaults to "
+         "32, and 4 oracle threads. The congestion window decides how many "
+         "of them issue operations at once.\n");
+  printf("  -b BATCH SIZE\t\tgc: Maximum number of keys passed to the oracle "
+         "at once. relocate: Maximum number of keys copied at once. Defaults "
+         "to 1000.\n");
+  printf("  -t OPS PER SEC\tgc, stats, export, relocate, cutover, "
+         "reconcile: Maximum number of RADOS operations per second. "
+         "Unlimited by default.\n");
+  printf("  -a SAMPLES\t\tstats: Approximate statistics from SAMPLES random "
+         "slices out of 1024. Full census by default.\n");
+  printf("  -f SNAPSHOT FILE\texport: Path of the snapshot file to write.\n");
+  printf("  -d DEST POOL NAME\trelocate: Pool to move RTs to.\n");
+  printf("  -O OVERFLOW POOL NAME\tadd: Create the RT with split layout, "
+         "keeping its header in POOL NAME and the bulk of keys in OVERFLOW "
+         "POOL NAME.\n");
+  printf("  -W WRITER ID		add, rem: Update the partition of WRITER ID, "
+         "e.g. a node ID, of a partitioned RT, and create the RT with "
+         "partitioned layout. Required to update partitioned RTs.\n");
+  printf("  -Z ZYGOTE SOCKET\tInstead of executing an operation, connect "
+         "and stay resident as a zygote listening on ZYGOTE SOCKET. 'add' "
+         "and 'rem' invocations with the same -i and -c, and %s set to "
+         "ZYGOTE SOCKET, are executed by the zygote.\n",
+         RT_ZYGOTE_SOCKET_ENV);
   printf("  -h\t\t\tThis help message.\n");
 }
 
-int main(int argc, const char **argv) {
-  int ret = 0;
+// Options of an invocation.
+typedef struct cli_args {
+  const char *client_id;
+  const char *pool_name;
+  const char *config_file;
+  const char *op_str;
+  const char *rt_name;
+  const char *oracle_cmd;
+  const char *snapshot_file;
+  const char *dst_pool_name;
+  const char *zygote_socket;
+  rt_op_t op;
+
+  int keys_count;
+  char **keys;
+
+  rt_gc_opts_t gc_opts;
+  rt_stats_opts_t stats_opts;
+  rt_relocate_opts_t relocate_opts;
+  rt_opts_t rt_opts;
+} cli_args_t;
 
-  const char *client_id = NULL;
-  const char *pool_name = NULL;
-  const char *config_file = NULL;
+// Parses and validates command line options into `a`. Returns -1 if
+// they're not valid, and 1 if usage was printed.
+int parse_args(int argc, const char **argv, cli_args_t *a) {
   const char *keys_str = NULL;
-  const char *op_str = NULL;
-  const char *rt_name = NULL;
-  rt_op_t op;
+  int err = 0;
 
-  rados_t rados = NULL;
+  memset(a, 0, sizeof(*a));
+  rt_gc_opts_init(&a->gc_opts);
+  rt_stats_opts_init(&a->stats_opts);
+  rt_relocate_opts_init(&a->relocate_opts);
+  rt_opts_init(&a->rt_opts);
 
-  // Parse reference-tracker command line options.
+  // Parse reference-tracker command line options. Zero resets getopt, the
+  // zygote parses options of every invocation.
   {
     int c;
-    while ((c = getopt(argc, (char *const *)argv, "i:p:c:k:o:r:h")) != -1) {
+    optind = 0;
+    while ((c = getopt(argc, (char *const *)argv,
+                       "i:p:c:k:o:r:x:j:b:t:a:f:d:O:W:Z:h")) != -1) {
       switch (c) {
       case 'i':
-        client_id = optarg;
+        a->client_id = optarg;
         break;
       case 'p':
-        pool_name = optarg;
+        a->pool_name = optarg;
         break;
       case 'c':
-        config_file = optarg;
+        a->config_file = optarg;
         break;
       case 'r':
-        rt_name = optarg;
+        a->rt_name = optarg;
         break;
       case 'k':
         keys_str = optarg;
         break;
       case 'o':
-        op_str = optarg;
+        a->op_str = optarg;
+        break;
+      case 'x':
+        a->oracle_cmd = optarg;
+        break;
+      case 'j':
+        a->gc_opts.scan_threads = parse_positive_int("-j THREADS", optarg);
+        a->gc_opts.oracle_threads = a->gc_opts.scan_threads;
+        a->gc_opts.remove_threads = a->gc_opts.scan_threads;
+        a->stats_opts.threads = a->gc_opts.scan_threads;
+        a->relocate_opts.threads = a->gc_opts.scan_threads;
+        err |= a->gc_opts.scan_threads < 0;
+        break;
+      case 'b':
+        a->gc_opts.batch_size = parse_positive_int("-b BATCH SIZE", optarg);
+        a->relocate_opts.chunk_size = a->gc_opts.batch_size;
+        err |= a->gc_opts.batch_size < 0;
+        break;
+      case 't':
+        a->gc_opts.max_ops_per_sec =
+            parse_positive_int("-t OPS PER SEC", optarg);
+        a->stats_opts.max_ops_per_sec = a->gc_opts.max_ops_per_sec;
+        a->relocate_opts.max_ops_per_sec = a->gc_opts.max_ops_per_sec;
+        err |= a->gc_opts.max_ops_per_sec < 0;
+        break;
+      case 'a':
+        a->stats_opts.samples = parse_positive_int("-a SAMPLES", optarg);
+        err |= a->stats_opts.samples < 0;
+        break;
+      case 'f':
+        a->snapshot_file = optarg;
+        break;
+      case 'd':
+        a->dst_pool_name = optarg;
+        break;
+      case 'O':
+        a->rt_opts.layout = RT_LAYOUT_SPLIT;
+        a->rt_opts.overflow_pool = optarg;
+        break;
+      case 'W':
+        a->rt_opts.layout = RT_LAYOUT_PARTITIONED;
+        a->rt_opts.writer_id = optarg;
+        break;
+      case 'Z':
+        a->zygote_socket = optarg;
         break;
       case 'h':
         print_usage(argv[0]);
-        exit(0);
+        return 1;
       }
     }
   }
 
-  validate_not_empty("-i CLIENT ID", client_id);
-  validate_not_empty("-c CEPH CONFIG FILE", client_id);
-  validate_not_empty("-p POOL NAME", pool_name);
-  validate_not_empty("-k COMMA SEPARATED LIST OF KEYS", keys_str);
-  validate_not_empty("-o OPERATION", op_str);
-  op = validate_and_parse_op(op_str);
+  if (err || validate_not_empty("-i CLIENT ID", a->client_id) < 0 ||
+      validate_not_empty("-c CEPH CONFIG FILE", a->client_id) < 0) {
+    return -1;
+  }
 
-  if (!rt_name || strlen(rt_name) == 0) {
-    rt_name = "hello-reference-tracker";
+  if (a->zygote_socket) {
+    // Operations come from invocations.
+    a->op = RT_OP_NONE;
+    return 0;
   }
 
-  int keys_count;
-  char **keys = tokenize(keys_str, ',', &keys_count);
+  if (validate_not_empty("-p POOL NAME", a->pool_name) < 0 ||
+      validate_not_empty("-o OPERATION", a->op_str) < 0 ||
+      (a->op = validate_and_parse_op(a->op_str)) == RT_OP_NONE) {
+    return -1;
+  }
+
+  if (a->op == RT_OP_GC) {
+    if (validate_not_empty("-x ORACLE COMMAND", a->oracle_cmd) < 0) {
+      return -1;
+    }
+    a->gc_opts.oracle = rt_gc_exec_oracle;
+    a->gc_opts.oracle_arg = (void *)a->oracle_cmd;
+  } else if (a->op == RT_OP_EXPORT) {
+    if (validate_not_empty("-f SNAPSHOT FILE", a->snapshot_file) < 0) {
+      return -1;
+    }
+  } else if (a->op == RT_OP_RELOCATE) {
+    if (validate_not_empty("-d DEST POOL NAME", a->dst_pool_name) < 0) {
+      return -1;
+    }
+  } else if (a->op == RT_OP_RECONCILE) {
+    if (a->stats_opts.samples > 0) {
+      fprintf(stderr, "-a SAMPLES can't be used with 'reconcile'.\n");
+      return -1;
+    }
+  } else if (a->op == RT_OP_ADD || a->op == RT_OP_REM) {
+    if (validate_not_empty("-k COMMA SEPARATED LIST OF KEYS", keys_str) < 0) {
+      return -1;
+    }
+  }
+
+  if (!a->rt_name || strlen(a->rt_name) == 0) {
+    a->rt_name = "hello-reference-tracker";
+  }
+
+  if (keys_str) {
+    a->keys = tokenize(keys_str, ',', &a->keys_count);
+  }
+
+  return 0;
+}
+
+void free_args(cli_args_t *a) {
+  for (int i = 0; i < a->keys_count; i++) {
+    free(a->keys[i]);
+  }
+  free(a->keys);
+}
+
+// Adds or removes keys of invocation `a` on `ioctx`, unless opening it
+// failed with `ret`, and prints whether the RT was created or deleted to
+// `out`.
+int run_update(const cli_args_t *a, rados_ioctx_t ioctx, int ret, FILE *out) {
+  int flag = 0;
+
+  size_t *key_lens = malloc(sizeof(size_t) * a->keys_count);
+  for (int i = 0; i < a->keys_count; i++) {
+    key_lens[i] = strlen(a->keys[i]);
+  }
+
+  if (a->op == RT_OP_ADD) {
+    if (ret == 0) {
+      ret = rt_add3(ioctx, a->rt_name, (const char *const *)a->keys,
+                    key_lens, a->keys_count, &a->rt_opts, &flag);
+    }
+    fprintf(out, "created=%d\n", flag);
+  } else {
+    if (ret == 0) {
+      ret = rt_remove3(ioctx, a->rt_name, (const char *const *)a->keys,
+                       key_lens, a->keys_count, &a->rt_opts, &flag);
+    }
+    fprintf(out, "deleted=%d\n", flag);
+  }
+
+  free(key_lens);
+
+  return ret;
+}
+
+// Serializes parsing of invocations, getopt isn't thread-safe.
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// rt_zygote_handler executing updates of invocations connecting as the
+// zygote does, with `arg` being options of the zygote.
+int zygote_handler(rt_ctx_t *ctx, int argc, const char **argv, FILE *out,
+                   void *arg) {
+  const cli_args_t *zygote = arg;
+  cli_args_t a;
+  rados_ioctx_t ioctx = NULL;
+  int ret;
+
+  pthread_mutex_lock(&parse_lock);
+  ret = parse_args(argc, argv, &a);
+  pthread_mutex_unlock(&parse_lock);
+
+  if (ret != 0 || (a.op != RT_OP_ADD && a.op != RT_OP_REM) ||
+      strcmp(a.client_id, zygote->client_id) != 0 ||
+      strcmp(a.config_file ? a.config_file : "",
+             zygote->config_file ? zygote->config_file : "") != 0) {
+    free_args(&a);
+    return RT_ZYGOTE_NOT_SERVED;
+  }
+
+  fprintf(out, "Connected to RADOS cluster.\n");
+
+  ret = rt_ctx_ioctx_get(ctx, a.pool_name, &ioctx);
+  ret = run_update(&a, ioctx, ret, out);
+  if (ioctx) {
+    rt_ctx_ioctx_put(ctx, a.pool_name, ioctx);
+  }
+
+  free_args(&a);
+
+  return ret;
+}
+
+int main(int argc, const char **argv) {
+  int ret = 0;
+  cli_args_t a;
+  rados_t rados = NULL;
+
+  if ((ret = parse_args(argc, argv, &a)) != 0) {
+    exit(ret < 0 ? 1 : 0);
+  }
+
+  if (a.op == RT_OP_GC) {
+    // The oracle command may exit before reading all of its input.
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  // Hand updates over to the zygote, if there's one.
+  {
+    const char *zygote_socket = getenv(RT_ZYGOTE_SOCKET_ENV);
+    if (zygote_socket && (a.op == RT_OP_ADD || a.op == RT_OP_REM) &&
+        (ret = rt_zygote_call(zygote_socket, argc, argv)) !=
+            RT_ZYGOTE_NOT_SERVED) {
+      goto out;
+    }
+    ret = 0;
+  }
 
   // Initialize RADOS.
   {
-    ret = rados_create(&rados, client_id);
+    ret = rados_create(&rados, a.client_id);
     if (ret < 0) {
       print_err("rados_create()", ret);
       ret = EXIT_FAILURE;
@@ -161,8 +461,8 @@ int main(int argc, const char **argv) {
 
   // Parse Ceph config.
   {
-    if (config_file) {
-      ret = rados_conf_read_file(rados, config_file);
+    if (a.config_file) {
+      ret = rados_conf_read_file(rados, a.config_file);
       if (ret < 0) {
         print_err("rados_conf_read_file()", ret);
         ret = EXIT_FAILURE;
@@ -183,27 +483,125 @@ int main(int argc, const char **argv) {
 
   printf("Connected to RADOS cluster.\n");
 
-  if (op == RT_OP_ADD) {
-    int created;
-    ret = rt_add(rados, pool_name, rt_name, (const char *const *)keys,
-                 keys_count, &created);
-    printf("created=%d\n", created);
+  if (a.zygote_socket || a.op == RT_OP_GC || a.op == RT_OP_RELOCATE) {
+    // Feed the rollups of updated pools.
+    if ((ret = rt_rollup_start(rados, CLI_ROLLUP_INTERVAL_MS)) < 0) {
+      print_err("rt_rollup_start()", ret);
+      ret = EXIT_FAILURE;
+      goto out;
+    }
+  }
+
+  if (a.zygote_socket) {
+    ret = rt_zygote_serve(rados, a.zygote_socket, zygote_handler, &a);
+    print_err("rt_zygote_serve()", ret);
+    ret = EXIT_FAILURE;
   }
 
-  if (op == RT_OP_REM) {
-    int deleted;
-    ret = rt_remove(rados, pool_name, rt_name, (const char *const *)keys,
-                    keys_count, &deleted);
-    printf("deleted=%d\n", deleted);
+  if (a.op == RT_OP_ADD || a.op == RT_OP_REM) {
+    rados_ioctx_t ioctx;
+
+    ret = rados_ioctx_create(rados, a.pool_name, &ioctx);
+    int opened = ret == 0;
+
+    ret = run_update(&a, ioctx, ret, stdout);
+    if (opened) {
+      rados_ioctx_destroy(ioctx);
+    }
   }
 
-out:
-  rados_shutdown(rados);
+  if (a.op == RT_OP_GC) {
+    rt_gc_stats_t stats;
+    ret = rt_gc_run(rados, a.pool_name, &a.gc_opts, &stats);
+    printf("scanned=%lu keys=%lu dead=%lu removed=%lu deleted=%lu "
+           "errors=%lu window=%d window_cuts=%lu\n",
+           stats.rts_scanned, stats.keys_scanned, stats.keys_dead,
+           stats.keys_removed, stats.rts_deleted, stats.errors,
+           stats.window.size, stats.window.cuts);
+  }
+
+  if (a.op == RT_OP_STATS) {
+    rt_pool_stats_t stats;
+    ret = rt_stats_run(rados, a.pool_name, &a.stats_opts, &stats);
+    printf("slices=%d/%d\n", stats.slices_scanned, stats.slices);
+    printf("objects=%.0f ci95=%.0f\n", stats.objects.value, stats.objects.ci95);
+    printf("rts=%.0f ci95=%.0f\n", stats.rts.value, stats.rts.ci95);
+    printf("refs=%.0f ci95=%.0f\n", stats.refs.value, stats.refs.ci95);
+    printf("omap_keys=%.0f ci95=%.0f\n", stats.omap_keys.value,
+           stats.omap_keys.ci95);
+    if (stats.slices_scanned == stats.slices) {
+      printf("distinct_keys=%.0f\n", stats.distinct_keys);
+    } else {
+      printf("distinct_keys_sampled=%.0f\n", stats.distinct_keys);
+    }
+    printf("window=%d window_cuts=%lu\n", stats.window.size,
+           stats.window.cuts);
+    printf("errors=%lu\n", stats.errors);
+  }
+
+  if (a.op == RT_OP_EXPORT) {
+    unsigned long exported = 0;
+    ret = rt_export_run(rados, a.pool_name, a.snapshot_file,
+                        a.stats_opts.threads, a.stats_opts.max_ops_per_sec,
+                        &exported);
+
+    rt_window_stats_t window;
+    rt_window_get_stats(rt_window_get(rados, a.pool_name), &window);
+    printf("exported=%lu window=%d window_cuts=%lu\n", exported, window.size,
+           window.cuts);
+  }
+
+  if (a.op == RT_OP_RELOCATE) {
+    rt_relocate_stats_t stats;
+    ret = rt_relocate_run(rados, a.pool_name, a.dst_pool_name,
+                          &a.relocate_opts, &stats);
+    printf("scanned=%lu relocated=%lu forwarded=%lu retries=%lu busy=%lu "
+           "conflicts=%lu errors=%lu window=%d window_cuts=%lu\n",
+           stats.rts_scanned, stats.rts_relocated, stats.rts_forwarded,
+           stats.retries, stats.busy, stats.conflicts, stats.errors,
+           stats.window.size, stats.window.cuts);
+  }
 
-  for (int i = 0; i < keys_count; i++) {
-    free(keys[i]);
+  if (a.op == RT_OP_CUTOVER) {
+    rt_cutover_stats_t stats;
+    ret = rt_cutover_run(rados, a.pool_name, &a.relocate_opts, &stats);
+    printf("scanned=%lu dropped=%lu left=%lu errors=%lu\n",
+           stats.objects_scanned, stats.markers_dropped, stats.objects_left,
+           stats.errors);
+  }
+
+  if (a.op == RT_OP_ROLLUP) {
+    rados_ioctx_t ioctx;
+    rt_rollup_t rollup = {0};
+
+    if ((ret = rados_ioctx_create(rados, a.pool_name, &ioctx)) == 0) {
+      ret = rt_rollup_read(ioctx, &rollup);
+      rados_ioctx_destroy(ioctx);
+    }
+    printf("rts=%" PRId64 " refs=%" PRId64 "\n", rollup.rts, rollup.refs);
   }
-  free(keys);
+
+  if (a.op == RT_OP_RECONCILE) {
+    rt_pool_stats_t stats;
+    rt_rollup_t correction;
+    ret = rt_stats_reconcile(rados, a.pool_name, &a.stats_opts, &stats,
+                             &correction);
+    printf("rts=%.0f refs=%.0f rts_correction=%" PRId64
+           " refs_correction=%" PRId64 " errors=%lu\n",
+           stats.rts.value, stats.refs.value, correction.rts,
+           correction.refs, stats.errors);
+  }
+
+out:
+  if (rados) {
+    // Flush the rollups before disconnecting.
+    rt_rollup_stop();
+    rt_cluster_release(rados);
+    rt_window_release(rados);
+    rados_shutdown(rados);
+  }
+
+  free_args(&a);
 
   return ret;
 }
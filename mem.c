@@ -0,0 +1,90 @@
+#include "mem.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// Header of rt_mem_alloc allocations, recording whom to credit on free.
+// Padded to keep the allocation's alignment.
+typedef union mem_header {
+  struct {
+    rt_mem_t *m;
+    size_t size;
+    rt_mem_kind_t kind;
+  } h;
+  max_align_t align;
+} mem_header_t;
+
+static __thread rt_mem_t *bound;
+
+static const char *kind_names[RT_MEM_KINDS] = {
+    [RT_MEM_SCRATCH] = "scratch",
+    [RT_MEM_CACHE] = "cache",
+    [RT_MEM_ITERATORS] = "iterators",
+    [RT_MEM_QUEUES] = "queues",
+};
+
+const char *rt_mem_kind_name(rt_mem_kind_t kind) { return kind_names[kind]; }
+
+// Raises high-water mark `peak` to `value`.
+static void raise_peak(size_t *peak, size_t value) {
+  size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+  while (old < value &&
+         !__atomic_compare_exchange_n(peak, &old, value, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+  }
+}
+
+void rt_mem_charge(rt_mem_t *m, rt_mem_kind_t kind, long bytes) {
+  if (!m || bytes == 0) {
+    return;
+  }
+
+  size_t used = __atomic_add_fetch(&m->used[kind], bytes, __ATOMIC_RELAXED);
+  size_t total = __atomic_add_fetch(&m->total, bytes, __ATOMIC_RELAXED);
+
+  if (bytes > 0) {
+    raise_peak(&m->peak[kind], used);
+    raise_peak(&m->total_peak, total);
+  }
+}
+
+rt_mem_t *rt_mem_bind(rt_mem_t *m) {
+  rt_mem_t *prev = bound;
+  bound = m;
+  return prev;
+}
+
+rt_mem_t *rt_mem_bound(void) { return bound; }
+
+void *rt_mem_alloc(rt_mem_kind_t kind, size_t size) {
+  mem_header_t *hdr = malloc(sizeof(mem_header_t) + size);
+  if (!hdr) {
+    return NULL;
+  }
+
+  hdr->h.m = bound;
+  hdr->h.size = size;
+  hdr->h.kind = kind;
+  rt_mem_charge(bound, kind, size);
+
+  return hdr + 1;
+}
+
+void rt_mem_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+
+  mem_header_t *hdr = (mem_header_t *)ptr - 1;
+  rt_mem_charge(hdr->h.m, hdr->h.kind, -(long)hdr->h.size);
+  free(hdr);
+}
+
+void rt_mem_snapshot(const rt_mem_t *m, rt_mem_t *out) {
+  for (int i = 0; i < RT_MEM_KINDS; i++) {
+    out->used[i] = __atomic_load_n(&m->used[i], __ATOMIC_RELAXED);
+    out->peak[i] = __atomic_load_n(&m->peak[i], __ATOMIC_RELAXED);
+  }
+  out->total = __atomic_load_n(&m->total, __ATOMIC_RELAXED);
+  out->total_peak = __atomic_load_n(&m->total_peak, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,81 @@
+#ifndef mem_h_INCLUDED
+#define mem_h_INCLUDED
+
+#include <stddef.h>
+
+/**
+ * rt_mem accounts memory used by the tracker, per subsystem, with
+ * high-water marks. Memory held inside librados can't be measured, so it's
+ * estimated from what it holds.
+ *
+ * Functions of rt.c allocate through rt_mem_alloc, which accounts to the
+ * rt_mem bound to the calling thread with rt_mem_bind, if any. Contexts
+ * bind theirs for the duration of each operation, see ctx.h.
+ *
+ * Counters are updated atomically, an rt_mem may be shared by threads.
+ */
+
+typedef enum rt_mem_kind {
+  // Buffers of a single operation: key arrays, keysets, pages of keys.
+  RT_MEM_SCRATCH,
+  // State kept between operations, such as idle I/O contexts.
+  RT_MEM_CACHE,
+  // OMap entries held by librados for rados_omap_iter_t, estimated.
+  RT_MEM_ITERATORS,
+  // Operations queued for worker threads.
+  RT_MEM_QUEUES,
+  RT_MEM_KINDS,
+} rt_mem_kind_t;
+
+// Estimated librados overhead of an OMap entry held by an iterator, in
+// addition to its key and value.
+#define RT_MEM_OMAP_ENTRY_SIZE 96
+// Estimated size of an idle librados I/O context.
+#define RT_MEM_IOCTX_SIZE 2048
+
+typedef struct rt_mem {
+  size_t used[RT_MEM_KINDS];
+  size_t peak[RT_MEM_KINDS];
+  size_t total;
+  size_t total_peak;
+} rt_mem_t;
+
+/**
+ * rt_mem_kind_name returns a short name of subsystem `kind`.
+ */
+const char *rt_mem_kind_name(rt_mem_kind_t kind);
+
+/**
+ * rt_mem_charge adds `bytes`, negative to release them, to the usage of
+ * `kind` in `m`. Does nothing if `m` is NULL.
+ */
+void rt_mem_charge(rt_mem_t *m, rt_mem_kind_t kind, long bytes);
+
+/**
+ * rt_mem_bind binds `m` to the calling thread, NULL unbinds. Returns the
+ * previous binding, to be restored afterwards.
+ */
+rt_mem_t *rt_mem_bind(rt_mem_t *m);
+
+/**
+ * rt_mem_bound returns the rt_mem bound to the calling thread, or NULL.
+ */
+rt_mem_t *rt_mem_bound(void);
+
+/**
+ * rt_mem_alloc allocates `size` bytes accounted as `kind` to the rt_mem
+ * bound to the calling thread.
+ */
+void *rt_mem_alloc(rt_mem_kind_t kind, size_t size);
+
+/**
+ * rt_mem_free frees memory allocated by rt_mem_alloc, on any thread.
+ */
+void rt_mem_free(void *ptr);
+
+/**
+ * rt_mem_snapshot copies counters of `m` into `out`.
+ */
+void rt_mem_snapshot(const rt_mem_t *m, rt_mem_t *out);
+
+#endif // mem_h_INCLUDED
@@ -0,0 +1,1002 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "ctx.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+/*
+
+Python bindings
+===============
+
+The reference_tracker module wraps an rt_ctx, see ctx.h, so that scripts
+connect to the cluster once and issue any number of RT operations on it:
+
+    import reference_tracker
+
+    with reference_tracker.Context("admin", "/etc/ceph/ceph.conf") as ctx:
+        created = ctx.add("pool", "rt", ["key1", b"key2"])
+        refcount, keys = ctx.list_keys("pool", "rt")
+        deleted = await ctx.remove_async("pool", "rt", keys)
+
+Keys are given as a str, a bytes-like object, or a sequence of them. Their
+memory is passed to the length-based RT API as is: str keys as their UTF-8
+representation cached by Python, others through the buffer protocol, which
+also keeps buffers such as bytearrays from being resized meanwhile.
+
+The GIL is released while RADOS I/O is in progress. Asynchronous calls are
+started on the context, see rt_ctx_start, and their results are delivered
+to the event loop of the caller. The first loop making asynchronous calls
+watches the event fd of the context with add_reader, and processes
+completions itself, so that updates of single object RTs don't go through
+worker threads. Calls from other loops are executed by worker threads.
+Failures are raised as OSError.
+
+*/
+
+#define DEFAULT_WORKERS 8
+#define DEFAULT_PAGE_SIZE 1000
+// Maximum number of congestion windows reported by stats().
+#define CONTEXT_WINDOWS_MAX 64
+
+typedef struct {
+  PyObject_HEAD rt_ctx_t *ctx;
+  // Synchronous calls in progress with the GIL released.
+  int users;
+  // Event loop watching the event fd of the context.
+  PyObject *reader_loop;
+} ContextObject;
+
+// Keys referring to memory of Python objects.
+typedef struct keys {
+  // Sequence of the key objects, keeping them alive.
+  PyObject *seq;
+  const char **keys;
+  size_t *lens;
+  int count;
+  Py_buffer *views;
+  int views_count;
+} keys_t;
+
+// An RT update with references to its arguments.
+typedef struct py_op {
+  rt_ctx_op_t op;
+  PyObject *pool;
+  PyObject *rt;
+  keys_t keys;
+} py_op_t;
+
+// Asynchronous call of one or more ops, resolving `future` once all are
+// done. Calls don't keep their context alive, closing it waits for them
+// instead.
+typedef struct async_call {
+  py_op_t *ops;
+  int count;
+  int remaining;
+  int batch;
+  PyObject *loop;
+  PyObject *future;
+} async_call_t;
+
+static PyObject *asyncio_module;
+static PyObject *complete_func;
+
+/*
+ * Arguments.
+ */
+
+static void keys_release(keys_t *k) {
+  for (int i = 0; i < k->views_count; i++) {
+    PyBuffer_Release(&k->views[i]);
+  }
+  PyMem_Free(k->views);
+  PyMem_Free(k->keys);
+  PyMem_Free(k->lens);
+  Py_XDECREF(k->seq);
+  memset(k, 0, sizeof(keys_t));
+}
+
+static int keys_init(keys_t *k, PyObject *obj) {
+  memset(k, 0, sizeof(keys_t));
+
+  if (PyUnicode_Check(obj) || PyObject_CheckBuffer(obj)) {
+    k->seq = PyTuple_Pack(1, obj);
+  } else {
+    k->seq = PySequence_Fast(obj, "keys must be a str, a bytes-like object "
+                                  "or a sequence of them");
+  }
+  if (!k->seq) {
+    return -1;
+  }
+
+  Py_ssize_t n = PySequence_Fast_GET_SIZE(k->seq);
+  if (n == 0 || n > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "invalid number of keys");
+    goto fail;
+  }
+
+  k->keys = PyMem_Malloc(sizeof(char *) * n);
+  k->lens = PyMem_Malloc(sizeof(size_t) * n);
+  k->views = PyMem_Malloc(sizeof(Py_buffer) * n);
+  if (!k->keys || !k->lens || !k->views) {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  PyObject **items = PySequence_Fast_ITEMS(k->seq);
+  for (; k->count < n; k->count++) {
+    PyObject *item = items[k->count];
+    Py_ssize_t len;
+
+    if (PyUnicode_Check(item)) {
+      if (!(k->keys[k->count] = PyUnicode_AsUTF8AndSize(item, &len))) {
+        goto fail;
+      }
+    } else {
+      Py_buffer *view = &k->views[k->views_count];
+      if (PyObject_GetBuffer(item, view, PyBUF_SIMPLE) < 0) {
+        goto fail;
+      }
+      k->views_count++;
+      k->keys[k->count] = view->buf;
+      len = view->len;
+    }
+
+    k->lens[k->count] = len;
+  }
+
+  return 0;
+
+fail:
+  keys_release(k);
+  return -1;
+}
+
+static void py_op_release(py_op_t *o) {
+  keys_release(&o->keys);
+  Py_XDECREF(o->pool);
+  Py_XDECREF(o->rt);
+}
+
+static int py_op_init(py_op_t *o, int remove, PyObject *pool, PyObject *rt,
+                      PyObject *keys) {
+  memset(o, 0, sizeof(py_op_t));
+
+  if (!PyUnicode_Check(pool) || !PyUnicode_Check(rt)) {
+    PyErr_SetString(PyExc_TypeError, "pool and RT names must be str");
+    return -1;
+  }
+
+  o->op.remove = remove;
+  if (!(o->op.pool_name = PyUnicode_AsUTF8(pool)) ||
+      !(o->op.rt_name = PyUnicode_AsUTF8(rt)) ||
+      keys_init(&o->keys, keys) < 0) {
+    return -1;
+  }
+
+  o->op.keys = o->keys.keys;
+  o->op.key_lens = o->keys.lens;
+  o->op.keys_count = o->keys.count;
+
+  Py_INCREF(pool);
+  o->pool = pool;
+  Py_INCREF(rt);
+  o->rt = rt;
+
+  return 0;
+}
+
+// Parses an item of a batch, a tuple of ("add" or "remove", pool, RT, keys).
+static int py_op_from_tuple(py_op_t *o, PyObject *item) {
+  const char *verb;
+  PyObject *pool, *rt, *keys;
+
+  if (!PyArg_ParseTuple(item, "sUUO", &verb, &pool, &rt, &keys)) {
+    return -1;
+  }
+
+  if (strcmp(verb, "add") != 0 && strcmp(verb, "remove") != 0) {
+    PyErr_Format(PyExc_ValueError, "unknown operation %s", verb);
+    return -1;
+  }
+
+  return py_op_init(o, strcmp(verb, "remove") == 0, pool, rt, keys);
+}
+
+// Returns the result of a completed op: a bool, or an OSError instance.
+static PyObject *py_op_result(const py_op_t *o) {
+  if (o->op.ret < 0) {
+    return PyObject_CallFunction(PyExc_OSError, "is", -o->op.ret,
+                                 strerror(-o->op.ret));
+  }
+
+  return PyBool_FromLong(o->op.flag);
+}
+
+static PyObject *raise_errno(int ret) {
+  errno = -ret;
+  return PyErr_SetFromErrno(PyExc_OSError);
+}
+
+/*
+ * Context.
+ */
+
+static int context_check(ContextObject *self) {
+  if (!self->ctx) {
+    PyErr_SetString(PyExc_ValueError, "context is closed");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int context_init(ContextObject *self, PyObject *args,
+                        PyObject *kwargs) {
+  static char *kwlist[] = {"client_id", "conf_file", "workers", "mem_limit",
+                           "writer_id", "rollup_interval_ms", NULL};
+  const char *client_id;
+  const char *conf_file = NULL;
+  int workers = DEFAULT_WORKERS;
+  Py_ssize_t mem_limit = 0;
+  const char *writer_id = NULL;
+  int rollup_interval_ms = 0;
+  int ret;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|zinzi", kwlist,
+                                   &client_id, &conf_file, &workers,
+                                   &mem_limit, &writer_id,
+                                   &rollup_interval_ms)) {
+    return -1;
+  }
+
+  if (self->ctx) {
+    PyErr_SetString(PyExc_RuntimeError, "context is already initialized");
+    return -1;
+  }
+
+  if (workers <= 0 || mem_limit < 0 || rollup_interval_ms < 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "workers must be positive, and mem_limit and "
+                    "rollup_interval_ms not negative");
+    return -1;
+  }
+
+  Py_BEGIN_ALLOW_THREADS;
+  ret = rt_ctx_connect(client_id, conf_file, workers, &self->ctx);
+  Py_END_ALLOW_THREADS;
+
+  if (ret < 0) {
+    self->ctx = NULL;
+    raise_errno(ret);
+    return -1;
+  }
+
+  rt_ctx_set_mem_limit(self->ctx, mem_limit);
+
+  if (rollup_interval_ms > 0 &&
+      (ret = rt_ctx_start_rollups(self->ctx, rollup_interval_ms)) < 0) {
+    Py_BEGIN_ALLOW_THREADS;
+    rt_ctx_destroy(self->ctx);
+    Py_END_ALLOW_THREADS;
+
+    self->ctx = NULL;
+    raise_errno(ret);
+    return -1;
+  }
+
+  if (writer_id) {
+    rt_opts_t opts;
+    rt_opts_init(&opts);
+    opts.layout = RT_LAYOUT_PARTITIONED;
+    opts.writer_id = writer_id;
+    rt_ctx_set_opts(self->ctx, &opts);
+  }
+
+  return 0;
+}
+
+static void context_close_ctx(ContextObject *self) {
+  rt_ctx_t *ctx = self->ctx;
+  self->ctx = NULL;
+
+  if (self->reader_loop) {
+    PyObject *ret = PyObject_CallMethod(self->reader_loop, "remove_reader",
+                                        "i", rt_ctx_event_fd(ctx));
+    if (!ret) {
+      // The loop is closed, it's not watching anymore.
+      PyErr_Clear();
+    }
+    Py_XDECREF(ret);
+    Py_CLEAR(self->reader_loop);
+  }
+
+  // Workers may need the GIL to complete asynchronous calls.
+  Py_BEGIN_ALLOW_THREADS;
+  rt_ctx_destroy(ctx);
+  Py_END_ALLOW_THREADS;
+}
+
+static void context_dealloc(ContextObject *self) {
+  if (self->ctx) {
+    context_close_ctx(self);
+  }
+
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *context_close(ContextObject *self, PyObject *unused) {
+  if (self->users > 0) {
+    PyErr_SetString(PyExc_RuntimeError, "context is in use");
+    return NULL;
+  }
+
+  if (self->ctx) {
+    context_close_ctx(self);
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *context_enter(ContextObject *self, PyObject *unused) {
+  if (context_check(self) < 0) {
+    return NULL;
+  }
+
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
+
+static PyObject *context_exit(ContextObject *self, PyObject *args) {
+  return context_close(self, NULL);
+}
+
+static PyObject *context_update(ContextObject *self, PyObject *args,
+                                int remove) {
+  PyObject *pool, *rt, *keys;
+  py_op_t o;
+
+  if (!PyArg_ParseTuple(args, "UUO", &pool, &rt, &keys) ||
+      context_check(self) < 0 || py_op_init(&o, remove, pool, rt, keys) < 0) {
+    return NULL;
+  }
+
+  self->users++;
+  Py_BEGIN_ALLOW_THREADS;
+  if (remove) {
+    o.op.ret = rt_ctx_remove(self->ctx, o.op.pool_name, o.op.rt_name,
+                             o.op.keys, o.op.key_lens, o.op.keys_count,
+                             &o.op.flag);
+  } else {
+    o.op.ret =
+        rt_ctx_add(self->ctx, o.op.pool_name, o.op.rt_name, o.op.keys,
+                   o.op.key_lens, o.op.keys_count, &o.op.flag);
+  }
+  Py_END_ALLOW_THREADS;
+  self->users--;
+
+  PyObject *result =
+      o.op.ret < 0 ? raise_errno(o.op.ret) : PyBool_FromLong(o.op.flag);
+  py_op_release(&o);
+  return result;
+}
+
+static PyObject *context_add(ContextObject *self, PyObject *args) {
+  return context_update(self, args, 0);
+}
+
+static PyObject *context_remove(ContextObject *self, PyObject *args) {
+  return context_update(self, args, 1);
+}
+
+// rt_keys_cb appending keys to a list.
+static int list_page(const char *const *keys, const size_t *key_lens,
+                     int keys_count, void *arg) {
+  PyGILState_STATE gil = PyGILState_Ensure();
+  int ret = 0;
+
+  for (int i = 0; i < keys_count; i++) {
+    PyObject *key = PyBytes_FromStringAndSize(keys[i], key_lens[i]);
+    if (!key || PyList_Append(arg, key) < 0) {
+      Py_XDECREF(key);
+      ret = -ENOMEM;
+      break;
+    }
+    Py_DECREF(key);
+  }
+
+  PyGILState_Release(gil);
+  return ret;
+}
+
+static PyObject *context_list_keys(ContextObject *self, PyObject *args,
+                                   PyObject *kwargs) {
+  static char *kwlist[] = {"pool", "rt", "page_size", NULL};
+  const char *pool_name, *rt_name;
+  int page_size = DEFAULT_PAGE_SIZE;
+  uint32_t refcount = 0;
+  int ret;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|i", kwlist, &pool_name,
+                                   &rt_name, &page_size) ||
+      context_check(self) < 0) {
+    return NULL;
+  }
+
+  if (page_size <= 0) {
+    PyErr_SetString(PyExc_ValueError, "page_size must be positive");
+    return NULL;
+  }
+
+  PyObject *keys = PyList_New(0);
+  if (!keys) {
+    return NULL;
+  }
+
+  self->users++;
+  Py_BEGIN_ALLOW_THREADS;
+  ret = rt_ctx_list_keys(self->ctx, pool_name, rt_name, page_size, list_page,
+                         keys, &refcount);
+  Py_END_ALLOW_THREADS;
+  self->users--;
+
+  if (ret < 0) {
+    Py_DECREF(keys);
+    return PyErr_Occurred() ? NULL : raise_errno(ret);
+  }
+
+  return Py_BuildValue("(IN)", refcount, keys);
+}
+
+// Parses a batch into `count` ops.
+static py_op_t *parse_batch(PyObject *batch, int *count) {
+  PyObject *seq = PySequence_Fast(batch, "batch must be a sequence");
+  if (!seq) {
+    return NULL;
+  }
+
+  Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+  if (n > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "batch is too large");
+    Py_DECREF(seq);
+    return NULL;
+  }
+
+  py_op_t *ops = PyMem_Calloc(n ? n : 1, sizeof(py_op_t));
+  if (!ops) {
+    Py_DECREF(seq);
+    PyErr_NoMemory();
+    return NULL;
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (py_op_from_tuple(&ops[i], PySequence_Fast_GET_ITEM(seq, i)) < 0) {
+      for (int j = 0; j < i; j++) {
+        py_op_release(&ops[j]);
+      }
+      PyMem_Free(ops);
+      Py_DECREF(seq);
+      return NULL;
+    }
+  }
+
+  Py_DECREF(seq);
+  *count = n;
+  return ops;
+}
+
+// Returns a list of results of `count` completed ops.
+static PyObject *batch_results(py_op_t *ops, int count) {
+  PyObject *results = PyList_New(count);
+
+  for (int i = 0; results && i < count; i++) {
+    PyObject *result = py_op_result(&ops[i]);
+    if (!result) {
+      Py_CLEAR(results);
+      break;
+    }
+    PyList_SET_ITEM(results, i, result);
+  }
+
+  return results;
+}
+
+static PyObject *context_batch(ContextObject *self, PyObject *args) {
+  PyObject *batch;
+  int count;
+
+  if (!PyArg_ParseTuple(args, "O", &batch) || context_check(self) < 0) {
+    return NULL;
+  }
+
+  py_op_t *ops = parse_batch(batch, &count);
+  if (!ops) {
+    return NULL;
+  }
+
+  PyObject *results = NULL;
+  rt_ctx_op_t *c_ops = PyMem_Malloc(sizeof(rt_ctx_op_t) * (count ? count : 1));
+  if (!c_ops) {
+    PyErr_NoMemory();
+    goto out;
+  }
+
+  for (int i = 0; i < count; i++) {
+    c_ops[i] = ops[i].op;
+  }
+
+  self->users++;
+  Py_BEGIN_ALLOW_THREADS;
+  rt_ctx_batch(self->ctx, c_ops, count);
+  Py_END_ALLOW_THREADS;
+  self->users--;
+
+  for (int i = 0; i < count; i++) {
+    ops[i].op = c_ops[i];
+  }
+
+  results = batch_results(ops, count);
+
+out:
+
+  for (int i = 0; i < count; i++) {
+    py_op_release(&ops[i]);
+  }
+  PyMem_Free(c_ops);
+  PyMem_Free(ops);
+
+  return results;
+}
+
+static PyObject *context_set_mem_limit(ContextObject *self, PyObject *args) {
+  Py_ssize_t bytes;
+
+  if (!PyArg_ParseTuple(args, "n", &bytes) || context_check(self) < 0) {
+    return NULL;
+  }
+
+  if (bytes < 0) {
+    PyErr_SetString(PyExc_ValueError, "mem_limit must not be negative");
+    return NULL;
+  }
+
+  rt_ctx_set_mem_limit(self->ctx, bytes);
+  Py_RETURN_NONE;
+}
+
+static PyObject *context_delegate(ContextObject *self, PyObject *args) {
+  const char *pool, *rt;
+  int ret;
+
+  if (!PyArg_ParseTuple(args, "ss", &pool, &rt) || context_check(self) < 0) {
+    return NULL;
+  }
+
+  self->users++;
+  Py_BEGIN_ALLOW_THREADS;
+  ret = rt_ctx_delegate(self->ctx, pool, rt);
+  Py_END_ALLOW_THREADS;
+  self->users--;
+
+  if (ret < 0) {
+    return raise_errno(ret);
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *context_undelegate(ContextObject *self, PyObject *args) {
+  const char *pool, *rt;
+
+  if (!PyArg_ParseTuple(args, "ss", &pool, &rt) || context_check(self) < 0) {
+    return NULL;
+  }
+
+  self->users++;
+  Py_BEGIN_ALLOW_THREADS;
+  rt_ctx_undelegate(self->ctx, pool, rt);
+  Py_END_ALLOW_THREADS;
+  self->users--;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *context_stats(ContextObject *self, PyObject *unused) {
+  rt_ctx_stats_t stats;
+
+  if (context_check(self) < 0) {
+    return NULL;
+  }
+
+  rt_ctx_get_stats(self->ctx, &stats);
+
+  PyObject *mem = PyDict_New();
+  for (int i = 0; mem && i < RT_MEM_KINDS; i++) {
+    PyObject *kind = Py_BuildValue("{s:n,s:n}", "used", stats.mem.used[i],
+                                   "peak", stats.mem.peak[i]);
+    if (!kind || PyDict_SetItemString(mem, rt_mem_kind_name(i), kind) < 0) {
+      Py_XDECREF(kind);
+      Py_CLEAR(mem);
+      break;
+    }
+    Py_DECREF(kind);
+  }
+  if (!mem) {
+    return NULL;
+  }
+
+  rt_window_stats_t windows[CONTEXT_WINDOWS_MAX];
+  int windows_count =
+      rt_ctx_get_windows(self->ctx, windows, CONTEXT_WINDOWS_MAX);
+
+  PyObject *wins = PyDict_New();
+  for (int i = 0; wins && i < windows_count; i++) {
+    PyObject *win = Py_BuildValue("{s:i,s:i,s:k}", "size", windows[i].size,
+                                  "in_flight", windows[i].in_flight, "cuts",
+                                  windows[i].cuts);
+    if (!win || PyDict_SetItemString(wins, windows[i].pool_name, win) < 0) {
+      Py_XDECREF(win);
+      Py_CLEAR(wins);
+      break;
+    }
+    Py_DECREF(win);
+  }
+  if (!wins) {
+    Py_DECREF(mem);
+    return NULL;
+  }
+
+  return Py_BuildValue("{s:N,s:n,s:n,s:n,s:i,s:i,s:k,s:k,s:N}", "mem", mem,
+                       "mem_total", stats.mem.total, "mem_peak",
+                       stats.mem.total_peak, "mem_limit", stats.mem_limit,
+                       "in_flight", stats.in_flight, "idle_ioctxs",
+                       stats.idle_ioctxs, "sheds", stats.sheds, "throttled",
+                       stats.throttled, "windows", wins);
+}
+
+/*
+ * Asynchronous calls.
+ */
+
+static void async_call_free(async_call_t *call) {
+  for (int i = 0; i < call->count; i++) {
+    py_op_release(&call->ops[i]);
+  }
+  PyMem_Free(call->ops);
+  Py_XDECREF(call->loop);
+  Py_XDECREF(call->future);
+  PyMem_Free(call);
+}
+
+// Hands the results of a completed call over to its event loop, and frees
+// the call. Called with the GIL held.
+static void async_call_finish(async_call_t *call) {
+  PyObject *result = call->batch ? batch_results(call->ops, call->count)
+                                 : py_op_result(&call->ops[0]);
+  if (!result) {
+    PyObject *type, *tb;
+    PyErr_Fetch(&type, &result, &tb);
+    PyErr_NormalizeException(&type, &result, &tb);
+    Py_XDECREF(type);
+    Py_XDECREF(tb);
+  }
+
+  PyObject *ret = PyObject_CallMethod(call->loop, "call_soon_threadsafe",
+                                      "OOO", complete_func, call->future,
+                                      result);
+  if (!ret) {
+    // The loop is closed, there's nobody to tell.
+    PyErr_Clear();
+  }
+
+  Py_XDECREF(ret);
+  Py_XDECREF(result);
+  async_call_free(call);
+}
+
+// rt_ctx_op_cb of asynchronous calls.
+static void async_op_done(rt_ctx_op_t *op) {
+  async_call_t *call = op->arg;
+
+  if (__atomic_sub_fetch(&call->remaining, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+
+  PyGILState_STATE gil = PyGILState_Ensure();
+  async_call_finish(call);
+  PyGILState_Release(gil);
+}
+
+// Returns whether ops of calls from `loop` are started on the context,
+// with their completions processed by the loop. The first loop asking
+// starts watching the event fd.
+static int async_loop_watches(ContextObject *self, PyObject *loop) {
+  if (!self->reader_loop) {
+    PyObject *process =
+        PyObject_GetAttrString((PyObject *)self, "process_completions");
+    PyObject *ret =
+        process ? PyObject_CallMethod(loop, "add_reader", "iO",
+                                      rt_ctx_event_fd(self->ctx), process)
+                : NULL;
+    Py_XDECREF(process);
+
+    if (!ret) {
+      // E.g. loops without add_reader, their calls are run by workers.
+      PyErr_Clear();
+      return 0;
+    }
+
+    Py_DECREF(ret);
+    Py_INCREF(loop);
+    self->reader_loop = loop;
+  }
+
+  return self->reader_loop == loop;
+}
+
+// Submits ops of `call` and returns its future. Takes ownership of the
+// call.
+static PyObject *async_call_submit(ContextObject *self, async_call_t *call) {
+  call->remaining = call->count;
+
+  if (!(call->loop = PyObject_CallMethod(asyncio_module, "get_running_loop",
+                                         NULL)) ||
+      !(call->future = PyObject_CallMethod(call->loop, "create_future",
+                                           NULL))) {
+    async_call_free(call);
+    return NULL;
+  }
+
+  PyObject *future = call->future;
+  Py_INCREF(future);
+
+  if (call->count == 0) {
+    async_call_finish(call);
+    return future;
+  }
+
+  for (int i = 0; i < call->count; i++) {
+    call->ops[i].op.cb = async_op_done;
+    call->ops[i].op.arg = call;
+  }
+
+  // The call may complete and be freed as soon as its last op is queued.
+  py_op_t *ops = call->ops;
+  int count = call->count;
+  int start = async_loop_watches(self, call->loop);
+  int ret = 0;
+  int i;
+
+  self->users++;
+  Py_BEGIN_ALLOW_THREADS;
+  for (i = 0; i < count; i++) {
+    if ((ret = start ? rt_ctx_start(self->ctx, &ops[i].op)
+                     : rt_ctx_submit(self->ctx, &ops[i].op)) < 0) {
+      break;
+    }
+  }
+  Py_END_ALLOW_THREADS;
+  self->users--;
+
+  if (ret < 0) {
+    // Fail the ops that didn't make it into the queue.
+    int last = 0;
+    for (int j = i; j < count; j++) {
+      ops[j].op.ret = ret;
+      last = __atomic_sub_fetch(&call->remaining, 1, __ATOMIC_ACQ_REL) == 0;
+    }
+    if (last) {
+      async_call_finish(call);
+    }
+  }
+
+  return future;
+}
+
+static PyObject *context_update_async(ContextObject *self, PyObject *args,
+                                      int remove) {
+  PyObject *pool, *rt, *keys;
+
+  if (!PyArg_ParseTuple(args, "UUO", &pool, &rt, &keys) ||
+      context_check(self) < 0) {
+    return NULL;
+  }
+
+  async_call_t *call = PyMem_Calloc(1, sizeof(async_call_t));
+  if (!call || !(call->ops = PyMem_Calloc(1, sizeof(py_op_t)))) {
+    PyMem_Free(call);
+    return PyErr_NoMemory();
+  }
+
+  if (py_op_init(&call->ops[0], remove, pool, rt, keys) < 0) {
+    async_call_free(call);
+    return NULL;
+  }
+  call->count = 1;
+
+  return async_call_submit(self, call);
+}
+
+static PyObject *context_add_async(ContextObject *self, PyObject *args) {
+  return context_update_async(self, args, 0);
+}
+
+static PyObject *context_remove_async(ContextObject *self, PyObject *args) {
+  return context_update_async(self, args, 1);
+}
+
+static PyObject *context_batch_async(ContextObject *self, PyObject *args) {
+  PyObject *batch;
+
+  if (!PyArg_ParseTuple(args, "O", &batch) || context_check(self) < 0) {
+    return NULL;
+  }
+
+  async_call_t *call = PyMem_Calloc(1, sizeof(async_call_t));
+  if (!call) {
+    return PyErr_NoMemory();
+  }
+
+  call->batch = 1;
+  if (!(call->ops = parse_batch(batch, &call->count))) {
+    PyMem_Free(call);
+    return NULL;
+  }
+
+  return async_call_submit(self, call);
+}
+
+static PyObject *context_fileno(ContextObject *self, PyObject *unused) {
+  if (context_check(self) < 0) {
+    return NULL;
+  }
+
+  return PyLong_FromLong(rt_ctx_event_fd(self->ctx));
+}
+
+static PyObject *context_process_completions(ContextObject *self,
+                                             PyObject *unused) {
+  int done;
+
+  if (context_check(self) < 0) {
+    return NULL;
+  }
+
+  // Callbacks take the GIL, and so may workers the context waits for.
+  self->users++;
+  Py_BEGIN_ALLOW_THREADS;
+  done = rt_ctx_process_completions(self->ctx);
+  Py_END_ALLOW_THREADS;
+  self->users--;
+
+  return PyLong_FromLong(done);
+}
+
+// Sets the result of `future` on its loop, unless it's been cancelled.
+static PyObject *complete(PyObject *module, PyObject *args) {
+  PyObject *future, *result;
+
+  if (!PyArg_ParseTuple(args, "OO", &future, &result)) {
+    return NULL;
+  }
+
+  PyObject *done = PyObject_CallMethod(future, "done", NULL);
+  if (!done) {
+    return NULL;
+  }
+
+  int is_done = PyObject_IsTrue(done);
+  Py_DECREF(done);
+  if (is_done) {
+    Py_RETURN_NONE;
+  }
+
+  return PyObject_CallMethod(future,
+                             PyExceptionInstance_Check(result)
+                                 ? "set_exception"
+                                 : "set_result",
+                             "O", result);
+}
+
+static PyMethodDef context_methods[] = {
+    {"add", (PyCFunction)context_add, METH_VARARGS,
+     "add(pool, rt, keys) -> bool\n\nAdds keys to RT, returns whether the RT "
+     "was created."},
+    {"remove", (PyCFunction)context_remove, METH_VARARGS,
+     "remove(pool, rt, keys) -> bool\n\nRemoves keys from RT, returns "
+     "whether the RT was deleted."},
+    {"list_keys", (PyCFunction)(void (*)(void))context_list_keys,
+     METH_VARARGS | METH_KEYWORDS,
+     "list_keys(pool, rt, page_size=1000) -> (refcount, keys)\n\nLists keys "
+     "of RT as bytes."},
+    {"batch", (PyCFunction)context_batch, METH_VARARGS,
+     "batch(ops) -> list\n\nExecutes (\"add\" or \"remove\", pool, rt, keys) "
+     "ops concurrently. Returns their results, with OSError for failed ops."},
+    {"add_async", (PyCFunction)context_add_async, METH_VARARGS,
+     "add_async(pool, rt, keys) -> awaitable of bool\n\nAsynchronous add()."},
+    {"remove_async", (PyCFunction)context_remove_async, METH_VARARGS,
+     "remove_async(pool, rt, keys) -> awaitable of bool\n\nAsynchronous "
+     "remove()."},
+    {"batch_async", (PyCFunction)context_batch_async, METH_VARARGS,
+     "batch_async(ops) -> awaitable of list\n\nAsynchronous batch()."},
+    {"fileno", (PyCFunction)context_fileno, METH_NOARGS,
+     "fileno() -> int\n\nEvent fd, readable while asynchronous calls have "
+     "completions to process."},
+    {"process_completions", (PyCFunction)context_process_completions,
+     METH_NOARGS,
+     "process_completions() -> int\n\nProcesses completions of "
+     "asynchronous calls without blocking, returns the number of ops "
+     "done. Called by the event loop watching fileno()."},
+    {"delegate", (PyCFunction)context_delegate, METH_VARARGS,
+     "delegate(pool, rt)\n\nAcquires write delegation of RT, recalling it "
+     "from its holder. Calls on the RT are served locally until it's "
+     "recalled."},
+    {"undelegate", (PyCFunction)context_undelegate, METH_VARARGS,
+     "undelegate(pool, rt)\n\nReleases write delegation of RT."},
+    {"stats", (PyCFunction)context_stats, METH_NOARGS,
+     "stats() -> dict\n\nMemory used per subsystem with high-water marks, "
+     "how often the memory limit shed caches and held operations back, and "
+     "congestion windows of batches per pool."},
+    {"set_mem_limit", (PyCFunction)context_set_mem_limit, METH_VARARGS,
+     "set_mem_limit(bytes)\n\nSets the soft memory limit, 0 for none."},
+    {"close", (PyCFunction)context_close, METH_NOARGS,
+     "close()\n\nWaits for asynchronous calls and disconnects."},
+    {"__enter__", (PyCFunction)context_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)context_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyTypeObject ContextType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "reference_tracker.Context",
+    .tp_doc = "Context(client_id, conf_file=None, workers=8, mem_limit=0, "
+              "writer_id=None, rollup_interval_ms=0)\n\nConnection to a "
+              "Ceph cluster for RT operations, with `workers` threads "
+              "executing asynchronous calls. Once memory used exceeds "
+              "`mem_limit` bytes, caches are dropped and new calls wait for "
+              "calls in progress. With `writer_id`, e.g. a node ID, RTs are "
+              "created partitioned, and updated in the partition of the "
+              "writer. With `rollup_interval_ms`, updates feed the pool "
+              "rollups, flushed every `rollup_interval_ms` milliseconds. Only "
+              "one context per process can feed them.",
+    .tp_basicsize = sizeof(ContextObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)context_init,
+    .tp_dealloc = (destructor)context_dealloc,
+    .tp_methods = context_methods,
+};
+
+static PyMethodDef module_methods[] = {
+    {"_complete", complete, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "reference_tracker",
+    .m_doc = "RADOS reference trackers.",
+    .m_size = -1,
+    .m_methods = module_methods,
+};
+
+PyMODINIT_FUNC PyInit_reference_tracker(void) {
+  if (PyType_Ready(&ContextType) < 0) {
+    return NULL;
+  }
+
+  PyObject *m = PyModule_Create(&module);
+  if (!m) {
+    return NULL;
+  }
+
+  if (!(asyncio_module = PyImport_ImportModule("asyncio")) ||
+      !(complete_func = PyObject_GetAttrString(m, "_complete")) ||
+      PyModule_AddObjectRef(m, "Context", (PyObject *)&ContextType) < 0) {
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  return m;
+}
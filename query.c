@@ -0,0 +1,737 @@
+#define _GNU_SOURCE
+
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Number of records a scanner thread claims at once.
+#define QUERY_CHUNK 256
+// Size of per-thread output buffer. Results are streamed to stdout every
+// time it fills up.
+#define QUERY_OUT_BUF_SIZE (64 * 1024)
+// Number of refcount histogram buckets: 0, 1, 2-3, 4-7, ... 2^31-2^32-1.
+#define QUERY_HIST_BUCKETS 34
+
+typedef enum query_op {
+  QUERY_KEYS,
+  QUERY_RTS,
+  QUERY_HIST,
+  QUERY_INDEX,
+  QUERY_LOOKUP
+} query_op_t;
+
+// Memory-mapped snapshot.
+typedef struct snap {
+  const char *data;
+  size_t size;
+  uint64_t records_count;
+  const uint64_t *index;
+} snap_t;
+
+// Refcount histogram of a single tenant.
+typedef struct hist_entry {
+  const char *tenant;
+  uint32_t tenant_len;
+  uint64_t counts[QUERY_HIST_BUCKETS];
+} hist_entry_t;
+
+// Open-addressing hash map of tenant histograms.
+typedef struct hist_map {
+  hist_entry_t *entries;
+  size_t cap;
+  size_t len;
+} hist_map_t;
+
+typedef struct query {
+  snap_t snap;
+  query_op_t op;
+  const char *prefix;
+  size_t prefix_len;
+  char delim;
+  int threads;
+
+  // Next record to be claimed by a scanner.
+  uint64_t next;
+
+  pthread_mutex_t lock;
+  // QUERY_HIST: merged histograms.
+  hist_map_t hist;
+  // QUERY_INDEX: collected index entries.
+  rt_snap_idx_entry_t *entries;
+  uint64_t entries_len;
+} query_t;
+
+// Scanner thread state.
+typedef struct scanner {
+  query_t *q;
+  pthread_t thread;
+
+  char *out;
+  size_t out_len;
+
+  hist_map_t hist;
+
+  rt_snap_idx_entry_t *entries;
+  uint64_t entries_len;
+  uint64_t entries_cap;
+} scanner_t;
+
+/*
+ * Helpers.
+ */
+
+static inline uint32_t load_le32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+static inline uint64_t load_le64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+// has_prefix reports whether `s` of `len` bytes starts with `p`. Compares
+// 16, then 8 bytes at a time. Most keys differ from the prefix within the
+// first vector.
+static inline int has_prefix(const char *s, size_t len, const char *p,
+                             size_t plen) {
+  if (len < plen) {
+    return 0;
+  }
+
+  size_t i = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= plen; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff) {
+      return 0;
+    }
+  }
+#endif
+
+  for (; i + 8 <= plen; i += 8) {
+    uint64_t a, b;
+    memcpy(&a, s + i, 8);
+    memcpy(&b, p + i, 8);
+    if (a != b) {
+      return 0;
+    }
+  }
+
+  for (; i < plen; i++) {
+    if (s[i] != p[i]) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void out_flush(scanner_t *s) {
+  if (s->out_len > 0) {
+    // A single fwrite call doesn't interleave with other threads.
+    fwrite(s->out, 1, s->out_len, stdout);
+    s->out_len = 0;
+  }
+}
+
+void out_line(scanner_t *s, const char *a, size_t a_len, const char *b,
+              size_t b_len) {
+  size_t len = a_len + (b ? 1 + b_len : 0) + 1;
+
+  if (s->out_len + len > QUERY_OUT_BUF_SIZE) {
+    out_flush(s);
+  }
+  if (len > QUERY_OUT_BUF_SIZE) {
+    // Doesn't fit the buffer at all, write it out directly.
+    flockfile(stdout);
+    fwrite(a, 1, a_len, stdout);
+    if (b) {
+      fputc('\t', stdout);
+      fwrite(b, 1, b_len, stdout);
+    }
+    fputc('\n', stdout);
+    funlockfile(stdout);
+    return;
+  }
+
+  char *p = s->out + s->out_len;
+  memcpy(p, a, a_len);
+  p += a_len;
+  if (b) {
+    *p++ = '\t';
+    memcpy(p, b, b_len);
+    p += b_len;
+  }
+  *p = '\n';
+
+  s->out_len += len;
+}
+
+int snap_open(const char *path, snap_t *snap) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  snap->size = st.st_size;
+  snap->data = mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (snap->data == MAP_FAILED) {
+    return -errno;
+  }
+
+  // Records are scanned mostly in order.
+  madvise((void *)snap->data, snap->size, MADV_SEQUENTIAL);
+
+  if (snap->size < sizeof(rt_snap_header_t) ||
+      memcmp(snap->data, RT_SNAP_MAGIC, 8) != 0) {
+    return -EINVAL;
+  }
+
+  snap->records_count = load_le64(snap->data + 8);
+  uint64_t index_offset = load_le64(snap->data + 16);
+
+  if (index_offset > snap->size ||
+      (snap->size - index_offset) / sizeof(uint64_t) < snap->records_count) {
+    return -EINVAL;
+  }
+
+  snap->index = (const uint64_t *)(snap->data + index_offset);
+
+  return 0;
+}
+
+/*
+ * Refcount histograms.
+ */
+
+static inline int hist_bucket(uint32_t refcount) {
+  return refcount == 0 ? 0 : 1 + (31 - __builtin_clz(refcount));
+}
+
+static inline uint64_t hist_hash(const char *s, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+hist_entry_t *hist_get(hist_map_t *m, const char *tenant, size_t len) {
+  if (m->len * 2 >= m->cap) {
+    // Grow and rehash.
+    hist_map_t grown = {.cap = m->cap ? m->cap * 2 : 64};
+    grown.entries = calloc(grown.cap, sizeof(hist_entry_t));
+
+    for (size_t i = 0; i < m->cap; i++) {
+      if (m->entries[i].tenant) {
+        hist_entry_t *e = hist_get(&grown, m->entries[i].tenant,
+                                   m->entries[i].tenant_len);
+        memcpy(e->counts, m->entries[i].counts, sizeof(e->counts));
+      }
+    }
+
+    free(m->entries);
+    *m = grown;
+  }
+
+  size_t i = hist_hash(tenant, len) & (m->cap - 1);
+  for (;; i = (i + 1) & (m->cap - 1)) {
+    hist_entry_t *e = &m->entries[i];
+
+    if (!e->tenant) {
+      e->tenant = tenant;
+      e->tenant_len = len;
+      m->len++;
+      return e;
+    }
+
+    if (e->tenant_len == len && memcmp(e->tenant, tenant, len) == 0) {
+      return e;
+    }
+  }
+}
+
+void hist_merge(hist_map_t *dst, const hist_map_t *src) {
+  for (size_t i = 0; i < src->cap; i++) {
+    const hist_entry_t *se = &src->entries[i];
+    if (!se->tenant) {
+      continue;
+    }
+
+    hist_entry_t *de = hist_get(dst, se->tenant, se->tenant_len);
+    for (int b = 0; b < QUERY_HIST_BUCKETS; b++) {
+      de->counts[b] += se->counts[b];
+    }
+  }
+}
+
+int hist_entry_cmp(const void *a, const void *b) {
+  const hist_entry_t *ea = a, *eb = b;
+  size_t n = ea->tenant_len < eb->tenant_len ? ea->tenant_len : eb->tenant_len;
+  int c = memcmp(ea->tenant, eb->tenant, n);
+  return c ? c : (int)ea->tenant_len - (int)eb->tenant_len;
+}
+
+/*
+ * Scanning.
+ */
+
+void scan_record(scanner_t *s, uint64_t record) {
+  query_t *q = s->q;
+  const snap_t *snap = &q->snap;
+
+  uint64_t off = le64toh(snap->index[record]);
+  if (off + sizeof(rt_snap_record_t) > snap->size) {
+    return;
+  }
+
+  const char *p = snap->data + off;
+  const char *end = snap->data + snap->size;
+
+  uint32_t name_len = load_le32(p);
+  uint32_t refcount = load_le32(p + 4);
+  uint32_t keys_count = load_le32(p + 8);
+  const char *name = p + sizeof(rt_snap_record_t);
+
+  if ((size_t)(end - name) < name_len) {
+    return;
+  }
+
+  if (q->op == QUERY_HIST) {
+    const char *d = memchr(name, q->delim, name_len);
+    size_t tenant_len = d ? (size_t)(d - name) : name_len;
+
+    hist_get(&s->hist, name, tenant_len)->counts[hist_bucket(refcount)]++;
+    return;
+  }
+
+  p = name + name_len;
+
+  for (uint32_t i = 0; i < keys_count; i++) {
+    if (end - p < 4) {
+      return;
+    }
+
+    uint32_t key_len = load_le32(p);
+    const char *key = p + 4;
+    if ((size_t)(end - key) < key_len) {
+      return;
+    }
+    p = key + key_len;
+
+    if (q->op == QUERY_INDEX) {
+      if (s->entries_len == s->entries_cap) {
+        s->entries_cap = s->entries_cap ? s->entries_cap * 2 : 4096;
+        s->entries =
+            realloc(s->entries, sizeof(rt_snap_idx_entry_t) * s->entries_cap);
+      }
+
+      rt_snap_idx_entry_t *e = &s->entries[s->entries_len++];
+      e->key_offset = key - snap->data;
+      e->key_len = key_len;
+      e->record = record;
+      continue;
+    }
+
+    if (!has_prefix(key, key_len, q->prefix, q->prefix_len)) {
+      continue;
+    }
+
+    if (q->op == QUERY_RTS) {
+      out_line(s, name, name_len, NULL, 0);
+      return;
+    }
+
+    out_line(s, name, name_len, key, key_len);
+  }
+}
+
+void *scan(void *arg) {
+  scanner_t *s = arg;
+  query_t *q = s->q;
+
+  s->out = malloc(QUERY_OUT_BUF_SIZE);
+
+  for (;;) {
+    uint64_t first =
+        __atomic_fetch_add(&q->next, QUERY_CHUNK, __ATOMIC_RELAXED);
+    if (first >= q->snap.records_count) {
+      break;
+    }
+
+    uint64_t last = first + QUERY_CHUNK;
+    if (last > q->snap.records_count) {
+      last = q->snap.records_count;
+    }
+
+    for (uint64_t i = first; i < last; i++) {
+      scan_record(s, i);
+    }
+  }
+
+  out_flush(s);
+  free(s->out);
+
+  // Hand over the aggregates.
+
+  pthread_mutex_lock(&q->lock);
+
+  if (q->op == QUERY_HIST) {
+    hist_merge(&q->hist, &s->hist);
+  }
+
+  if (q->op == QUERY_INDEX) {
+    q->entries = realloc(q->entries, sizeof(rt_snap_idx_entry_t) *
+                                         (q->entries_len + s->entries_len));
+    memcpy(q->entries + q->entries_len, s->entries,
+           sizeof(rt_snap_idx_entry_t) * s->entries_len);
+    q->entries_len += s->entries_len;
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  free(s->hist.entries);
+  free(s->entries);
+
+  return NULL;
+}
+
+void run_scan(query_t *q) {
+  scanner_t *scanners = calloc(q->threads, sizeof(scanner_t));
+
+  for (int i = 0; i < q->threads; i++) {
+    scanners[i].q = q;
+    pthread_create(&scanners[i].thread, NULL, scan, &scanners[i]);
+  }
+
+  for (int i = 0; i < q->threads; i++) {
+    pthread_join(scanners[i].thread, NULL);
+  }
+
+  free(scanners);
+}
+
+/*
+ * Side index.
+ */
+
+int idx_key_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+  size_t n = a_len < b_len ? a_len : b_len;
+  int c = memcmp(a, b, n);
+  return c ? c : (a_len > b_len) - (a_len < b_len);
+}
+
+int idx_entry_cmp(const void *a, const void *b, void *arg) {
+  const snap_t *snap = arg;
+  const rt_snap_idx_entry_t *ea = a, *eb = b;
+  return idx_key_cmp(snap->data + ea->key_offset, ea->key_len,
+                     snap->data + eb->key_offset, eb->key_len);
+}
+
+int build_index(query_t *q, const char *idx_path) {
+  run_scan(q);
+
+  qsort_r(q->entries, q->entries_len, sizeof(rt_snap_idx_entry_t),
+          idx_entry_cmp, &q->snap);
+
+  FILE *out = fopen(idx_path, "wb");
+  if (!out) {
+    return -errno;
+  }
+
+  rt_snap_idx_header_t header = {
+      .magic = RT_SNAP_IDX_MAGIC,
+      .entries_count = htole64(q->entries_len),
+      .snapshot_size = htole64(q->snap.size),
+  };
+  fwrite(&header, sizeof(header), 1, out);
+
+  for (uint64_t i = 0; i < q->entries_len; i++) {
+    rt_snap_idx_entry_t e = {
+        .key_offset = htole64(q->entries[i].key_offset),
+        .key_len = htole32(q->entries[i].key_len),
+        .record = htole32(q->entries[i].record),
+    };
+    fwrite(&e, sizeof(e), 1, out);
+  }
+
+  if (fclose(out) != 0) {
+    return -errno;
+  }
+
+  fprintf(stderr, "Indexed %lu keys of %lu RTs.\n", q->entries_len,
+          q->snap.records_count);
+
+  return 0;
+}
+
+int lookup(query_t *q, const char *idx_path) {
+  int fd = open(idx_path, O_RDONLY);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  const char *idx = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (idx == MAP_FAILED) {
+    return -errno;
+  }
+
+  if ((size_t)st.st_size < sizeof(rt_snap_idx_header_t) ||
+      memcmp(idx, RT_SNAP_IDX_MAGIC, 8) != 0 ||
+      load_le64(idx + 16) != q->snap.size) {
+    fprintf(stderr, "Index %s doesn't belong to this snapshot.\n", idx_path);
+    munmap((void *)idx, st.st_size);
+    return -EINVAL;
+  }
+
+  uint64_t count = load_le64(idx + 8);
+  const char *entries = idx + sizeof(rt_snap_idx_header_t);
+  if ((st.st_size - sizeof(rt_snap_idx_header_t)) /
+          sizeof(rt_snap_idx_entry_t) <
+      count) {
+    munmap((void *)idx, st.st_size);
+    return -EINVAL;
+  }
+
+#define ENTRY_KEY(i)                                                           \
+  (q->snap.data + load_le64(entries + (i) * sizeof(rt_snap_idx_entry_t)))
+#define ENTRY_KEY_LEN(i)                                                       \
+  load_le32(entries + (i) * sizeof(rt_snap_idx_entry_t) + 8)
+#define ENTRY_RECORD(i)                                                        \
+  load_le32(entries + (i) * sizeof(rt_snap_idx_entry_t) + 12)
+
+  // Find the first key not less than the prefix. All matching keys follow
+  // it.
+
+  uint64_t lo = 0, hi = count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (idx_key_cmp(ENTRY_KEY(mid), ENTRY_KEY_LEN(mid), q->prefix,
+                    q->prefix_len) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  scanner_t s = {.q = q, .out = malloc(QUERY_OUT_BUF_SIZE)};
+
+  for (uint64_t i = lo; i < count; i++) {
+    const char *key = ENTRY_KEY(i);
+    uint32_t key_len = ENTRY_KEY_LEN(i);
+
+    if (!has_prefix(key, key_len, q->prefix, q->prefix_len)) {
+      break;
+    }
+
+    const char *record =
+        q->snap.data + le64toh(q->snap.index[ENTRY_RECORD(i)]);
+    out_line(&s, record + sizeof(rt_snap_record_t), load_le32(record), key,
+             key_len);
+  }
+
+#undef ENTRY_KEY
+#undef ENTRY_KEY_LEN
+#undef ENTRY_RECORD
+
+  out_flush(&s);
+  free(s.out);
+  munmap((void *)idx, st.st_size);
+
+  return 0;
+}
+
+/*
+ * Command line.
+ */
+
+void print_usage(const char *progname) {
+  printf("rt-query runs analytics queries over RT snapshot files exported by "
+         "'reference-tracker -o export'.\n\n");
+
+  printf("Usage: %s -f SNAPSHOT FILE -q QUERY [-m KEY PREFIX] [-d DELIMITER] "
+         "[-j THREADS] [-h]\n",
+         progname);
+
+  printf("  -f SNAPSHOT FILE\tSnapshot file to query.\n");
+  printf("  -q QUERY\t\tOne of:\n");
+  printf("\t\t\t  'keys': List RTs and their keys matching KEY PREFIX.\n");
+  printf("\t\t\t  'rts': List RTs referencing keys matching KEY PREFIX.\n");
+  printf("\t\t\t  'hist': Refcount distribution per tenant prefix of RT "
+         "names.\n");
+  printf("\t\t\t  'index': Build key to RT side index, SNAPSHOT FILE.idx.\n");
+  printf("\t\t\t  'lookup': Same as 'keys', but uses the side index.\n");
+  printf("  -m KEY PREFIX\t\tKey prefix to match, optionally followed by '*'. "
+         "Matches all keys if empty.\n");
+  printf("  -d DELIMITER\t\tTenant prefix of an RT name ends at the first "
+         "occurrence of this character. Defaults to '.'.\n");
+  printf("  -j THREADS\t\tNumber of scanner threads. Defaults to the number "
+         "of CPUs.\n");
+  printf("  -h\t\t\tThis help message.\n");
+}
+
+int main(int argc, char **argv) {
+  int ret = 0;
+
+  const char *path = NULL;
+  const char *op_str = NULL;
+
+  query_t q = {
+      .prefix = "",
+      .delim = '.',
+      .threads = sysconf(_SC_NPROCESSORS_ONLN),
+  };
+
+  // Parse rt-query command line options.
+  {
+    int c;
+    while ((c = getopt(argc, argv, "f:q:m:d:j:h")) != -1) {
+      switch (c) {
+      case 'f':
+        path = optarg;
+        break;
+      case 'q':
+        op_str = optarg;
+        break;
+      case 'm':
+        q.prefix = optarg;
+        break;
+      case 'd':
+        q.delim = optarg[0];
+        break;
+      case 'j':
+        q.threads = atoi(optarg);
+        break;
+      case 'h':
+        print_usage(argv[0]);
+        exit(0);
+      }
+    }
+  }
+
+  if (!path || !op_str || q.threads <= 0) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  if (strcmp(op_str, "keys") == 0) {
+    q.op = QUERY_KEYS;
+  } else if (strcmp(op_str, "rts") == 0) {
+    q.op = QUERY_RTS;
+  } else if (strcmp(op_str, "hist") == 0) {
+    q.op = QUERY_HIST;
+  } else if (strcmp(op_str, "index") == 0) {
+    q.op = QUERY_INDEX;
+  } else if (strcmp(op_str, "lookup") == 0) {
+    q.op = QUERY_LOOKUP;
+  } else {
+    fprintf(stderr, "Unknown query passed in -q %s.\n", op_str);
+    exit(1);
+  }
+
+  q.prefix_len = strlen(q.prefix);
+  if (q.prefix_len > 0 && q.prefix[q.prefix_len - 1] == '*') {
+    q.prefix_len--;
+  }
+
+  if ((ret = snap_open(path, &q.snap)) < 0) {
+    fprintf(stderr, "Failed to open snapshot %s: %s\n", path, strerror(-ret));
+    exit(1);
+  }
+
+  pthread_mutex_init(&q.lock, NULL);
+
+  char *idx_path = malloc(strlen(path) + sizeof(".idx"));
+  sprintf(idx_path, "%s.idx", path);
+
+  switch (q.op) {
+  case QUERY_KEYS:
+  case QUERY_RTS:
+    run_scan(&q);
+    break;
+  case QUERY_HIST: {
+    run_scan(&q);
+
+    // Compact and sort the histograms by tenant.
+
+    size_t n = 0;
+    for (size_t i = 0; i < q.hist.cap; i++) {
+      if (q.hist.entries[i].tenant) {
+        q.hist.entries[n++] = q.hist.entries[i];
+      }
+    }
+    qsort(q.hist.entries, n, sizeof(hist_entry_t), hist_entry_cmp);
+
+    printf("tenant\trefcount_min\trefcount_max\trts\n");
+    for (size_t i = 0; i < n; i++) {
+      hist_entry_t *e = &q.hist.entries[i];
+      for (int b = 0; b < QUERY_HIST_BUCKETS; b++) {
+        if (e->counts[b] == 0) {
+          continue;
+        }
+
+        uint64_t min = b == 0 ? 0 : 1ULL << (b - 1);
+        uint64_t max = b == 0 ? 0 : (1ULL << b) - 1;
+        printf("%.*s\t%lu\t%lu\t%lu\n", (int)e->tenant_len, e->tenant, min,
+               max, e->counts[b]);
+      }
+    }
+
+    free(q.hist.entries);
+    break;
+  }
+  case QUERY_INDEX:
+    ret = build_index(&q, idx_path);
+    free(q.entries);
+    break;
+  case QUERY_LOOKUP:
+    ret = lookup(&q, idx_path);
+    break;
+  }
+
+  if (ret < 0) {
+    fprintf(stderr, "Query failed: %s\n", strerror(-ret));
+    ret = 1;
+  }
+
+  free(idx_path);
+  pthread_mutex_destroy(&q.lock);
+  munmap((void *)q.snap.data, q.snap.size);
+
+  return ret;
+}
@@ -0,0 +1,52 @@
+#ifndef queue_h_INCLUDED
+#define queue_h_INCLUDED
+
+#include <pthread.h>
+
+/**
+ * rt_queue is a bounded, blocking FIFO queue connecting stages of bulk
+ * pipelines. Producers block while the queue is full, consumers block
+ * while it's empty. Once closed, consumers drain the remaining items and
+ * then get NULL.
+ */
+typedef struct rt_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+
+  void **items;
+  int capacity;
+  int head;
+  int count;
+  int closed;
+} rt_queue_t;
+
+/**
+ * rt_queue_init initializes queue `q` holding at most `capacity` items.
+ */
+int rt_queue_init(rt_queue_t *q, int capacity);
+
+/**
+ * rt_queue_destroy releases resources held by queue `q`. Items still in
+ * the queue are not freed.
+ */
+void rt_queue_destroy(rt_queue_t *q);
+
+/**
+ * rt_queue_push appends `item` to the queue, blocking while the queue is
+ * full. Returns -EPIPE if the queue has been closed.
+ */
+int rt_queue_push(rt_queue_t *q, void *item);
+
+/**
+ * rt_queue_pop removes the oldest item from the queue, blocking while the
+ * queue is empty. Returns NULL once the queue is closed and drained.
+ */
+void *rt_queue_pop(rt_queue_t *q);
+
+/**
+ * rt_queue_close marks the queue as closed and wakes up all waiters.
+ */
+void rt_queue_close(rt_queue_t *q);
+
+#endif // queue_h_INCLUDED
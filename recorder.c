@@ -0,0 +1,78 @@
+#include "recorder.h"
+#include <errno.h>
+
+// Arguments of list_cb.
+typedef struct list_arg {
+  rt_keys_cb cb;
+  void *arg;
+  uint64_t keys_count;
+  uint64_t hash;
+} list_arg_t;
+
+// rt_keys_cb hashing listed keys before passing them on.
+static int list_cb(const char *const *keys, const size_t *key_lens,
+                   int keys_count, void *arg) {
+  list_arg_t *la = arg;
+
+  la->keys_count += keys_count;
+  la->hash ^= rt_history_set_hash(keys, key_lens, keys_count);
+
+  return la->cb(keys, key_lens, keys_count, la->arg);
+}
+
+int rt_recorder_add(rt_history_t *h, int proc, rados_t rados,
+                    const char *pool_name, const char *rt_name,
+                    const char *const *keys, int keys_count, int *rt_created) {
+  if (!h) {
+    return rt_add(rados, pool_name, rt_name, keys, keys_count, rt_created);
+  }
+
+  uint64_t call_ns = rt_history_now();
+  int ret = rt_add(rados, pool_name, rt_name, keys, keys_count, rt_created);
+
+  rt_history_update(h, proc, call_ns, rt_history_now(), 0, rt_name, keys,
+                    keys_count, ret, *rt_created);
+  return ret;
+}
+
+int rt_recorder_remove(rt_history_t *h, int proc, rados_t rados,
+                       const char *pool_name, const char *rt_name,
+                       const char *const *keys, int keys_count,
+                       int *rt_deleted) {
+  if (!h) {
+    return rt_remove(rados, pool_name, rt_name, keys, keys_count, rt_deleted);
+  }
+
+  uint64_t call_ns = rt_history_now();
+  int ret = rt_remove(rados, pool_name, rt_name, keys, keys_count, rt_deleted);
+
+  rt_history_update(h, proc, call_ns, rt_history_now(), 1, rt_name, keys,
+                    keys_count, ret, *rt_deleted);
+  return ret;
+}
+
+int rt_recorder_list_keys(rt_history_t *h, int proc, rados_ioctx_t ioctx,
+                          const char *rt_name, int page_size, rt_keys_cb cb,
+                          void *arg, uint32_t *refcount) {
+  if (!h) {
+    return rt_list_keys(ioctx, rt_name, page_size, cb, arg, refcount);
+  }
+
+  list_arg_t la = {.cb = cb, .arg = arg};
+  uint32_t rc = 0;
+
+  uint64_t call_ns = rt_history_now();
+  int ret = rt_list_keys(ioctx, rt_name, page_size, list_cb, &la, &rc);
+  uint64_t return_ns = rt_history_now();
+
+  if (ret == -ENOENT) {
+    // RT objects are deleted once they hold no references.
+    rt_history_list(h, proc, call_ns, return_ns, rt_name, 0, 0, 0, 0);
+  } else {
+    rt_history_list(h, proc, call_ns, return_ns, rt_name, ret, rc,
+                    la.keys_count, la.hash);
+  }
+
+  *refcount = rc;
+  return ret;
+}
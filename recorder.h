@@ -0,0 +1,36 @@
+#ifndef recorder_h_INCLUDED
+#define recorder_h_INCLUDED
+
+#include "history.h"
+#include "rt.h"
+
+/*
+ * Recording wrappers of the RT API. Each calls the wrapped function and
+ * records the call into history `h`, see history.h, as issued by `proc`.
+ * With NULL `h`, they only call the wrapped function.
+ */
+
+/**
+ * rt_recorder_add calls rt_add and records it.
+ */
+int rt_recorder_add(rt_history_t *h, int proc, rados_t rados,
+                    const char *pool_name, const char *rt_name,
+                    const char *const *keys, int keys_count, int *rt_created);
+
+/**
+ * rt_recorder_remove calls rt_remove and records it.
+ */
+int rt_recorder_remove(rt_history_t *h, int proc, rados_t rados,
+                       const char *pool_name, const char *rt_name,
+                       const char *const *keys, int keys_count,
+                       int *rt_deleted);
+
+/**
+ * rt_recorder_list_keys calls rt_list_keys and records it. A missing RT is
+ * recorded as listing no keys.
+ */
+int rt_recorder_list_keys(rt_history_t *h, int proc, rados_ioctx_t ioctx,
+                          const char *rt_name, int page_size, rt_keys_cb cb,
+                          void *arg, uint32_t *refcount);
+
+#endif // recorder_h_INCLUDED
@@ -0,0 +1,315 @@
+#include "relocate.h"
+#include "rt.h"
+#include "throttle.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of objects fetched from pool listing at once.
+#define RELOCATE_LIST_PAGE_SIZE 1024
+// Maximum number of attempts to relocate an RT that keeps being modified.
+#define RELOCATE_MAX_RETRIES 16
+
+typedef struct relocate {
+  rados_t rados;
+  const char *pool_name;
+  // NULL for a cutover.
+  const char *dst_pool_name;
+  const rt_relocate_opts_t *opts;
+  rt_throttle_t throttle;
+  // Windows of the source pool, bounding its listing, and of the
+  // destination pool, bounding the copies, which mostly write there.
+  rt_window_t *window;
+  rt_window_t *dst_window;
+
+  pthread_mutex_t stats_lock;
+  rt_relocate_stats_t stats;
+  rt_cutover_stats_t cutover_stats;
+} relocate_t;
+
+// Scanner thread state.
+typedef struct relocate_scanner {
+  relocate_t *rl;
+  pthread_t thread;
+  int slice;
+
+  // Not shared, see rt_list_keys.
+  rados_ioctx_t ioctx;
+  rados_ioctx_t dst_ioctx;
+
+  // Start of the copy step in the destination window, if any. A step ends
+  // where the next one is paced.
+  double step_started;
+  int in_step;
+} relocate_scanner_t;
+
+void relocate_add_stat(relocate_t *rl, unsigned long *stat, unsigned long n);
+void relocate_run_scanners(relocate_t *rl);
+void *relocate_scan(void *arg);
+
+void rt_relocate_opts_init(rt_relocate_opts_t *opts) {
+  opts->threads = RT_WINDOW_THREADS;
+  opts->chunk_size = 1000;
+  opts->max_ops_per_sec = 0;
+}
+
+int rt_relocate_run(rados_t rados, const char *pool_name,
+                    const char *dst_pool_name, const rt_relocate_opts_t *opts,
+                    rt_relocate_stats_t *stats) {
+  int ret = 0;
+
+  relocate_t rl = {
+      .rados = rados,
+      .pool_name = pool_name,
+      .dst_pool_name = dst_pool_name,
+      .opts = opts,
+  };
+
+  memset(stats, 0, sizeof(*stats));
+
+  if (strcmp(pool_name, dst_pool_name) == 0) {
+    return -EINVAL;
+  }
+
+  rt_throttle_init(&rl.throttle, opts->max_ops_per_sec);
+  rl.window = rt_window_get(rados, pool_name);
+  rl.dst_window = rt_window_get(rados, dst_pool_name);
+  pthread_mutex_init(&rl.stats_lock, NULL);
+
+  relocate_run_scanners(&rl);
+
+  *stats = rl.stats;
+  rt_window_get_stats(rl.dst_window, &stats->window);
+  if (stats->errors > 0 || stats->conflicts > 0 || stats->busy > 0) {
+    ret = -EIO;
+  }
+
+  pthread_mutex_destroy(&rl.stats_lock);
+  rt_throttle_destroy(&rl.throttle);
+
+  return ret;
+}
+
+int rt_cutover_run(rados_t rados, const char *pool_name,
+                   const rt_relocate_opts_t *opts, rt_cutover_stats_t *stats) {
+  int ret = 0;
+
+  relocate_t rl = {
+      .rados = rados,
+      .pool_name = pool_name,
+      .opts = opts,
+  };
+
+  rt_throttle_init(&rl.throttle, opts->max_ops_per_sec);
+  rl.window = rt_window_get(rados, pool_name);
+  pthread_mutex_init(&rl.stats_lock, NULL);
+
+  relocate_run_scanners(&rl);
+
+  *stats = rl.cutover_stats;
+  if (stats->errors > 0) {
+    ret = -EIO;
+  }
+
+  pthread_mutex_destroy(&rl.stats_lock);
+  rt_throttle_destroy(&rl.throttle);
+
+  return ret;
+}
+
+void relocate_run_scanners(relocate_t *rl) {
+  relocate_scanner_t *scanners =
+      calloc(rl->opts->threads, sizeof(relocate_scanner_t));
+
+  for (int i = 0; i < rl->opts->threads; i++) {
+    scanners[i].rl = rl;
+    scanners[i].slice = i;
+    pthread_create(&scanners[i].thread, NULL, relocate_scan, &scanners[i]);
+  }
+
+  for (int i = 0; i < rl->opts->threads; i++) {
+    pthread_join(scanners[i].thread, NULL);
+  }
+
+  free(scanners);
+}
+
+void relocate_add_stat(relocate_t *rl, unsigned long *stat, unsigned long n) {
+  pthread_mutex_lock(&rl->stats_lock);
+  *stat += n;
+  pthread_mutex_unlock(&rl->stats_lock);
+}
+
+// Ends the copy step of scanner `s` in progress, if any, which issued `ops`
+// RADOS operations.
+static void relocate_end_step(relocate_scanner_t *s, int ops, int ret) {
+  if (s->in_step) {
+    rt_window_leave(s->rl->dst_window, s->step_started, RT_WINDOW_WRITE, ops,
+                    ret);
+    s->in_step = 0;
+  }
+}
+
+// rt_pace_cb taking a token from the throttle, and entering the destination
+// window.
+void relocate_pace(void *arg, int ops) {
+  relocate_scanner_t *s = arg;
+
+  relocate_end_step(s, ops, 0);
+  rt_throttle_wait(&s->rl->throttle, 1);
+
+  s->step_started = rt_window_enter(s->rl->dst_window);
+  s->in_step = 1;
+}
+
+void relocate_rt(relocate_scanner_t *s, const char *rt_name) {
+  relocate_t *rl = s->rl;
+  int ret;
+  int relocated = 0;
+
+  for (int attempt = 0; attempt < RELOCATE_MAX_RETRIES; attempt++) {
+    ret = rt_relocate(s->ioctx, s->dst_ioctx, rl->dst_pool_name, rt_name,
+                      rl->opts->chunk_size, relocate_pace, s, &relocated);
+    // The last step is a single write, unless it failed early.
+    relocate_end_step(s, 1, ret);
+    if (ret != -ERANGE) {
+      break;
+    }
+
+    relocate_add_stat(rl, &rl->stats.retries, 1);
+  }
+
+  if (ret == -ENODATA || ret == -ENOENT) {
+    // Not an RT object, or it's been deleted in the meantime.
+    return;
+  }
+
+  relocate_add_stat(rl, &rl->stats.rts_scanned, 1);
+
+  if (ret == -ERANGE || ret == -EBUSY) {
+    { // Debug log message.
+      printf("relocate: RT %s keeps changing, leaving it in place.\n",
+             rt_name);
+    }
+    relocate_add_stat(rl, &rl->stats.busy, 1);
+  } else if (ret == -EEXIST) {
+    relocate_add_stat(rl, &rl->stats.conflicts, 1);
+  } else if (ret < 0) {
+    { // Debug log message.
+      printf("relocate: Failed to relocate RT %s: %d.\n", rt_name, ret);
+    }
+    relocate_add_stat(rl, &rl->stats.errors, 1);
+  } else if (relocated) {
+    relocate_add_stat(rl, &rl->stats.rts_relocated, 1);
+  } else {
+    relocate_add_stat(rl, &rl->stats.rts_forwarded, 1);
+  }
+}
+
+void cutover_rt(relocate_scanner_t *s, const char *rt_name) {
+  relocate_t *rl = s->rl;
+  int dropped = 0;
+
+  rt_throttle_wait(&rl->throttle, 1);
+
+  double started = rt_window_enter(rl->window);
+  int ret = rt_drop_marker(s->ioctx, rt_name, &dropped);
+  rt_window_leave(rl->window, started, RT_WINDOW_WRITE, 1, ret);
+
+  relocate_add_stat(rl, &rl->cutover_stats.objects_scanned, 1);
+
+  if (ret < 0) {
+    { // Debug log message.
+      printf("cutover: Failed to drop marker %s: %d.\n", rt_name, ret);
+    }
+    relocate_add_stat(rl, &rl->cutover_stats.errors, 1);
+  } else if (dropped) {
+    relocate_add_stat(rl, &rl->cutover_stats.markers_dropped, 1);
+  } else {
+    relocate_add_stat(rl, &rl->cutover_stats.objects_left, 1);
+  }
+}
+
+void *relocate_scan(void *arg) {
+  relocate_scanner_t *s = arg;
+  relocate_t *rl = s->rl;
+  unsigned long *errors =
+      rl->dst_pool_name ? &rl->stats.errors : &rl->cutover_stats.errors;
+  int ret;
+
+  if ((ret = rados_ioctx_create(rl->rados, rl->pool_name, &s->ioctx)) < 0) {
+    { // Debug log message.
+      printf("relocate: Failed to create ioctx: %d.\n", ret);
+    }
+    relocate_add_stat(rl, errors, 1);
+    return NULL;
+  }
+
+  if (rl->dst_pool_name &&
+      (ret = rados_ioctx_create(rl->rados, rl->dst_pool_name,
+                                &s->dst_ioctx)) < 0) {
+    { // Debug log message.
+      printf("relocate: Failed to create destination ioctx: %d.\n", ret);
+    }
+    relocate_add_stat(rl, errors, 1);
+    rados_ioctx_destroy(s->ioctx);
+    return NULL;
+  }
+
+  rados_ioctx_t ioctx = s->ioctx;
+
+  rados_object_list_item items[RELOCATE_LIST_PAGE_SIZE];
+  rados_object_list_cursor begin = rados_object_list_begin(ioctx);
+  rados_object_list_cursor end = rados_object_list_end(ioctx);
+  rados_object_list_cursor cursor, slice_end;
+
+  rados_object_list_slice(ioctx, begin, end, s->slice, rl->opts->threads,
+                          &cursor, &slice_end);
+
+  while (rados_object_list_cursor_cmp(ioctx, cursor, slice_end) < 0) {
+    rados_object_list_cursor next = NULL;
+
+    rt_throttle_wait(&rl->throttle, 1);
+
+    double started = rt_window_enter(rl->window);
+    int n = rados_object_list(ioctx, cursor, slice_end,
+                              RELOCATE_LIST_PAGE_SIZE, NULL, 0, items, &next);
+    rt_window_leave(rl->window, started, RT_WINDOW_LIST, 1, n < 0 ? n : 0);
+    if (n < 0) {
+      { // Debug log message.
+        printf("relocate: Scanning slice %d failed with error code %d.\n",
+               s->slice, n);
+      }
+      relocate_add_stat(rl, errors, 1);
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      char *rt_name = strndup(items[i].oid, items[i].oid_length);
+      if (rl->dst_pool_name) {
+        relocate_rt(s, rt_name);
+      } else {
+        cutover_rt(s, rt_name);
+      }
+      free(rt_name);
+    }
+
+    rados_object_list_free(n, items);
+    rados_object_list_cursor_free(ioctx, cursor);
+    cursor = next;
+  }
+
+  rados_object_list_cursor_free(ioctx, cursor);
+  rados_object_list_cursor_free(ioctx, slice_end);
+  rados_object_list_cursor_free(ioctx, begin);
+  rados_object_list_cursor_free(ioctx, end);
+
+  if (s->dst_ioctx) {
+    rados_ioctx_destroy(s->dst_ioctx);
+  }
+  rados_ioctx_destroy(ioctx);
+
+  return NULL;
+}
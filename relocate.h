@@ -0,0 +1,81 @@
+#ifndef relocate_h_INCLUDED
+#define relocate_h_INCLUDED
+
+#include "throttle.h"
+#include <rados/librados.h>
+
+/**
+ * Relocation moves all RT objects of a pool into another pool with
+ * rt_relocate, while they stay in use. The source pool is scanned in
+ * parallel slices. Relocated RTs leave forwarding markers behind, which
+ * rt_add and rt_remove follow until clients are switched over to the
+ * destination pool. RTs created in the source pool in the meantime are
+ * picked up by running the relocation again. The cutover then removes the
+ * markers, so that nothing pays for following them anymore.
+ */
+
+typedef struct rt_relocate_opts {
+  // Number of parallel pool scanners. Each scans its own slice of the pool.
+  int threads;
+  // Maximum number of keys copied by a single RADOS operation.
+  int chunk_size;
+  // Maximum number of RADOS operations per second. Zero means unlimited.
+  double max_ops_per_sec;
+} rt_relocate_opts_t;
+
+typedef struct rt_relocate_stats {
+  unsigned long rts_scanned;
+  unsigned long rts_relocated;
+  // RTs the source pool holds forwarding markers of already.
+  unsigned long rts_forwarded;
+  // Copies dropped because the RT was modified while being copied.
+  unsigned long retries;
+  // RTs that kept being modified and were left in place.
+  unsigned long busy;
+  // RTs of the same name already existing in the destination pool.
+  unsigned long conflicts;
+  unsigned long errors;
+  // Congestion window of the destination pool at the end of the run.
+  rt_window_stats_t window;
+} rt_relocate_stats_t;
+
+/**
+ * rt_relocate_opts_init fills `opts` with default values.
+ */
+void rt_relocate_opts_init(rt_relocate_opts_t *opts);
+
+/**
+ * rt_relocate_run relocates all RT objects of a pool into another pool.
+ *
+ * `rados` is a handle to a Ceph cluster.
+ * `pool_name` is name of the pool where the RT RADOS objects are stored.
+ * `dst_pool_name` is name of the pool to move them to.
+ * `opts` are relocation options.
+ * `stats` is filled with relocation statistics.
+ */
+int rt_relocate_run(rados_t rados, const char *pool_name,
+                    const char *dst_pool_name, const rt_relocate_opts_t *opts,
+                    rt_relocate_stats_t *stats);
+
+typedef struct rt_cutover_stats {
+  unsigned long objects_scanned;
+  unsigned long markers_dropped;
+  // Objects other than forwarding markers, e.g. RTs not relocated.
+  unsigned long objects_left;
+  unsigned long errors;
+} rt_cutover_stats_t;
+
+/**
+ * rt_cutover_run removes all forwarding markers of a relocated pool with
+ * rt_drop_marker. It must only be run once all clients use the destination
+ * pool. Other objects are left in place and counted.
+ *
+ * `rados` is a handle to a Ceph cluster.
+ * `pool_name` is name of the pool RTs have been relocated from.
+ * `opts` are relocation options, of which `chunk_size` isn't used.
+ * `stats` is filled with cutover statistics.
+ */
+int rt_cutover_run(rados_t rados, const char *pool_name,
+                   const rt_relocate_opts_t *opts, rt_cutover_stats_t *stats);
+
+#endif // relocate_h_INCLUDED
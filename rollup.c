@@ -0,0 +1,498 @@
+#include "rollup.h"
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <stdio.h>
+
+// See rt.c.
+#ifdef RT_NO_DEBUG_LOG
+#define printf(...) ((void)(0 && printf(__VA_ARGS__)))
+#endif
+
+/*
+
+Rollup object layout
+====================
+
+The rollup of a pool is stored in RT_ROLLUP_SHARDS counter shard objects,
+so that flushes of different processes land on different placement groups
+instead of all serializing on one object:
+
+    namespace: ROLLUP_NSPACE
+    oid: "rt-rollup.<n>", n in 00 .. RT_ROLLUP_SHARDS - 1
+
+Shards live in their own namespace of the pool, so that their names can't
+collide with RT names, and listings of the RTs of the pool don't see them.
+
+Each shard object holds a single OMap key ROLLUP_KEY:
+
+    byte idx      type         name
+    --------     ------       ------
+     0 ..  7     int64_t      rts
+     8 .. 15     int64_t      refs
+
+Values are big-endian. Totals of the pool are the sums over all shards.
+Shard objects are created by the first increment of the shard, with the
+key zeroed, so that increments can compare the whole value of a shard.
+Missing shards read as zero.
+
+*/
+
+#define ROLLUP_NSPACE "rt-rollup"
+#define ROLLUP_OID_PREFIX "rt-rollup."
+#define ROLLUP_OID_SIZE 32
+#define ROLLUP_KEY "counters"
+#define ROLLUP_VAL_SIZE 16
+// Number of guarded increments tried before giving up.
+#define ROLLUP_MAX_ATTEMPTS (RT_ROLLUP_SHARDS * 2)
+// Maximum number of pools tracked by a process.
+#define ROLLUP_POOLS_MAX 64
+
+// Deltas accumulated for a pool.
+typedef struct rollup_pool {
+  int64_t pool_id;
+  // Updated atomically by rt_rollup_note, and swapped out by flushes.
+  int64_t rts;
+  int64_t refs;
+  // Opened by the first flush of the pool, in ROLLUP_NSPACE.
+  rados_ioctx_t ioctx;
+} rollup_pool_t;
+
+static struct {
+  // Connection of the running flusher, NULL while stopped.
+  rados_t rados;
+  int interval_ms;
+  // Shard tried first by the process.
+  int shard;
+  int stopping;
+  pthread_t thread;
+
+  // Guards the fields above, and registration of pools.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Serializes flushes.
+  pthread_mutex_t flush_lock;
+
+  rollup_pool_t pools[ROLLUP_POOLS_MAX];
+  int pools_count;
+} rollup = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .flush_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void shard_oid(char *buf, int shard) {
+  snprintf(buf, ROLLUP_OID_SIZE, ROLLUP_OID_PREFIX "%02d", shard);
+}
+
+static void val_encode(char *buf, const rt_rollup_t *r) {
+  uint64_t rts = htobe64((uint64_t)r->rts);
+  uint64_t refs = htobe64((uint64_t)r->refs);
+  memcpy(buf, &rts, 8);
+  memcpy(buf + 8, &refs, 8);
+}
+
+static void val_decode(const char *buf, rt_rollup_t *r) {
+  uint64_t rts, refs;
+  memcpy(&rts, buf, 8);
+  memcpy(&refs, buf + 8, 8);
+  r->rts = (int64_t)be64toh(rts);
+  r->refs = (int64_t)be64toh(refs);
+}
+
+// Creates shard object `oid` with its counters zeroed. Fails with -EEXIST if
+// it already exists.
+static int create_shard(rados_ioctx_t ioctx, const char *oid) {
+  const char *key = ROLLUP_KEY;
+  const char *val = (char[ROLLUP_VAL_SIZE]){0};
+  size_t key_len = strlen(ROLLUP_KEY);
+  size_t val_len = ROLLUP_VAL_SIZE;
+
+  rados_write_op_t write_op = rados_create_write_op();
+  rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+  rados_write_op_omap_set2(write_op, &key, &val, &key_len, &val_len, 1);
+
+  int ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+  rados_release_write_op(write_op);
+
+  return ret;
+}
+
+// Pending read of a shard.
+typedef struct shard_read {
+  rados_read_op_t read_op;
+  rados_completion_t completion;
+  rados_omap_iter_t iter;
+  int iter_ret;
+} shard_read_t;
+
+static void shard_read_start(rados_ioctx_t ioctx, const char *oid,
+                             shard_read_t *r) {
+  const char *key = ROLLUP_KEY;
+  size_t key_len = strlen(ROLLUP_KEY);
+
+  r->read_op = rados_create_read_op();
+  rados_read_op_omap_get_vals_by_keys2(r->read_op, &key, 1, &key_len,
+                                       &r->iter, &r->iter_ret);
+
+  rados_aio_create_completion2(NULL, NULL, &r->completion);
+  int ret = rados_aio_read_op_operate(r->read_op, ioctx, r->completion, oid, 0);
+  if (ret < 0) {
+    rados_aio_release(r->completion);
+    r->completion = NULL;
+    r->iter_ret = ret;
+  }
+}
+
+// Waits for read `r` and decodes the shard value into `buf`.
+static int shard_read_finish(shard_read_t *r, char *buf) {
+  int ret = r->iter_ret;
+
+  if (r->completion) {
+    rados_aio_wait_for_complete(r->completion);
+    ret = rados_aio_get_return_value(r->completion);
+    rados_aio_release(r->completion);
+
+    if (ret == 0) {
+      ret = r->iter_ret;
+    }
+
+    if (ret == 0) {
+      char *k, *v;
+      size_t k_len, v_len;
+
+      if (rados_omap_get_next2(r->iter, &k, &v, &k_len, &v_len) < 0 || !k ||
+          v_len != ROLLUP_VAL_SIZE) {
+        ret = -EIO;
+      } else {
+        memcpy(buf, v, ROLLUP_VAL_SIZE);
+      }
+
+      rados_omap_get_end(r->iter);
+    }
+  }
+
+  rados_release_read_op(r->read_op);
+
+  return ret;
+}
+
+// Reads the value of shard object `oid` into `buf`.
+static int read_shard(rados_ioctx_t ioctx, const char *oid, char *buf) {
+  shard_read_t r;
+  shard_read_start(ioctx, oid, &r);
+  return shard_read_finish(&r, buf);
+}
+
+// Opens an I/O context on the rollup namespace of pool `pool_id`.
+static int open_rollup(rados_t rados, int64_t pool_id, rados_ioctx_t *ioctx) {
+  int ret = rados_ioctx_create2(rados, pool_id, ioctx);
+  if (ret < 0) {
+    return ret;
+  }
+  rados_ioctx_set_namespace(*ioctx, ROLLUP_NSPACE);
+  return 0;
+}
+
+int rt_rollup_read(rados_ioctx_t pool_ioctx, rt_rollup_t *rollup) {
+  shard_read_t reads[RT_ROLLUP_SHARDS];
+  rados_ioctx_t ioctx;
+  int ret;
+
+  *rollup = (rt_rollup_t){0};
+
+  if ((ret = open_rollup(rados_ioctx_get_cluster(pool_ioctx),
+                         rados_ioctx_get_id(pool_ioctx), &ioctx)) < 0) {
+    return ret;
+  }
+
+  // Shards are read concurrently.
+
+  for (int i = 0; i < RT_ROLLUP_SHARDS; i++) {
+    char oid[ROLLUP_OID_SIZE];
+    shard_oid(oid, i);
+    shard_read_start(ioctx, oid, &reads[i]);
+  }
+
+  for (int i = 0; i < RT_ROLLUP_SHARDS; i++) {
+    char val[ROLLUP_VAL_SIZE];
+    int err = shard_read_finish(&reads[i], val);
+
+    if (err == 0) {
+      rt_rollup_t shard;
+      val_decode(val, &shard);
+      rollup->rts += shard.rts;
+      rollup->refs += shard.refs;
+    } else if (err != -ENOENT) {
+      // Nothing has been rolled up into missing shards yet.
+      ret = err;
+    }
+  }
+
+  rados_ioctx_destroy(ioctx);
+
+  if (ret < 0) {
+    *rollup = (rt_rollup_t){0};
+  }
+
+  return ret;
+}
+
+// Applies `delta` through `ioctx`, which is on the rollup namespace.
+static int apply(rados_ioctx_t ioctx, int shard, const rt_rollup_t *delta) {
+  for (int attempt = 0; attempt < ROLLUP_MAX_ATTEMPTS; attempt++) {
+    char oid[ROLLUP_OID_SIZE];
+    char old_val[ROLLUP_VAL_SIZE];
+    char new_val[ROLLUP_VAL_SIZE];
+    int ret;
+
+    // Conflicting writers move on to the next shard.
+    shard_oid(oid, (shard + attempt) % RT_ROLLUP_SHARDS);
+
+    if ((ret = read_shard(ioctx, oid, old_val)) == -ENOENT) {
+      if ((ret = create_shard(ioctx, oid)) < 0 && ret != -EEXIST) {
+        return ret;
+      }
+      ret = read_shard(ioctx, oid, old_val);
+    }
+    if (ret < 0) {
+      return ret;
+    }
+
+    rt_rollup_t r;
+    val_decode(old_val, &r);
+    r.rts += delta->rts;
+    r.refs += delta->refs;
+    val_encode(new_val, &r);
+
+    const char *key = ROLLUP_KEY;
+    const char *val = new_val;
+    size_t key_len = strlen(ROLLUP_KEY);
+    size_t val_len = ROLLUP_VAL_SIZE;
+
+    // The increment only applies if the shard still holds the value it was
+    // computed from.
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_omap_cmp(write_op, ROLLUP_KEY, LIBRADOS_CMPXATTR_OP_EQ,
+                            old_val, ROLLUP_VAL_SIZE, NULL);
+    rados_write_op_omap_set2(write_op, &key, &val, &key_len, &val_len, 1);
+
+    ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+    rados_release_write_op(write_op);
+
+    if (ret != -ECANCELED) {
+      return ret;
+    }
+
+    { // Debug log message.
+      printf("rt_rollup_apply(): Shard %s changed concurrently, "
+             "retrying.\n",
+             oid);
+    }
+  }
+
+  return -EBUSY;
+}
+
+int rt_rollup_apply(rados_ioctx_t pool_ioctx, int shard,
+                    const rt_rollup_t *delta) {
+  rados_ioctx_t ioctx;
+  int ret;
+
+  if ((ret = open_rollup(rados_ioctx_get_cluster(pool_ioctx),
+                         rados_ioctx_get_id(pool_ioctx), &ioctx)) < 0) {
+    return ret;
+  }
+
+  ret = apply(ioctx, shard, delta);
+  rados_ioctx_destroy(ioctx);
+
+  return ret;
+}
+
+void rt_rollup_note(rados_ioctx_t ioctx, int64_t rts, int64_t refs) {
+  rados_t rados = __atomic_load_n(&rollup.rados, __ATOMIC_ACQUIRE);
+  if (!rados || rados != rados_ioctx_get_cluster(ioctx) ||
+      (rts == 0 && refs == 0)) {
+    return;
+  }
+
+  int64_t pool_id = rados_ioctx_get_id(ioctx);
+  rollup_pool_t *p = NULL;
+
+  // Pools are only ever appended, look them up without locking first.
+
+  int count = __atomic_load_n(&rollup.pools_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count && !p; i++) {
+    if (rollup.pools[i].pool_id == pool_id) {
+      p = &rollup.pools[i];
+    }
+  }
+
+  if (!p) {
+    pthread_mutex_lock(&rollup.lock);
+
+    count = rollup.pools_count;
+    for (int i = 0; i < count && !p; i++) {
+      if (rollup.pools[i].pool_id == pool_id) {
+        p = &rollup.pools[i];
+      }
+    }
+
+    if (!p && count < ROLLUP_POOLS_MAX) {
+      p = &rollup.pools[count];
+      *p = (rollup_pool_t){.pool_id = pool_id};
+      __atomic_store_n(&rollup.pools_count, count + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&rollup.lock);
+
+    if (!p) {
+      // Too many pools, leave this one for reconciliation.
+      return;
+    }
+  }
+
+  __atomic_add_fetch(&p->rts, rts, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&p->refs, refs, __ATOMIC_RELAXED);
+}
+
+int rt_rollup_flush(void) {
+  int ret = 0;
+
+  pthread_mutex_lock(&rollup.flush_lock);
+
+  rados_t rados = __atomic_load_n(&rollup.rados, __ATOMIC_ACQUIRE);
+  int count = __atomic_load_n(&rollup.pools_count, __ATOMIC_ACQUIRE);
+
+  for (int i = 0; rados && i < count; i++) {
+    rollup_pool_t *p = &rollup.pools[i];
+    rt_rollup_t delta = {
+        .rts = __atomic_exchange_n(&p->rts, 0, __ATOMIC_RELAXED),
+        .refs = __atomic_exchange_n(&p->refs, 0, __ATOMIC_RELAXED),
+    };
+
+    if (delta.rts == 0 && delta.refs == 0) {
+      continue;
+    }
+
+    int err = 0;
+    if (!p->ioctx) {
+      err = open_rollup(rados, p->pool_id, &p->ioctx);
+      if (err < 0) {
+        p->ioctx = NULL;
+      }
+    }
+    if (err == 0) {
+      err = apply(p->ioctx, rollup.shard, &delta);
+    }
+
+    if (err < 0) {
+      // Keep the deltas for the next flush.
+      __atomic_add_fetch(&p->rts, delta.rts, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&p->refs, delta.refs, __ATOMIC_RELAXED);
+      ret = err;
+
+      { // Debug log message.
+        printf("rt_rollup_flush(): Failed to flush rollup of pool %lld: "
+               "%d.\n",
+               (long long)p->pool_id, err);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&rollup.flush_lock);
+
+  return ret;
+}
+
+static void *rollup_flusher(void *arg) {
+  pthread_mutex_lock(&rollup.lock);
+
+  while (!rollup.stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += rollup.interval_ms / 1000;
+    deadline.tv_nsec += (long)(rollup.interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&rollup.cond, &rollup.lock, &deadline);
+
+    if (!rollup.stopping) {
+      pthread_mutex_unlock(&rollup.lock);
+      rt_rollup_flush();
+      pthread_mutex_lock(&rollup.lock);
+    }
+  }
+
+  pthread_mutex_unlock(&rollup.lock);
+
+  return NULL;
+}
+
+int rt_rollup_start(rados_t rados, int interval_ms) {
+  int ret = 0;
+
+  pthread_mutex_lock(&rollup.lock);
+
+  if (rollup.rados) {
+    ret = -EBUSY;
+    goto out;
+  }
+
+  rollup.interval_ms = interval_ms > 0 ? interval_ms : 1;
+  rollup.shard = rados_get_instance_id(rados) % RT_ROLLUP_SHARDS;
+  rollup.stopping = 0;
+
+  if ((ret = -pthread_create(&rollup.thread, NULL, rollup_flusher, NULL)) <
+      0) {
+    goto out;
+  }
+
+  __atomic_store_n(&rollup.rados, rados, __ATOMIC_RELEASE);
+
+out:
+  pthread_mutex_unlock(&rollup.lock);
+
+  return ret;
+}
+
+void rt_rollup_stop(void) {
+  pthread_mutex_lock(&rollup.lock);
+
+  if (!rollup.rados || rollup.stopping) {
+    pthread_mutex_unlock(&rollup.lock);
+    return;
+  }
+
+  rollup.stopping = 1;
+  pthread_cond_signal(&rollup.cond);
+  pthread_mutex_unlock(&rollup.lock);
+
+  pthread_join(rollup.thread, NULL);
+
+  // Writes done by now are flushed, later ones are dropped.
+
+  rt_rollup_flush();
+
+  pthread_mutex_lock(&rollup.lock);
+  pthread_mutex_lock(&rollup.flush_lock);
+
+  __atomic_store_n(&rollup.rados, NULL, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < rollup.pools_count; i++) {
+    if (rollup.pools[i].ioctx) {
+      rados_ioctx_destroy(rollup.pools[i].ioctx);
+    }
+  }
+  __atomic_store_n(&rollup.pools_count, 0, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&rollup.flush_lock);
+  pthread_mutex_unlock(&rollup.lock);
+}
@@ -0,0 +1,83 @@
+#ifndef rollup_h_INCLUDED
+#define rollup_h_INCLUDED
+
+#include <rados/librados.h>
+#include <stdint.h>
+
+/**
+ * Rollups are pool-wide totals of RT objects and the references they hold,
+ * maintained incrementally, so that they're read with a single operation
+ * instead of a pool scan.
+ *
+ * Successful RT writes of a process, of all layouts, and relocations, which
+ * move the counts of an RT from its source pool to its destination, are
+ * accumulated into per-pool local deltas, in memory and without any I/O. A
+ * background flusher periodically folds the deltas into one of the pool's
+ * RT_ROLLUP_SHARDS counter shard objects "rt-rollup.<n>", in the pool's
+ * namespace "rt-rollup", apart from RTs. Each increment is guarded by an
+ * OMap comparison with the shard value it was computed from, and moves on
+ * to the next shard on conflict. Processes start at different shards, so
+ * that concurrent flushers rarely collide, and shards are separate objects,
+ * so that their flushes don't serialize on a single placement group.
+ *
+ * The flusher is meant for resident processes and batch operations,
+ * batching many updates into a flush. A short-lived process would pay a
+ * flush per update.
+ *
+ * Rollups aren't exact. Writes of processes without a running flusher,
+ * deltas lost in crashes, and RTs deleted by other means make them drift.
+ * rt_stats_reconcile corrects them against a full census.
+ */
+
+// Number of counter shard objects of a pool.
+#define RT_ROLLUP_SHARDS 16
+
+typedef struct rt_rollup {
+  // RT objects.
+  int64_t rts;
+  // Sum of RT refcounts.
+  int64_t refs;
+} rt_rollup_t;
+
+/**
+ * rt_rollup_start starts the rollup flusher of the process for connection
+ * `rados`, flushing accumulated deltas every `interval_ms` milliseconds.
+ * Until it's started, rt_rollup_note drops deltas. Only one connection per
+ * process is tracked, returns -EBUSY if the flusher is already running.
+ */
+int rt_rollup_start(rados_t rados, int interval_ms);
+
+/**
+ * rt_rollup_stop stops the rollup flusher, flushing the remaining deltas.
+ * Must be called before `rados` is shut down.
+ */
+void rt_rollup_stop(void);
+
+/**
+ * rt_rollup_flush flushes accumulated deltas now. Deltas that fail to be
+ * flushed are kept for the next flush. Returns the last error, if any.
+ */
+int rt_rollup_flush(void);
+
+/**
+ * rt_rollup_note accumulates a delta of `rts` RT objects and `refs`
+ * references in the pool of `ioctx`. It doesn't do any I/O, and is a no-op
+ * unless the flusher runs on the connection of `ioctx`.
+ */
+void rt_rollup_note(rados_ioctx_t ioctx, int64_t rts, int64_t refs);
+
+/**
+ * rt_rollup_read reads the rollup of the pool of `ioctx`, reading all
+ * shards concurrently. Missing shards read as zero. The namespace of
+ * `ioctx` doesn't matter.
+ */
+int rt_rollup_read(rados_ioctx_t ioctx, rt_rollup_t *rollup);
+
+/**
+ * rt_rollup_apply adds `delta` to the rollup of the pool of `ioctx`,
+ * creating the shard object if needed. `shard` is the shard to try
+ * first. Returns -EBUSY if it keeps conflicting with other writers.
+ */
+int rt_rollup_apply(rados_ioctx_t ioctx, int shard, const rt_rollup_t *delta);
+
+#endif // rollup_h_INCLUDED
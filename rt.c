@@ -1,10 +1,25 @@
 #include "rt.h"
+#include "hll.h"
+#include "keyset.h"
+#include "mem.h"
+#include "rollup.h"
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <stdio.h>
 
+// With RT_NO_DEBUG_LOG, debug log messages are dropped, for embedding into
+// programs whose stdout isn't ours to write to.
+#ifdef RT_NO_DEBUG_LOG
+#define printf(...) ((void)(0 && printf(__VA_ARGS__)))
+#endif
+
 /*
 
 RT object layout
@@ -24,6 +39,97 @@ Version 1:
                 reference keys are stored in an OMap along with the RADOS
                 object.
 
+Version 2 (split):
+
+  Header object, stored in the pool of the RT under its name:
+
+    byte idx      type         name
+    --------     ------       ------
+     0 ..  3     uint32_t     refcount
+     4 ..  7     uint32_t     recent_count
+     8 .. 11     uint32_t     dead_count
+    12 .. 15     uint32_t     recent_max
+    16 .. 19     uint32_t     shards
+    20 .. 27     uint64_t     incarnation
+    28 ..  n     char[]       pool
+
+    `refcount`: Number of references held by the RT.
+    `recent_count`: Number of recent keys in the header OMap.
+    `dead_count`: Number of dead keys in the header OMap.
+    `recent_max`: Recent keys are moved to overflow objects once there's
+                  more of them than this.
+    `shards`: Number of overflow objects.
+    `incarnation`: Random identifier of this RT instance. Overflow objects of
+                   an RT that's deleted and created again aren't shared.
+    `pool`: Name of the pool of overflow objects, not NUL-terminated.
+
+    Header OMap holds recently added keys prefixed by 'r', and dead keys
+    prefixed by 'd'. Dead keys have been removed from the RT, but may still
+    be present in an overflow object.
+
+  Overflow objects, stored in `pool` as "<RT name>.<incarnation>.<shard>",
+  with incarnation in 16 hex digits:
+
+    OMap of keys moved out of the header. Key `k` is stored in shard
+    rt_hash64(k) % `shards`.
+
+  A key is tracked by the RT if it's a recent key, or if it's present in its
+  overflow object and isn't a dead key. Updates only read overflow objects,
+  and are guarded by the header version alone. Overflow objects are written
+  only by compaction, which moves recent keys there and drops dead keys from
+  there, in a way that doesn't change which keys are tracked as of any
+  header version. See compact_v2.
+
+Version 3 (partitioned):
+
+  Directory object, stored in the pool of the RT under its name:
+
+    byte idx      type         name
+    --------     ------       ------
+     0 ..  7     uint64_t     incarnation
+
+    `incarnation`: Random identifier of this RT instance, see Version 2.
+
+    Directory OMap holds writer IDs prefixed by 'p' for each partition
+    created, and prefixed by 'a' for active partitions, which may hold
+    references.
+
+  Partition objects, stored in the pool of the RT as
+  "<RT name>.<incarnation>.<writer ID>", with incarnation in 16 hex digits:
+
+    byte idx      type         name
+    --------     ------       ------
+     0 ..  3     uint32_t     refcount
+
+    `refcount`: Number of references held by the partition. Its keys are
+                stored in its OMap.
+
+  Each writer adds and removes keys only in its own partition, guarded by
+  the partition version alone, so writers don't conflict. Keys added by
+  several writers are tracked once per writer. Refcount of the RT is the
+  sum of refcounts of its partitions. The directory is written only when a
+  partition becomes non-empty, which registers it as active first, and
+  when it becomes empty, which unregisters it afterwards. The RT is deleted
+  once no partition is active. See v3_close.
+
+Forwarding marker (version 0xffffffff):
+
+    byte idx      type         name
+    --------     ------       ------
+     0 ..  n     char[]       pool
+
+    `pool`: Name of the pool the RT was relocated to by rt_relocate, not
+            NUL-terminated. The RT object there has the same name. Markers
+            have no OMap, and are never changed once written.
+
+  While rt_relocate copies an RT, the copy holds only keys, and xattr
+  RT_RELOCATE_XATTR with a random cookie of the rt_relocate call. Every
+  write into the copy compares the cookie, so that concurrent relocations
+  of an RT never write into, or drop, each other's copies. Completing the
+  copy replaces the cookie with the RT version. Copies left over by
+  interrupted relocations are dropped once they haven't been written for
+  RT_RELOCATE_STALE_SECS.
+
 */
 
 // RT version xattr key.
@@ -35,6 +141,43 @@ Version 1:
 // Current RT object version.
 #define RT_CURRENT_VERSION 1
 
+// RT version of forwarding markers.
+#define RT_FORWARD_VERSION 0xffffffff
+// Maximum length of pool names stored in RT objects.
+#define RT_POOL_NAME_MAX 256
+// Maximum number of forwarding markers followed, in case they form a loop.
+#define RT_FORWARD_MAX_HOPS 8
+// Maximum number of I/O contexts of other pools kept open, see
+// open_pool_ioctx.
+#define RT_POOL_IOCTX_CACHE_SIZE 64
+// Cookie xattr of copies being made by rt_relocate, and its size.
+#define RT_RELOCATE_XATTR "csi.ceph.com/rt-relocation"
+#define RT_RELOCATE_COOKIE_SIZE 8
+// Copies not written for this long are left over by interrupted
+// relocations.
+#define RT_RELOCATE_STALE_SECS 600
+
+// Header OMap key prefixes (Version 2).
+#define RT_V2_RECENT_PREFIX 'r'
+#define RT_V2_DEAD_PREFIX 'd'
+// Size of fixed fields of RT header (Version 2).
+#define RT_V2_HEADER_SIZE 28
+// Maximum number of header keys moved by a single compaction (Version 2).
+#define RT_V2_COMPACT_MAX 1024
+
+// Directory OMap key prefixes (Version 3).
+#define RT_V3_ACTIVE_PREFIX 'a'
+#define RT_V3_PARTITION_PREFIX 'p'
+// Size of RT directory (Version 3).
+#define RT_V3_DIR_SIZE 8
+// Maximum length of writer IDs (Version 3).
+#define RT_V3_WRITER_ID_MAX 256
+// Number of directory keys read at once (Version 3).
+#define RT_V3_DIR_PAGE_SIZE 256
+// Maximum number of attempts to unregister an emptied partition
+// (Version 3).
+#define RT_V3_CLOSE_MAX_RETRIES 8
+
 // RT reference count type (Version 1).
 #define RT_V1_REFCOUNT_T uint32_t
 // RT reference count size (Version 1).
@@ -42,46 +185,188 @@ Version 1:
 
 // Read RT object version from xattrs.
 int read_rt_version(rados_ioctx_t ioctx, const char *oid, uint32_t *version);
+// Read RT object version, following forwarding markers.
+// Markers aren't followed if `fwd_ioctx` is NULL, and fail with -EXDEV.
+int resolve_rt_version(rados_ioctx_t *ioctx, const char *oid,
+                       uint32_t *version, rados_ioctx_t *fwd_ioctx);
+// Open I/O context of another pool on the cluster of `ioctx`.
+int open_pool_ioctx(rados_ioctx_t ioctx, const char *pool_name,
+                    rados_ioctx_t *pool_ioctx);
+// Release I/O context opened by open_pool_ioctx, if not NULL.
+void release_pool_ioctx(rados_ioctx_t pool_ioctx);
+// Random identifier of RT instances and relocation copies.
+static uint64_t new_incarnation(rados_ioctx_t ioctx);
 
 // Initialize RT object (Version 1).
 int init_v1(rados_ioctx_t ioctx, const char *oid, const char *const *keys,
-            int keys_count);
+            const size_t *key_lens, int keys_count);
 // Add keys to RT object (Version 1).
 int add_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
-           const char *const *keys, int keys_count);
+           const char *const *keys, const size_t *key_lens, int keys_count);
 // Remove keys from RT object (Version 1).
 int remove_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
-              const char *const *keys, int keys_count, int *rt_removed);
+              const char *const *keys, const size_t *key_lens, int keys_count,
+              int *rt_removed);
+// Add or remove keys of RT object (Version 1).
+int update_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen, int remove,
+              const char *const *keys, const size_t *key_lens, int keys_count,
+              int *rt_removed);
+// Fill write op with initialization of RT object (Version 1).
+void v1_init_op(rados_write_op_t write_op, const char *const *keys,
+                const size_t *key_lens, int keys_count);
+// Fill write op with an update of RT object read by read_v1 (Version 1).
+int v1_update_op(rados_write_op_t write_op, uint64_t gen, int remove,
+                 const char *const *keys, const size_t *key_lens,
+                 int keys_count, const int *ref_keys_found,
+                 RT_V1_REFCOUNT_T refcount, int *rt_removed);
 // Read RT object (Version 1).
 int read_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
-            const char *const *keys, int keys_count, RT_V1_REFCOUNT_T *refcount,
-            int *ref_keys_found);
+            const char *const *keys, const size_t *key_lens, int keys_count,
+            RT_V1_REFCOUNT_T *refcount, int *ref_keys_found);
+// Collect keys of an OMap iterator into a keyset, charging memory of both.
+int collect_keys(rados_omap_iter_t omap_iter, rt_keyset_t **keyset,
+                 long *iter_bytes, long *keyset_bytes);
+// Release what collect_keys and the OMap iterator hold.
+void release_keys(rados_omap_iter_t omap_iter, rt_keyset_t *keyset,
+                  long iter_bytes, long keyset_bytes);
+// List keys of RT object (Version 1).
+int list_keys_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                 int page_size, rt_keys_cb cb, void *arg,
+                 RT_V1_REFCOUNT_T *refcount);
+
+// Decoded RT header (Version 2).
+typedef struct v2_header {
+  uint32_t refcount;
+  uint32_t recent_count;
+  uint32_t dead_count;
+  uint32_t recent_max;
+  uint32_t shards;
+  uint64_t incarnation;
+  char pool[RT_POOL_NAME_MAX + 1];
+} v2_header_t;
+
+// Where a key was found in RT (Version 2).
+typedef enum v2_key_state {
+  V2_KEY_ABSENT,
+  V2_KEY_RECENT,
+  V2_KEY_OVERFLOW,
+  V2_KEY_DEAD,
+} v2_key_state_t;
+
+// Encode RT header into `buf`, returning its size (Version 2).
+size_t v2_header_encode(const v2_header_t *hdr, char *buf);
+// Decode RT header from `len` bytes of `buf` (Version 2).
+int v2_header_decode(const char *buf, size_t len, v2_header_t *hdr);
+// Initialize RT objects (Version 2).
+int init_v2(rados_ioctx_t ioctx, const char *oid, const char *const *keys,
+            const size_t *key_lens, int keys_count, const rt_opts_t *opts);
+// Add keys to RT (Version 2).
+int add_v2(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+           const char *const *keys, const size_t *key_lens, int keys_count);
+// Remove keys from RT (Version 2).
+int remove_v2(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+              const char *const *keys, const size_t *key_lens, int keys_count,
+              int *rt_removed);
+// Read RT header and find keys (Version 2). The I/O context of the
+// overflow pool is opened into `ovf_ioctx` if needed.
+int read_v2(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+            const char *const *keys, const size_t *key_lens, int keys_count,
+            v2_header_t *hdr, rados_ioctx_t *ovf_ioctx,
+            v2_key_state_t *states);
+// Move recent keys to overflow objects and drop dead keys from there
+// (Version 2).
+int compact_v2(rados_ioctx_t ioctx, const char *oid, const v2_header_t *hdr,
+               rados_ioctx_t *ovf_ioctx);
+// List keys of RT (Version 2).
+int list_keys_v2(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                 int page_size, rt_keys_cb cb, void *arg,
+                 uint32_t *refcount);
+
+// Initialize RT objects with the partition of `writer` (Version 3).
+int init_v3(rados_ioctx_t ioctx, const char *oid, const char *const *keys,
+            const size_t *key_lens, int keys_count, const char *writer);
+// Add keys to the partition of `writer` (Version 3).
+int add_v3(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+           const char *const *keys, const size_t *key_lens, int keys_count,
+           const char *writer);
+// Remove keys from the partition of `writer` (Version 3).
+int remove_v3(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+              const char *const *keys, const size_t *key_lens, int keys_count,
+              const char *writer, int *rt_removed);
+// List keys of RT (Version 3). `writer`, if not NULL, is set to the writer
+// ID of the partition being listed.
+int list_keys_v3(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                 int page_size, rt_keys_cb cb, void *arg, uint32_t *refcount,
+                 const char **writer);
 
 /**
  * rt_add atomically adds keys to reference tracker.
  */
 int rt_add(rados_t rados, const char *pool_name, const char *rt_name,
            const char *const *keys, int keys_count, int *rt_created) {
+  int ret;
+  rados_ioctx_t ioctx;
+
+  *rt_created = 0;
+
+  if ((ret = rados_ioctx_create(rados, pool_name, &ioctx)) < 0) {
+    return ret;
+  }
+
+  size_t *key_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * keys_count);
+  for (int i = 0; i < keys_count; i++) {
+    key_lens[i] = strlen(keys[i]);
+  }
+
+  ret = rt_add2(ioctx, rt_name, keys, key_lens, keys_count, rt_created);
+
+  rt_mem_free(key_lens);
+  rados_ioctx_destroy(ioctx);
+
+  return ret;
+}
+
+void rt_opts_init(rt_opts_t *opts) {
+  opts->layout = RT_LAYOUT_SINGLE;
+  opts->overflow_pool = NULL;
+  opts->overflow_shards = 8;
+  opts->header_keys = 64;
+  opts->writer_id = NULL;
+}
+
+/**
+ * rt_add2 atomically adds keys of given lengths to reference tracker.
+ */
+int rt_add2(rados_ioctx_t ioctx, const char *rt_name, const char *const *keys,
+            const size_t *key_lens, int keys_count, int *rt_created) {
+  return rt_add3(ioctx, rt_name, keys, key_lens, keys_count, NULL,
+                 rt_created);
+}
+
+/**
+ * rt_add3 atomically adds keys to reference tracker, created with layout of
+ * `opts`.
+ */
+int rt_add3(rados_ioctx_t ioctx, const char *rt_name, const char *const *keys,
+            const size_t *key_lens, int keys_count, const rt_opts_t *opts,
+            int *rt_created) {
   { // Debug log message.
     printf("rt_add(): Adding %d keys:", keys_count);
     for (int i = 0; i < keys_count; i++)
-      printf(" %s", keys[i]);
+      printf(" %.*s", (int)key_lens[i], keys[i]);
     printf(".\n");
   }
 
   int ret = 0;
   int created = 0;
-  rados_ioctx_t ioctx = NULL;
-
-  if ((ret = rados_ioctx_create(rados, pool_name, &ioctx)) < 0) {
-    goto out;
-  }
 
-  // Read RT object version.
+  // Read RT object version. If the RT has been relocated, `ioctx` is
+  // switched to the pool it's been relocated to.
 
   RT_VERSION_T version;
+  rados_ioctx_t fwd_ioctx = NULL;
 
-  if ((ret = read_rt_version(ioctx, rt_name, &version)) < 0) {
+  if ((ret = resolve_rt_version(&ioctx, rt_name, &version, &fwd_ioctx)) < 0) {
     if (ret == -ENOENT) {
       // This is new RT. Initialize it with `keys`.
 
@@ -90,7 +375,14 @@ int rt_add(rados_t rados, const char *pool_name, const char *rt_name,
                "provided keys.\n");
       }
 
-      ret = init_v1(ioctx, rt_name, keys, keys_count);
+      if (opts && opts->layout == RT_LAYOUT_SPLIT) {
+        ret = init_v2(ioctx, rt_name, keys, key_lens, keys_count, opts);
+      } else if (opts && opts->layout == RT_LAYOUT_PARTITIONED) {
+        ret = init_v3(ioctx, rt_name, keys, key_lens, keys_count,
+                      opts->writer_id);
+      } else {
+        ret = init_v1(ioctx, rt_name, keys, key_lens, keys_count);
+      }
       created = 1;
     }
 
@@ -111,7 +403,14 @@ int rt_add(rados_t rados, const char *pool_name, const char *rt_name,
 
   switch (version) {
   case 1:
-    ret = add_v1(ioctx, rt_name, gen, keys, keys_count);
+    ret = add_v1(ioctx, rt_name, gen, keys, key_lens, keys_count);
+    break;
+  case 2:
+    ret = add_v2(ioctx, rt_name, gen, keys, key_lens, keys_count);
+    break;
+  case 3:
+    ret = add_v3(ioctx, rt_name, gen, keys, key_lens, keys_count,
+                 opts ? opts->writer_id : NULL);
     break;
   default:
     // Unknown version.
@@ -124,10 +423,7 @@ int rt_add(rados_t rados, const char *pool_name, const char *rt_name,
 
 out:
 
-  if (ioctx) {
-    rados_ioctx_destroy(ioctx);
-  }
-
+  release_pool_ioctx(fwd_ioctx);
   *rt_created = created;
 
   return ret;
@@ -138,26 +434,61 @@ out:
  */
 int rt_remove(rados_t rados, const char *pool_name, const char *rt_name,
               const char *const *keys, int keys_count, int *rt_deleted) {
+  int ret;
+  rados_ioctx_t ioctx;
+
+  *rt_deleted = 0;
+
+  if ((ret = rados_ioctx_create(rados, pool_name, &ioctx)) < 0) {
+    return ret;
+  }
+
+  size_t *key_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * keys_count);
+  for (int i = 0; i < keys_count; i++) {
+    key_lens[i] = strlen(keys[i]);
+  }
+
+  ret = rt_remove2(ioctx, rt_name, keys, key_lens, keys_count, rt_deleted);
+
+  rt_mem_free(key_lens);
+  rados_ioctx_destroy(ioctx);
+
+  return ret;
+}
+
+/**
+ * rt_remove2 atomically removes keys of given lengths from reference tracker.
+ */
+int rt_remove2(rados_ioctx_t ioctx, const char *rt_name,
+               const char *const *keys, const size_t *key_lens,
+               int keys_count, int *rt_deleted) {
+  return rt_remove3(ioctx, rt_name, keys, key_lens, keys_count, NULL,
+                    rt_deleted);
+}
+
+/**
+ * rt_remove3 atomically removes keys from reference tracker, as the writer
+ * of `opts`.
+ */
+int rt_remove3(rados_ioctx_t ioctx, const char *rt_name,
+               const char *const *keys, const size_t *key_lens,
+               int keys_count, const rt_opts_t *opts, int *rt_deleted) {
   { // Debug log message.
     printf("rt_remove(): Removing %d keys:", keys_count);
     for (int i = 0; i < keys_count; i++)
-      printf(" %s", keys[i]);
+      printf(" %.*s", (int)key_lens[i], keys[i]);
     printf(".\n");
   }
 
   int ret = 0;
   int deleted = 0;
-  rados_ioctx_t ioctx;
-
-  if ((ret = rados_ioctx_create(rados, pool_name, &ioctx)) < 0) {
-    goto out;
-  }
 
-  // Read RT object version.
+  // Read RT object version, following forwarding markers.
 
   RT_VERSION_T version;
+  rados_ioctx_t fwd_ioctx = NULL;
 
-  if ((ret = read_rt_version(ioctx, rt_name, &version)) < 0) {
+  if ((ret = resolve_rt_version(&ioctx, rt_name, &version, &fwd_ioctx)) < 0) {
     if (ret == -ENOENT) {
       // This RT doesn't exist. Assume it was already deleted.
 
@@ -187,7 +518,16 @@ int rt_remove(rados_t rados, const char *pool_name, const char *rt_name,
 
   switch (version) {
   case 1:
-    ret = remove_v1(ioctx, rt_name, gen, keys, keys_count, &deleted);
+    ret = remove_v1(ioctx, rt_name, gen, keys, key_lens, keys_count,
+                    &deleted);
+    break;
+  case 2:
+    ret = remove_v2(ioctx, rt_name, gen, keys, key_lens, keys_count,
+                    &deleted);
+    break;
+  case 3:
+    ret = remove_v3(ioctx, rt_name, gen, keys, key_lens, keys_count,
+                    opts ? opts->writer_id : NULL, &deleted);
     break;
   default:
     // Unknown version.
@@ -200,467 +540,3476 @@ int rt_remove(rados_t rados, const char *pool_name, const char *rt_name,
 
 out:
 
-  if (ioctx) {
-    rados_ioctx_destroy(ioctx);
-  }
-
+  release_pool_ioctx(fwd_ioctx);
   *rt_deleted = deleted;
 
   return ret;
 }
 
-int read_rt_version(rados_ioctx_t ioctx, const char *oid,
-                    RT_VERSION_T *version) {
-  { // Debug log message.
-    printf("Reading RT version...\n");
+// Lists keys of an RT, following forwarding markers. `writer` is set as by
+// list_keys_v3, and to NULL for RTs of other layouts.
+static int list_keys(rados_ioctx_t ioctx, const char *rt_name, int page_size,
+                     rt_keys_cb cb, void *arg, uint32_t *refcount,
+                     const char **writer, int follow) {
+  int ret;
+  RT_VERSION_T version;
+  rados_ioctx_t fwd_ioctx = NULL;
+
+  if ((ret = resolve_rt_version(&ioctx, rt_name, &version,
+                                follow ? &fwd_ioctx : NULL)) < 0) {
+    goto out;
   }
 
-  char version_bytes[RT_VERSION_SIZE];
+  uint64_t gen = rados_get_last_version(ioctx);
 
-  int ret;
-  if ((ret = rados_getxattr(ioctx, oid, RT_VERSION_XATTR, version_bytes,
-                            RT_VERSION_SIZE)) < 0) {
-    return ret;
+  switch (version) {
+  case 1:
+    ret = list_keys_v1(ioctx, rt_name, gen, page_size, cb, arg, refcount);
+    break;
+  case 2:
+    ret = list_keys_v2(ioctx, rt_name, gen, page_size, cb, arg, refcount);
+    break;
+  case 3:
+    ret = list_keys_v3(ioctx, rt_name, gen, page_size, cb, arg, refcount,
+                       writer);
+    break;
+  default:
+    // Unknown version.
+    { // Debug log message.
+      printf("This is not a known RT object version.\n");
+    }
+    ret = -1;
+    break;
   }
 
-  memcpy(version, version_bytes, RT_VERSION_SIZE);
-  *version = ntohl(*version);
+out:
 
-  return 0;
+  release_pool_ioctx(fwd_ioctx);
+
+  return ret;
 }
 
-int init_v1(rados_ioctx_t ioctx, const char *oid, const char *const *keys,
-            int keys_count) {
-  { // Debug log message.
-    printf("init_v1(): Initializing new RT v1 object.\n");
-  }
+/**
+ * rt_list_keys lists all keys tracked by reference tracker.
+ */
+int rt_list_keys(rados_ioctx_t ioctx, const char *rt_name, int page_size,
+                 rt_keys_cb cb, void *arg, uint32_t *refcount) {
+  return list_keys(ioctx, rt_name, page_size, cb, arg, refcount, NULL, 1);
+}
 
-  const int write_buf_size = RT_V1_REFCOUNT_SIZE;
-  char write_buf[write_buf_size];
+// Listing of rt_list_keys2, passing pages on with their writer.
+typedef struct writer_list {
+  rt_writer_keys_cb cb;
+  void *arg;
+  const char *writer;
+} writer_list_t;
+
+static int writer_list_page(const char *const *keys, const size_t *key_lens,
+                            int keys_count, void *arg) {
+  writer_list_t *l = arg;
+  return l->cb(l->writer, keys, key_lens, keys_count, l->arg);
+}
 
-  // Prepare version.
+/**
+ * rt_list_keys2 lists all keys tracked by reference tracker, along with the
+ * writers of partitioned RTs holding them.
+ */
+int rt_list_keys2(rados_ioctx_t ioctx, const char *rt_name, int page_size,
+                  rt_writer_keys_cb cb, void *arg, uint32_t *refcount) {
+  writer_list_t l = {.cb = cb, .arg = arg};
 
-  char version_bytes[RT_VERSION_SIZE];
+  return list_keys(ioctx, rt_name, page_size, writer_list_page, &l, refcount,
+                   &l.writer, 1);
+}
 
-  {
-    RT_VERSION_T version = htonl(RT_CURRENT_VERSION);
-    memcpy(version_bytes, &version, RT_VERSION_SIZE);
-  }
+/**
+ * rt_list_local_keys lists all keys tracked by reference tracker stored in
+ * the pool of `ioctx`, without following forwarding markers.
+ */
+int rt_list_local_keys(rados_ioctx_t ioctx, const char *rt_name,
+                       int page_size, rt_keys_cb cb, void *arg,
+                       uint32_t *refcount) {
+  return list_keys(ioctx, rt_name, page_size, cb, arg, refcount, NULL, 0);
+}
 
-  // Prepare reference count.
+/**
+ * rt_list_ops returns the number of RADOS operations of listing an RT.
+ */
+int rt_list_ops(uint32_t refcount, int page_size) {
+  // The version, and then at least one page.
+  uint32_t pages = (refcount + page_size - 1) / page_size;
+  return 1 + (pages > 0 ? (int)pages : 1);
+}
 
-  {
-    RT_V1_REFCOUNT_T refcount = htonl(keys_count);
-    memcpy(write_buf, &refcount, RT_V1_REFCOUNT_SIZE);
+// State of an RT copy made by rt_relocate.
+typedef struct relocate_copy {
+  rados_ioctx_t dst;
+  const char *oid;
+  rt_pace_cb pace;
+  void *pace_arg;
+  // Value of RT_RELOCATE_XATTR identifying the copy made by this call.
+  char cookie[RT_RELOCATE_COOKIE_SIZE];
+  // Whether the destination object has been created by this call, and is
+  // still ours.
+  int created;
+  // Destination object version once the copy is complete, zero before.
+  uint64_t complete_gen;
+  // Empty OMap values, for a chunk of keys.
+  char **vals;
+  size_t *val_lens;
+  // RADOS operations issued since `pace` was last called.
+  int ops;
+} relocate_copy_t;
+
+// Drops a copy left at destination by an interrupted relocation. Complete
+// RTs, objects that aren't copies, and copies still being written by
+// another relocation are left alone. Returns 0 once the copy is gone.
+static int relocate_drop_stale(rados_ioctx_t dst, const char *oid) {
+  rados_xattrs_iter_t iter = NULL;
+  int xattrs_ret, stat_ret;
+  uint64_t size;
+  time_t mtime;
+  int has_version = 0, has_cookie = 0;
+
+  rados_read_op_t read_op = rados_create_read_op();
+  rados_read_op_stat(read_op, &size, &mtime, &stat_ret);
+  rados_read_op_getxattrs(read_op, &iter, &xattrs_ret);
+
+  int ret = rados_read_op_operate(read_op, dst, oid, 0);
+  rados_release_read_op(read_op);
+
+  if (ret == 0 && (ret = xattrs_ret) == 0) {
+    const char *name, *val;
+    size_t len;
+
+    while (rados_getxattrs_next(iter, &name, &val, &len) == 0 && name) {
+      has_version |= strcmp(name, RT_VERSION_XATTR) == 0;
+      has_cookie |= strcmp(name, RT_RELOCATE_XATTR) == 0;
+    }
   }
 
-  // Prepare OMap entries.
-
-  char **vals = malloc(sizeof(void *) * keys_count);
-  size_t *key_lens = malloc(sizeof(size_t) * keys_count);
-  size_t *val_lens = malloc(sizeof(size_t) * keys_count);
+  if (iter) {
+    rados_getxattrs_end(iter);
+  }
 
-  for (int i = 0; i < keys_count; i++) {
-    key_lens[i] = strlen(keys[i]);
-    vals[i] = NULL;
-    val_lens[i] = 0;
+  if (ret == -ENOENT) {
+    return 0;
+  }
+  if (ret < 0) {
+    return ret;
   }
 
-  // Perform write.
+  if (has_version || !has_cookie) {
+    { // Debug log message.
+      printf("RT %s already exists at destination.\n", oid);
+    }
+    return -EEXIST;
+  }
 
-  rados_write_op_t write_op = rados_create_write_op();
+  if (time(NULL) - mtime < RT_RELOCATE_STALE_SECS) {
+    { // Debug log message.
+      printf("RT %s is being relocated concurrently.\n", oid);
+    }
+    return -EBUSY;
+  }
 
-  rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
-  rados_write_op_setxattr(write_op, RT_VERSION_XATTR, version_bytes,
-                          RT_VERSION_SIZE);
-  rados_write_op_write_full(write_op, write_buf, write_buf_size);
-  rados_write_op_omap_set2(write_op, keys, (const char *const *)vals, key_lens,
-                           (const size_t *)val_lens, keys_count);
+  // Only the copy as it's been stat'ed is dropped. A write by its owner
+  // in the meantime keeps it.
 
-  int ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+  uint64_t gen = rados_get_last_version(dst);
 
-  { // Debug log message.
-    if (ret < 0) {
-      printf("Write operation failed with error code %d.\n", ret);
-    } else {
-      printf("RT object successfully initialized.\n");
-    }
-  }
+  rados_write_op_t write_op = rados_create_write_op();
+  rados_write_op_assert_version(write_op, gen);
+  rados_write_op_remove(write_op);
 
+  ret = rados_write_op_operate(write_op, dst, oid, NULL, 0);
   rados_release_write_op(write_op);
 
-  free(val_lens);
-  free(vals);
-  free(key_lens);
+  if (ret == -ERANGE) {
+    return -EBUSY;
+  }
 
-  return ret;
+  return ret == -ENOENT ? 0 : ret;
 }
 
-int add_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
-           const char *const *keys, int keys_count) {
-  { // Debug log message.
-    printf("add_v1(): Adding keys to an existing RT v1 object.\n");
-  }
-
-  int ret = 0;
-  RT_V1_REFCOUNT_T refcount;
+// rt_keys_cb writing a chunk of keys into the copy at destination. The
+// first chunk creates the copy, tagged with the cookie of this call, and
+// the others only write into it as long as it still carries the cookie.
+static int relocate_copy_keys(const char *const *keys, const size_t *key_lens,
+                              int keys_count, void *arg) {
+  relocate_copy_t *c = arg;
+  int ret;
 
-  const int write_buf_size = RT_V1_REFCOUNT_SIZE;
-  char write_buf[write_buf_size];
+  // Keys come from a page just read.
+  c->ops++;
 
-  // Return values from OMap comparisons.
-  int *ref_keys_found = malloc(sizeof(int) * keys_count);
+  for (int attempt = 0;; attempt++) {
+    if (c->pace) {
+      c->pace(c->pace_arg, c->ops);
+    }
+    c->ops = 0;
 
-  // Read the RT object.
-  if ((ret = read_v1(ioctx, oid, gen, keys, keys_count, &refcount,
-                     ref_keys_found)) < 0) {
-    goto out;
-  }
+    rados_write_op_t write_op = rados_create_write_op();
+    if (!c->created) {
+      rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+      rados_write_op_setxattr(write_op, RT_RELOCATE_XATTR, c->cookie,
+                              RT_RELOCATE_COOKIE_SIZE);
+    } else {
+      rados_write_op_cmpxattr(write_op, RT_RELOCATE_XATTR,
+                              LIBRADOS_CMPXATTR_OP_EQ, c->cookie,
+                              RT_RELOCATE_COOKIE_SIZE);
+    }
+    rados_write_op_omap_set2(write_op, keys, (const char *const *)c->vals,
+                             key_lens, c->val_lens, keys_count);
 
-  // Prepare keys to add.
+    ret = rados_write_op_operate(write_op, c->dst, c->oid, NULL, 0);
+    rados_release_write_op(write_op);
+    c->ops++;
 
-  int keys_to_add_count = 0;
-  for (int i = 0; i < keys_count; i++) {
-    if (!ref_keys_found[i]) {
-      keys_to_add_count++;
+    if (c->created && (ret == -ECANCELED || ret == -ENOENT)) {
+      // The copy has been dropped as stale by another relocation, which
+      // may be writing its own copy now.
+      { // Debug log message.
+        printf("Copy of RT %s has been dropped concurrently.\n", c->oid);
+      }
+      c->created = 0;
+      return -EBUSY;
     }
-  }
 
-  char **keys_to_add = NULL;
-  char **vals_to_add = NULL;
-  size_t *keys_to_add_lens = NULL;
-  size_t *vals_to_add_lens = NULL;
+    if (ret != -EEXIST || attempt > 0) {
+      break;
+    }
 
-  if (!keys_to_add_count) {
-    // Nothing to do.
-    { // Debug log message.
-      printf("No keys will be added. They are all already tracked.\n");
+    if ((ret = relocate_drop_stale(c->dst, c->oid)) < 0) {
+      return ret;
     }
-    goto out;
   }
 
-  keys_to_add = malloc(sizeof(void *) * keys_to_add_count);
-  vals_to_add = malloc(sizeof(void *) * keys_to_add_count);
-  keys_to_add_lens = malloc(sizeof(size_t) * keys_to_add_count);
-  vals_to_add_lens = malloc(sizeof(size_t) * keys_to_add_count);
-
-  { // Debug log message.
-    printf("Adding %d keys out of %d requested:", keys_to_add_count,
-           keys_count);
+  if (ret == 0) {
+    c->created = 1;
   }
 
-  for (int i = 0, j = 0; i < keys_count; i++) {
-    if (ref_keys_found[i]) {
-      // Skip this key as it's already tracked.
-      continue;
-    }
+  return ret;
+}
 
-    keys_to_add[j] = (char *)keys[i];
-    vals_to_add[j] = NULL;
-    keys_to_add_lens[j] = strlen(keys[i]);
-    vals_to_add_lens[j] = 0;
+// Drops the copy made by this call after rt_relocate failed, unless the
+// source has been replaced by a forwarding marker, which may lead to it.
+static void relocate_drop_copy(rados_ioctx_t src, relocate_copy_t *c) {
+  RT_VERSION_T version;
+  int ret = read_rt_version(src, c->oid, &version);
 
-    j++;
+  if ((ret < 0 && ret != -ENOENT) ||
+      (ret == 0 && version == RT_FORWARD_VERSION)) {
     { // Debug log message.
-      printf(" %s", keys[i]);
+      printf("Keeping copy of RT %s: %d.\n", c->oid, ret);
     }
+    return;
   }
 
-  { // Debug log message.
-    printf(".\n");
+  // The copy is removed only if it's still the one written by this call:
+  // tagged with its cookie, or unchanged since it's been completed.
+
+  rados_write_op_t write_op = rados_create_write_op();
+  if (c->complete_gen) {
+    rados_write_op_assert_version(write_op, c->complete_gen);
+  } else {
+    rados_write_op_cmpxattr(write_op, RT_RELOCATE_XATTR,
+                            LIBRADOS_CMPXATTR_OP_EQ, c->cookie,
+                            RT_RELOCATE_COOKIE_SIZE);
   }
+  rados_write_op_remove(write_op);
+
+  rados_write_op_operate(write_op, c->dst, c->oid, NULL, 0);
+  rados_release_write_op(write_op);
+}
 
-  // Prepare new value refcount.
+/**
+ * rt_relocate moves reference tracker to another pool.
+ */
+int rt_relocate(rados_ioctx_t src, rados_ioctx_t dst, const char *dst_pool,
+                const char *rt_name, int chunk_size, rt_pace_cb pace,
+                void *pace_arg, int *relocated) {
+  int ret;
+  RT_VERSION_T version;
+  RT_V1_REFCOUNT_T refcount;
 
-  refcount += (RT_V1_REFCOUNT_T)keys_to_add_count;
+  *relocated = 0;
 
-  {
-    RT_V1_REFCOUNT_T refcount_n = htonl(refcount);
-    memcpy(write_buf, &refcount_n, RT_V1_REFCOUNT_SIZE);
+  size_t dst_pool_len = strlen(dst_pool);
+  if (dst_pool_len == 0 || dst_pool_len > RT_POOL_NAME_MAX) {
+    return -EINVAL;
   }
 
-  // Perform write.
+  if (pace) {
+    pace(pace_arg, 0);
+  }
 
-  {
-    rados_write_op_t write_op = rados_create_write_op();
+  if ((ret = read_rt_version(src, rt_name, &version)) < 0) {
+    return ret;
+  }
 
-    rados_write_op_assert_version(write_op, gen);
+  if (version == RT_FORWARD_VERSION) {
+    // Already relocated.
+    return 0;
+  }
+
+  if (version == 2 || version == 3) {
+    // Split RTs span two pools already, and partitioned RTs many objects.
+    { // Debug log message.
+      printf("Only RT v1 objects can be relocated.\n");
+    }
+    return -EOPNOTSUPP;
+  }
+
+  if (version != 1) {
+    // Unknown version.
+    { // Debug log message.
+      printf("This is not a known RT object version.\n");
+    }
+    return -1;
+  }
+
+  uint64_t gen = rados_get_last_version(src);
+
+  relocate_copy_t c = {
+      .dst = dst,
+      .oid = rt_name,
+      .pace = pace,
+      .pace_arg = pace_arg,
+      .vals = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * chunk_size),
+      .val_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * chunk_size),
+      // The version read.
+      .ops = 1,
+  };
+
+  {
+    uint64_t cookie = htobe64(new_incarnation(dst));
+    memcpy(c.cookie, &cookie, RT_RELOCATE_COOKIE_SIZE);
+  }
+
+  for (int i = 0; i < chunk_size; i++) {
+    c.vals[i] = NULL;
+    c.val_lens[i] = 0;
+  }
+
+  // Copy the OMap in chunks, all read from the source version `gen`. An RT
+  // without keys still needs its copy created.
+
+  if ((ret = list_keys_v1(src, rt_name, gen, chunk_size, relocate_copy_keys,
+                          &c, &refcount)) < 0 ||
+      (!c.created && (ret = relocate_copy_keys(NULL, NULL, 0, &c)) < 0)) {
+    goto out;
+  }
+
+  // Setting the version and refcount completes the copy. The cookie isn't
+  // needed from then on, a complete RT is never taken for a stale copy.
+
+  {
+    char version_bytes[RT_VERSION_SIZE];
+    char refcount_bytes[RT_V1_REFCOUNT_SIZE];
+
+    RT_VERSION_T version_n = htonl(1);
+    memcpy(version_bytes, &version_n, RT_VERSION_SIZE);
+    RT_V1_REFCOUNT_T refcount_n = htonl(refcount);
+    memcpy(refcount_bytes, &refcount_n, RT_V1_REFCOUNT_SIZE);
+
+    if (pace) {
+      pace(pace_arg, c.ops);
+    }
+
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_cmpxattr(write_op, RT_RELOCATE_XATTR,
+                            LIBRADOS_CMPXATTR_OP_EQ, c.cookie,
+                            RT_RELOCATE_COOKIE_SIZE);
+    rados_write_op_rmxattr(write_op, RT_RELOCATE_XATTR);
+    rados_write_op_setxattr(write_op, RT_VERSION_XATTR, version_bytes,
+                            RT_VERSION_SIZE);
+    rados_write_op_write_full(write_op, refcount_bytes, RT_V1_REFCOUNT_SIZE);
+
+    ret = rados_write_op_operate(write_op, dst, rt_name, NULL, 0);
+    rados_release_write_op(write_op);
+
+    if (ret == -ECANCELED || ret == -ENOENT) {
+      // Dropped as stale, see relocate_copy_keys.
+      c.created = 0;
+      ret = -EBUSY;
+    }
+    if (ret < 0) {
+      goto out;
+    }
+    c.complete_gen = rados_get_last_version(dst);
+  }
+
+  // Replace the source with a forwarding marker, unless it's changed since
+  // it was copied. Updates from then on follow the marker to the copy.
+
+  {
+    char version_bytes[RT_VERSION_SIZE];
+    RT_VERSION_T version_n = htonl(RT_FORWARD_VERSION);
+    memcpy(version_bytes, &version_n, RT_VERSION_SIZE);
+
+    if (pace) {
+      pace(pace_arg, 1);
+    }
+
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_assert_version(write_op, gen);
+    rados_write_op_omap_clear(write_op);
+    rados_write_op_setxattr(write_op, RT_VERSION_XATTR, version_bytes,
+                            RT_VERSION_SIZE);
+    rados_write_op_write_full(write_op, dst_pool, dst_pool_len);
+
+    ret = rados_write_op_operate(write_op, src, rt_name, NULL, 0);
+    rados_release_write_op(write_op);
+  }
+
+  { // Debug log message.
+    if (ret == -ERANGE) {
+      printf("The RT object has changed while it was copied. Please try "
+             "again.\n");
+    } else if (ret < 0) {
+      printf("Write operation failed with error code %d.\n", ret);
+    } else {
+      printf("RT %s relocated to pool %s.\n", rt_name, dst_pool);
+    }
+  }
+
+  if (ret == 0) {
+    *relocated = 1;
+    // The RT is counted in the pool it lives in from now on.
+    rt_rollup_note(src, -1, -(int64_t)refcount);
+    rt_rollup_note(dst, 1, refcount);
+  }
+
+out:
+
+  if (ret < 0 && c.created) {
+    relocate_drop_copy(src, &c);
+  }
+
+  rt_mem_free(c.vals);
+  rt_mem_free(c.val_lens);
+
+  return ret;
+}
+
+/**
+ * rt_drop_marker removes forwarding marker left behind by rt_relocate.
+ */
+int rt_drop_marker(rados_ioctx_t ioctx, const char *rt_name, int *dropped) {
+  char version_bytes[RT_VERSION_SIZE];
+  RT_VERSION_T version_n = htonl(RT_FORWARD_VERSION);
+  memcpy(version_bytes, &version_n, RT_VERSION_SIZE);
+
+  *dropped = 0;
+
+  rados_write_op_t write_op = rados_create_write_op();
+  rados_write_op_cmpxattr(write_op, RT_VERSION_XATTR, LIBRADOS_CMPXATTR_OP_EQ,
+                          version_bytes, RT_VERSION_SIZE);
+  rados_write_op_remove(write_op);
+
+  int ret = rados_write_op_operate(write_op, ioctx, rt_name, NULL, 0);
+  rados_release_write_op(write_op);
+
+  if (ret == 0) {
+    *dropped = 1;
+  } else if (ret == -ECANCELED || ret == -ENOENT) {
+    // Not a forwarding marker, or already gone.
+    ret = 0;
+  }
+
+  return ret;
+}
+
+/**
+ * rt_load reads all keys of single object reference tracker, and its
+ * version.
+ */
+int rt_load(rados_ioctx_t ioctx, const char *rt_name, int page_size,
+            rt_keys_cb cb, void *arg, uint32_t *refcount, uint64_t *gen) {
+  int ret;
+  RT_VERSION_T version;
+
+  if ((ret = read_rt_version(ioctx, rt_name, &version)) < 0) {
+    return ret;
+  }
+
+  if (version != 1) {
+    { // Debug log message.
+      printf("Only RT v1 objects can be loaded.\n");
+    }
+    return -EOPNOTSUPP;
+  }
+
+  *gen = rados_get_last_version(ioctx);
+
+  return list_keys_v1(ioctx, rt_name, *gen, page_size, cb, arg, refcount);
+}
+
+/**
+ * rt_store writes an update of single object reference tracker without
+ * reading it first.
+ */
+int rt_store(rados_ioctx_t ioctx, const char *rt_name, uint64_t *gen,
+             uint32_t refcount, const char *const *add_keys,
+             const size_t *add_key_lens, int add_count,
+             const char *const *rm_keys, const size_t *rm_key_lens,
+             int rm_count) {
+  { // Debug log message.
+    printf("rt_store(): Adding %d and removing %d keys, refcount %u.\n",
+           add_count, rm_count, refcount);
+  }
+
+  char **vals = NULL;
+  size_t *val_lens = NULL;
+  RT_V1_REFCOUNT_T refcount_n = htonl(refcount);
+
+  rados_write_op_t write_op = rados_create_write_op();
+  rados_write_op_assert_version(write_op, *gen);
+
+  if (refcount == 0) {
+    rados_write_op_remove(write_op);
+  } else {
+    rados_write_op_write_full(write_op, (const char *)&refcount_n,
+                              RT_V1_REFCOUNT_SIZE);
+    if (add_count > 0) {
+      vals = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * add_count);
+      val_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * add_count);
+      for (int i = 0; i < add_count; i++) {
+        vals[i] = NULL;
+        val_lens[i] = 0;
+      }
+
+      rados_write_op_omap_set2(write_op, add_keys, (const char *const *)vals,
+                               add_key_lens, val_lens, add_count);
+    }
+    if (rm_count > 0) {
+      rados_write_op_omap_rm_keys2(write_op, rm_keys, rm_key_lens, rm_count);
+    }
+  }
+
+  int ret = rados_write_op_operate(write_op, ioctx, rt_name, NULL, 0);
+  rados_release_write_op(write_op);
+
+  if (ret == 0) {
+    rt_rollup_note(ioctx, refcount == 0 ? -1 : 0,
+                   (int64_t)add_count - rm_count);
+  }
+
+  if (ret == 0 && refcount > 0) {
+    *gen = rados_get_last_version(ioctx);
+  }
+
+  { // Debug log message.
+    if (ret == -ERANGE) {
+      printf("The RT object has changed since it was loaded. Please try "
+             "again.\n");
+    } else if (ret < 0) {
+      printf("Write operation failed with error code %d.\n", ret);
+    }
+  }
+
+  rt_mem_free(vals);
+  rt_mem_free(val_lens);
+
+  return ret;
+}
+
+// Steps of an update issued by rt_aio_start.
+typedef enum aio_state {
+  AIO_READ,
+  AIO_INIT,
+  AIO_WRITE,
+} aio_state_t;
+
+struct rt_aio {
+  rados_ioctx_t ioctx;
+  const char *oid;
+  int remove;
+  const char *const *keys;
+  const size_t *key_lens;
+  int keys_count;
+  rt_aio_cb cb;
+  void *arg;
+
+  aio_state_t state;
+  rados_completion_t completion;
+  rados_read_op_t read_op;
+  rados_write_op_t write_op;
+  // Whether the write deletes the RT.
+  int removed;
+  // Number of keys the write adds or removes.
+  int changed;
+
+  // Here will be stored results of the read.
+  char read_buf[RT_V1_REFCOUNT_SIZE];
+  size_t read_bytes;
+  int read_rval;
+  rados_omap_iter_t omap_iter;
+  int omap_get_vals_ret;
+};
+
+static void aio_complete(rados_completion_t completion, void *arg) {
+  rt_aio_t *aio = arg;
+  aio->cb(aio, aio->arg);
+}
+
+// Issues the read of the RT object (Version 1). The version xattr is
+// compared instead of read, so that RTs of other layouts and forwarding
+// markers fail the read with -ECANCELED.
+static int aio_submit_read(rt_aio_t *aio) {
+  char version_bytes[RT_VERSION_SIZE];
+
+  {
+    RT_VERSION_T version = htonl(1);
+    memcpy(version_bytes, &version, RT_VERSION_SIZE);
+  }
+
+  aio->state = AIO_READ;
+  aio->read_op = rados_create_read_op();
+
+  rados_read_op_cmpxattr(aio->read_op, RT_VERSION_XATTR,
+                         LIBRADOS_CMPXATTR_OP_EQ, version_bytes,
+                         RT_VERSION_SIZE);
+  rados_read_op_read(aio->read_op, 0, RT_V1_REFCOUNT_SIZE, aio->read_buf,
+                     &aio->read_bytes, &aio->read_rval);
+  rados_read_op_omap_get_vals_by_keys2(aio->read_op, aio->keys,
+                                       aio->keys_count, aio->key_lens,
+                                       &aio->omap_iter,
+                                       &aio->omap_get_vals_ret);
+
+  rados_aio_create_completion2(aio, aio_complete, &aio->completion);
+
+  return rados_aio_read_op_operate(aio->read_op, aio->ioctx, aio->completion,
+                                   aio->oid, 0);
+}
+
+// Issues the write prepared in `aio->write_op` as step `state`. `aio` must
+// not be touched afterwards, its callback may already be running.
+static int aio_submit_write(rt_aio_t *aio, aio_state_t state) {
+  aio->state = state;
+  rados_aio_create_completion2(aio, aio_complete, &aio->completion);
+
+  return rados_aio_write_op_operate(aio->write_op, aio->ioctx,
+                                    aio->completion, aio->oid, NULL, 0);
+}
+
+// Releases the completion and the op of the completed step.
+static void aio_release_step(rt_aio_t *aio) {
+  if (aio->completion) {
+    rados_aio_release(aio->completion);
+    aio->completion = NULL;
+  }
+  if (aio->read_op) {
+    rados_release_read_op(aio->read_op);
+    aio->read_op = NULL;
+  }
+  if (aio->write_op) {
+    rados_release_write_op(aio->write_op);
+    aio->write_op = NULL;
+  }
+}
+
+/**
+ * rt_aio_start starts an update of single object reference tracker with
+ * asynchronous I/O.
+ */
+int rt_aio_start(rados_ioctx_t ioctx, const char *rt_name, int remove,
+                 const char *const *keys, const size_t *key_lens,
+                 int keys_count, rt_aio_cb cb, void *arg, rt_aio_t **aio) {
+  rt_aio_t *a = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(rt_aio_t));
+  *a = (rt_aio_t){
+      .ioctx = ioctx,
+      .oid = rt_name,
+      .remove = remove,
+      .keys = keys,
+      .key_lens = key_lens,
+      .keys_count = keys_count,
+      .cb = cb,
+      .arg = arg,
+  };
+
+  // Set before the read is issued, for the callback to find it.
+  *aio = a;
+
+  int ret = aio_submit_read(a);
+  if (ret < 0) {
+    rt_aio_release(a);
+    *aio = NULL;
+  }
+
+  return ret;
+}
+
+/**
+ * rt_aio_advance handles the completed step of an update started by
+ * rt_aio_start, and issues the next one.
+ */
+int rt_aio_advance(rt_aio_t *aio, int *ret, int *flag) {
+  int rval = rados_aio_get_return_value(aio->completion);
+
+  *flag = 0;
+
+  switch (aio->state) {
+  case AIO_READ: {
+    uint64_t gen = rados_aio_get_version(aio->completion);
+
+    if (rval < 0) {
+      release_keys(aio->omap_iter, NULL, 0, 0);
+      aio_release_step(aio);
+    }
+
+    if (rval == -ENOENT) {
+      if (aio->remove) {
+        // This RT doesn't exist. Assume it was already deleted.
+        *ret = 0;
+        *flag = 1;
+        return 1;
+      }
+
+      // This is new RT. Initialize it with the keys.
+      aio->write_op = rados_create_write_op();
+      v1_init_op(aio->write_op, aio->keys, aio->key_lens, aio->keys_count);
+
+      if ((*ret = aio_submit_write(aio, AIO_INIT)) < 0) {
+        return 1;
+      }
+      return 0;
+    }
+
+    if (rval < 0) {
+      if (rval == -ECANCELED) {
+        { // Debug log message.
+          printf("Only RT v1 objects can be updated asynchronously.\n");
+        }
+        rval = -EOPNOTSUPP;
+      }
+
+      *ret = rval;
+      return 1;
+    }
+
+    // Find which of the keys the RT holds, and prepare the write.
+
+    rt_keyset_t *fetched_keys = NULL;
+    long iter_bytes = 0;
+    long keyset_bytes = 0;
+    int *ref_keys_found =
+        rt_mem_alloc(RT_MEM_SCRATCH, sizeof(int) * aio->keys_count);
+
+    if ((rval = collect_keys(aio->omap_iter, &fetched_keys, &iter_bytes,
+                             &keyset_bytes)) == 0) {
+      for (int i = 0; i < aio->keys_count; i++) {
+        ref_keys_found[i] = rt_keyset_contains(fetched_keys, aio->keys[i],
+                                               aio->key_lens[i]);
+      }
+    }
+
+    release_keys(aio->omap_iter, fetched_keys, iter_bytes, keyset_bytes);
+    aio_release_step(aio);
+
+    int changed = 0;
+    if (rval == 0) {
+      RT_V1_REFCOUNT_T refcount;
+      memcpy(&refcount, aio->read_buf, RT_V1_REFCOUNT_SIZE);
+      refcount = ntohl(refcount);
+
+      aio->write_op = rados_create_write_op();
+      changed = v1_update_op(aio->write_op, gen, aio->remove, aio->keys,
+                             aio->key_lens, aio->keys_count, ref_keys_found,
+                             refcount, &aio->removed);
+      aio->changed = changed;
+    }
+
+    rt_mem_free(ref_keys_found);
+
+    if (rval < 0 || changed == 0) {
+      aio_release_step(aio);
+      *ret = rval;
+      return 1;
+    }
+
+    if ((*ret = aio_submit_write(aio, AIO_WRITE)) < 0) {
+      return 1;
+    }
+    return 0;
+  }
+  case AIO_INIT:
+    *ret = rval;
+    *flag = rval == 0;
+    if (rval == 0) {
+      rt_rollup_note(aio->ioctx, 1, aio->keys_count);
+    }
+    break;
+  case AIO_WRITE:
+    *ret = rval;
+    *flag = rval == 0 && aio->removed;
+    if (rval == 0) {
+      rt_rollup_note(aio->ioctx, -aio->removed,
+                     aio->remove ? -aio->changed : aio->changed);
+    }
+    break;
+  }
+
+  { // Debug log message.
+    if (rval == -ERANGE) {
+      printf("The RT object has changed since it was last read. Please try "
+             "again.\n");
+    } else if (rval < 0) {
+      printf("Write operation failed with error code %d.\n", rval);
+    }
+  }
+
+  aio_release_step(aio);
+  return 1;
+}
+
+/**
+ * rt_aio_release frees an update started by rt_aio_start.
+ */
+void rt_aio_release(rt_aio_t *aio) {
+  aio_release_step(aio);
+  rt_mem_free(aio);
+}
+
+int read_rt_version(rados_ioctx_t ioctx, const char *oid,
+                    RT_VERSION_T *version) {
+  { // Debug log message.
+    printf("Reading RT version...\n");
+  }
+
+  char version_bytes[RT_VERSION_SIZE];
+
+  int ret;
+  if ((ret = rados_getxattr(ioctx, oid, RT_VERSION_XATTR, version_bytes,
+                            RT_VERSION_SIZE)) < 0) {
+    return ret;
+  }
+
+  memcpy(version, version_bytes, RT_VERSION_SIZE);
+  *version = ntohl(*version);
+
+  return 0;
+}
+
+int resolve_rt_version(rados_ioctx_t *ioctx, const char *oid,
+                       RT_VERSION_T *version, rados_ioctx_t *fwd_ioctx) {
+  int ret;
+
+  for (int hops = 0;; hops++) {
+    // Read the version along with the data, which is the pool the RT was
+    // relocated to if it's a forwarding marker, so that following a marker
+    // doesn't take another read.
+
+    char pool[RT_POOL_NAME_MAX + 1];
+    size_t pool_len = 0;
+    int read_rval, xattrs_ret;
+    rados_xattrs_iter_t iter = NULL;
+
+    {
+      rados_read_op_t read_op = rados_create_read_op();
+      rados_read_op_getxattrs(read_op, &iter, &xattrs_ret);
+      rados_read_op_read(read_op, 0, RT_POOL_NAME_MAX, pool, &pool_len,
+                         &read_rval);
+      ret = rados_read_op_operate(read_op, *ioctx, oid, 0);
+      rados_release_read_op(read_op);
+    }
+
+    if (ret == 0 && (ret = xattrs_ret) == 0) {
+      const char *name, *val;
+      size_t len;
+
+      ret = -ENODATA;
+      while (rados_getxattrs_next(iter, &name, &val, &len) == 0 && name) {
+        if (strcmp(name, RT_VERSION_XATTR) == 0 && len == RT_VERSION_SIZE) {
+          memcpy(version, val, RT_VERSION_SIZE);
+          *version = ntohl(*version);
+          ret = 0;
+        }
+      }
+    }
+
+    if (iter) {
+      rados_getxattrs_end(iter);
+    }
+
+    if (ret < 0 || *version != RT_FORWARD_VERSION) {
+      return ret;
+    }
+
+    if (!fwd_ioctx) {
+      return -EXDEV;
+    }
+
+    if (hops == RT_FORWARD_MAX_HOPS) {
+      return -ELOOP;
+    }
+
+    pool[pool_len] = '\0';
+
+    { // Debug log message.
+      printf("RT has been relocated to pool %s.\n", pool);
+    }
+
+    rados_ioctx_t next;
+    if ((ret = open_pool_ioctx(*ioctx, pool, &next)) < 0) {
+      return ret;
+    }
+
+    release_pool_ioctx(*fwd_ioctx);
+    *fwd_ioctx = next;
+    *ioctx = next;
+  }
+}
+
+// I/O contexts opened by open_pool_ioctx, kept for reuse once they're
+// released. Each is used by one operation at a time, see rt_list_keys.
+static struct {
+  pthread_mutex_t lock;
+  struct {
+    rados_t rados;
+    char pool[RT_POOL_NAME_MAX + 1];
+    rados_ioctx_t ioctx;
+    int busy;
+  } entries[RT_POOL_IOCTX_CACHE_SIZE];
+  int count;
+} pool_ioctxs = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int open_pool_ioctx(rados_ioctx_t ioctx, const char *pool_name,
+                    rados_ioctx_t *pool_ioctx) {
+  rados_t rados = rados_ioctx_get_cluster(ioctx);
+  int ret = -ENOENT;
+
+  pthread_mutex_lock(&pool_ioctxs.lock);
+  for (int i = 0; i < pool_ioctxs.count; i++) {
+    if (!pool_ioctxs.entries[i].busy &&
+        pool_ioctxs.entries[i].rados == rados &&
+        strcmp(pool_ioctxs.entries[i].pool, pool_name) == 0) {
+      pool_ioctxs.entries[i].busy = 1;
+      *pool_ioctx = pool_ioctxs.entries[i].ioctx;
+      ret = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool_ioctxs.lock);
+
+  if (ret < 0 &&
+      (ret = rados_ioctx_create(rados, pool_name, pool_ioctx)) == 0 &&
+      strlen(pool_name) <= RT_POOL_NAME_MAX) {
+    // Keep it, if there's room.
+    pthread_mutex_lock(&pool_ioctxs.lock);
+    if (pool_ioctxs.count < RT_POOL_IOCTX_CACHE_SIZE) {
+      int i = pool_ioctxs.count++;
+      pool_ioctxs.entries[i].rados = rados;
+      strcpy(pool_ioctxs.entries[i].pool, pool_name);
+      pool_ioctxs.entries[i].ioctx = *pool_ioctx;
+      pool_ioctxs.entries[i].busy = 1;
+    }
+    pthread_mutex_unlock(&pool_ioctxs.lock);
+  }
+
+  if (ret == 0) {
+    rt_mem_charge(rt_mem_bound(), RT_MEM_SCRATCH, RT_MEM_IOCTX_SIZE);
+  }
+
+  return ret;
+}
+
+void release_pool_ioctx(rados_ioctx_t pool_ioctx) {
+  if (!pool_ioctx) {
+    return;
+  }
+
+  int kept = 0;
+
+  pthread_mutex_lock(&pool_ioctxs.lock);
+  for (int i = 0; i < pool_ioctxs.count; i++) {
+    if (pool_ioctxs.entries[i].ioctx == pool_ioctx) {
+      pool_ioctxs.entries[i].busy = 0;
+      kept = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool_ioctxs.lock);
+
+  if (!kept) {
+    rados_ioctx_destroy(pool_ioctx);
+  }
+  rt_mem_charge(rt_mem_bound(), RT_MEM_SCRATCH, -RT_MEM_IOCTX_SIZE);
+}
+
+/**
+ * rt_cluster_release closes I/O contexts kept by RT operations for
+ * connection `rados`.
+ */
+void rt_cluster_release(rados_t rados) {
+  pthread_mutex_lock(&pool_ioctxs.lock);
+  for (int i = 0; i < pool_ioctxs.count;) {
+    if (pool_ioctxs.entries[i].rados == rados) {
+      rados_ioctx_destroy(pool_ioctxs.entries[i].ioctx);
+      pool_ioctxs.entries[i] = pool_ioctxs.entries[--pool_ioctxs.count];
+    } else {
+      i++;
+    }
+  }
+  pthread_mutex_unlock(&pool_ioctxs.lock);
+}
+
+int init_v1(rados_ioctx_t ioctx, const char *oid, const char *const *keys,
+            const size_t *key_lens, int keys_count) {
+  { // Debug log message.
+    printf("init_v1(): Initializing new RT v1 object.\n");
+  }
+
+  rados_write_op_t write_op = rados_create_write_op();
+  v1_init_op(write_op, keys, key_lens, keys_count);
+
+  int ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+  if (ret == 0) {
+    rt_rollup_note(ioctx, 1, keys_count);
+  }
+
+  { // Debug log message.
+    if (ret < 0) {
+      printf("Write operation failed with error code %d.\n", ret);
+    } else {
+      printf("RT object successfully initialized.\n");
+    }
+  }
+
+  rados_release_write_op(write_op);
+
+  return ret;
+}
+
+void v1_init_op(rados_write_op_t write_op, const char *const *keys,
+                const size_t *key_lens, int keys_count) {
+  const int write_buf_size = RT_V1_REFCOUNT_SIZE;
+  char write_buf[write_buf_size];
+
+  // Prepare version.
+
+  char version_bytes[RT_VERSION_SIZE];
+
+  {
+    RT_VERSION_T version = htonl(RT_CURRENT_VERSION);
+    memcpy(version_bytes, &version, RT_VERSION_SIZE);
+  }
+
+  // Prepare reference count.
+
+  {
+    RT_V1_REFCOUNT_T refcount = htonl(keys_count);
+    memcpy(write_buf, &refcount, RT_V1_REFCOUNT_SIZE);
+  }
+
+  // Prepare OMap entries.
+
+  char **vals = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * keys_count);
+  size_t *val_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * keys_count);
+
+  for (int i = 0; i < keys_count; i++) {
+    vals[i] = NULL;
+    val_lens[i] = 0;
+  }
+
+  // The write op keeps copies of buffers passed to it.
+
+  rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+  rados_write_op_setxattr(write_op, RT_VERSION_XATTR, version_bytes,
+                          RT_VERSION_SIZE);
+  rados_write_op_write_full(write_op, write_buf, write_buf_size);
+  rados_write_op_omap_set2(write_op, keys, (const char *const *)vals, key_lens,
+                           (const size_t *)val_lens, keys_count);
+
+  rt_mem_free(val_lens);
+  rt_mem_free(vals);
+}
+
+int add_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+           const char *const *keys, const size_t *key_lens, int keys_count) {
+  { // Debug log message.
+    printf("add_v1(): Adding keys to an existing RT v1 object.\n");
+  }
+
+  int unused;
+  return update_v1(ioctx, oid, gen, 0, keys, key_lens, keys_count, &unused);
+}
+
+int remove_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+              const char *const *keys, const size_t *key_lens, int keys_count,
+              int *rt_removed) {
+  { // Debug log message.
+    printf("remove_v1(): Removing keys from an existing RT v1 object.\n");
+  }
+
+  return update_v1(ioctx, oid, gen, 1, keys, key_lens, keys_count,
+                   rt_removed);
+}
+
+int update_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen, int remove,
+              const char *const *keys, const size_t *key_lens, int keys_count,
+              int *rt_removed) {
+  int ret = 0;
+  RT_V1_REFCOUNT_T refcount;
+
+  *rt_removed = 0;
+
+  // Return values from OMap comparisons.
+  int *ref_keys_found = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(int) * keys_count);
+
+  // Read the RT object.
+  if ((ret = read_v1(ioctx, oid, gen, keys, key_lens, keys_count, &refcount,
+                     ref_keys_found)) < 0) {
+    goto out;
+  }
+
+  // Perform write.
+
+  {
+    int removed = 0;
+    rados_write_op_t write_op = rados_create_write_op();
+
+    int count = v1_update_op(write_op, gen, remove, keys, key_lens,
+                             keys_count, ref_keys_found, refcount, &removed);
+    if (count > 0) {
+      ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+      *rt_removed = ret == 0 && removed;
+      if (ret == 0) {
+        rt_rollup_note(ioctx, -removed, remove ? -count : count);
+      }
+
+      { // Debug log message.
+        if (ret == -ERANGE) {
+          printf("The RT object has changed since it was last read. Please try "
+                 "again.\n");
+        } else if (ret < 0) {
+          printf("Write operation failed with error code %d.\n", ret);
+        } else {
+          printf("RT object successfully updated.\n");
+        }
+      }
+    }
+
+    rados_release_write_op(write_op);
+  }
+
+out:
+
+  rt_mem_free(ref_keys_found);
+
+  return ret;
+}
+
+int v1_update_op(rados_write_op_t write_op, uint64_t gen, int remove,
+                 const char *const *keys, const size_t *key_lens,
+                 int keys_count, const int *ref_keys_found,
+                 RT_V1_REFCOUNT_T refcount, int *rt_removed) {
+  const int write_buf_size = RT_V1_REFCOUNT_SIZE;
+  char write_buf[write_buf_size];
+
+  // Keys are added if they're not tracked yet, and removed if they are.
+
+  int count = 0;
+  for (int i = 0; i < keys_count; i++) {
+    if (!ref_keys_found[i] == !remove) {
+      count++;
+    }
+  }
+
+  if (!count) {
+    // Nothing to do.
+    { // Debug log message.
+      if (remove) {
+        printf("No keys will be removed because none of the keys requested "
+               "for removal are present.\n");
+      } else {
+        printf("No keys will be added. They are all already tracked.\n");
+      }
+    }
+    return 0;
+  }
+
+  const char **changed_keys =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * count);
+  size_t *changed_key_lens =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * count);
+  char **vals = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * count);
+  size_t *val_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * count);
+
+  { // Debug log message.
+    printf("%s %d keys out of %d requested:", remove ? "Removing" : "Adding",
+           count, keys_count);
+  }
+
+  for (int i = 0, j = 0; i < keys_count; i++) {
+    if (!ref_keys_found[i] != !remove) {
+      // Skip this key as it's already tracked, or already removed.
+      continue;
+    }
+
+    changed_keys[j] = keys[i];
+    changed_key_lens[j] = key_lens[i];
+    vals[j] = NULL;
+    val_lens[j] = 0;
+
+    j++;
+    { // Debug log message.
+      printf(" %.*s", (int)key_lens[i], keys[i]);
+    }
+  }
+
+  { // Debug log message.
+    printf(".\n");
+  }
+
+  // Prepare new value of refcount.
+
+  if (remove) {
+    refcount -= (RT_V1_REFCOUNT_T)count;
+  } else {
+    refcount += (RT_V1_REFCOUNT_T)count;
+  }
+
+  {
+    RT_V1_REFCOUNT_T refcount_n = htonl(refcount);
+    memcpy(write_buf, &refcount_n, RT_V1_REFCOUNT_SIZE);
+  }
+
+  // The write op keeps copies of buffers passed to it.
+
+  rados_write_op_assert_version(write_op, gen);
+
+  if (refcount == 0) {
+    // This RT holds no references, delete it.
+
+    { // Debug log message.
+      printf("After this operation, this RT would hold no references. "
+             "Deleting the whole object instead.\n");
+    }
+
+    rados_write_op_remove(write_op);
+    *rt_removed = 1;
+  } else if (remove) {
     rados_write_op_write_full(write_op, write_buf, write_buf_size);
-    rados_write_op_omap_set2(write_op, (const char *const *)keys_to_add,
-                             (const char *const *)vals_to_add, keys_to_add_lens,
-                             vals_to_add_lens, keys_to_add_count);
+    rados_write_op_omap_rm_keys2(write_op, changed_keys, changed_key_lens,
+                                 count);
+  } else {
+    rados_write_op_write_full(write_op, write_buf, write_buf_size);
+    rados_write_op_omap_set2(write_op, changed_keys,
+                             (const char *const *)vals, changed_key_lens,
+                             val_lens, count);
+  }
+
+  rt_mem_free(changed_keys);
+  rt_mem_free(changed_key_lens);
+  rt_mem_free(vals);
+  rt_mem_free(val_lens);
+
+  return count;
+}
+
+int read_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+            const char *const *keys, const size_t *key_lens, int keys_count,
+            RT_V1_REFCOUNT_T *refcount, int *ref_keys_found) {
+  { // Debug log message.
+    printf("read_v1(): Reading RT v1 object.\n");
+  }
+
+  int ret = 0;
+
+  const int buf_size = RT_V1_REFCOUNT_SIZE;
+  char read_buf[buf_size];
+
+  // Here will be stored results of op_read.
+  int read_rval;
+  size_t read_bytes;
+
+  rt_keyset_t *fetched_keys = NULL;
+
+  rados_omap_iter_t omap_iter = NULL;
+  int omap_get_vals_ret;
+  // Accounted memory of the iterator and keyset.
+  long iter_bytes = 0;
+  long keyset_bytes = 0;
+
+  // Perform read operation.
+
+  {
+    rados_read_op_t read_op = rados_create_read_op();
+
+    rados_read_op_assert_version(read_op, gen);
+    rados_read_op_read(read_op, 0, buf_size, read_buf, &read_bytes, &read_rval);
+    rados_read_op_omap_get_vals_by_keys2(read_op, keys, keys_count, key_lens,
+                                         &omap_iter, &omap_get_vals_ret);
+
+    ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+    rados_release_read_op(read_op);
+
+    if (ret < 0) {
+      // Bail out on any error.
+      goto out;
+    }
+  }
+
+  // Populate ref_keys_found array. OMap returns fetched keys in sorted
+  // order, so they are collected into a keyset, and each requested key is
+  // then looked up in it.
+
+  {
+    { // Debug log message.
+      printf("Based on requested ref keys, we were able to fetch %d of them "
+             "from RT OMap:",
+             rados_omap_iter_size(omap_iter));
+    }
+
+    if ((ret = collect_keys(omap_iter, &fetched_keys, &iter_bytes,
+                            &keyset_bytes)) < 0) {
+      goto out;
+    }
+
+    for (int i = 0; i < keys_count; i++) {
+      ref_keys_found[i] =
+          rt_keyset_contains(fetched_keys, keys[i], key_lens[i]);
+    }
+  }
+
+  // Output refcount value.
+
+  memcpy(refcount, read_buf, RT_V1_REFCOUNT_SIZE);
+  *refcount = ntohl(*refcount);
+
+out:
+
+  release_keys(omap_iter, fetched_keys, iter_bytes, keyset_bytes);
+
+  return ret;
+}
+
+int collect_keys(rados_omap_iter_t omap_iter, rt_keyset_t **keyset,
+                 long *iter_bytes, long *keyset_bytes) {
+  int ret = 0;
+  unsigned iter_elems = rados_omap_iter_size(omap_iter);
+  rt_keyset_builder_t *builder = rt_keyset_builder_new();
+
+  *iter_bytes = (long)iter_elems * RT_MEM_OMAP_ENTRY_SIZE;
+  rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, *iter_bytes);
+
+  for (unsigned i = 0; i < iter_elems; i++) {
+    char *key, *val;
+    size_t key_len, val_len;
+    ret = rados_omap_get_next2(omap_iter, &key, &val, &key_len, &val_len);
+    if (ret < 0) {
+      { // Debug log message.
+        printf("\nrados_omap_get_next2() failed with error code %d\n", ret);
+      }
+      rt_keyset_builder_abort(builder);
+      return ret;
+    }
+
+    rt_keyset_builder_add(builder, key, key_len);
+    rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, key_len + val_len);
+    *iter_bytes += key_len + val_len;
+    { // Debug log message.
+      printf(" %.*s", (int)key_len, key);
+    }
+  }
+
+  { // Debug log message.
+    printf(".\n");
+  }
+
+  if (!(*keyset = rt_keyset_builder_finish(builder))) {
+    // OMap keys out of order.
+    return -EIO;
+  }
+
+  *keyset_bytes = rt_keyset_memory(*keyset);
+  rt_mem_charge(rt_mem_bound(), RT_MEM_SCRATCH, *keyset_bytes);
+
+  return 0;
+}
+
+int list_keys_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                 int page_size, rt_keys_cb cb, void *arg,
+                 RT_V1_REFCOUNT_T *refcount) {
+  int ret = 0;
+
+  const int buf_size = RT_V1_REFCOUNT_SIZE;
+  char read_buf[buf_size];
+
+  const char **page_keys =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * page_size);
+  size_t *page_key_lens =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * page_size);
+
+  // Keys are returned from OMap in sorted order. Each page starts right
+  // after the last key of the previous one.
+  char *start_after = NULL;
+  unsigned char more = 1;
+
+  for (int first = 1; more; first = 0) {
+    int read_rval;
+    size_t read_bytes;
+    int omap_get_keys_ret;
+    rados_omap_iter_t omap_iter = NULL;
+
+    {
+      rados_read_op_t read_op = rados_create_read_op();
+
+      // Every page is read from the same RT object version.
+      rados_read_op_assert_version(read_op, gen);
+      if (first) {
+        rados_read_op_read(read_op, 0, buf_size, read_buf, &read_bytes,
+                           &read_rval);
+      }
+      rados_read_op_omap_get_keys2(read_op, start_after ? start_after : "",
+                                   page_size, &omap_iter, &more,
+                                   &omap_get_keys_ret);
+
+      ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+      rados_release_read_op(read_op);
+
+      if (ret < 0) {
+        // Bail out on any error. The iterator is allocated even if the op
+        // fails.
+        rados_omap_get_end(omap_iter);
+        goto out;
+      }
+    }
+
+    if (first) {
+      memcpy(refcount, read_buf, RT_V1_REFCOUNT_SIZE);
+      *refcount = ntohl(*refcount);
+    }
+
+    long iter_bytes =
+        (long)rados_omap_iter_size(omap_iter) * RT_MEM_OMAP_ENTRY_SIZE;
+    rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, iter_bytes);
+
+    int count = 0;
+    for (;;) {
+      char *key, *val;
+      size_t key_len, val_len;
+      if ((ret = rados_omap_get_next2(omap_iter, &key, &val, &key_len,
+                                      &val_len)) < 0 ||
+          !key) {
+        break;
+      }
+
+      page_keys[count] = key;
+      page_key_lens[count] = key_len;
+      count++;
+
+      rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, key_len + val_len);
+      iter_bytes += key_len + val_len;
+    }
+
+    if (ret == 0 && count > 0) {
+      ret = cb(page_keys, page_key_lens, count, arg);
+
+      free(start_after);
+      start_after = strndup(page_keys[count - 1], page_key_lens[count - 1]);
+    }
+
+    rados_omap_get_end(omap_iter);
+    rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, -iter_bytes);
+
+    if (ret < 0) {
+      goto out;
+    }
+
+    if (count == 0) {
+      break;
+    }
+  }
+
+out:
+
+  free(start_after);
+  rt_mem_free(page_keys);
+  rt_mem_free(page_key_lens);
+
+  return ret;
+}
+
+void release_keys(rados_omap_iter_t omap_iter, rt_keyset_t *keyset,
+                  long iter_bytes, long keyset_bytes) {
+  if (omap_iter) {
+    rados_omap_get_end(omap_iter);
+  }
+  rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, -iter_bytes);
+
+  rt_keyset_free(keyset);
+  rt_mem_charge(rt_mem_bound(), RT_MEM_SCRATCH, -keyset_bytes);
+}
+
+/*
+ * Version 2.
+ */
+
+// Arena of keys with a one byte prefix, for header OMap operations.
+typedef struct v2_keys {
+  char **keys;
+  size_t *lens;
+  int count;
+  char *buf;
+  size_t buf_len;
+} v2_keys_t;
+
+static void v2_keys_init(v2_keys_t *ks, int cap, size_t bytes) {
+  ks->keys = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * cap);
+  ks->lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * cap);
+  ks->buf = rt_mem_alloc(RT_MEM_SCRATCH, bytes + cap);
+  ks->count = 0;
+  ks->buf_len = 0;
+}
+
+static void v2_keys_add(v2_keys_t *ks, char prefix, const char *key,
+                        size_t len) {
+  char *k = ks->buf + ks->buf_len;
+  k[0] = prefix;
+  memcpy(k + 1, key, len);
+
+  ks->keys[ks->count] = k;
+  ks->lens[ks->count] = len + 1;
+  ks->count++;
+  ks->buf_len += len + 1;
+}
+
+static void v2_keys_free(v2_keys_t *ks) {
+  rt_mem_free(ks->keys);
+  rt_mem_free(ks->lens);
+  rt_mem_free(ks->buf);
+}
+
+// Empty OMap values for `count` keys.
+static void v2_empty_vals(int count, char ***vals, size_t **val_lens) {
+  *vals = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * count);
+  *val_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * count);
+
+  for (int i = 0; i < count; i++) {
+    (*vals)[i] = NULL;
+    (*val_lens)[i] = 0;
+  }
+}
+
+size_t v2_header_encode(const v2_header_t *hdr, char *buf) {
+  uint32_t u32s[5] = {htonl(hdr->refcount), htonl(hdr->recent_count),
+                      htonl(hdr->dead_count), htonl(hdr->recent_max),
+                      htonl(hdr->shards)};
+  uint64_t incarnation = htobe64(hdr->incarnation);
+  size_t pool_len = strlen(hdr->pool);
+
+  memcpy(buf, u32s, sizeof(u32s));
+  memcpy(buf + sizeof(u32s), &incarnation, sizeof(incarnation));
+  memcpy(buf + RT_V2_HEADER_SIZE, hdr->pool, pool_len);
+
+  return RT_V2_HEADER_SIZE + pool_len;
+}
+
+int v2_header_decode(const char *buf, size_t len, v2_header_t *hdr) {
+  uint32_t u32s[5];
+  uint64_t incarnation;
+  size_t pool_len = len - RT_V2_HEADER_SIZE;
+
+  if (len <= RT_V2_HEADER_SIZE || pool_len > RT_POOL_NAME_MAX) {
+    return -EIO;
+  }
+
+  memcpy(u32s, buf, sizeof(u32s));
+  memcpy(&incarnation, buf + sizeof(u32s), sizeof(incarnation));
+
+  hdr->refcount = ntohl(u32s[0]);
+  hdr->recent_count = ntohl(u32s[1]);
+  hdr->dead_count = ntohl(u32s[2]);
+  hdr->recent_max = ntohl(u32s[3]);
+  hdr->shards = ntohl(u32s[4]);
+  hdr->incarnation = be64toh(incarnation);
+  memcpy(hdr->pool, buf + RT_V2_HEADER_SIZE, pool_len);
+  hdr->pool[pool_len] = '\0';
+
+  return hdr->shards > 0 ? 0 : -EIO;
+}
+
+// Size of buffers holding overflow object names of RT `oid`.
+#define V2_SHARD_OID_SIZE(oid) (strlen(oid) + 32)
+
+static void v2_shard_oid(char *buf, const char *oid, const v2_header_t *hdr,
+                         uint32_t shard) {
+  sprintf(buf, "%s.%016" PRIx64 ".%" PRIu32, oid, hdr->incarnation, shard);
+}
+
+static uint32_t v2_shard_of(const v2_header_t *hdr, const char *key,
+                            size_t len) {
+  return rt_hash64(key, len) % hdr->shards;
+}
+
+// Returns a new incarnation identifier, unique across clients.
+static uint64_t new_incarnation(rados_ioctx_t ioctx) {
+  static uint64_t seq;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  uint64_t seed[3] = {
+      rados_get_instance_id(rados_ioctx_get_cluster(ioctx)),
+      (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+      __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED),
+  };
+
+  return rt_hash64((const char *)seed, sizeof(seed));
+}
+
+static int v2_open_overflow(rados_ioctx_t ioctx, const v2_header_t *hdr,
+                            rados_ioctx_t *ovf_ioctx) {
+  return *ovf_ioctx ? 0 : open_pool_ioctx(ioctx, hdr->pool, ovf_ioctx);
+}
+
+// Removes overflow objects of RT `oid`, ignoring errors. Objects left
+// behind belong to an incarnation that is gone, and aren't read again.
+static void v2_remove_overflow(rados_ioctx_t ioctx, const char *oid,
+                               const v2_header_t *hdr,
+                               rados_ioctx_t *ovf_ioctx) {
+  char shard_oid[V2_SHARD_OID_SIZE(oid)];
+
+  if (v2_open_overflow(ioctx, hdr, ovf_ioctx) < 0) {
+    return;
+  }
+
+  for (uint32_t s = 0; s < hdr->shards; s++) {
+    v2_shard_oid(shard_oid, oid, hdr, s);
+    rados_remove(*ovf_ioctx, shard_oid);
+  }
+}
+
+int init_v2(rados_ioctx_t ioctx, const char *oid, const char *const *keys,
+            const size_t *key_lens, int keys_count, const rt_opts_t *opts) {
+  { // Debug log message.
+    printf("init_v2(): Initializing new RT v2 object.\n");
+  }
+
+  int ret = 0;
+  uint32_t shards_created = 0;
+  rados_ioctx_t ovf_ioctx = NULL;
+  char **vals = NULL;
+  size_t *val_lens = NULL;
+  v2_keys_t recent;
+
+  if (!opts->overflow_pool || strlen(opts->overflow_pool) == 0 ||
+      strlen(opts->overflow_pool) > RT_POOL_NAME_MAX ||
+      opts->overflow_shards <= 0 || opts->header_keys < 0) {
+    return -EINVAL;
+  }
+
+  v2_header_t hdr = {
+      .refcount = keys_count,
+      .recent_count = keys_count,
+      .recent_max = opts->header_keys,
+      .shards = opts->overflow_shards,
+      .incarnation = new_incarnation(ioctx),
+  };
+  strcpy(hdr.pool, opts->overflow_pool);
+
+  size_t bytes = 0;
+  for (int i = 0; i < keys_count; i++) {
+    bytes += key_lens[i];
+  }
+  v2_keys_init(&recent, keys_count, bytes);
+
+  if ((ret = v2_open_overflow(ioctx, &hdr, &ovf_ioctx)) < 0) {
+    goto out;
+  }
+
+  // Create overflow objects first, the header makes them reachable.
+
+  {
+    char shard_oid[V2_SHARD_OID_SIZE(oid)];
+
+    for (; shards_created < hdr.shards; shards_created++) {
+      v2_shard_oid(shard_oid, oid, &hdr, shards_created);
+
+      rados_write_op_t write_op = rados_create_write_op();
+      rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+      ret = rados_write_op_operate(write_op, ovf_ioctx, shard_oid, NULL, 0);
+      rados_release_write_op(write_op);
+
+      if (ret < 0) {
+        goto out;
+      }
+    }
+  }
+
+  // Create the header.
+
+  {
+    char version_bytes[RT_VERSION_SIZE];
+    RT_VERSION_T version = htonl(2);
+    memcpy(version_bytes, &version, RT_VERSION_SIZE);
+
+    char hdr_buf[RT_V2_HEADER_SIZE + RT_POOL_NAME_MAX];
+    size_t hdr_len = v2_header_encode(&hdr, hdr_buf);
+
+    for (int i = 0; i < keys_count; i++) {
+      v2_keys_add(&recent, RT_V2_RECENT_PREFIX, keys[i], key_lens[i]);
+    }
+    v2_empty_vals(keys_count, &vals, &val_lens);
+
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+    rados_write_op_setxattr(write_op, RT_VERSION_XATTR, version_bytes,
+                            RT_VERSION_SIZE);
+    rados_write_op_write_full(write_op, hdr_buf, hdr_len);
+    rados_write_op_omap_set2(write_op, (const char *const *)recent.keys,
+                             (const char *const *)vals, recent.lens, val_lens,
+                             recent.count);
+
+    ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+    rados_release_write_op(write_op);
+
+    if (ret == 0) {
+      rt_rollup_note(ioctx, 1, keys_count);
+    }
+  }
+
+  { // Debug log message.
+    if (ret < 0) {
+      printf("Write operation failed with error code %d.\n", ret);
+    } else {
+      printf("RT object successfully initialized.\n");
+    }
+  }
+
+  if (ret == 0 && hdr.recent_count > hdr.recent_max) {
+    compact_v2(ioctx, oid, &hdr, &ovf_ioctx);
+  }
+
+out:
+
+  if (ret < 0 && shards_created > 0) {
+    hdr.shards = shards_created;
+    v2_remove_overflow(ioctx, oid, &hdr, &ovf_ioctx);
+  }
+
+  release_pool_ioctx(ovf_ioctx);
+  v2_keys_free(&recent);
+  rt_mem_free(vals);
+  rt_mem_free(val_lens);
+
+  return ret;
+}
+
+int read_v2(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+            const char *const *keys, const size_t *key_lens, int keys_count,
+            v2_header_t *hdr, rados_ioctx_t *ovf_ioctx,
+            v2_key_state_t *states) {
+  { // Debug log message.
+    printf("read_v2(): Reading RT v2 object.\n");
+  }
+
+  int ret = 0;
+
+  char hdr_buf[RT_V2_HEADER_SIZE + RT_POOL_NAME_MAX];
+  size_t hdr_len;
+  int read_rval;
+
+  rados_omap_iter_t omap_iter = NULL;
+  int omap_get_vals_ret;
+  rt_keyset_t *fetched_keys = NULL;
+  long iter_bytes = 0;
+  long keyset_bytes = 0;
+
+  // Keys of the request looked up in an overflow object.
+  const char **shard_keys = NULL;
+  size_t *shard_key_lens = NULL;
+  int *shard_idx = NULL;
+
+  // Look keys up in the header, both as recent and dead keys.
+
+  v2_keys_t hdr_keys;
+  {
+    size_t bytes = 0;
+    for (int i = 0; i < keys_count; i++) {
+      bytes += key_lens[i];
+    }
+    v2_keys_init(&hdr_keys, 2 * keys_count, 2 * bytes);
+  }
+
+  for (int i = 0; i < keys_count; i++) {
+    v2_keys_add(&hdr_keys, RT_V2_RECENT_PREFIX, keys[i], key_lens[i]);
+  }
+  for (int i = 0; i < keys_count; i++) {
+    v2_keys_add(&hdr_keys, RT_V2_DEAD_PREFIX, keys[i], key_lens[i]);
+  }
+
+  {
+    rados_read_op_t read_op = rados_create_read_op();
+
+    rados_read_op_assert_version(read_op, gen);
+    rados_read_op_read(read_op, 0, sizeof(hdr_buf), hdr_buf, &hdr_len,
+                       &read_rval);
+    rados_read_op_omap_get_vals_by_keys2(
+        read_op, (const char *const *)hdr_keys.keys, hdr_keys.count,
+        hdr_keys.lens, &omap_iter, &omap_get_vals_ret);
+
+    ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+    rados_release_read_op(read_op);
+
+    if (ret < 0) {
+      goto out;
+    }
+  }
+
+  if ((ret = v2_header_decode(hdr_buf, hdr_len, hdr)) < 0) {
+    goto out;
+  }
+
+  { // Debug log message.
+    printf("Fetched %d keys from RT header OMap:",
+           rados_omap_iter_size(omap_iter));
+  }
+
+  if ((ret = collect_keys(omap_iter, &fetched_keys, &iter_bytes,
+                          &keyset_bytes)) < 0) {
+    goto out;
+  }
+
+  int lookups = 0;
+  for (int i = 0; i < keys_count; i++) {
+    if (rt_keyset_contains(fetched_keys, hdr_keys.keys[i],
+                           hdr_keys.lens[i])) {
+      states[i] = V2_KEY_RECENT;
+    } else if (rt_keyset_contains(fetched_keys, hdr_keys.keys[keys_count + i],
+                                  hdr_keys.lens[keys_count + i])) {
+      states[i] = V2_KEY_DEAD;
+    } else {
+      states[i] = V2_KEY_ABSENT;
+      lookups++;
+    }
+  }
+
+  release_keys(omap_iter, fetched_keys, iter_bytes, keyset_bytes);
+  omap_iter = NULL;
+  fetched_keys = NULL;
+  iter_bytes = keyset_bytes = 0;
+
+  if (lookups == 0) {
+    goto out;
+  }
+
+  // Look the remaining keys up in overflow objects, one read per object.
+  // Overflow objects are only changed in ways that don't change which keys
+  // are tracked as of header version `gen`, so they're not version-checked.
+
+  if ((ret = v2_open_overflow(ioctx, hdr, ovf_ioctx)) < 0) {
+    goto out;
+  }
+
+  shard_keys = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * lookups);
+  shard_key_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * lookups);
+  shard_idx = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(int) * lookups);
+
+  {
+    uint32_t *key_shards =
+        rt_mem_alloc(RT_MEM_SCRATCH, sizeof(uint32_t) * keys_count);
+    for (int i = 0; i < keys_count; i++) {
+      key_shards[i] = v2_shard_of(hdr, keys[i], key_lens[i]);
+    }
+
+    char shard_oid[V2_SHARD_OID_SIZE(oid)];
+
+    for (uint32_t s = 0; s < hdr->shards && ret == 0; s++) {
+      int n = 0;
+      for (int i = 0; i < keys_count; i++) {
+        if (states[i] == V2_KEY_ABSENT && key_shards[i] == s) {
+          shard_keys[n] = keys[i];
+          shard_key_lens[n] = key_lens[i];
+          shard_idx[n] = i;
+          n++;
+        }
+      }
+
+      if (n == 0) {
+        continue;
+      }
+
+      v2_shard_oid(shard_oid, oid, hdr, s);
+
+      rados_read_op_t read_op = rados_create_read_op();
+      rados_read_op_omap_get_vals_by_keys2(read_op, shard_keys, n,
+                                           shard_key_lens, &omap_iter,
+                                           &omap_get_vals_ret);
+      ret = rados_read_op_operate(read_op, *ovf_ioctx, shard_oid, 0);
+      rados_release_read_op(read_op);
+
+      if (ret == -ENOENT) {
+        // The RT is being deleted. Updates based on this read will fail
+        // anyway.
+        ret = 0;
+      } else if (ret == 0) {
+        { // Debug log message.
+          printf("Fetched %d keys from overflow object %s:",
+                 rados_omap_iter_size(omap_iter), shard_oid);
+        }
+
+        if ((ret = collect_keys(omap_iter, &fetched_keys, &iter_bytes,
+                                &keyset_bytes)) == 0) {
+          for (int j = 0; j < n; j++) {
+            if (rt_keyset_contains(fetched_keys, shard_keys[j],
+                                   shard_key_lens[j])) {
+              states[shard_idx[j]] = V2_KEY_OVERFLOW;
+            }
+          }
+        }
+      }
+
+      release_keys(omap_iter, fetched_keys, iter_bytes, keyset_bytes);
+      omap_iter = NULL;
+      fetched_keys = NULL;
+      iter_bytes = keyset_bytes = 0;
+    }
+
+    rt_mem_free(key_shards);
+  }
+
+out:
+
+  release_keys(omap_iter, fetched_keys, iter_bytes, keyset_bytes);
+  v2_keys_free(&hdr_keys);
+  rt_mem_free(shard_keys);
+  rt_mem_free(shard_key_lens);
+  rt_mem_free(shard_idx);
+
+  return ret;
+}
+
+// Writes header `hdr` and header OMap changes, asserting version `gen`.
+static int v2_write_header(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                           const v2_header_t *hdr, const v2_keys_t *set,
+                           const v2_keys_t *rm) {
+  char hdr_buf[RT_V2_HEADER_SIZE + RT_POOL_NAME_MAX];
+  size_t hdr_len = v2_header_encode(hdr, hdr_buf);
+  char **vals = NULL;
+  size_t *val_lens = NULL;
+
+  rados_write_op_t write_op = rados_create_write_op();
+  rados_write_op_assert_version(write_op, gen);
+  rados_write_op_write_full(write_op, hdr_buf, hdr_len);
+  if (set && set->count > 0) {
+    v2_empty_vals(set->count, &vals, &val_lens);
+    rados_write_op_omap_set2(write_op, (const char *const *)set->keys,
+                             (const char *const *)vals, set->lens, val_lens,
+                             set->count);
+  }
+  if (rm && rm->count > 0) {
+    rados_write_op_omap_rm_keys2(write_op, (const char *const *)rm->keys,
+                                 rm->lens, rm->count);
+  }
+
+  int ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+  rados_release_write_op(write_op);
+
+  rt_mem_free(vals);
+  rt_mem_free(val_lens);
+
+  { // Debug log message.
+    if (ret == -ERANGE) {
+      printf("The RT object has changed since it was last read. Please try "
+             "again.\n");
+    } else if (ret < 0) {
+      printf("Write operation failed with error code %d.\n", ret);
+    }
+  }
+
+  return ret;
+}
+
+int add_v2(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+           const char *const *keys, const size_t *key_lens, int keys_count) {
+  { // Debug log message.
+    printf("add_v2(): Adding keys to an existing RT v2 object.\n");
+  }
+
+  int ret = 0;
+  v2_header_t hdr;
+  rados_ioctx_t ovf_ioctx = NULL;
+  v2_keys_t set = {0}, rm = {0};
+
+  v2_key_state_t *states =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(v2_key_state_t) * keys_count);
+
+  if ((ret = read_v2(ioctx, oid, gen, keys, key_lens, keys_count, &hdr,
+                     &ovf_ioctx, states)) < 0) {
+    goto out;
+  }
+
+  // New keys become recent keys, and stop being dead.
+
+  int to_add = 0, to_revive = 0;
+  size_t bytes = 0;
+  for (int i = 0; i < keys_count; i++) {
+    if (states[i] == V2_KEY_ABSENT || states[i] == V2_KEY_DEAD) {
+      to_add++;
+      to_revive += states[i] == V2_KEY_DEAD;
+      bytes += key_lens[i];
+    }
+  }
+
+  if (!to_add) {
+    // Nothing to do.
+    { // Debug log message.
+      printf("No keys will be added. They are all already tracked.\n");
+    }
+    goto out;
+  }
+
+  v2_keys_init(&set, to_add, bytes);
+  v2_keys_init(&rm, to_revive, bytes);
+
+  for (int i = 0; i < keys_count; i++) {
+    if (states[i] == V2_KEY_ABSENT || states[i] == V2_KEY_DEAD) {
+      v2_keys_add(&set, RT_V2_RECENT_PREFIX, keys[i], key_lens[i]);
+    }
+    if (states[i] == V2_KEY_DEAD) {
+      v2_keys_add(&rm, RT_V2_DEAD_PREFIX, keys[i], key_lens[i]);
+    }
+  }
+
+  hdr.refcount += to_add;
+  hdr.recent_count += to_add;
+  hdr.dead_count -= to_revive;
+
+  if ((ret = v2_write_header(ioctx, oid, gen, &hdr, &set, &rm)) < 0) {
+    goto out;
+  }
+  rt_rollup_note(ioctx, 0, to_add);
+
+  { // Debug log message.
+    printf("RT object successfully updated.\n");
+  }
+
+  if (hdr.recent_count > hdr.recent_max) {
+    compact_v2(ioctx, oid, &hdr, &ovf_ioctx);
+  }
+
+out:
+
+  release_pool_ioctx(ovf_ioctx);
+  rt_mem_free(states);
+  if (set.keys) {
+    v2_keys_free(&set);
+    v2_keys_free(&rm);
+  }
+
+  return ret;
+}
+
+int remove_v2(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+              const char *const *keys, const size_t *key_lens, int keys_count,
+              int *rt_removed) {
+  { // Debug log message.
+    printf("remove_v2(): Removing keys from an existing RT v2 object.\n");
+  }
+
+  int ret = 0;
+  int removed = 0;
+  v2_header_t hdr;
+  rados_ioctx_t ovf_ioctx = NULL;
+  v2_keys_t set = {0}, rm = {0};
+
+  v2_key_state_t *states =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(v2_key_state_t) * keys_count);
+
+  if ((ret = read_v2(ioctx, oid, gen, keys, key_lens, keys_count, &hdr,
+                     &ovf_ioctx, states)) < 0) {
+    goto out;
+  }
+
+  // Removed keys become dead keys, even recent ones: a concurrent
+  // compaction may be moving them into an overflow object.
+
+  int to_remove = 0, from_recent = 0;
+  size_t bytes = 0;
+  for (int i = 0; i < keys_count; i++) {
+    if (states[i] == V2_KEY_RECENT || states[i] == V2_KEY_OVERFLOW) {
+      to_remove++;
+      from_recent += states[i] == V2_KEY_RECENT;
+      bytes += key_lens[i];
+    }
+  }
+
+  if (!to_remove) {
+    // Nothing to do.
+    { // Debug log message.
+      printf("No keys will be removed because none of the keys requested for "
+             "removal are present.\n");
+    }
+    goto out;
+  }
+
+  hdr.refcount -= to_remove;
+
+  if (hdr.refcount == 0) {
+    // This RT holds no references, delete it.
+
+    { // Debug log message.
+      printf("After this operation, this RT would hold no references. "
+             "Deleting the whole object instead.\n");
+    }
+
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_assert_version(write_op, gen);
+    rados_write_op_remove(write_op);
+    ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+    rados_release_write_op(write_op);
+
+    if (ret == 0) {
+      removed = 1;
+      rt_rollup_note(ioctx, -1, -to_remove);
+      v2_remove_overflow(ioctx, oid, &hdr, &ovf_ioctx);
+    }
+
+    goto out;
+  }
+
+  v2_keys_init(&set, to_remove, bytes);
+  v2_keys_init(&rm, from_recent, bytes);
+
+  for (int i = 0; i < keys_count; i++) {
+    if (states[i] == V2_KEY_RECENT || states[i] == V2_KEY_OVERFLOW) {
+      v2_keys_add(&set, RT_V2_DEAD_PREFIX, keys[i], key_lens[i]);
+    }
+    if (states[i] == V2_KEY_RECENT) {
+      v2_keys_add(&rm, RT_V2_RECENT_PREFIX, keys[i], key_lens[i]);
+    }
+  }
+
+  hdr.recent_count -= from_recent;
+  hdr.dead_count += to_remove;
+
+  if ((ret = v2_write_header(ioctx, oid, gen, &hdr, &set, &rm)) < 0) {
+    goto out;
+  }
+  rt_rollup_note(ioctx, 0, -to_remove);
+
+  { // Debug log message.
+    printf("RT object successfully updated.\n");
+  }
+
+  // Dead keys are dropped from overflow objects once there's as many of
+  // them as the header holds recent keys, so that removes don't write the
+  // overflow pool every time.
+  if (hdr.dead_count > hdr.recent_max) {
+    compact_v2(ioctx, oid, &hdr, &ovf_ioctx);
+  }
+
+out:
+
+  release_pool_ioctx(ovf_ioctx);
+  rt_mem_free(states);
+  if (set.keys) {
+    v2_keys_free(&set);
+    v2_keys_free(&rm);
+  }
+
+  *rt_removed = removed;
+
+  return ret;
+}
+
+int compact_v2(rados_ioctx_t ioctx, const char *oid, const v2_header_t *hdr,
+               rados_ioctx_t *ovf_ioctx) {
+  { // Debug log message.
+    printf("compact_v2(): Moving header keys into overflow objects.\n");
+  }
+
+  int ret;
+  char shard_oid[V2_SHARD_OID_SIZE(oid)];
+
+  uint64_t *shard_gens = NULL;
+  rados_omap_iter_t omap_iter = NULL;
+  long iter_bytes = 0;
+
+  // Header keys to remove, and the same keys without prefix, by shard.
+  const char **hdr_keys = NULL;
+  size_t *hdr_key_lens = NULL;
+  const char **shard_keys = NULL;
+  size_t *shard_key_lens = NULL;
+  uint32_t *key_shards = NULL;
+  char **vals = NULL;
+  size_t *val_lens = NULL;
+
+  if ((ret = v2_open_overflow(ioctx, hdr, ovf_ioctx)) < 0) {
+    return ret;
+  }
+
+  // 1. Read versions of overflow objects. They must be read before the
+  //    header: a key recent in the header read below can then only have
+  //    been removed from an overflow object after this point, and writing
+  //    it there again fails on the version.
+
+  shard_gens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(uint64_t) * hdr->shards);
+
+  for (uint32_t s = 0; s < hdr->shards; s++) {
+    v2_shard_oid(shard_oid, oid, hdr, s);
+
+    uint64_t size;
+    time_t mtime;
+    int stat_rval;
+
+    rados_read_op_t read_op = rados_create_read_op();
+    rados_read_op_stat(read_op, &size, &mtime, &stat_rval);
+    ret = rados_read_op_operate(read_op, *ovf_ioctx, shard_oid, 0);
+    rados_release_read_op(read_op);
+
+    if (ret < 0) {
+      goto out;
+    }
+
+    shard_gens[s] = rados_get_last_version(*ovf_ioctx);
+  }
+
+  // 2. Read the header, with a bounded chunk of its keys.
+
+  v2_header_t cur;
+  uint64_t gen;
+
+  {
+    char hdr_buf[RT_V2_HEADER_SIZE + RT_POOL_NAME_MAX];
+    size_t hdr_len;
+    int read_rval;
+    int omap_get_keys_ret;
+    unsigned char more;
+
+    rados_read_op_t read_op = rados_create_read_op();
+    rados_read_op_read(read_op, 0, sizeof(hdr_buf), hdr_buf, &hdr_len,
+                       &read_rval);
+    rados_read_op_omap_get_keys2(read_op, "", RT_V2_COMPACT_MAX, &omap_iter,
+                                 &more, &omap_get_keys_ret);
+    ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+    rados_release_read_op(read_op);
+
+    if (ret < 0) {
+      goto out;
+    }
+
+    gen = rados_get_last_version(ioctx);
+
+    if ((ret = v2_header_decode(hdr_buf, hdr_len, &cur)) < 0) {
+      goto out;
+    }
+  }
+
+  unsigned n = rados_omap_iter_size(omap_iter);
+  if (n == 0) {
+    goto out;
+  }
+
+  iter_bytes = (long)n * RT_MEM_OMAP_ENTRY_SIZE;
+  rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, iter_bytes);
+
+  hdr_keys = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * n);
+  hdr_key_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * n);
+  shard_keys = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * n);
+  shard_key_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * n);
+  key_shards = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(uint32_t) * n);
+  v2_empty_vals(n, &vals, &val_lens);
+
+  unsigned moved = 0, dropped = 0;
+
+  for (unsigned i = 0; i < n; i++) {
+    char *key, *val;
+    size_t key_len, val_len;
+    if ((ret = rados_omap_get_next2(omap_iter, &key, &val, &key_len,
+                                    &val_len)) < 0) {
+      goto out;
+    }
+
+    if (key_len < 1 ||
+        (key[0] != RT_V2_RECENT_PREFIX && key[0] != RT_V2_DEAD_PREFIX)) {
+      ret = -EIO;
+      goto out;
+    }
+
+    hdr_keys[i] = key;
+    hdr_key_lens[i] = key_len;
+    key_shards[i] = v2_shard_of(&cur, key + 1, key_len - 1);
+    moved += key[0] == RT_V2_RECENT_PREFIX;
+    dropped += key[0] == RT_V2_DEAD_PREFIX;
+
+    rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, key_len + val_len);
+    iter_bytes += key_len + val_len;
+  }
+
+  // 3. Write recent keys into, and drop dead keys from, overflow objects.
+
+  for (uint32_t s = 0; s < cur.shards; s++) {
+    int set_count = 0, rm_count = 0;
+
+    // Keys to set fill `shard_keys` from the front, keys to remove from the
+    // back.
+    for (unsigned i = 0; i < n; i++) {
+      if (key_shards[i] != s) {
+        continue;
+      }
+
+      int j = hdr_keys[i][0] == RT_V2_RECENT_PREFIX ? set_count++
+                                                    : (int)n - ++rm_count;
+      shard_keys[j] = hdr_keys[i] + 1;
+      shard_key_lens[j] = hdr_key_lens[i] - 1;
+    }
+
+    if (set_count == 0 && rm_count == 0) {
+      continue;
+    }
+
+    v2_shard_oid(shard_oid, oid, &cur, s);
+
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_assert_version(write_op, shard_gens[s]);
+    if (set_count > 0) {
+      rados_write_op_omap_set2(write_op, shard_keys,
+                               (const char *const *)vals, shard_key_lens,
+                               val_lens, set_count);
+    }
+    if (rm_count > 0) {
+      rados_write_op_omap_rm_keys2(write_op, shard_keys + n - rm_count,
+                                   shard_key_lens + n - rm_count, rm_count);
+    }
+    ret = rados_write_op_operate(write_op, *ovf_ioctx, shard_oid, NULL, 0);
+    rados_release_write_op(write_op);
+
+    if (ret < 0) {
+      goto out;
+    }
+  }
+
+  // 4. Drop the keys from the header, unless it has changed since 2.
+
+  {
+    cur.recent_count -= moved;
+    cur.dead_count -= dropped;
+
+    char hdr_buf[RT_V2_HEADER_SIZE + RT_POOL_NAME_MAX];
+    size_t hdr_len = v2_header_encode(&cur, hdr_buf);
+
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_assert_version(write_op, gen);
+    rados_write_op_write_full(write_op, hdr_buf, hdr_len);
+    rados_write_op_omap_rm_keys2(write_op, hdr_keys, hdr_key_lens, n);
+    ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+    rados_release_write_op(write_op);
+  }
+
+out:
+
+  { // Debug log message.
+    if (ret < 0) {
+      printf("Compaction failed with error code %d, keys stay in the "
+             "header.\n",
+             ret);
+    }
+  }
+
+  release_keys(omap_iter, NULL, iter_bytes, 0);
+  rt_mem_free(shard_gens);
+  rt_mem_free(hdr_keys);
+  rt_mem_free(hdr_key_lens);
+  rt_mem_free(shard_keys);
+  rt_mem_free(shard_key_lens);
+  rt_mem_free(key_shards);
+  rt_mem_free(vals);
+  rt_mem_free(val_lens);
+
+  return ret;
+}
+
+// Pages through OMap keys of object `oid`, all from version `gen` unless
+// it's zero, calling `cb` for each page.
+static int v2_page_keys(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                        int page_size, const char **page_keys,
+                        size_t *page_key_lens, rt_keys_cb cb, void *arg) {
+  int ret = 0;
+  char *start_after = NULL;
+  unsigned char more = 1;
+
+  while (more) {
+    int omap_get_keys_ret;
+    rados_omap_iter_t omap_iter = NULL;
+
+    rados_read_op_t read_op = rados_create_read_op();
+    if (gen) {
+      rados_read_op_assert_version(read_op, gen);
+    }
+    rados_read_op_omap_get_keys2(read_op, start_after ? start_after : "",
+                                 page_size, &omap_iter, &more,
+                                 &omap_get_keys_ret);
+    ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+    rados_release_read_op(read_op);
+
+    if (ret < 0) {
+      rados_omap_get_end(omap_iter);
+      break;
+    }
+
+    long iter_bytes =
+        (long)rados_omap_iter_size(omap_iter) * RT_MEM_OMAP_ENTRY_SIZE;
+    rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, iter_bytes);
+
+    int count = 0;
+    for (;;) {
+      char *key, *val;
+      size_t key_len, val_len;
+      if ((ret = rados_omap_get_next2(omap_iter, &key, &val, &key_len,
+                                      &val_len)) < 0 ||
+          !key) {
+        break;
+      }
+
+      page_keys[count] = key;
+      page_key_lens[count] = key_len;
+      count++;
+
+      rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, key_len + val_len);
+      iter_bytes += key_len + val_len;
+    }
+
+    if (ret == 0 && count > 0) {
+      ret = cb(page_keys, page_key_lens, count, arg);
+
+      free(start_after);
+      start_after = strndup(page_keys[count - 1], page_key_lens[count - 1]);
+    }
+
+    rados_omap_get_end(omap_iter);
+    rt_mem_charge(rt_mem_bound(), RT_MEM_ITERATORS, -iter_bytes);
+
+    if (ret < 0 || count == 0) {
+      break;
+    }
+  }
+
+  free(start_after);
+
+  return ret;
+}
+
+// State of list_keys_v2.
+typedef struct v2_list {
+  rt_keys_cb cb;
+  void *arg;
+  rt_keyset_builder_t *recent_builder;
+  rt_keyset_builder_t *dead_builder;
+  rt_keyset_t *recent;
+  rt_keyset_t *dead;
+  // Keys passed on to `cb`.
+  const char **keys;
+  size_t *key_lens;
+} v2_list_t;
+
+// rt_keys_cb collecting recent and dead keys of a page of header keys, and
+// passing the recent ones on.
+static int v2_list_header(const char *const *keys, const size_t *key_lens,
+                          int keys_count, void *arg) {
+  v2_list_t *l = arg;
+  int count = 0;
+
+  for (int i = 0; i < keys_count; i++) {
+    if (key_lens[i] < 1) {
+      return -EIO;
+    }
+
+    if (keys[i][0] == RT_V2_RECENT_PREFIX) {
+      rt_keyset_builder_add(l->recent_builder, keys[i] + 1, key_lens[i] - 1);
+      l->keys[count] = keys[i] + 1;
+      l->key_lens[count] = key_lens[i] - 1;
+      count++;
+    } else if (keys[i][0] == RT_V2_DEAD_PREFIX) {
+      rt_keyset_builder_add(l->dead_builder, keys[i] + 1, key_lens[i] - 1);
+    } else {
+      return -EIO;
+    }
+  }
+
+  return count > 0 ? l->cb(l->keys, l->key_lens, count, l->arg) : 0;
+}
+
+// rt_keys_cb passing on keys of a page of overflow object keys, which are
+// neither recent, already passed on, nor dead.
+static int v2_list_overflow(const char *const *keys, const size_t *key_lens,
+                            int keys_count, void *arg) {
+  v2_list_t *l = arg;
+  int count = 0;
+
+  for (int i = 0; i < keys_count; i++) {
+    if (!rt_keyset_contains(l->recent, keys[i], key_lens[i]) &&
+        !rt_keyset_contains(l->dead, keys[i], key_lens[i])) {
+      l->keys[count] = keys[i];
+      l->key_lens[count] = key_lens[i];
+      count++;
+    }
+  }
+
+  return count > 0 ? l->cb(l->keys, l->key_lens, count, l->arg) : 0;
+}
+
+int list_keys_v2(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                 int page_size, rt_keys_cb cb, void *arg,
+                 uint32_t *refcount) {
+  int ret = 0;
+  v2_header_t hdr;
+  rados_ioctx_t ovf_ioctx = NULL;
+  long keysets_bytes = 0;
+
+  v2_list_t l = {
+      .cb = cb,
+      .arg = arg,
+      .recent_builder = rt_keyset_builder_new(),
+      .dead_builder = rt_keyset_builder_new(),
+      .keys = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * page_size),
+      .key_lens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * page_size),
+  };
+
+  const char **page_keys =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * page_size);
+  size_t *page_key_lens =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * page_size);
+
+  // Read the header, and all of its keys, from version `gen`.
+
+  {
+    char hdr_buf[RT_V2_HEADER_SIZE + RT_POOL_NAME_MAX];
+    size_t hdr_len;
+    int read_rval;
+
+    rados_read_op_t read_op = rados_create_read_op();
+    rados_read_op_assert_version(read_op, gen);
+    rados_read_op_read(read_op, 0, sizeof(hdr_buf), hdr_buf, &hdr_len,
+                       &read_rval);
+    ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+    rados_release_read_op(read_op);
+
+    if (ret < 0 || (ret = v2_header_decode(hdr_buf, hdr_len, &hdr)) < 0) {
+      goto out;
+    }
+  }
+
+  ret = v2_page_keys(ioctx, oid, gen, page_size, page_keys, page_key_lens,
+                     v2_list_header, &l);
+
+  l.recent = rt_keyset_builder_finish(l.recent_builder);
+  l.dead = rt_keyset_builder_finish(l.dead_builder);
+  l.recent_builder = l.dead_builder = NULL;
+
+  if (ret < 0) {
+    goto out;
+  }
+  if (!l.recent || !l.dead) {
+    // OMap keys out of order.
+    ret = -EIO;
+    goto out;
+  }
+
+  keysets_bytes = rt_keyset_memory(l.recent) + rt_keyset_memory(l.dead);
+  rt_mem_charge(rt_mem_bound(), RT_MEM_SCRATCH, keysets_bytes);
+
+  // Pass on keys of overflow objects. They're not version-checked, see
+  // read_v2.
+
+  if ((ret = v2_open_overflow(ioctx, &hdr, &ovf_ioctx)) < 0) {
+    goto out;
+  }
+
+  {
+    char shard_oid[V2_SHARD_OID_SIZE(oid)];
+
+    for (uint32_t s = 0; s < hdr.shards && ret == 0; s++) {
+      v2_shard_oid(shard_oid, oid, &hdr, s);
+      ret = v2_page_keys(ovf_ioctx, shard_oid, 0, page_size, page_keys,
+                         page_key_lens, v2_list_overflow, &l);
+    }
+  }
+
+  if (ret == -ENOENT) {
+    // Overflow object of an RT that's been deleted in the meantime, so
+    // version check of the header fails.
+    ret = 0;
+  }
+  if (ret < 0) {
+    goto out;
+  }
+
+  // Check the header hasn't changed in the meantime.
+
+  {
+    rados_read_op_t read_op = rados_create_read_op();
+    rados_read_op_assert_version(read_op, gen);
+    ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+    rados_release_read_op(read_op);
+  }
+
+  *refcount = hdr.refcount;
+
+out:
+
+  if (l.recent_builder) {
+    rt_keyset_builder_abort(l.recent_builder);
+    rt_keyset_builder_abort(l.dead_builder);
+  }
+  rt_keyset_free(l.recent);
+  rt_keyset_free(l.dead);
+  rt_mem_charge(rt_mem_bound(), RT_MEM_SCRATCH, -keysets_bytes);
+
+  release_pool_ioctx(ovf_ioctx);
+  rt_mem_free(l.keys);
+  rt_mem_free(l.key_lens);
+  rt_mem_free(page_keys);
+  rt_mem_free(page_key_lens);
+
+  return ret;
+}
+
+/*
+ * Version 3.
+ */
+
+// RT directory, as seen by a writer (Version 3).
+typedef struct v3_dir {
+  // Version of the directory object read.
+  uint64_t gen;
+  uint64_t incarnation;
+  // Partition of the writer is active.
+  int active;
+  // Partitions of other writers are active.
+  int others;
+} v3_dir_t;
+
+// Writer IDs of directory keys with a prefix (Version 3).
+typedef struct v3_writers {
+  char prefix;
+  char **ids;
+  int count;
+  int cap;
+} v3_writers_t;
+
+// Size of buffers holding partition object names of RT `oid`.
+#define V3_PARTITION_OID_SIZE(oid) (strlen(oid) + RT_V3_WRITER_ID_MAX + 19)
+
+static void v3_partition_oid(char *buf, const char *oid, uint64_t incarnation,
+                             const char *writer) {
+  sprintf(buf, "%s.%016" PRIx64 ".%s", oid, incarnation, writer);
+}
+
+static int v3_check_writer(const char *writer) {
+  if (!writer || strlen(writer) == 0 ||
+      strlen(writer) > RT_V3_WRITER_ID_MAX) {
+    { // Debug log message.
+      printf("Partitioned RTs need a writer ID.\n");
+    }
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+// rt_keys_cb collecting writer IDs of a page of directory keys.
+static int v3_collect_writers(const char *const *keys, const size_t *key_lens,
+                              int keys_count, void *arg) {
+  v3_writers_t *w = arg;
+
+  for (int i = 0; i < keys_count; i++) {
+    if (key_lens[i] < 1) {
+      return -EIO;
+    }
+    if (keys[i][0] != w->prefix) {
+      continue;
+    }
+
+    if (w->count == w->cap) {
+      int cap = w->cap ? 2 * w->cap : 16;
+      char **ids = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * cap);
+      if (w->count > 0) {
+        memcpy(ids, w->ids, sizeof(void *) * w->count);
+      }
+      rt_mem_free(w->ids);
+      w->ids = ids;
+      w->cap = cap;
+    }
+
+    w->ids[w->count++] = strndup(keys[i] + 1, key_lens[i] - 1);
+  }
+
+  return 0;
+}
+
+static void v3_writers_free(v3_writers_t *w) {
+  for (int i = 0; i < w->count; i++) {
+    free(w->ids[i]);
+  }
+  rt_mem_free(w->ids);
+}
+
+// Reads directory of RT `oid`, as seen by `writer`. Its version isn't
+// asserted: writers of other partitions change it, and what's read is
+// consistent as of the version read.
+static int v3_read_dir(rados_ioctx_t ioctx, const char *oid,
+                       const char *writer, v3_dir_t *dir) {
+  char dir_buf[RT_V3_DIR_SIZE];
+  size_t dir_len;
+  int read_rval;
+
+  char active_key[RT_V3_WRITER_ID_MAX + 1];
+  const char *own_keys[1] = {active_key};
+  size_t own_key_lens[1] = {strlen(writer) + 1};
+  const char active_prefix[2] = {RT_V3_ACTIVE_PREFIX, '\0'};
+
+  rados_omap_iter_t own_iter = NULL;
+  rados_omap_iter_t active_iter = NULL;
+  int own_ret, active_ret;
+  unsigned char more;
+
+  char version_bytes[RT_VERSION_SIZE];
+  RT_VERSION_T version = htonl(3);
+  memcpy(version_bytes, &version, RT_VERSION_SIZE);
+
+  active_key[0] = RT_V3_ACTIVE_PREFIX;
+  memcpy(active_key + 1, writer, own_key_lens[0] - 1);
+
+  rados_read_op_t read_op = rados_create_read_op();
+  rados_read_op_cmpxattr(read_op, RT_VERSION_XATTR, LIBRADOS_CMPXATTR_OP_EQ,
+                         version_bytes, RT_VERSION_SIZE);
+  rados_read_op_read(read_op, 0, sizeof(dir_buf), dir_buf, &dir_len,
+                     &read_rval);
+  rados_read_op_omap_get_vals_by_keys2(read_op, own_keys, 1, own_key_lens,
+                                       &own_iter, &own_ret);
+  // Two active partitions tell whether the writer's is the only one.
+  rados_read_op_omap_get_vals2(read_op, "", active_prefix, 2, &active_iter,
+                               &more, &active_ret);
+
+  int ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+  rados_release_read_op(read_op);
+
+  if (ret == -ECANCELED) {
+    // Deleted and created again with another layout.
+    ret = -ERANGE;
+  } else if (ret == 0 && dir_len != RT_V3_DIR_SIZE) {
+    ret = -EIO;
+  }
+
+  if (ret == 0) {
+    uint64_t incarnation;
+    memcpy(&incarnation, dir_buf, sizeof(incarnation));
+
+    dir->gen = rados_get_last_version(ioctx);
+    dir->incarnation = be64toh(incarnation);
+    dir->active = rados_omap_iter_size(own_iter) > 0;
+    dir->others = (int)rados_omap_iter_size(active_iter) > dir->active;
+
+    { // Debug log message.
+      printf("RT directory: writer %s is %sactive, %s.\n", writer,
+             dir->active ? "" : "not ",
+             dir->others ? "others are active" : "no others are active");
+    }
+  }
+
+  // Iterators are allocated even if the op fails.
+  rados_omap_get_end(own_iter);
+  rados_omap_get_end(active_iter);
+
+  return ret;
+}
+
+// Reads refcount of partition `poid` and finds keys in it. `pgen` is set to
+// its version, or to zero if it doesn't exist yet.
+static int v3_read_partition(rados_ioctx_t ioctx, const char *poid,
+                             const char *const *keys, const size_t *key_lens,
+                             int keys_count, uint32_t *refcount,
+                             int *ref_keys_found, uint64_t *pgen) {
+  int ret = 0;
+
+  char read_buf[RT_V1_REFCOUNT_SIZE];
+  size_t read_bytes;
+  int read_rval;
+
+  rados_omap_iter_t omap_iter = NULL;
+  int omap_get_vals_ret;
+  rt_keyset_t *fetched_keys = NULL;
+  long iter_bytes = 0;
+  long keyset_bytes = 0;
+
+  *refcount = 0;
+  *pgen = 0;
+  for (int i = 0; i < keys_count; i++) {
+    ref_keys_found[i] = 0;
+  }
+
+  {
+    rados_read_op_t read_op = rados_create_read_op();
+
+    rados_read_op_read(read_op, 0, sizeof(read_buf), read_buf, &read_bytes,
+                       &read_rval);
+    if (keys_count > 0) {
+      rados_read_op_omap_get_vals_by_keys2(read_op, keys, keys_count,
+                                           key_lens, &omap_iter,
+                                           &omap_get_vals_ret);
+    }
+
+    ret = rados_read_op_operate(read_op, ioctx, poid, 0);
+    rados_release_read_op(read_op);
+  }
+
+  if (ret == -ENOENT) {
+    // The partition is created by the first write.
+    { // Debug log message.
+      printf("Partition %s doesn't exist yet.\n", poid);
+    }
+    ret = 0;
+    goto out;
+  }
+  if (ret < 0) {
+    goto out;
+  }
+  if (read_bytes != RT_V1_REFCOUNT_SIZE) {
+    ret = -EIO;
+    goto out;
+  }
+
+  *pgen = rados_get_last_version(ioctx);
+  memcpy(refcount, read_buf, RT_V1_REFCOUNT_SIZE);
+  *refcount = ntohl(*refcount);
+
+  if (keys_count > 0) {
+    { // Debug log message.
+      printf("Fetched %d keys from partition %s:",
+             rados_omap_iter_size(omap_iter), poid);
+    }
+
+    if ((ret = collect_keys(omap_iter, &fetched_keys, &iter_bytes,
+                            &keyset_bytes)) < 0) {
+      goto out;
+    }
+
+    for (int i = 0; i < keys_count; i++) {
+      ref_keys_found[i] =
+          rt_keyset_contains(fetched_keys, keys[i], key_lens[i]);
+    }
+  }
+
+out:
+
+  release_keys(omap_iter, fetched_keys, iter_bytes, keyset_bytes);
+
+  return ret;
+}
+
+// Writes `refcount` of partition `poid`, setting and removing keys,
+// asserting version `pgen`, or creating the partition if it's zero.
+static int v3_write_partition(rados_ioctx_t ioctx, const char *poid,
+                              uint64_t pgen, uint32_t refcount,
+                              const char *const *set_keys,
+                              const size_t *set_key_lens, int set_count,
+                              const char *const *rm_keys,
+                              const size_t *rm_key_lens, int rm_count) {
+  char **vals = NULL;
+  size_t *val_lens = NULL;
+  RT_V1_REFCOUNT_T refcount_n = htonl(refcount);
+
+  rados_write_op_t write_op = rados_create_write_op();
+  if (pgen) {
+    rados_write_op_assert_version(write_op, pgen);
+  } else {
+    rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+  }
+  rados_write_op_write_full(write_op, (const char *)&refcount_n,
+                            RT_V1_REFCOUNT_SIZE);
+  if (set_count > 0) {
+    v2_empty_vals(set_count, &vals, &val_lens);
+    rados_write_op_omap_set2(write_op, set_keys, (const char *const *)vals,
+                             set_key_lens, val_lens, set_count);
+  }
+  if (rm_count > 0) {
+    rados_write_op_omap_rm_keys2(write_op, rm_keys, rm_key_lens, rm_count);
+  }
+
+  int ret = rados_write_op_operate(write_op, ioctx, poid, NULL, 0);
+  rados_release_write_op(write_op);
+
+  rt_mem_free(vals);
+  rt_mem_free(val_lens);
+
+  { // Debug log message.
+    if (ret == -ERANGE || ret == -EEXIST) {
+      printf("The partition has changed since it was last read. Please try "
+             "again.\n");
+    } else if (ret < 0) {
+      printf("Write operation failed with error code %d.\n", ret);
+    }
+  }
+
+  return ret == -EEXIST ? -ERANGE : ret;
+}
+
+// Registers partition of `writer` as active, or unregisters it, asserting
+// directory version `gen`.
+static int v3_set_active(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                         const char *writer, int active) {
+  size_t len = strlen(writer);
+  char **vals = NULL;
+  size_t *val_lens = NULL;
+  v2_keys_t ks;
+
+  v2_keys_init(&ks, 2, 2 * len);
+  v2_keys_add(&ks, RT_V3_ACTIVE_PREFIX, writer, len);
+
+  rados_write_op_t write_op = rados_create_write_op();
+  rados_write_op_assert_version(write_op, gen);
+  if (active) {
+    v2_keys_add(&ks, RT_V3_PARTITION_PREFIX, writer, len);
+    v2_empty_vals(ks.count, &vals, &val_lens);
+    rados_write_op_omap_set2(write_op, (const char *const *)ks.keys,
+                             (const char *const *)vals, ks.lens, val_lens,
+                             ks.count);
+  } else {
+    rados_write_op_omap_rm_keys2(write_op, (const char *const *)ks.keys,
+                                 ks.lens, ks.count);
+  }
+
+  int ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+  rados_release_write_op(write_op);
+
+  v2_keys_free(&ks);
+  rt_mem_free(vals);
+  rt_mem_free(val_lens);
+
+  { // Debug log message.
+    printf("%s partition of writer %s: %d.\n",
+           active ? "Registering" : "Unregistering", writer, ret);
+  }
+
+  return ret;
+}
+
+// Deletes RT `oid`, unless its directory has changed since version `gen`,
+// and then its partitions. Partitions left behind belong to an incarnation
+// that is gone, and aren't read again.
+static int v3_delete(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                     uint64_t incarnation) {
+  v3_writers_t w = {.prefix = RT_V3_PARTITION_PREFIX};
+  const char **page_keys =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * RT_V3_DIR_PAGE_SIZE);
+  size_t *page_key_lens =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * RT_V3_DIR_PAGE_SIZE);
+
+  int ret = v2_page_keys(ioctx, oid, gen, RT_V3_DIR_PAGE_SIZE, page_keys,
+                         page_key_lens, v3_collect_writers, &w);
+
+  if (ret == 0) {
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_assert_version(write_op, gen);
+    rados_write_op_remove(write_op);
+    ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+    rados_release_write_op(write_op);
+  }
+
+  { // Debug log message.
+    if (ret == 0) {
+      printf("RT has no active partitions, deleted it.\n");
+    }
+  }
+
+  if (ret == 0) {
+    char *poid = rt_mem_alloc(RT_MEM_SCRATCH, V3_PARTITION_OID_SIZE(oid));
+
+    for (int i = 0; i < w.count; i++) {
+      v3_partition_oid(poid, oid, incarnation, w.ids[i]);
+      rados_remove(ioctx, poid);
+    }
 
-    ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
-    rados_release_write_op(write_op);
+    rt_mem_free(poid);
+  }
 
-    if (ret < 0) {
-      { // Debug log message.
-        if (ret == -ERANGE) {
-          printf("The RT object has changed since it was last read. Please try "
-                 "again.\n");
-        } else {
-          printf("Write operation failed with error code %d.\n", ret);
-        }
+  v3_writers_free(&w);
+  rt_mem_free(page_keys);
+  rt_mem_free(page_key_lens);
+
+  return ret;
+}
+
+// Unregisters partition of `writer`, emptied after directory `dir` was
+// read, deleting the RT if no other partition is active. If `dir` is NULL,
+// the partition is read first, and rewritten if it's empty.
+//
+// Partitions are registered before they become non-empty, and unregistered
+// after they become empty, so the RT holds no references once none is
+// active. An update filling the emptied partition registers it again before
+// writing it, changing the directory version, which fails unregistering.
+// The partition is then rewritten if it's still empty, failing updates
+// that read it before, and unregistering is retried. Failing that, the
+// partition is left active, and is unregistered by the next removal of the
+// writer.
+static void v3_close(rados_ioctx_t ioctx, const char *oid, const char *writer,
+                     const v3_dir_t *dir, int *rt_removed) {
+  int ret = 0;
+  v3_dir_t d;
+  char *poid = rt_mem_alloc(RT_MEM_SCRATCH, V3_PARTITION_OID_SIZE(oid));
+
+  if (dir) {
+    d = *dir;
+  }
+
+  for (int attempt = dir ? 0 : 1; attempt <= RT_V3_CLOSE_MAX_RETRIES;
+       attempt++) {
+    if (attempt > 0) {
+      uint32_t refcount;
+      uint64_t pgen;
+
+      if ((ret = v3_read_dir(ioctx, oid, writer, &d)) < 0 || !d.active) {
+        break;
+      }
+
+      v3_partition_oid(poid, oid, d.incarnation, writer);
+      if ((ret = v3_read_partition(ioctx, poid, NULL, NULL, 0, &refcount,
+                                   NULL, &pgen)) < 0 ||
+          refcount > 0) {
+        break;
+      }
+      if ((ret = v3_write_partition(ioctx, poid, pgen, 0, NULL, NULL, 0, NULL,
+                                    NULL, 0)) < 0) {
+        continue;
       }
-      goto out;
+    }
+
+    if (d.others) {
+      ret = v3_set_active(ioctx, oid, d.gen, writer, 0);
+    } else if ((ret = v3_delete(ioctx, oid, d.gen, d.incarnation)) == 0) {
+      *rt_removed = 1;
+      rt_rollup_note(ioctx, -1, 0);
+    }
+
+    if (ret != -ERANGE) {
+      break;
     }
   }
 
   { // Debug log message.
-    printf("RT object successfully updated.\n");
+    if (ret < 0 && ret != -ENOENT) {
+      printf("Failed to unregister partition of writer %s: %d.\n", writer,
+             ret);
+    }
   }
 
-out:
+  rt_mem_free(poid);
+}
 
-  free(ref_keys_found);
-  free(keys_to_add);
-  free(vals_to_add);
-  free(keys_to_add_lens);
-  free(vals_to_add_lens);
+int init_v3(rados_ioctx_t ioctx, const char *oid, const char *const *keys,
+            const size_t *key_lens, int keys_count, const char *writer) {
+  { // Debug log message.
+    printf("init_v3(): Initializing new RT v3 object.\n");
+  }
+
+  int ret;
+
+  if ((ret = v3_check_writer(writer)) < 0) {
+    return ret;
+  }
+
+  uint64_t incarnation = new_incarnation(ioctx);
+
+  // Create the directory with the partition registered, and then the
+  // partition.
+
+  {
+    char version_bytes[RT_VERSION_SIZE];
+    RT_VERSION_T version = htonl(3);
+    memcpy(version_bytes, &version, RT_VERSION_SIZE);
+
+    uint64_t incarnation_n = htobe64(incarnation);
+
+    size_t len = strlen(writer);
+    char **vals = NULL;
+    size_t *val_lens = NULL;
+    v2_keys_t ks;
+
+    v2_keys_init(&ks, 2, 2 * len);
+    v2_keys_add(&ks, RT_V3_ACTIVE_PREFIX, writer, len);
+    v2_keys_add(&ks, RT_V3_PARTITION_PREFIX, writer, len);
+    v2_empty_vals(ks.count, &vals, &val_lens);
+
+    rados_write_op_t write_op = rados_create_write_op();
+    rados_write_op_create(write_op, LIBRADOS_CREATE_EXCLUSIVE, NULL);
+    rados_write_op_setxattr(write_op, RT_VERSION_XATTR, version_bytes,
+                            RT_VERSION_SIZE);
+    rados_write_op_write_full(write_op, (const char *)&incarnation_n,
+                              sizeof(incarnation_n));
+    rados_write_op_omap_set2(write_op, (const char *const *)ks.keys,
+                             (const char *const *)vals, ks.lens, val_lens,
+                             ks.count);
+
+    ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
+    rados_release_write_op(write_op);
+
+    v2_keys_free(&ks);
+    rt_mem_free(vals);
+    rt_mem_free(val_lens);
+  }
+
+  // The RT is counted once its directory exists, v3_close uncounts it if
+  // the partition can't be written.
+
+  if (ret == 0) {
+    rt_rollup_note(ioctx, 1, 0);
+
+    char *poid = rt_mem_alloc(RT_MEM_SCRATCH, V3_PARTITION_OID_SIZE(oid));
+    v3_partition_oid(poid, oid, incarnation, writer);
+
+    ret = v3_write_partition(ioctx, poid, 0, keys_count, keys, key_lens,
+                             keys_count, NULL, NULL, 0);
+    rt_mem_free(poid);
+
+    if (ret == 0) {
+      rt_rollup_note(ioctx, 0, keys_count);
+    } else {
+      int removed = 0;
+      v3_close(ioctx, oid, writer, NULL, &removed);
+    }
+  }
+
+  { // Debug log message.
+    if (ret < 0) {
+      printf("Write operation failed with error code %d.\n", ret);
+    } else {
+      printf("RT object successfully initialized.\n");
+    }
+  }
 
   return ret;
 }
 
-int remove_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
-              const char *const *keys, int keys_count, int *rt_removed) {
+int add_v3(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+           const char *const *keys, const size_t *key_lens, int keys_count,
+           const char *writer) {
   { // Debug log message.
-    printf("remove_v1(): Removing keys from an existing RT v1 object.\n");
+    printf("add_v3(): Adding keys to partition of writer %s.\n",
+           writer ? writer : "(none)");
   }
 
-  int removed = 0;
-  int ret = 0;
-  RT_V1_REFCOUNT_T refcount;
+  int ret;
+  v3_dir_t dir;
+  uint32_t refcount;
+  uint64_t pgen;
+  char *poid = NULL;
+  const char **keys_to_add = NULL;
+  size_t *keys_to_add_lens = NULL;
+  int *ref_keys_found = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(int) * keys_count);
 
-  const int write_buf_size = RT_V1_REFCOUNT_SIZE;
-  char write_buf[write_buf_size];
+  if ((ret = v3_check_writer(writer)) < 0) {
+    goto out;
+  }
 
-  // Return values from OMap comparisons.
-  int *ref_keys_found = malloc(sizeof(int) * keys_count);
+  // The directory is read before the partition, see v3_close.
 
-  // Read the RT object.
-  if ((ret = read_v1(ioctx, oid, gen, keys, keys_count, &refcount,
-                     ref_keys_found)) < 0) {
+  if ((ret = v3_read_dir(ioctx, oid, writer, &dir)) < 0) {
     goto out;
   }
 
-  // Prepare keys to remove.
+  poid = rt_mem_alloc(RT_MEM_SCRATCH, V3_PARTITION_OID_SIZE(oid));
+  v3_partition_oid(poid, oid, dir.incarnation, writer);
 
-  int keys_to_remove_count = 0;
+  if ((ret = v3_read_partition(ioctx, poid, keys, key_lens, keys_count,
+                               &refcount, ref_keys_found, &pgen)) < 0) {
+    goto out;
+  }
+
+  int keys_to_add_count = 0;
   for (int i = 0; i < keys_count; i++) {
-    if (ref_keys_found[i]) {
-      keys_to_remove_count++;
+    if (!ref_keys_found[i]) {
+      keys_to_add_count++;
     }
   }
 
-  char **keys_to_remove = NULL;
-  size_t *keys_to_remove_lens = NULL;
-
-  if (!keys_to_remove_count) {
+  if (!keys_to_add_count) {
     // Nothing to do.
     { // Debug log message.
-      printf("No keys will be removed because none of the keys requested for "
-             "removal are present.\n");
+      printf("No keys will be added. They are all already tracked.\n");
     }
     goto out;
   }
 
-  keys_to_remove = malloc(sizeof(void *) * keys_to_remove_count);
-  keys_to_remove_lens = malloc(sizeof(size_t) * keys_to_remove_count);
-
-  { // Debug log message.
-    printf("Removing %d keys out of %d requested:", keys_to_remove_count,
-           keys_count);
-  }
+  keys_to_add =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * keys_to_add_count);
+  keys_to_add_lens =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * keys_to_add_count);
 
   for (int i = 0, j = 0; i < keys_count; i++) {
     if (!ref_keys_found[i]) {
-      // Skip this key as it's been already removed from RT.
-      continue;
+      keys_to_add[j] = keys[i];
+      keys_to_add_lens[j] = key_lens[i];
+      j++;
     }
+  }
 
-    keys_to_remove[j] = (char *)keys[i];
-    keys_to_remove_lens[j] = strlen(keys[i]);
+  // A partition becoming non-empty is registered first, even if it's still
+  // registered, so that unregistering it concurrently fails.
 
-    j++;
-    { // Debug log message.
-      printf(" %s", keys[i]);
-    }
+  if (refcount == 0 &&
+      (ret = v3_set_active(ioctx, oid, dir.gen, writer, 1)) < 0) {
+    goto out;
+  }
+
+  ret = v3_write_partition(ioctx, poid, pgen, refcount + keys_to_add_count,
+                           keys_to_add, keys_to_add_lens, keys_to_add_count,
+                           NULL, NULL, 0);
+  if (ret == 0) {
+    rt_rollup_note(ioctx, 0, keys_to_add_count);
+  }
+
+  if (ret < 0 && refcount == 0) {
+    // Don't leave the partition registered, unless another update has
+    // filled it in the meantime.
+    int removed = 0;
+    v3_close(ioctx, oid, writer, NULL, &removed);
   }
 
   { // Debug log message.
-    printf(".\n");
+    if (ret == 0) {
+      printf("RT object successfully updated.\n");
+    }
   }
 
-  // Prepare new value for refcount.
+out:
 
-  refcount -= (RT_V1_REFCOUNT_T)keys_to_remove_count;
+  rt_mem_free(ref_keys_found);
+  rt_mem_free(keys_to_add);
+  rt_mem_free(keys_to_add_lens);
+  rt_mem_free(poid);
 
-  {
-    RT_V1_REFCOUNT_T refcount_n = htonl(refcount);
-    memcpy(write_buf, &refcount_n, RT_V1_REFCOUNT_SIZE);
+  return ret;
+}
+
+int remove_v3(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+              const char *const *keys, const size_t *key_lens, int keys_count,
+              const char *writer, int *rt_removed) {
+  { // Debug log message.
+    printf("remove_v3(): Removing keys from partition of writer %s.\n",
+           writer ? writer : "(none)");
   }
 
-  // Perform write operation.
+  int ret;
+  v3_dir_t dir;
+  uint32_t refcount;
+  uint64_t pgen;
+  char *poid = NULL;
+  const char **keys_to_remove = NULL;
+  size_t *keys_to_remove_lens = NULL;
+  int *ref_keys_found = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(int) * keys_count);
 
-  {
-    rados_write_op_t write_op = rados_create_write_op();
-    rados_write_op_assert_version(write_op, gen);
+  if ((ret = v3_check_writer(writer)) < 0) {
+    goto out;
+  }
 
-    if (refcount == 0) {
-      // This RT holds no references, delete it.
+  // The directory is read before the partition, see v3_close.
 
-      { // Debug log message.
-        printf("After this operation, this RT would hold no references. "
-               "Deleting the whole object instead.\n");
-      }
+  if ((ret = v3_read_dir(ioctx, oid, writer, &dir)) < 0) {
+    goto out;
+  }
 
-      rados_write_op_remove(write_op);
-      removed = 1;
-    } else {
-      // Update it with new values.
+  poid = rt_mem_alloc(RT_MEM_SCRATCH, V3_PARTITION_OID_SIZE(oid));
+  v3_partition_oid(poid, oid, dir.incarnation, writer);
 
-      rados_write_op_write_full(write_op, write_buf, write_buf_size);
-      rados_write_op_omap_rm_keys2(write_op,
-                                   (const char *const *)keys_to_remove,
-                                   keys_to_remove_lens, keys_to_remove_count);
+  if ((ret = v3_read_partition(ioctx, poid, keys, key_lens, keys_count,
+                               &refcount, ref_keys_found, &pgen)) < 0) {
+    goto out;
+  }
+
+  int keys_to_remove_count = 0;
+  for (int i = 0; i < keys_count; i++) {
+    if (ref_keys_found[i]) {
+      keys_to_remove_count++;
     }
+  }
 
-    ret = rados_write_op_operate(write_op, ioctx, oid, NULL, 0);
-    rados_release_write_op(write_op);
+  if (!keys_to_remove_count) {
+    // Nothing to do.
+    { // Debug log message.
+      printf("No keys will be removed. They are all already untracked.\n");
+    }
 
-    if (ret < 0) {
-      { // Debug log message.
-        if (ret == -ERANGE) {
-          printf("The RT object has changed since it was last read. Please try "
-                 "again.\n");
-        } else {
-          printf("Write operation failed with error code %d.\n", ret);
-        }
-      }
+    if (refcount == 0 && dir.active) {
+      // Left registered by an update that failed.
+      v3_close(ioctx, oid, writer, NULL, rt_removed);
     }
+    goto out;
   }
 
-  { // Debug log message.
-    printf("RT object successfully updated.\n");
+  if (keys_to_remove_count > (int)refcount) {
+    ret = -EIO;
+    goto out;
   }
 
-out:
+  keys_to_remove =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * keys_to_remove_count);
+  keys_to_remove_lens =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * keys_to_remove_count);
 
-  free(ref_keys_found);
-  free(keys_to_remove);
-  free(keys_to_remove_lens);
+  for (int i = 0, j = 0; i < keys_count; i++) {
+    if (ref_keys_found[i]) {
+      keys_to_remove[j] = keys[i];
+      keys_to_remove_lens[j] = key_lens[i];
+      j++;
+    }
+  }
 
-  *rt_removed = removed;
+  refcount -= keys_to_remove_count;
 
-  return ret;
-}
+  if ((ret = v3_write_partition(ioctx, poid, pgen, refcount, NULL, NULL, 0,
+                                keys_to_remove, keys_to_remove_lens,
+                                keys_to_remove_count)) < 0) {
+    goto out;
+  }
+  rt_rollup_note(ioctx, 0, -keys_to_remove_count);
 
-int read_v1(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
-            const char *const *keys, int keys_count, RT_V1_REFCOUNT_T *refcount,
-            int *ref_keys_found) {
-  { // Debug log message.
-    printf("read_v1(): Reading RT v1 object.\n");
+  if (refcount == 0) {
+    v3_close(ioctx, oid, writer, &dir, rt_removed);
   }
 
-  int ret = 0;
+  { // Debug log message.
+    printf("RT object successfully updated.\n");
+  }
 
-  const int buf_size = RT_V1_REFCOUNT_SIZE;
-  char read_buf[buf_size];
+out:
 
-  // Here will be stored results of op_read.
-  int read_rval;
-  size_t read_bytes;
+  rt_mem_free(ref_keys_found);
+  rt_mem_free(keys_to_remove);
+  rt_mem_free(keys_to_remove_lens);
+  rt_mem_free(poid);
 
-  // Prepare input for rados_read_op_omap_get_vals_by_keys2.
+  return ret;
+}
 
-  size_t *key_lens = malloc(sizeof(size_t) * keys_count);
-  for (int i = 0; i < keys_count; i++) {
-    key_lens[i] = strlen(keys[i]);
-  }
+int list_keys_v3(rados_ioctx_t ioctx, const char *oid, uint64_t gen,
+                 int page_size, rt_keys_cb cb, void *arg, uint32_t *refcount,
+                 const char **writer) {
+  int ret = 0;
+  uint64_t incarnation;
+  v3_writers_t w = {.prefix = RT_V3_ACTIVE_PREFIX};
+  uint64_t *pgens = NULL;
+  char *poid = rt_mem_alloc(RT_MEM_SCRATCH, V3_PARTITION_OID_SIZE(oid));
 
-  const char **fetched_keys = NULL;
+  const char **page_keys =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(void *) * page_size);
+  size_t *page_key_lens =
+      rt_mem_alloc(RT_MEM_SCRATCH, sizeof(size_t) * page_size);
 
-  rados_omap_iter_t omap_iter = NULL;
-  int omap_get_vals_ret;
+  *refcount = 0;
 
-  // Perform read operation.
+  // Read the directory, and its active partitions, from version `gen`.
+  // Inactive partitions hold no keys.
 
   {
-    rados_read_op_t read_op = rados_create_read_op();
+    char dir_buf[RT_V3_DIR_SIZE];
+    size_t dir_len;
+    int read_rval;
 
+    rados_read_op_t read_op = rados_create_read_op();
     rados_read_op_assert_version(read_op, gen);
-    rados_read_op_read(read_op, 0, buf_size, read_buf, &read_bytes, &read_rval);
-    rados_read_op_omap_get_vals_by_keys2(read_op, keys, keys_count, key_lens,
-                                         &omap_iter, &omap_get_vals_ret);
-
+    rados_read_op_read(read_op, 0, sizeof(dir_buf), dir_buf, &dir_len,
+                       &read_rval);
     ret = rados_read_op_operate(read_op, ioctx, oid, 0);
     rados_release_read_op(read_op);
 
+    if (ret == 0 && dir_len != RT_V3_DIR_SIZE) {
+      ret = -EIO;
+    }
     if (ret < 0) {
-      // Bail out on any error.
       goto out;
     }
+
+    memcpy(&incarnation, dir_buf, sizeof(incarnation));
+    incarnation = be64toh(incarnation);
   }
 
-  // Populate ref_keys_found array. This could be implemented a bit nicer
-  // than O(m*n), but it doesn't really matter as this is just a PoC.
+  if ((ret = v2_page_keys(ioctx, oid, gen, page_size, page_keys,
+                          page_key_lens, v3_collect_writers, &w)) < 0) {
+    goto out;
+  }
 
-  {
-    unsigned iter_elems = rados_omap_iter_size(omap_iter);
-    fetched_keys = malloc(sizeof(void *) * iter_elems);
+  // List each partition from a single version. A registered partition may
+  // not exist yet.
 
-    { // Debug log message.
-      printf("Based on requested ref keys, we were able to fetch %d of them "
-             "from RT OMap:",
-             iter_elems);
-    }
+  pgens = rt_mem_alloc(RT_MEM_SCRATCH, sizeof(uint64_t) * (w.count + 1));
 
-    for (unsigned i = 0; i < iter_elems; i++) {
-      char *key, *val;
-      size_t key_len, val_len;
-      ret = rados_omap_get_next2(omap_iter, &key, &val, &key_len, &val_len);
-      if (ret < 0) {
-        { // Debug log message.
-          printf("\nrados_omap_get_next2() failed with error code %d\n", ret);
-        }
-        goto out;
-      }
+  for (int i = 0; i < w.count; i++) {
+    uint64_t size;
+    int stat_rval;
+    uint32_t partition_refcount;
 
-      fetched_keys[i] = key;
-      { // Debug log message.
-        printf(" %s", key);
-      }
+    v3_partition_oid(poid, oid, incarnation, w.ids[i]);
+
+    rados_read_op_t read_op = rados_create_read_op();
+    rados_read_op_stat(read_op, &size, NULL, &stat_rval);
+    ret = rados_read_op_operate(read_op, ioctx, poid, 0);
+    rados_release_read_op(read_op);
+
+    if (ret == -ENOENT) {
+      pgens[i] = 0;
+      ret = 0;
+      continue;
+    }
+    if (ret < 0) {
+      goto out;
     }
 
-    { // Debug log message.
-      printf(".\n");
+    pgens[i] = rados_get_last_version(ioctx);
+    if (writer) {
+      *writer = w.ids[i];
+    }
+    if ((ret = list_keys_v1(ioctx, poid, pgens[i], page_size, cb, arg,
+                            &partition_refcount)) < 0) {
+      goto out;
     }
 
-    for (int i = 0; i < keys_count; i++) {
-      int found = 0;
+    *refcount += partition_refcount;
+  }
 
-      for (unsigned j = 0; j < iter_elems; j++) {
-        if (strcmp(keys[i], fetched_keys[j]) == 0) {
-          found = 1;
-          break;
-        }
-      }
+  // Check nothing has changed in the meantime, so that the keys passed on
+  // were all tracked at once: right after the last partition was read.
 
-      ref_keys_found[i] = found;
-    }
+  {
+    rados_read_op_t read_op = rados_create_read_op();
+    rados_read_op_assert_version(read_op, gen);
+    ret = rados_read_op_operate(read_op, ioctx, oid, 0);
+    rados_release_read_op(read_op);
   }
 
-  // Output refcount value.
+  for (int i = 0; i < w.count && ret == 0; i++) {
+    uint64_t size;
+    int stat_rval;
 
-  memcpy(refcount, read_buf, RT_V1_REFCOUNT_SIZE);
-  *refcount = ntohl(*refcount);
+    v3_partition_oid(poid, oid, incarnation, w.ids[i]);
 
-out:
+    rados_read_op_t read_op = rados_create_read_op();
+    if (pgens[i]) {
+      rados_read_op_assert_version(read_op, pgens[i]);
+    } else {
+      rados_read_op_stat(read_op, &size, NULL, &stat_rval);
+    }
+    ret = rados_read_op_operate(read_op, ioctx, poid, 0);
+    rados_release_read_op(read_op);
+
+    if (!pgens[i] && ret == 0) {
+      // Created in the meantime.
+      ret = -ERANGE;
+    } else if (!pgens[i] && ret == -ENOENT) {
+      ret = 0;
+    }
+  }
 
-  rados_omap_get_end(omap_iter);
+out:
 
-  free(key_lens);
-  free(fetched_keys);
+  v3_writers_free(&w);
+  rt_mem_free(pgens);
+  rt_mem_free(poid);
+  rt_mem_free(page_keys);
+  rt_mem_free(page_key_lens);
 
   return ret;
 }
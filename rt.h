@@ -47,4 +47,268 @@ int rt_add(rados_t rados, const char *pool_name, const char *rt_name,
 int rt_remove(rados_t rados, const char *pool_name, const char *rt_name,
               const char *const *keys, int keys_count, int *rt_deleted);
 
+/**
+ * rt_add2 is rt_add operating on an I/O context of the pool instead of
+ * opening one, with keys given by their lengths in `key_lens`. Keys don't
+ * need to be NUL-terminated, so they can be passed straight from buffers
+ * of the caller.
+ */
+int rt_add2(rados_ioctx_t ioctx, const char *rt_name, const char *const *keys,
+            const size_t *key_lens, int keys_count, int *rt_created);
+
+/**
+ * rt_layout_t selects how a reference tracker is stored in RADOS objects.
+ */
+typedef enum rt_layout {
+  // A single object holding the refcount and all keys.
+  RT_LAYOUT_SINGLE,
+  // A header object holding the refcount and recently added keys, with the
+  // bulk of keys in overflow objects in another pool. Keeps the header in a
+  // fast pool and the keys in a capacity pool. Updates read the overflow
+  // pool only for keys not found in the header.
+  RT_LAYOUT_SPLIT,
+  // An object per writer, holding the keys added by it, and a directory
+  // object of their partitions. Writers update only their own partition, so
+  // writers on different nodes don't conflict. Readers merge partitions.
+  RT_LAYOUT_PARTITIONED,
+} rt_layout_t;
+
+typedef struct rt_opts {
+  // Layout of RTs created by rt_add3. Existing RTs keep their layout.
+  rt_layout_t layout;
+  // RT_LAYOUT_SPLIT: Pool of overflow objects, their number, and how many
+  // keys the header holds before they're moved to overflow objects.
+  const char *overflow_pool;
+  int overflow_shards;
+  int header_keys;
+  // RT_LAYOUT_PARTITIONED: Identity of the writer, e.g. a node ID, selecting
+  // its partition. Required to update partitioned RTs, whether created by
+  // rt_add3 or not. Keys are tracked per writer: a key added by several
+  // writers is held until each of them removes it.
+  const char *writer_id;
+} rt_opts_t;
+
+/**
+ * rt_opts_init fills `opts` with default values: RTs are created with the
+ * single object layout.
+ */
+void rt_opts_init(rt_opts_t *opts);
+
+/**
+ * rt_add3 is rt_add2 creating the RT, if it doesn't exist, with the layout
+ * of `opts`. NULL `opts` means defaults.
+ */
+int rt_add3(rados_ioctx_t ioctx, const char *rt_name, const char *const *keys,
+            const size_t *key_lens, int keys_count, const rt_opts_t *opts,
+            int *rt_created);
+
+/**
+ * rt_remove2 is rt_remove operating on an I/O context of the pool instead
+ * of opening one, with keys given by their lengths in `key_lens`.
+ */
+int rt_remove2(rados_ioctx_t ioctx, const char *rt_name,
+               const char *const *keys, const size_t *key_lens,
+               int keys_count, int *rt_deleted);
+
+/**
+ * rt_remove3 is rt_remove2 removing keys as the writer of `opts`, see
+ * rt_opts_t. NULL `opts` means defaults.
+ */
+int rt_remove3(rados_ioctx_t ioctx, const char *rt_name,
+               const char *const *keys, const size_t *key_lens,
+               int keys_count, const rt_opts_t *opts, int *rt_deleted);
+
+/**
+ * rt_keys_cb is called by rt_list_keys for each page of keys read from the
+ * reference tracker. Key strings are only valid for the duration of the
+ * call. Returning a negative value stops the listing and is passed back to
+ * the caller of rt_list_keys.
+ */
+typedef int (*rt_keys_cb)(const char *const *keys, const size_t *key_lens,
+                          int keys_count, void *arg);
+
+/**
+ * rt_list_keys lists all keys tracked by reference tracker.
+ *
+ * `ioctx` is an I/O context of the pool where the RT RADOS object is stored.
+ * `rt_name` is name of the reference tracker RADOS object.
+ * `page_size` is the maximum number of keys read from RT OMap at once.
+ * `cb` is called for every page of keys. All pages are read from the same
+ *      RT object version. If the RT is modified in the middle of listing,
+ *      -ERANGE is returned.
+ * `refcount` is set to the number of references held by the RT.
+ *
+ * Listing checks that pages come from the same RT version with
+ * rados_get_last_version, which reports the last operation of the whole
+ * I/O context. `ioctx` must therefore not be used by other threads in the
+ * meantime. The same holds for all RT operations taking an I/O context.
+ */
+int rt_list_keys(rados_ioctx_t ioctx, const char *rt_name, int page_size,
+                 rt_keys_cb cb, void *arg, uint32_t *refcount);
+
+/**
+ * rt_writer_keys_cb is rt_keys_cb called by rt_list_keys2, with `writer_id`
+ * of the partition holding the keys for partitioned RTs, see rt_opts_t,
+ * and NULL for RTs of other layouts.
+ */
+typedef int (*rt_writer_keys_cb)(const char *writer_id,
+                                 const char *const *keys,
+                                 const size_t *key_lens, int keys_count,
+                                 void *arg);
+
+/**
+ * rt_list_keys2 is rt_list_keys passing every page of keys on along with
+ * the writer ID of its partition. Keys held by several partitions are
+ * passed once for each of them. Removing keys as that writer, see
+ * rt_remove3, removes them from the partition they were listed from.
+ */
+int rt_list_keys2(rados_ioctx_t ioctx, const char *rt_name, int page_size,
+                  rt_writer_keys_cb cb, void *arg, uint32_t *refcount);
+
+/**
+ * rt_list_local_keys is rt_list_keys for scans of the RTs stored in a
+ * pool: it doesn't follow forwarding markers, see rt_relocate, and fails
+ * with -EXDEV on them instead.
+ */
+int rt_list_local_keys(rados_ioctx_t ioctx, const char *rt_name,
+                       int page_size, rt_keys_cb cb, void *arg,
+                       uint32_t *refcount);
+
+/**
+ * rt_list_ops returns the number of RADOS operations rt_list_keys issues to
+ * list a single object RT holding `refcount` references in pages of
+ * `page_size` keys.
+ */
+int rt_list_ops(uint32_t refcount, int page_size);
+
+/**
+ * rt_pace_cb is called by rt_relocate before its first RADOS operation and
+ * before each write, and may block to limit their rate. `ops` is the number
+ * of RADOS operations issued since the previous call.
+ */
+typedef void (*rt_pace_cb)(void *arg, int ops);
+
+/**
+ * rt_relocate moves reference tracker to another pool, while it stays in
+ * use. The RT is copied into the destination pool in chunks, read from
+ * the same RT object version. The source object is then replaced by a
+ * forwarding marker, unless the RT has been modified since, in which case
+ * the copy is dropped and -ERANGE is returned. rt_add, rt_remove and
+ * rt_list_keys follow forwarding markers to the relocated RT.
+ *
+ * `src` is an I/O context of the pool where the RT RADOS object is stored.
+ * `dst` is an I/O context of the destination pool.
+ * `dst_pool` is name of the destination pool, recorded in the marker.
+ * `rt_name` is name of the reference tracker RADOS object.
+ * `chunk_size` is the maximum number of keys copied at once.
+ * `pace` is called with `pace_arg` as described at rt_pace_cb, if not
+ *        NULL.
+ * `relocated` is set to non-zero value if the RT was relocated by this
+ *             call. It's zero if the source is a forwarding marker already.
+ *
+ * Returns -EEXIST if an RT of the same name already exists in the
+ * destination pool, and -EBUSY if it's being relocated concurrently.
+ */
+int rt_relocate(rados_ioctx_t src, rados_ioctx_t dst, const char *dst_pool,
+                const char *rt_name, int chunk_size, rt_pace_cb pace,
+                void *pace_arg, int *relocated);
+
+/**
+ * rt_drop_marker removes forwarding marker `rt_name` left behind by
+ * rt_relocate, once clients use the pool it forwards to. Clients still
+ * using the pool of the marker would create the RT there anew afterwards.
+ *
+ * `dropped` is set to non-zero value if the marker was removed. It's zero,
+ * and the object is left alone, if it's not a forwarding marker.
+ */
+int rt_drop_marker(rados_ioctx_t ioctx, const char *rt_name, int *dropped);
+
+/**
+ * rt_cluster_release closes I/O contexts kept open by RT operations for
+ * connection `rados`, e.g. of pools that forwarding markers lead to. Must
+ * be called before `rados` is shut down, once no RT operations on it are
+ * in progress.
+ */
+void rt_cluster_release(rados_t rados);
+
+/**
+ * rt_load reads single object reference tracker along with the RT object
+ * version it's read at, for callers keeping it in memory, see deleg.h.
+ *
+ * `ioctx` is an I/O context of the pool where the RT RADOS object is stored.
+ * `rt_name` is name of the reference tracker RADOS object.
+ * `page_size` is the maximum number of keys read from RT OMap at once.
+ * `cb` is called for every page of keys, all read from the same RT object
+ *      version.
+ * `refcount` is set to the number of references held by the RT.
+ * `gen` is set to the RT object version the keys were read from.
+ *
+ * Returns -EOPNOTSUPP for RTs of other layouts and forwarding markers.
+ */
+int rt_load(rados_ioctx_t ioctx, const char *rt_name, int page_size,
+            rt_keys_cb cb, void *arg, uint32_t *refcount, uint64_t *gen);
+
+/**
+ * rt_store writes an update of single object reference tracker loaded by
+ * rt_load, without reading the RT first. The caller works out the update
+ * from the keys it holds.
+ *
+ * `gen` is the RT object version the caller's keys are from. The update is
+ *       written only if the RT is still at this version, otherwise -ERANGE
+ *       is returned. It's set to the version written.
+ * `refcount` is the new number of references. Zero deletes the RT.
+ * `add_keys` are keys not held by the RT, to add.
+ * `rm_keys` are keys held by the RT, to remove.
+ */
+int rt_store(rados_ioctx_t ioctx, const char *rt_name, uint64_t *gen,
+             uint32_t refcount, const char *const *add_keys,
+             const size_t *add_key_lens, int add_count,
+             const char *const *rm_keys, const size_t *rm_key_lens,
+             int rm_count);
+
+/**
+ * rt_aio is an update of single object reference tracker issued with
+ * asynchronous I/O, for event loops driving many updates from a single
+ * thread. The update takes two steps, a read and a write, and is advanced
+ * by its caller once each of them completes.
+ */
+typedef struct rt_aio rt_aio_t;
+
+/**
+ * rt_aio_cb is called on a librados thread once the current step of update
+ * `aio` has completed. It must not advance the update, only wake up the
+ * thread that does.
+ */
+typedef void (*rt_aio_cb)(rt_aio_t *aio, void *arg);
+
+/**
+ * rt_aio_start starts adding keys to the reference tracker, or with
+ * `remove` removing keys from it, see rt_add2 and rt_remove2. RTs that
+ * don't exist are created with the single object layout.
+ *
+ * `rt_name` and the keys must stay valid until the update is released.
+ * `cb` is called with `arg` once each step of the update completes.
+ * `aio` is set to the update, to be released with rt_aio_release once it's
+ *       done.
+ */
+int rt_aio_start(rados_ioctx_t ioctx, const char *rt_name, int remove,
+                 const char *const *keys, const size_t *key_lens,
+                 int keys_count, rt_aio_cb cb, void *arg, rt_aio_t **aio);
+
+/**
+ * rt_aio_advance handles the completed step of update `aio`, and issues
+ * the next one. Returns 0 if another step has been issued, and 1 once the
+ * update is done, with `ret` set to what rt_add2 or rt_remove2 would
+ * return, and `flag` to `rt_created` or `rt_deleted`.
+ *
+ * `ret` is -EOPNOTSUPP for RTs of other layouts and forwarding markers,
+ * which are to be updated with rt_add3 or rt_remove3 instead.
+ */
+int rt_aio_advance(rt_aio_t *aio, int *ret, int *flag);
+
+/**
+ * rt_aio_release frees update `aio` once it's done.
+ */
+void rt_aio_release(rt_aio_t *aio);
+
 #endif // rt_h_INCLUDED
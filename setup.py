@@ -0,0 +1,43 @@
+# Builds the reference_tracker Python extension, see
+# python/reference_tracker.c. With EMU=1 in the environment, it's built
+# against the local RADOS emulator instead of librados, like `make EMU=1`.
+
+import os
+
+from setuptools import Extension, setup
+
+sources = [
+    "python/reference_tracker.c",
+    "ctx.c",
+    "deleg.c",
+    "rt.c",
+    "mem.c",
+    "keyset.c",
+    "queue.c",
+    "hll.c",
+    "rollup.c",
+    "throttle.c",
+]
+include_dirs = ["."]
+libraries = []
+
+if os.environ.get("EMU"):
+    sources.append("emu/librados.c")
+    include_dirs.append("emu")
+else:
+    libraries.append("rados")
+
+setup(
+    name="reference-tracker",
+    version="0.1",
+    ext_modules=[
+        Extension(
+            "reference_tracker",
+            sources=sources,
+            include_dirs=include_dirs,
+            libraries=libraries,
+            define_macros=[("RT_NO_DEBUG_LOG", None)],
+            extra_compile_args=["-Wno-unused-parameter"],
+        )
+    ],
+)
@@ -0,0 +1,88 @@
+#ifndef snapshot_h_INCLUDED
+#define snapshot_h_INCLUDED
+
+#include <endian.h>
+#include <stdint.h>
+
+/*
+
+RT snapshot file layout
+=======================
+
+Snapshot files hold the contents of all RT objects of a pool, as exported by
+`reference-tracker -o export`. They are meant to be memory-mapped by
+`rt-query`, so unlike RT objects, all values are stored in little-endian
+order, and records are aligned to 8 bytes.
+
+Header:
+
+    byte idx      type         name
+    --------     ------       ------
+     0 ..  7     char[8]      magic, "RTSNAP01"
+     8 .. 15     uint64_t     records_count
+    16 .. 23     uint64_t     index_offset
+    24 .. 31     uint64_t     reserved
+
+Records follow the header, one per RT object:
+
+     0 ..  3     uint32_t     name_len
+     4 ..  7     uint32_t     refcount
+     8 .. 11     uint32_t     keys_count
+    12 .. 15     uint32_t     reserved
+    16 ..        char[]       name
+                 ...          keys_count times: uint32_t key_len, char[] key
+
+Index is at `index_offset` and holds `records_count` uint64_t offsets of
+the records, in the order they were written.
+
+Side index
+==========
+
+`rt-query -q index` builds a side index of a snapshot, stored next to it
+with `.idx` suffix. It maps keys to records referencing them:
+
+Header:
+
+     0 ..  7     char[8]      magic, "RTIDX001"
+     8 .. 15     uint64_t     entries_count
+    16 .. 23     uint64_t     snapshot_size
+
+Entries follow, sorted by key:
+
+     0 ..  7     uint64_t     key_offset, offset of key bytes in snapshot
+     8 .. 11     uint32_t     key_len
+    12 .. 15     uint32_t     record, index of the record in snapshot
+
+*/
+
+#define RT_SNAP_MAGIC "RTSNAP01"
+#define RT_SNAP_IDX_MAGIC "RTIDX001"
+#define RT_SNAP_ALIGN 8
+
+typedef struct rt_snap_header {
+  char magic[8];
+  uint64_t records_count;
+  uint64_t index_offset;
+  uint64_t reserved;
+} rt_snap_header_t;
+
+typedef struct rt_snap_record {
+  uint32_t name_len;
+  uint32_t refcount;
+  uint32_t keys_count;
+  uint32_t reserved;
+} rt_snap_record_t;
+
+typedef struct rt_snap_idx_header {
+  char magic[8];
+  uint64_t entries_count;
+  uint64_t snapshot_size;
+} rt_snap_idx_header_t;
+
+typedef struct rt_snap_idx_entry {
+  uint64_t key_offset;
+  uint32_t key_len;
+  uint32_t record;
+} rt_snap_idx_entry_t;
+
+#endif // snapshot_h_INCLUDED
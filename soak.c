@@ -0,0 +1,841 @@
+#include "hist.h"
+#include "recorder.h"
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+
+Scale soak benchmark
+====================
+
+rt-soak populates a pool with many small RTs and a few giant ones, then runs
+a mixed workload against them for a given duration. Every interval it writes
+a CSV row with the following columns to stdout:
+
+    time_s        Seconds since start.
+    phase         populate, giant or mixed.
+    ops           Operations completed in the interval.
+    ops_per_sec   Throughput in the interval.
+    drift         Throughput relative to the first full mixed interval.
+    errors        Failed operations.
+    conflicts     Retries after the RT changed underneath (-ERANGE, -EEXIST,
+                  -ENOENT, -EOVERFLOW).
+    p50_us .. max_us
+                  Latency percentiles of all operations in the interval.
+    OP_ops, OP_p99_us
+                  Operations and their p99 latency, for each operation type.
+    rss_kb, rss_peak_kb
+                  Resident and peak resident memory of this process.
+    heap_kb       Heap in use, as reported by mallinfo2.
+    allocs, frees Calls to malloc/calloc/realloc(NULL) and free in the
+                  interval.
+    emu_rss_kb    Resident memory of process -e PID, e.g. rt-emu.
+
+Operation types:
+
+    add           Add a new key to a random RT.
+    rem           Remove an initial key from a random RT.
+    list          List all keys of a random RT.
+    cold          Create a new RT (all of populate phase is cold adds).
+    giant_add     Add a new key to a random giant RT.
+    giant_list    List all keys of a random giant RT.
+
+Debug log of the tracker is discarded, unless -v is given.
+
+*/
+
+// Attempts of an operation before it's counted as failed.
+#define SOAK_MAX_RETRIES 10
+// Number of keys fetched from RT OMap at once when listing.
+#define SOAK_KEYS_PAGE_SIZE 1000
+
+typedef enum soak_op {
+  SOAK_OP_ADD,
+  SOAK_OP_REM,
+  SOAK_OP_LIST,
+  SOAK_OP_COLD,
+  SOAK_OP_GIANT_ADD,
+  SOAK_OP_GIANT_LIST,
+  SOAK_OP_COUNT
+} soak_op_t;
+
+static const char *soak_op_names[SOAK_OP_COUNT] = {
+    "add", "rem", "list", "cold", "giant_add", "giant_list",
+};
+
+typedef enum soak_phase {
+  SOAK_PHASE_POPULATE,
+  SOAK_PHASE_GIANT,
+  SOAK_PHASE_MIXED,
+} soak_phase_t;
+
+static const char *soak_phase_names[] = {"populate", "giant", "mixed"};
+
+// Measurements of one interval.
+typedef struct soak_interval {
+  rt_hist_t all;
+  rt_hist_t ops[SOAK_OP_COUNT];
+  uint64_t errors;
+  uint64_t conflicts;
+} soak_interval_t;
+
+typedef struct soak_opts {
+  const char *pool_name;
+  int rts;
+  int keys_per_rt;
+  int giants;
+  int giant_keys;
+  int batch_size;
+  int threads;
+  int duration;
+  int interval;
+  int weights[SOAK_OP_COUNT];
+  int skip_populate;
+  int emu_pid;
+  // Records all operations if set.
+  rt_history_t *history;
+} soak_opts_t;
+
+typedef struct soak_worker {
+  pthread_t thread;
+  int id;
+  rados_t rados;
+  rados_ioctx_t ioctx;
+  const soak_opts_t *opts;
+  unsigned seed;
+  uint64_t next_key;
+
+  pthread_mutex_t lock;
+  soak_interval_t cur;
+} soak_worker_t;
+
+// Shared between workers and the reporter.
+static volatile int soak_stop;
+static volatile soak_phase_t soak_phase;
+static int soak_next_rt;
+
+// Counted by the malloc wrappers below.
+static uint64_t soak_allocs;
+static uint64_t soak_frees;
+
+void print_usage(const char *progname);
+int parse_positive_int(const char *name, const char *val);
+int parse_mix(const char *mix, int *weights);
+
+/*
+ * Allocation counting. glibc allows replacing malloc, the replacements count
+ * calls and forward them to the glibc implementation.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+void *malloc(size_t size) {
+  __atomic_add_fetch(&soak_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_add_fetch(&soak_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  if (!p) {
+    __atomic_add_fetch(&soak_allocs, 1, __ATOMIC_RELAXED);
+  }
+  return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+  if (p) {
+    __atomic_add_fetch(&soak_frees, 1, __ATOMIC_RELAXED);
+  }
+  __libc_free(p);
+}
+
+/*
+ * Measurements.
+ */
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void record(soak_worker_t *w, soak_op_t op, uint64_t start_us,
+                   int ret, int conflicts) {
+  uint64_t lat = now_us() - start_us;
+
+  pthread_mutex_lock(&w->lock);
+  rt_hist_add(&w->cur.all, lat);
+  rt_hist_add(&w->cur.ops[op], lat);
+  w->cur.conflicts += conflicts;
+  if (ret < 0) {
+    w->cur.errors++;
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+// Returns value of field `name` in kB from /proc/PID/status.
+static long proc_status_kb(int pid, const char *name) {
+  char path[64], line[256];
+  long kb = 0;
+
+  if (pid > 0) {
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  } else {
+    snprintf(path, sizeof(path), "/proc/self/status");
+  }
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+
+  size_t name_len = strlen(name);
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      kb = strtol(line + name_len + 1, NULL, 10);
+      break;
+    }
+  }
+
+  fclose(f);
+  return kb;
+}
+
+/*
+ * Operations.
+ */
+
+// rt_keys_cb counting listed keys.
+static int count_keys(const char *const *keys, const size_t *key_lens,
+                      int keys_count, void *arg) {
+  *(uint64_t *)arg += keys_count;
+  return 0;
+}
+
+// Runs rt_add or rt_remove, retrying when another writer got in between.
+static int update(soak_worker_t *w, soak_op_t op, int remove,
+                  const char *rt_name, const char *const *keys,
+                  int keys_count) {
+  const soak_opts_t *opts = w->opts;
+  uint64_t start = now_us();
+  int ret, flag, conflicts = 0;
+
+  for (int attempt = 0; attempt < SOAK_MAX_RETRIES; attempt++) {
+    if (remove) {
+      ret = rt_recorder_remove(opts->history, w->id, w->rados,
+                               opts->pool_name, rt_name, keys, keys_count,
+                               &flag);
+    } else {
+      ret = rt_recorder_add(opts->history, w->id, w->rados, opts->pool_name,
+                            rt_name, keys, keys_count, &flag);
+    }
+
+    // The RT changed between reading and writing it: -EEXIST is a
+    // concurrent creation, -ENOENT and -EOVERFLOW a concurrent deletion.
+    if (ret != -ERANGE && ret != -EEXIST && ret != -ENOENT &&
+        ret != -EOVERFLOW) {
+      break;
+    }
+    conflicts++;
+  }
+
+  record(w, op, start, ret, conflicts);
+  return ret;
+}
+
+static int list(soak_worker_t *w, soak_op_t op, const char *rt_name) {
+  uint64_t start = now_us();
+  uint64_t keys;
+  uint32_t refcount;
+  int ret, conflicts = 0;
+
+  for (int attempt = 0; attempt < SOAK_MAX_RETRIES; attempt++) {
+    keys = 0;
+    ret = rt_recorder_list_keys(w->opts->history, w->id, w->ioctx, rt_name,
+                                SOAK_KEYS_PAGE_SIZE, count_keys, &keys,
+                                &refcount);
+    if (ret != -ERANGE) {
+      break;
+    }
+    conflicts++;
+  }
+
+  if (ret == -ENOENT) {
+    // Deleted by removals, not an error.
+    ret = 0;
+  }
+
+  record(w, op, start, ret, conflicts);
+  return ret;
+}
+
+static void rt_name(char *buf, size_t len, int idx) {
+  snprintf(buf, len, "soak-rt-%d", idx);
+}
+
+static void giant_name(char *buf, size_t len, int idx) {
+  snprintf(buf, len, "soak-giant-%d", idx);
+}
+
+// Initial key `idx` of an RT.
+static void initial_key(char *buf, size_t len, int idx) {
+  snprintf(buf, len, "csi-snap-%08d", idx);
+}
+
+/*
+ * Phases.
+ */
+
+static void *populate(void *arg) {
+  soak_worker_t *w = arg;
+  const soak_opts_t *opts = w->opts;
+  int k = opts->keys_per_rt;
+
+  char **keys = malloc(sizeof(char *) * k);
+  for (int i = 0; i < k; i++) {
+    keys[i] = malloc(32);
+    initial_key(keys[i], 32, i);
+  }
+
+  char name[64];
+  while (!soak_stop) {
+    int idx = __atomic_fetch_add(&soak_next_rt, 1, __ATOMIC_RELAXED);
+    if (idx >= opts->rts) {
+      break;
+    }
+
+    rt_name(name, sizeof(name), idx);
+    update(w, SOAK_OP_COLD, 0, name, (const char *const *)keys, k);
+  }
+
+  for (int i = 0; i < k; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+
+  return NULL;
+}
+
+static void *populate_giants(void *arg) {
+  soak_worker_t *w = arg;
+  const soak_opts_t *opts = w->opts;
+  int b = opts->batch_size;
+
+  char **keys = malloc(sizeof(char *) * b);
+  for (int i = 0; i < b; i++) {
+    keys[i] = malloc(48);
+  }
+
+  // Giant RTs are spread over workers, each filled by a single one.
+
+  char name[64];
+  for (int g = w->id; g < opts->giants && !soak_stop; g += opts->threads) {
+    giant_name(name, sizeof(name), g);
+
+    for (int i = 0; i < opts->giant_keys && !soak_stop; i += b) {
+      int n = opts->giant_keys - i < b ? opts->giant_keys - i : b;
+      for (int j = 0; j < n; j++) {
+        snprintf(keys[j], 48, "csi-vol-%08x-%08d", g, i + j);
+      }
+      update(w, SOAK_OP_GIANT_ADD, 0, name, (const char *const *)keys, n);
+    }
+  }
+
+  for (int i = 0; i < b; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+
+  return NULL;
+}
+
+static soak_op_t pick_op(soak_worker_t *w) {
+  const int *weights = w->opts->weights;
+  int total = 0;
+  for (int i = 0; i < SOAK_OP_COUNT; i++) {
+    total += weights[i];
+  }
+
+  int r = rand_r(&w->seed) % total;
+  for (int i = 0; i < SOAK_OP_COUNT; i++) {
+    if (r < weights[i]) {
+      return i;
+    }
+    r -= weights[i];
+  }
+
+  return SOAK_OP_ADD;
+}
+
+static void *mixed(void *arg) {
+  soak_worker_t *w = arg;
+  const soak_opts_t *opts = w->opts;
+  char name[64], key[64];
+  const char *keys[1] = {key};
+
+  while (!soak_stop) {
+    soak_op_t op = pick_op(w);
+
+    // Ops on giant RTs fall back to small ones if there are none.
+    if (opts->giants == 0 && op == SOAK_OP_GIANT_ADD) {
+      op = SOAK_OP_ADD;
+    } else if (opts->giants == 0 && op == SOAK_OP_GIANT_LIST) {
+      op = SOAK_OP_LIST;
+    }
+
+    switch (op) {
+    case SOAK_OP_ADD:
+      rt_name(name, sizeof(name), rand_r(&w->seed) % opts->rts);
+      snprintf(key, sizeof(key), "csi-snap-w%d-%lu", w->id,
+               (unsigned long)w->next_key++);
+      update(w, op, 0, name, keys, 1);
+      break;
+    case SOAK_OP_REM:
+      rt_name(name, sizeof(name), rand_r(&w->seed) % opts->rts);
+      initial_key(key, sizeof(key), rand_r(&w->seed) % opts->keys_per_rt);
+      update(w, op, 1, name, keys, 1);
+      break;
+    case SOAK_OP_LIST:
+      rt_name(name, sizeof(name), rand_r(&w->seed) % opts->rts);
+      list(w, op, name);
+      break;
+    case SOAK_OP_COLD:
+      snprintf(name, sizeof(name), "soak-cold-%d-%lu", w->id,
+               (unsigned long)w->next_key++);
+      initial_key(key, sizeof(key), 0);
+      update(w, op, 0, name, keys, 1);
+      break;
+    case SOAK_OP_GIANT_ADD:
+      giant_name(name, sizeof(name), rand_r(&w->seed) % opts->giants);
+      snprintf(key, sizeof(key), "csi-vol-w%d-%lu", w->id,
+               (unsigned long)w->next_key++);
+      update(w, op, 0, name, keys, 1);
+      break;
+    case SOAK_OP_GIANT_LIST:
+      giant_name(name, sizeof(name), rand_r(&w->seed) % opts->giants);
+      list(w, op, name);
+      break;
+    default:
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void run_phase(soak_worker_t *workers, int threads, soak_phase_t phase,
+                      void *(*fn)(void *)) {
+  soak_phase = phase;
+
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&workers[i].thread, NULL, fn, &workers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+}
+
+/*
+ * Reporting.
+ */
+
+typedef struct soak_reporter {
+  pthread_t thread;
+  soak_worker_t *workers;
+  const soak_opts_t *opts;
+  FILE *out;
+  uint64_t start_us;
+  volatile int done;
+
+  // Throughput of the first full mixed interval, for drift.
+  double base_rate;
+  int mixed_intervals;
+
+  uint64_t total_ops;
+  double first_rate;
+  double last_rate;
+} soak_reporter_t;
+
+static void report(soak_reporter_t *r, uint64_t interval_us) {
+  const soak_opts_t *opts = r->opts;
+  soak_interval_t *sum = calloc(1, sizeof(soak_interval_t));
+  soak_interval_t *cur = malloc(sizeof(soak_interval_t));
+
+  for (int i = 0; i < opts->threads; i++) {
+    soak_worker_t *w = &r->workers[i];
+
+    pthread_mutex_lock(&w->lock);
+    memcpy(cur, &w->cur, sizeof(*cur));
+    memset(&w->cur, 0, sizeof(w->cur));
+    pthread_mutex_unlock(&w->lock);
+
+    rt_hist_merge(&sum->all, &cur->all);
+    for (int op = 0; op < SOAK_OP_COUNT; op++) {
+      rt_hist_merge(&sum->ops[op], &cur->ops[op]);
+    }
+    sum->errors += cur->errors;
+    sum->conflicts += cur->conflicts;
+  }
+
+  uint64_t allocs = __atomic_exchange_n(&soak_allocs, 0, __ATOMIC_RELAXED);
+  uint64_t frees = __atomic_exchange_n(&soak_frees, 0, __ATOMIC_RELAXED);
+
+  double rate = interval_us ? sum->all.count * 1e6 / interval_us : 0;
+  soak_phase_t phase = soak_phase;
+
+  // The first mixed interval may have started in the middle of the
+  // previous phase, drift is relative to the second one.
+  if (phase == SOAK_PHASE_MIXED && ++r->mixed_intervals == 2) {
+    r->base_rate = rate;
+  }
+
+  struct mallinfo2 mi = mallinfo2();
+
+  fprintf(r->out, "%.1f,%s,%lu,%.1f,%.3f,%lu,%lu,%lu,%lu,%lu,%lu,%lu",
+          (now_us() - r->start_us) / 1e6, soak_phase_names[phase],
+          (unsigned long)sum->all.count, rate,
+          r->base_rate > 0 ? rate / r->base_rate : 0,
+          (unsigned long)sum->errors, (unsigned long)sum->conflicts,
+          (unsigned long)rt_hist_percentile(&sum->all, 0.5),
+          (unsigned long)rt_hist_percentile(&sum->all, 0.9),
+          (unsigned long)rt_hist_percentile(&sum->all, 0.99),
+          (unsigned long)rt_hist_percentile(&sum->all, 0.999),
+          (unsigned long)sum->all.max);
+  for (int op = 0; op < SOAK_OP_COUNT; op++) {
+    fprintf(r->out, ",%lu,%lu", (unsigned long)sum->ops[op].count,
+            (unsigned long)rt_hist_percentile(&sum->ops[op], 0.99));
+  }
+  fprintf(r->out, ",%ld,%ld,%lu,%lu,%lu,%ld\n", proc_status_kb(0, "VmRSS"),
+          proc_status_kb(0, "VmHWM"),
+          (unsigned long)((mi.uordblks + mi.hblkhd) / 1024),
+          (unsigned long)allocs, (unsigned long)frees,
+          opts->emu_pid ? proc_status_kb(opts->emu_pid, "VmRSS") : 0L);
+  fflush(r->out);
+
+  if (phase == SOAK_PHASE_MIXED) {
+    r->total_ops += sum->all.count;
+    if (r->mixed_intervals == 2) {
+      r->first_rate = rate;
+    }
+    r->last_rate = rate;
+  }
+
+  free(sum);
+  free(cur);
+}
+
+static void *reporter_run(void *arg) {
+  soak_reporter_t *r = arg;
+  uint64_t last = now_us();
+
+  while (!r->done) {
+    // Sleep in small steps to notice the end promptly.
+    while (!r->done && now_us() - last < r->opts->interval * 1000000ULL) {
+      usleep(50000);
+    }
+
+    uint64_t now = now_us();
+    report(r, now - last);
+    last = now;
+  }
+
+  return NULL;
+}
+
+static void on_signal(int sig) { soak_stop = 1; }
+
+int main(int argc, char *argv[]) {
+  char *client_id = NULL;
+  char *ceph_conf = NULL;
+  char *history_path = NULL;
+  int verbose = 0;
+  int ret = 0;
+  int opt;
+
+  soak_opts_t opts = {
+      .rts = 100000,
+      .keys_per_rt = 4,
+      .giants = 1,
+      .giant_keys = 1000000,
+      .batch_size = 1000,
+      .threads = 8,
+      .duration = 600,
+      .interval = 10,
+      .weights = {40, 30, 20, 5, 4, 1},
+  };
+
+  while ((opt = getopt(argc, argv, "i:p:c:n:k:g:G:b:j:d:I:m:e:H:svh")) !=
+         -1) {
+    switch (opt) {
+    case 'i':
+      client_id = optarg;
+      break;
+    case 'p':
+      opts.pool_name = optarg;
+      break;
+    case 'c':
+      ceph_conf = optarg;
+      break;
+    case 'n':
+      opts.rts = parse_positive_int("-n", optarg);
+      break;
+    case 'k':
+      opts.keys_per_rt = parse_positive_int("-k", optarg);
+      break;
+    case 'g':
+      opts.giants = strcmp(optarg, "0") == 0
+                        ? 0
+                        : parse_positive_int("-g", optarg);
+      break;
+    case 'G':
+      opts.giant_keys = parse_positive_int("-G", optarg);
+      break;
+    case 'b':
+      opts.batch_size = parse_positive_int("-b", optarg);
+      break;
+    case 'j':
+      opts.threads = parse_positive_int("-j", optarg);
+      break;
+    case 'd':
+      opts.duration = parse_positive_int("-d", optarg);
+      break;
+    case 'I':
+      opts.interval = parse_positive_int("-I", optarg);
+      break;
+    case 'm':
+      if (parse_mix(optarg, opts.weights) < 0) {
+        return 1;
+      }
+      break;
+    case 'e':
+      opts.emu_pid = parse_positive_int("-e", optarg);
+      break;
+    case 'H':
+      history_path = optarg;
+      break;
+    case 's':
+      opts.skip_populate = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'h':
+    default:
+      print_usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (!client_id || !ceph_conf || !opts.pool_name) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // CSV goes to the original stdout, the tracker's debug log to /dev/null.
+
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!verbose) {
+    freopen("/dev/null", "w", stdout);
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  rt_history_t history;
+  if (history_path) {
+    if ((ret = rt_history_open(&history, history_path)) < 0) {
+      fprintf(stderr, "Failed to create history file %s: %d\n", history_path,
+              ret);
+      return 1;
+    }
+    opts.history = &history;
+
+    if (opts.skip_populate) {
+      fprintf(stderr, "Warning: with -s, the history doesn't start from "
+                      "empty RTs and won't check as linearizable.\n");
+    }
+  }
+
+  rados_t rados;
+  rados_create(&rados, client_id);
+  if ((ret = rados_conf_read_file(rados, ceph_conf)) < 0 ||
+      (ret = rados_connect(rados)) < 0) {
+    fprintf(stderr, "Failed to connect to RADOS cluster: %d\n", ret);
+    return 1;
+  }
+
+  soak_worker_t *workers = calloc(opts.threads, sizeof(soak_worker_t));
+  for (int i = 0; i < opts.threads; i++) {
+    soak_worker_t *w = &workers[i];
+    w->id = i;
+    w->rados = rados;
+    w->opts = &opts;
+    w->seed = time(NULL) ^ (i * 2654435761u);
+    pthread_mutex_init(&w->lock, NULL);
+
+    // Each worker needs its own ioctx for rt_list_keys.
+    if ((ret = rados_ioctx_create(rados, opts.pool_name, &w->ioctx)) < 0) {
+      fprintf(stderr, "Failed to create ioctx: %d\n", ret);
+      return 1;
+    }
+  }
+
+  fprintf(out, "time_s,phase,ops,ops_per_sec,drift,errors,conflicts,p50_us,"
+               "p90_us,p99_us,p999_us,max_us");
+  for (int op = 0; op < SOAK_OP_COUNT; op++) {
+    fprintf(out, ",%s_ops,%s_p99_us", soak_op_names[op], soak_op_names[op]);
+  }
+  fprintf(out, ",rss_kb,rss_peak_kb,heap_kb,allocs,frees,emu_rss_kb\n");
+
+  soak_reporter_t reporter = {
+      .workers = workers,
+      .opts = &opts,
+      .out = out,
+      .start_us = now_us(),
+  };
+  pthread_create(&reporter.thread, NULL, reporter_run, &reporter);
+
+  if (!opts.skip_populate) {
+    run_phase(workers, opts.threads, SOAK_PHASE_POPULATE, populate);
+    run_phase(workers, opts.threads, SOAK_PHASE_GIANT, populate_giants);
+  }
+
+  if (!soak_stop) {
+    // Mixed workload runs until the duration elapses or it's interrupted.
+    soak_phase = SOAK_PHASE_MIXED;
+    for (int i = 0; i < opts.threads; i++) {
+      pthread_create(&workers[i].thread, NULL, mixed, &workers[i]);
+    }
+
+    uint64_t end = now_us() + opts.duration * 1000000ULL;
+    while (!soak_stop && now_us() < end) {
+      usleep(100000);
+    }
+    soak_stop = 1;
+
+    for (int i = 0; i < opts.threads; i++) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+
+  reporter.done = 1;
+  pthread_join(reporter.thread, NULL);
+
+  fprintf(stderr,
+          "mixed: ops=%lu first_ops_per_sec=%.1f last_ops_per_sec=%.1f "
+          "rss_peak_kb=%ld\n",
+          (unsigned long)reporter.total_ops, reporter.first_rate,
+          reporter.last_rate, proc_status_kb(0, "VmHWM"));
+
+  for (int i = 0; i < opts.threads; i++) {
+    rados_ioctx_destroy(workers[i].ioctx);
+    pthread_mutex_destroy(&workers[i].lock);
+  }
+  free(workers);
+
+  rt_cluster_release(rados);
+  rados_shutdown(rados);
+  fclose(out);
+
+  if (opts.history && (ret = rt_history_close(opts.history)) < 0) {
+    fprintf(stderr, "Failed to write history file %s: %d\n", history_path,
+            ret);
+    return 1;
+  }
+
+  return 0;
+}
+
+int parse_positive_int(const char *name, const char *val) {
+  char *end;
+  long n = strtol(val, &end, 10);
+  if (*end != '\0' || n <= 0) {
+    fprintf(stderr, "%s must be a positive integer\n", name);
+    exit(1);
+  }
+
+  return (int)n;
+}
+
+// Parses op mix of the form `add=40,rem=30,...`. Ops not listed get zero
+// weight.
+int parse_mix(const char *mix, int *weights) {
+  int total = 0;
+  char *str = strdup(mix);
+  char *save = NULL;
+
+  memset(weights, 0, sizeof(int) * SOAK_OP_COUNT);
+
+  for (char *tok = strtok_r(str, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+    char *eq = strchr(tok, '=');
+    int op = -1;
+
+    if (eq) {
+      *eq = '\0';
+      for (int i = 0; i < SOAK_OP_COUNT; i++) {
+        if (strcmp(tok, soak_op_names[i]) == 0) {
+          op = i;
+        }
+      }
+    }
+
+    if (op < 0 || atoi(eq + 1) < 0) {
+      fprintf(stderr, "Invalid op mix entry in -m: %s\n", tok);
+      free(str);
+      return -EINVAL;
+    }
+
+    weights[op] = atoi(eq + 1);
+    total += weights[op];
+  }
+
+  free(str);
+
+  if (total <= 0) {
+    fprintf(stderr, "Op mix in -m must have a positive total weight\n");
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+void print_usage(const char *progname) {
+  printf("Usage: %s -i CLIENT ID -p POOL NAME -c CEPH CONFIG FILE [-n RTS] "
+         "[-k KEYS] [-g GIANTS] [-G GIANT KEYS] [-b BATCH SIZE] [-j THREADS] "
+         "[-d SECONDS] [-I SECONDS] [-m MIX] [-e PID] [-H HISTORY FILE] [-s] "
+         "[-v] [-h]\n",
+         progname);
+  printf("Scale soak benchmark, writes a CSV time series to stdout.\n");
+  printf("  -n RTS\t\tNumber of RTs to populate. Defaults to 100000.\n");
+  printf("  -k KEYS\t\tNumber of keys of each populated RT. Defaults to 4.\n");
+  printf("  -g GIANTS\t\tNumber of giant RTs to populate. Defaults to 1.\n");
+  printf("  -G GIANT KEYS\t\tNumber of keys of each giant RT. Defaults to "
+         "1000000.\n");
+  printf("  -b BATCH SIZE\t\tKeys added at once when populating giant RTs. "
+         "Defaults to 1000.\n");
+  printf("  -j THREADS\t\tNumber of worker threads. Defaults to 8.\n");
+  printf("  -d SECONDS\t\tDuration of the mixed workload. Defaults to 600.\n");
+  printf("  -I SECONDS\t\tReporting interval. Defaults to 10.\n");
+  printf("  -m MIX\t\tOp weights of the mixed workload. Defaults to "
+         "add=40,rem=30,list=20,cold=5,giant_add=4,giant_list=1.\n");
+  printf("  -e PID\t\tAlso report resident memory of process PID.\n");
+  printf("  -H HISTORY FILE\tRecord all operations for rt-histcheck.\n");
+  printf("  -s\t\t\tSkip populating, reuse RTs of a previous run.\n");
+  printf("  -v\t\t\tKeep the tracker's debug log on stdout.\n");
+  printf("  -h\t\t\tThis help message.\n");
+}
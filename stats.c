@@ -0,0 +1,363 @@
+#include "stats.h"
+#include "hll.h"
+#include "rt.h"
+#include "throttle.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of objects fetched from pool listing at once.
+#define STATS_LIST_PAGE_SIZE 1024
+// Number of keys fetched from RT OMap at once.
+#define STATS_KEYS_PAGE_SIZE 1024
+// z-score of the 95% confidence level.
+#define STATS_Z95 1.96
+// How many times listing of an RT is retried when it changes underneath.
+#define STATS_MAX_RETRIES 5
+
+// Totals of a single slice.
+typedef struct stats_slice {
+  double objects;
+  double rts;
+  double refs;
+  double omap_keys;
+} stats_slice_t;
+
+typedef struct stats {
+  rados_t rados;
+  const char *pool_name;
+  rados_ioctx_t ioctx;
+  const rt_stats_opts_t *opts;
+  rt_throttle_t throttle;
+  rt_window_t *window;
+
+  // Indices of the slices to scan, and the next one to pick up.
+  int *sampled;
+  int samples;
+  int next;
+
+  // Results, indexed the same way as `sampled`.
+  stats_slice_t *results;
+
+  pthread_mutex_t lock;
+  rt_hll_t hll;
+  unsigned long errors;
+} stats_t;
+
+// Scanner thread state.
+typedef struct stats_scanner {
+  stats_t *st;
+  pthread_t thread;
+
+  // Not shared, see rt_list_keys.
+  rados_ioctx_t ioctx;
+
+  rt_hll_t hll;
+  unsigned long keys;
+} stats_scanner_t;
+
+void *stats_scan(void *arg);
+rt_estimate_t stats_extrapolate(const stats_t *st, size_t field);
+
+void rt_stats_opts_init(rt_stats_opts_t *opts) {
+  opts->slices = 1024;
+  opts->samples = 0;
+  opts->threads = RT_WINDOW_THREADS;
+  opts->max_ops_per_sec = 0;
+}
+
+int rt_stats_run(rados_t rados, const char *pool_name,
+                 const rt_stats_opts_t *opts, rt_pool_stats_t *stats) {
+  int ret = 0;
+
+  stats_t st = {.rados = rados, .pool_name = pool_name, .opts = opts};
+  memset(stats, 0, sizeof(*stats));
+
+  if ((ret = rados_ioctx_create(rados, pool_name, &st.ioctx)) < 0) {
+    return ret;
+  }
+
+  int samples = opts->samples;
+  if (samples <= 0 || samples > opts->slices) {
+    samples = opts->slices;
+  }
+  st.samples = samples;
+
+  // Pick `samples` distinct slices at random, partial Fisher-Yates shuffle.
+
+  st.sampled = malloc(sizeof(int) * opts->slices);
+  for (int i = 0; i < opts->slices; i++) {
+    st.sampled[i] = i;
+  }
+
+  {
+    unsigned seed = time(NULL) ^ getpid();
+    for (int i = 0; i < samples; i++) {
+      int j = i + rand_r(&seed) % (opts->slices - i);
+      int tmp = st.sampled[i];
+      st.sampled[i] = st.sampled[j];
+      st.sampled[j] = tmp;
+    }
+  }
+
+  st.results = calloc(samples, sizeof(stats_slice_t));
+  rt_hll_init(&st.hll);
+  rt_throttle_init(&st.throttle, opts->max_ops_per_sec);
+  st.window = rt_window_get(rados, pool_name);
+  pthread_mutex_init(&st.lock, NULL);
+
+  // Scan the sampled slices.
+
+  {
+    stats->slices = opts->slices;
+    stats->slices_scanned = samples;
+
+    int threads = opts->threads < samples ? opts->threads : samples;
+    stats_scanner_t *scanners = calloc(threads, sizeof(stats_scanner_t));
+
+    for (int i = 0; i < threads; i++) {
+      scanners[i].st = &st;
+      pthread_create(&scanners[i].thread, NULL, stats_scan, &scanners[i]);
+    }
+
+    for (int i = 0; i < threads; i++) {
+      pthread_join(scanners[i].thread, NULL);
+      rt_hll_merge(&st.hll, &scanners[i].hll);
+    }
+
+    free(scanners);
+  }
+
+  // Extrapolate.
+
+  stats->objects = stats_extrapolate(&st, offsetof(stats_slice_t, objects));
+  stats->rts = stats_extrapolate(&st, offsetof(stats_slice_t, rts));
+  stats->refs = stats_extrapolate(&st, offsetof(stats_slice_t, refs));
+  stats->omap_keys =
+      stats_extrapolate(&st, offsetof(stats_slice_t, omap_keys));
+
+  // Distinct counts don't scale with the sample, keys of the sampled slices
+  // recur in the rest of the pool. Only the sample is counted.
+  stats->distinct_keys = rt_hll_estimate(&st.hll);
+
+  rt_window_get_stats(st.window, &stats->window);
+
+  stats->errors = st.errors;
+  if (st.errors > 0) {
+    ret = -EIO;
+  }
+
+  pthread_mutex_destroy(&st.lock);
+  rt_throttle_destroy(&st.throttle);
+  free(st.results);
+  free(st.sampled);
+  rados_ioctx_destroy(st.ioctx);
+
+  return ret;
+}
+
+int rt_stats_reconcile(rados_t rados, const char *pool_name,
+                       const rt_stats_opts_t *opts, rt_pool_stats_t *stats,
+                       rt_rollup_t *correction) {
+  rados_ioctx_t ioctx;
+  rt_rollup_t rollup;
+  int ret;
+
+  *correction = (rt_rollup_t){0};
+
+  if (opts->samples > 0 && opts->samples < opts->slices) {
+    return -EINVAL;
+  }
+
+  if ((ret = rados_ioctx_create(rados, pool_name, &ioctx)) < 0) {
+    return ret;
+  }
+
+  // The census is compared with the rollup as of its start. Deltas flushed
+  // during the scan are kept on top of the correction.
+  if ((ret = rt_rollup_read(ioctx, &rollup)) < 0) {
+    goto out;
+  }
+
+  if ((ret = rt_stats_run(rados, pool_name, opts, stats)) < 0) {
+    goto out;
+  }
+
+  correction->rts = (int64_t)stats->rts.value - rollup.rts;
+  correction->refs = (int64_t)stats->refs.value - rollup.refs;
+
+  if (correction->rts != 0 || correction->refs != 0) {
+    ret = rt_rollup_apply(ioctx, 0, correction);
+  }
+
+out:
+  rados_ioctx_destroy(ioctx);
+
+  return ret;
+}
+
+rt_estimate_t stats_extrapolate(const stats_t *st, size_t field) {
+  // Simple random sampling without replacement of n out of N slices:
+  //
+  //   total = N * mean
+  //   var   = N^2 * (1 - n/N) * s^2 / n
+
+  const double N = st->opts->slices;
+  const int n = st->samples;
+
+  double sum = 0, sum_sq = 0;
+  for (int i = 0; i < n; i++) {
+    double y = *(const double *)((const char *)&st->results[i] + field);
+    sum += y;
+    sum_sq += y * y;
+  }
+
+  double mean = sum / n;
+  double s2 = n > 1 ? (sum_sq - n * mean * mean) / (n - 1) : 0;
+  if (s2 < 0) {
+    s2 = 0;
+  }
+
+  rt_estimate_t e = {
+      .value = N * mean,
+      .ci95 = STATS_Z95 * sqrt(N * N * (1 - n / N) * s2 / n),
+  };
+
+  return e;
+}
+
+// rt_keys_cb feeding the scanner's HyperLogLog sketch.
+int stats_count_keys(const char *const *keys, const size_t *key_lens,
+                     int keys_count, void *arg) {
+  stats_scanner_t *s = arg;
+
+  for (int i = 0; i < keys_count; i++) {
+    rt_hll_add(&s->hll, keys[i], key_lens[i]);
+  }
+  s->keys += keys_count;
+
+  return 0;
+}
+
+void stats_scan_slice(stats_scanner_t *s, int slice, stats_slice_t *result) {
+  stats_t *st = s->st;
+  rados_ioctx_t ioctx = s->ioctx;
+
+  rados_object_list_item items[STATS_LIST_PAGE_SIZE];
+  rados_object_list_cursor begin = rados_object_list_begin(ioctx);
+  rados_object_list_cursor end = rados_object_list_end(ioctx);
+  rados_object_list_cursor cursor, slice_end;
+
+  rados_object_list_slice(ioctx, begin, end, slice, st->opts->slices, &cursor,
+                          &slice_end);
+
+  while (rados_object_list_cursor_cmp(ioctx, cursor, slice_end) < 0) {
+    rados_object_list_cursor next = NULL;
+
+    rt_throttle_wait(&st->throttle, 1);
+
+    double started = rt_window_enter(st->window);
+    int n = rados_object_list(ioctx, cursor, slice_end, STATS_LIST_PAGE_SIZE,
+                              NULL, 0, items, &next);
+    rt_window_leave(st->window, started, RT_WINDOW_LIST, 1, n < 0 ? n : 0);
+    if (n < 0) {
+      pthread_mutex_lock(&st->lock);
+      st->errors++;
+      pthread_mutex_unlock(&st->lock);
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      char *rt_name = strndup(items[i].oid, items[i].oid_length);
+      uint32_t refcount;
+      int ret;
+
+      result->objects++;
+
+      // Listing is retried from scratch if the RT changes underneath. Only
+      // keys of the last, complete, listing are counted. Adding keys of the
+      // failed attempts to the sketch again is harmless. An RT that keeps
+      // changing is counted as an error rather than stalling the slice.
+      for (int attempt = 0; attempt < STATS_MAX_RETRIES; attempt++) {
+        rt_throttle_wait(&st->throttle, 1);
+
+        s->keys = 0;
+        double started = rt_window_enter(st->window);
+        ret = rt_list_local_keys(ioctx, rt_name, STATS_KEYS_PAGE_SIZE,
+                                 stats_count_keys, s, &refcount);
+        rt_window_leave(st->window, started, RT_WINDOW_READ,
+                        rt_list_ops(ret == 0 ? refcount : 0,
+                                    STATS_KEYS_PAGE_SIZE),
+                        ret);
+        if (ret != -ERANGE) {
+          break;
+        }
+      }
+
+      // Relocated RTs are counted in the pool they live in, not by their
+      // forwarding markers, which fail with -EXDEV.
+      if (ret == 0) {
+        result->rts++;
+        result->refs += refcount;
+        result->omap_keys += s->keys;
+      } else if (ret != -ENODATA && ret != -ENOENT && ret != -EXDEV) {
+        { // Debug log message.
+          printf("stats: Failed to read RT %s: %d.\n", rt_name, ret);
+        }
+        pthread_mutex_lock(&st->lock);
+        st->errors++;
+        pthread_mutex_unlock(&st->lock);
+      }
+
+      free(rt_name);
+    }
+
+    rados_object_list_free(n, items);
+    rados_object_list_cursor_free(ioctx, cursor);
+    cursor = next;
+  }
+
+  rados_object_list_cursor_free(ioctx, cursor);
+  rados_object_list_cursor_free(ioctx, slice_end);
+  rados_object_list_cursor_free(ioctx, begin);
+  rados_object_list_cursor_free(ioctx, end);
+}
+
+void *stats_scan(void *arg) {
+  stats_scanner_t *s = arg;
+  stats_t *st = s->st;
+
+  rt_hll_init(&s->hll);
+
+  int ret = rados_ioctx_create(st->rados, st->pool_name, &s->ioctx);
+  if (ret < 0) {
+    { // Debug log message.
+      printf("stats: Failed to create ioctx: %d.\n", ret);
+    }
+    pthread_mutex_lock(&st->lock);
+    st->errors++;
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&st->lock);
+    int i = st->next < st->samples ? st->next++ : -1;
+    pthread_mutex_unlock(&st->lock);
+
+    if (i < 0) {
+      break;
+    }
+
+    stats_scan_slice(s, st->sampled[i], &st->results[i]);
+  }
+
+  rados_ioctx_destroy(s->ioctx);
+
+  return NULL;
+}
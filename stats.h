@@ -0,0 +1,91 @@
+#ifndef stats_h_INCLUDED
+#define stats_h_INCLUDED
+
+#include "rollup.h"
+#include "throttle.h"
+#include <rados/librados.h>
+
+/**
+ * Pool statistics count RT objects, held references and tracked keys in a
+ * pool. The pool is split into equally sized hash-range slices. A census
+ * scans all of them. An approximate run scans only a random sample of the
+ * slices and extrapolates the totals, along with their 95% confidence
+ * intervals.
+ */
+
+typedef struct rt_stats_opts {
+  // Number of hash-range slices the pool is split into.
+  int slices;
+  // Number of slices to sample. Zero or `slices` means full census.
+  int samples;
+  // Number of slices scanned in parallel.
+  int threads;
+  // Maximum number of RADOS operations per second. Zero means unlimited.
+  double max_ops_per_sec;
+} rt_stats_opts_t;
+
+// Estimated total, with half-width of its 95% confidence interval.
+typedef struct rt_estimate {
+  double value;
+  double ci95;
+} rt_estimate_t;
+
+typedef struct rt_pool_stats {
+  int slices_scanned;
+  int slices;
+
+  // Objects in the pool, including non-RT ones.
+  rt_estimate_t objects;
+  // RT objects, not counting forwarding markers of relocated RTs.
+  rt_estimate_t rts;
+  // Sum of RT refcounts.
+  rt_estimate_t refs;
+  // Sum of RT OMap sizes. Matches `refs` in a consistent pool.
+  rt_estimate_t omap_keys;
+
+  // HyperLogLog estimate of distinct reference keys in the scanned slices.
+  // It covers the whole pool only if all slices were scanned, and isn't
+  // extrapolated in approximate runs.
+  double distinct_keys;
+
+  // Congestion window of the pool at the end of the run.
+  rt_window_stats_t window;
+
+  unsigned long errors;
+} rt_pool_stats_t;
+
+/**
+ * rt_stats_opts_init fills `opts` with default values for a full census.
+ */
+void rt_stats_opts_init(rt_stats_opts_t *opts);
+
+/**
+ * rt_stats_run collects statistics of RT objects in a pool.
+ *
+ * `rados` is a handle to a Ceph cluster.
+ * `pool_name` is name of the pool where the RT RADOS objects are stored.
+ * `opts` are sampling options.
+ * `stats` is filled with the collected statistics.
+ */
+int rt_stats_run(rados_t rados, const char *pool_name,
+                 const rt_stats_opts_t *opts, rt_pool_stats_t *stats);
+
+/**
+ * rt_stats_reconcile corrects the rollup of a pool, see rollup.h, against
+ * a full census. The rollup is read before the census, and the correction
+ * is the difference between the two. Only a pool without writers feeding
+ * the rollup, with their deltas flushed, is reconciled exactly. Otherwise
+ * updates during the scan, and deltas not yet flushed when it starts, may
+ * be counted both by the census and by the rollup, so the correction is
+ * only as exact as the number of such updates.
+ *
+ * `opts` must not sample. `stats` is filled with the census.
+ * `correction` is set to the delta applied to the rollup.
+ *
+ * The rollup isn't touched if the census had errors.
+ */
+int rt_stats_reconcile(rados_t rados, const char *pool_name,
+                       const rt_stats_opts_t *opts, rt_pool_stats_t *stats,
+                       rt_rollup_t *correction);
+
+#endif // stats_h_INCLUDED
@@ -0,0 +1,75 @@
+// Checks that rt_gc_exec_oracle doesn't deadlock with a command answering
+// as it reads, when the batch is larger than the pipe buffer.
+
+#include "../gc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define KEYS_COUNT 200000
+
+static int check(const char *cmd, const char *const *keys, int expect_odd) {
+  int *dead = calloc(KEYS_COUNT, sizeof(int));
+  int ret = rt_gc_exec_oracle(keys, KEYS_COUNT, dead, (void *)cmd);
+  if (ret < 0) {
+    fprintf(stderr, "%s: oracle failed: %d\n", cmd, ret);
+    free(dead);
+    return 1;
+  }
+
+  int failed = 0;
+  for (int i = 0; i < KEYS_COUNT; i++) {
+    int want = expect_odd ? i % 2 : 1;
+    if (dead[i] != want) {
+      fprintf(stderr, "%s: key %s dead=%d, expected %d\n", cmd, keys[i],
+              dead[i], want);
+      failed = 1;
+      break;
+    }
+  }
+
+  free(dead);
+  return failed;
+}
+
+int main(void) {
+  char live_path[] = "/tmp/rt-gc-oracle-XXXXXX";
+  int fd = mkstemp(live_path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  FILE *live = fdopen(fd, "w");
+
+  char **keys = malloc(sizeof(char *) * KEYS_COUNT);
+  for (int i = 0; i < KEYS_COUNT; i++) {
+    keys[i] = malloc(32);
+    snprintf(keys[i], 32, "gc-oracle-key-%08d", i);
+    if (i % 2 == 0) {
+      fprintf(live, "%s\n", keys[i]);
+    }
+  }
+  fclose(live);
+
+  // A deadlock shows up as the test timing out.
+  alarm(60);
+
+  char grep_cmd[128];
+  snprintf(grep_cmd, sizeof(grep_cmd), "grep -vxF -f %s", live_path);
+
+  int failed = check("cat", (const char *const *)keys, 0);
+  failed |= check(grep_cmd, (const char *const *)keys, 1);
+
+  unlink(live_path);
+  for (int i = 0; i < KEYS_COUNT; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+
+  if (!failed) {
+    printf("gc_oracle: OK\n");
+  }
+
+  return failed;
+}
@@ -0,0 +1,276 @@
+#include "throttle.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Initial and maximum size of a window.
+#define WINDOW_INITIAL 4
+#define WINDOW_MAX 256
+// Latency over WINDOW_INFLATION times the baseline, plus WINDOW_SLACK
+// seconds for the jitter of fast operations, cuts the window.
+#define WINDOW_INFLATION 2.0
+#define WINDOW_SLACK 0.001
+// Seconds after which the baseline is replaced by the minimum latency seen
+// since, so that it follows lasting changes of the cluster.
+#define WINDOW_BASE_PERIOD 10.0
+// Maximum number of windows of a process. Pools past it, or whose ID can't
+// be looked up, share the fallback window, which doesn't grow past its
+// initial size.
+#define WINDOW_MAX_POOLS 64
+#define WINDOW_FALLBACK_POOL "(shared)"
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void rt_throttle_init(rt_throttle_t *t, double ops_per_sec) {
+  pthread_mutex_init(&t->lock, NULL);
+
+  t->rate = ops_per_sec;
+  // Allow bursts of up to 1/10th of a second worth of operations.
+  t->burst = ops_per_sec > 10 ? ops_per_sec / 10 : 1;
+  t->tokens = t->burst;
+  t->last = now_sec();
+}
+
+void rt_throttle_destroy(rt_throttle_t *t) { pthread_mutex_destroy(&t->lock); }
+
+void rt_throttle_wait(rt_throttle_t *t, int n) {
+  if (t->rate <= 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&t->lock);
+
+  // Refill the bucket and take the tokens right away. If there's not enough
+  // of them, the debt is paid by sleeping outside of the lock.
+
+  double now = now_sec();
+  t->tokens += (now - t->last) * t->rate;
+  if (t->tokens > t->burst) {
+    t->tokens = t->burst;
+  }
+  t->last = now;
+  t->tokens -= n;
+
+  double wait = t->tokens < 0 ? -t->tokens / t->rate : 0;
+
+  pthread_mutex_unlock(&t->lock);
+
+  if (wait > 0) {
+    struct timespec ts = {.tv_sec = (time_t)wait,
+                          .tv_nsec = (long)((wait - (time_t)wait) * 1e9)};
+    nanosleep(&ts, NULL);
+  }
+}
+
+// Latency baseline of a class of operations.
+typedef struct window_base {
+  // Minimum latency of the current and of the next period, zero if none.
+  double base;
+  double next_base;
+  double period_start;
+} window_base_t;
+
+struct rt_window {
+  rados_t rados;
+  int64_t pool_id;
+  char *pool_name;
+
+  pthread_mutex_t lock;
+  pthread_cond_t room;
+
+  // Fractional, so that it grows by 1/size per completion, up to
+  // `max_size`.
+  double size;
+  double max_size;
+  int in_flight;
+  // Time of the last cut.
+  double last_cut;
+  unsigned long cuts;
+
+  window_base_t bases[RT_WINDOW_OPS];
+};
+
+static struct {
+  pthread_mutex_t lock;
+  rt_window_t *windows[WINDOW_MAX_POOLS];
+  int count;
+} windows = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static rt_window_t fallback = {
+    .pool_id = -1,
+    .pool_name = WINDOW_FALLBACK_POOL,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .room = PTHREAD_COND_INITIALIZER,
+    .size = WINDOW_INITIAL,
+    .max_size = WINDOW_INITIAL,
+};
+
+// Returns the window of pool `pool_name`, or of pool `pool_id` if not
+// negative, on connection `rados`. Called with windows.lock held.
+static rt_window_t *find_window(rados_t rados, const char *pool_name,
+                                int64_t pool_id) {
+  for (int i = 0; i < windows.count; i++) {
+    rt_window_t *w = windows.windows[i];
+    if (w->rados == rados &&
+        (pool_id < 0 ? strcmp(w->pool_name, pool_name) == 0
+                     : w->pool_id == pool_id)) {
+      return w;
+    }
+  }
+
+  return NULL;
+}
+
+rt_window_t *rt_window_get(rados_t rados, const char *pool_name) {
+  pthread_mutex_lock(&windows.lock);
+  rt_window_t *w = find_window(rados, pool_name, -1);
+  pthread_mutex_unlock(&windows.lock);
+
+  if (w) {
+    return w;
+  }
+
+  // Windows are keyed by pool ID, so that other names of the pool, e.g.
+  // after a rename, share its window.
+  int64_t pool_id = rados_pool_lookup(rados, pool_name);
+  if (pool_id < 0) {
+    return &fallback;
+  }
+
+  pthread_mutex_lock(&windows.lock);
+
+  w = find_window(rados, pool_name, pool_id);
+
+  if (!w && windows.count < WINDOW_MAX_POOLS) {
+    w = calloc(1, sizeof(rt_window_t));
+    w->rados = rados;
+    w->pool_id = pool_id;
+    w->pool_name = strdup(pool_name);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->room, NULL);
+    w->size = WINDOW_INITIAL;
+    w->max_size = WINDOW_MAX;
+    w->last_cut = now_sec();
+
+    windows.windows[windows.count++] = w;
+  }
+
+  pthread_mutex_unlock(&windows.lock);
+
+  return w ? w : &fallback;
+}
+
+void rt_window_release(rados_t rados) {
+  pthread_mutex_lock(&windows.lock);
+
+  for (int i = 0; i < windows.count;) {
+    rt_window_t *w = windows.windows[i];
+    if (w->rados != rados) {
+      i++;
+      continue;
+    }
+
+    windows.windows[i] = windows.windows[--windows.count];
+
+    pthread_cond_destroy(&w->room);
+    pthread_mutex_destroy(&w->lock);
+    free(w->pool_name);
+    free(w);
+  }
+
+  pthread_mutex_unlock(&windows.lock);
+}
+
+double rt_window_enter(rt_window_t *w) {
+  if (!w) {
+    return now_sec();
+  }
+
+  pthread_mutex_lock(&w->lock);
+  while (w->in_flight >= (int)w->size) {
+    pthread_cond_wait(&w->room, &w->lock);
+  }
+  w->in_flight++;
+  pthread_mutex_unlock(&w->lock);
+
+  return now_sec();
+}
+
+void rt_window_leave(rt_window_t *w, double started, rt_window_op_t op,
+                     int ops, int ret) {
+  if (!w) {
+    return;
+  }
+
+  double now = now_sec();
+  double latency = (now - started) / (ops > 1 ? ops : 1);
+
+  pthread_mutex_lock(&w->lock);
+
+  // The window was full, unless the tool doesn't have enough operations to
+  // fill it. Such windows aren't grown, they'd stop bounding anything.
+  int full = w->in_flight >= (int)w->size;
+  w->in_flight--;
+
+  window_base_t *b = &w->bases[op];
+  if (b->base == 0 || latency < b->base) {
+    b->base = latency;
+  }
+  if (b->next_base == 0 || latency < b->next_base) {
+    b->next_base = latency;
+  }
+  if (now - b->period_start > WINDOW_BASE_PERIOD) {
+    b->base = b->next_base;
+    b->next_base = 0;
+    b->period_start = now;
+  }
+
+  int congested = ret == -EAGAIN || ret == -EBUSY ||
+                  latency > b->base * WINDOW_INFLATION + WINDOW_SLACK;
+
+  if (congested) {
+    if (started >= w->last_cut) {
+      w->size = w->size / 2 < 1 ? 1 : w->size / 2;
+      w->last_cut = now;
+      w->cuts++;
+    }
+  } else if (full && w->size < w->max_size) {
+    w->size += 1 / w->size;
+  }
+
+  pthread_cond_broadcast(&w->room);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void rt_window_get_stats(rt_window_t *w, rt_window_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!w) {
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  stats->pool_name = w->pool_name;
+  stats->size = (int)w->size;
+  stats->in_flight = w->in_flight;
+  stats->cuts = w->cuts;
+  pthread_mutex_unlock(&w->lock);
+}
+
+int rt_window_list(rados_t rados, rt_window_stats_t *stats, int max) {
+  int n = 0;
+
+  pthread_mutex_lock(&windows.lock);
+  for (int i = 0; i < windows.count && n < max; i++) {
+    if (windows.windows[i]->rados == rados) {
+      rt_window_get_stats(windows.windows[i], &stats[n++]);
+    }
+  }
+  pthread_mutex_unlock(&windows.lock);
+
+  return n;
+}
@@ -0,0 +1,127 @@
+#ifndef throttle_h_INCLUDED
+#define throttle_h_INCLUDED
+
+#include <pthread.h>
+#include <rados/librados.h>
+
+/**
+ * rt_throttle is a token bucket limiting the rate of RADOS operations
+ * issued by bulk tools, so that they don't starve regular rt_add/rt_remove
+ * traffic.
+ */
+typedef struct rt_throttle {
+  pthread_mutex_t lock;
+
+  // Tokens added per second. Zero means unlimited.
+  double rate;
+  // Maximum number of tokens the bucket may hold.
+  double burst;
+  double tokens;
+  // Time of the last refill, in seconds.
+  double last;
+} rt_throttle_t;
+
+/**
+ * rt_throttle_init initializes throttle `t` allowing `ops_per_sec`
+ * operations per second. Zero disables throttling.
+ */
+void rt_throttle_init(rt_throttle_t *t, double ops_per_sec);
+
+/**
+ * rt_throttle_destroy releases resources held by throttle `t`.
+ */
+void rt_throttle_destroy(rt_throttle_t *t);
+
+/**
+ * rt_throttle_wait blocks until `n` operations may be issued.
+ */
+void rt_throttle_wait(rt_throttle_t *t, int n);
+
+/**
+ * rt_window is an AIMD congestion window bounding RADOS operations of bulk
+ * tools in flight to a pool. A window is shared by all bulk tools of the
+ * process using the same connection and pool, identified by its ID.
+ *
+ * The window grows by one operation per window's worth of completions while
+ * latency per RADOS operation stays near its baseline, the minimum latency
+ * seen during the last few seconds, and is halved once latency doubles, or
+ * an operation fails with -EAGAIN or -EBUSY. Only operations started after
+ * the last cut may cut it again, so that one congestion episode cuts it
+ * once. Bulk tools so use idle capacity of the cluster, and back off before
+ * they hurt latency of regular rt_add/rt_remove traffic.
+ *
+ * A window can't grow past the threads of the tools using it, each has one
+ * operation in flight at most. Tools run RT_WINDOW_THREADS threads by
+ * default, which wait in rt_window_enter until the window lets them in.
+ */
+typedef struct rt_window rt_window_t;
+
+// Default number of threads of bulk tools issuing windowed operations.
+#define RT_WINDOW_THREADS 32
+
+// Classes of operations, with separate latency baselines.
+typedef enum rt_window_op {
+  // Page of object listing.
+  RT_WINDOW_LIST,
+  // Read of an RT and its keys.
+  RT_WINDOW_READ,
+  // Update of an RT.
+  RT_WINDOW_WRITE,
+  RT_WINDOW_OPS
+} rt_window_op_t;
+
+typedef struct rt_window_stats {
+  // Pool of the window, valid until it's released.
+  const char *pool_name;
+  // Current window size, and operations in flight.
+  int size;
+  int in_flight;
+  // Number of times the window was cut.
+  unsigned long cuts;
+} rt_window_stats_t;
+
+/**
+ * rt_window_get returns the window of pool `pool_name` on connection
+ * `rados`, creating it if needed. Windows live until rt_window_release.
+ *
+ * If the pool can't be looked up, or the process has too many windows,
+ * returns a window shared by all such pools that stays at the initial
+ * window size, so that their operations are still bounded.
+ */
+rt_window_t *rt_window_get(rados_t rados, const char *pool_name);
+
+/**
+ * rt_window_release frees the windows of connection `rados`. Must be
+ * called before `rados` is shut down, once no bulk tools run on it.
+ */
+void rt_window_release(rados_t rados);
+
+/**
+ * rt_window_enter blocks until there's room for another operation in
+ * window `w`. Returns the time the operation starts at, to be passed to
+ * rt_window_leave.
+ */
+double rt_window_enter(rt_window_t *w);
+
+/**
+ * rt_window_leave records the completion of `ops` RADOS operations of class
+ * `op`, issued one after another since `started`, with return value `ret`,
+ * and adjusts the window. Latency per operation is compared with the
+ * baseline, so that reading a large RT page by page doesn't look like
+ * congestion.
+ */
+void rt_window_leave(rt_window_t *w, double started, rt_window_op_t op,
+                     int ops, int ret);
+
+/**
+ * rt_window_get_stats fills `stats` with current state of window `w`.
+ */
+void rt_window_get_stats(rt_window_t *w, rt_window_stats_t *stats);
+
+/**
+ * rt_window_list fills `stats` with up to `max` windows on connection
+ * `rados`, and returns their number.
+ */
+int rt_window_list(rados_t rados, rt_window_stats_t *stats, int max);
+
+#endif // throttle_h_INCLUDED
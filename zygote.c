@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+
+#include "zygote.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+
+Zygote protocol
+===============
+
+An invocation connects to the zygote socket and sends a request:
+
+    byte idx      type         name
+    --------     ------       ------
+     0 ..  3     uint32_t     magic
+     4 ..  7     uint32_t     argc
+     8 .. 11     uint32_t     args_len
+    12 ..  n     char[]       args
+
+    `magic`: ZYGOTE_MAGIC.
+    `args`: `argc` NUL-terminated arguments, `args_len` bytes in total.
+
+Values are in host byte order, both ends run on the same host. Standard
+input, output and error of the invocation are passed along with the header
+as SCM_RIGHTS. The zygote executes the invocation, writing the handler's
+output to the passed standard output, and replies with its int32_t exit
+status, or RT_ZYGOTE_NOT_SERVED. Debug log messages of the tracker go to
+the zygote's own standard output, it's shared by all invocations.
+
+The zygote's RADOS connection doesn't survive fork(), librados runs its own
+threads, so invocations are executed by threads of the zygote instead of
+forked children.
+
+*/
+
+#define ZYGOTE_MAGIC 0x5a475452
+// Maximum size of arguments of an invocation.
+#define ZYGOTE_ARGS_MAX (1 << 20)
+#define ZYGOTE_BACKLOG 128
+
+typedef struct zygote_req {
+  uint32_t magic;
+  uint32_t argc;
+  uint32_t args_len;
+} zygote_req_t;
+
+// Invocation handed over to the zygote.
+typedef struct zygote_call {
+  rt_ctx_t *ctx;
+  rt_zygote_handler handler;
+  void *arg;
+  int sock;
+} zygote_call_t;
+
+static int read_full(int fd, void *buf, size_t len) {
+  for (size_t off = 0; off < len;) {
+    ssize_t n = read(fd, (char *)buf + off, len - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n < 0 ? -errno : -EPIPE;
+    }
+    off += n;
+  }
+
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+  for (size_t off = 0; off < len;) {
+    ssize_t n = write(fd, (const char *)buf + off, len - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -errno;
+    }
+    off += n;
+  }
+
+  return 0;
+}
+
+// Receives the request header with the stdio of the invocation.
+static int recv_req(int sock, zygote_req_t *req, int *fds) {
+  char control[CMSG_SPACE(sizeof(int) * 3)];
+  struct iovec iov = {.iov_base = req, .iov_len = sizeof(*req)};
+  struct msghdr mh = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+
+  ssize_t n = recvmsg(sock, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  if (n < 0) {
+    return -errno;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3)) {
+    return -EPROTO;
+  }
+
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+
+  if (n != sizeof(*req) || req->magic != ZYGOTE_MAGIC || req->argc == 0 ||
+      req->args_len == 0 || req->args_len > ZYGOTE_ARGS_MAX) {
+    for (int i = 0; i < 3; i++) {
+      close(fds[i]);
+    }
+    return -EPROTO;
+  }
+
+  return 0;
+}
+
+static void *zygote_thread(void *arg) {
+  zygote_call_t *call = arg;
+  zygote_req_t req;
+  int fds[3];
+  char *args = NULL;
+  const char **argv = NULL;
+  FILE *out = NULL;
+  int32_t status = RT_ZYGOTE_NOT_SERVED;
+
+  if (recv_req(call->sock, &req, fds) < 0) {
+    goto out;
+  }
+
+  // The zygote only writes to standard output of the invocation.
+  close(fds[0]);
+  close(fds[2]);
+
+  args = malloc(req.args_len + 1);
+  argv = malloc(sizeof(char *) * (req.argc + 1));
+  if (!args || !argv || read_full(call->sock, args, req.args_len) < 0 ||
+      !(out = fdopen(fds[1], "w"))) {
+    close(fds[1]);
+    goto out;
+  }
+
+  // Split the arguments, each must be NUL-terminated.
+
+  args[req.args_len] = '\0';
+
+  uint32_t argc = 0;
+  for (char *p = args; p < args + req.args_len && argc < req.argc;
+       p += strlen(p) + 1) {
+    argv[argc++] = p;
+  }
+  argv[argc] = NULL;
+
+  if (argc == req.argc && args[req.args_len - 1] == '\0') {
+    status = call->handler(call->ctx, argc, argv, out, call->arg);
+  }
+
+out:
+  if (out) {
+    fclose(out);
+  }
+
+  write_full(call->sock, &status, sizeof(status));
+  close(call->sock);
+
+  free(argv);
+  free(args);
+  free(call);
+
+  return NULL;
+}
+
+int rt_zygote_serve(rados_t rados, const char *socket_path,
+                    rt_zygote_handler handler, void *arg) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  rt_ctx_t *ctx;
+  int lfd;
+  int ret;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    return -ENAMETOOLONG;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  // Invocations may exit before reading their output.
+  signal(SIGPIPE, SIG_IGN);
+
+  // Updates are executed by the invocation threads, the context only
+  // caches I/O contexts for them, and needs a single worker.
+  if ((ret = rt_ctx_create(rados, 1, &ctx)) < 0) {
+    return ret;
+  }
+
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    ret = -errno;
+    goto out;
+  }
+
+  // Only a stale socket is replaced, not one a zygote listens on.
+  {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int live = probe >= 0 &&
+               connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (probe >= 0) {
+      close(probe);
+    }
+    if (live) {
+      ret = -EADDRINUSE;
+      goto out;
+    }
+  }
+
+  // Invocations are executed with the zygote's cluster identity, so only
+  // its own user may connect. The mode is set before listening, so no
+  // connection gets in before.
+  unlink(socket_path);
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      chmod(socket_path, S_IRUSR | S_IWUSR) < 0 ||
+      listen(lfd, ZYGOTE_BACKLOG) < 0) {
+    ret = -errno;
+    goto out;
+  }
+
+  printf("Zygote listening on %s.\n", socket_path);
+  fflush(stdout);
+
+  for (;;) {
+    int sock = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      ret = -errno;
+      break;
+    }
+
+    // Invocations of other users, e.g. through a socket path made
+    // accessible to them, run by themselves.
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        cred.uid != geteuid()) {
+      int32_t status = RT_ZYGOTE_NOT_SERVED;
+      write_full(sock, &status, sizeof(status));
+      close(sock);
+      continue;
+    }
+
+    zygote_call_t *call = malloc(sizeof(zygote_call_t));
+    *call = (zygote_call_t){
+        .ctx = ctx,
+        .handler = handler,
+        .arg = arg,
+        .sock = sock,
+    };
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attr, zygote_thread, call) != 0) {
+      // The invocation runs by itself.
+      int32_t status = RT_ZYGOTE_NOT_SERVED;
+      write_full(sock, &status, sizeof(status));
+      close(sock);
+      free(call);
+    }
+
+    pthread_attr_destroy(&attr);
+  }
+
+out:
+  if (lfd >= 0) {
+    close(lfd);
+  }
+  rt_ctx_destroy(ctx);
+
+  return ret;
+}
+
+int rt_zygote_call(const char *socket_path, int argc, const char **argv) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int32_t status;
+  int sock;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path) ||
+      (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    return RT_ZYGOTE_NOT_SERVED;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return RT_ZYGOTE_NOT_SERVED;
+  }
+
+  // Prepare the request.
+
+  zygote_req_t req = {.magic = ZYGOTE_MAGIC, .argc = argc};
+  for (int i = 0; i < argc; i++) {
+    req.args_len += strlen(argv[i]) + 1;
+  }
+
+  char *args = malloc(req.args_len);
+  for (int i = 0, off = 0; i < argc; i++) {
+    size_t len = strlen(argv[i]) + 1;
+    memcpy(args + off, argv[i], len);
+    off += len;
+  }
+
+  // Send the header with stdio, then the arguments.
+
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  struct msghdr mh = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // Output written by the zygote must follow ours.
+  fflush(stdout);
+
+  if (sendmsg(sock, &mh, 0) != sizeof(req) ||
+      write_full(sock, args, req.args_len) < 0) {
+    // The zygote can't have executed it without all arguments.
+    status = RT_ZYGOTE_NOT_SERVED;
+  } else if (read_full(sock, &status, sizeof(status)) < 0) {
+    // The zygote went away before replying. If it did so after executing
+    // the update, running it again would report it wrong.
+    fprintf(stderr, "Zygote at %s failed to reply.\n", socket_path);
+    status = EXIT_FAILURE;
+  }
+
+  free(args);
+  close(sock);
+
+  return status;
+}
@@ -0,0 +1,58 @@
+#ifndef zygote_h_INCLUDED
+#define zygote_h_INCLUDED
+
+#include "ctx.h"
+#include <limits.h>
+#include <stdio.h>
+
+/**
+ * The zygote is a resident reference-tracker process, connected to the
+ * cluster once, executing RT updates of short-lived reference-tracker
+ * invocations on their behalf. An invocation hands its arguments and
+ * stdio over to the zygote through a UNIX socket, and exits with the
+ * status the zygote replies with. Its exit status and the output of the
+ * handler stay the same, while it doesn't pay for connecting to the
+ * cluster. Debug log messages of the tracker are printed to the standard
+ * output of the process, so those of invocations go to the zygote's.
+ *
+ * Invocations find the zygote through the RT_ZYGOTE_SOCKET environment
+ * variable. Those the zygote doesn't serve, or can't reach, run as usual.
+ */
+
+// Environment variable with the path of the zygote socket.
+#define RT_ZYGOTE_SOCKET_ENV "RT_ZYGOTE_SOCKET"
+
+// Status of invocations the zygote doesn't serve.
+#define RT_ZYGOTE_NOT_SERVED INT_MIN
+
+/**
+ * rt_zygote_handler executes an invocation with arguments `argv` on
+ * context `ctx`, writing its output to `out`. Returns the exit status of
+ * the invocation, or RT_ZYGOTE_NOT_SERVED to have it run by itself. It's
+ * called by a thread per invocation.
+ */
+typedef int (*rt_zygote_handler)(rt_ctx_t *ctx, int argc, const char **argv,
+                                 FILE *out, void *arg);
+
+/**
+ * rt_zygote_serve listens on UNIX socket `socket_path`, and executes
+ * invocations handed over to it with `handler` on a context created on
+ * connection `rados`. It returns only on failure, or -EADDRINUSE right
+ * away if another zygote listens on `socket_path`.
+ *
+ * The socket is accessible only to the user of the zygote, and invocations
+ * of other users are not served, as the zygote executes them with its own
+ * cluster identity.
+ */
+int rt_zygote_serve(rados_t rados, const char *socket_path,
+                    rt_zygote_handler handler, void *arg);
+
+/**
+ * rt_zygote_call hands invocation `argv`, with the stdio of the process,
+ * over to the zygote listening on `socket_path`, and waits for it to be
+ * executed. Returns its exit status, or RT_ZYGOTE_NOT_SERVED if the zygote
+ * can't be reached or doesn't serve it.
+ */
+int rt_zygote_call(const char *socket_path, int argc, const char **argv);
+
+#endif // zygote_h_INCLUDED